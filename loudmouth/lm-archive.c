@@ -0,0 +1,779 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-archive
+ * @Title: LmArchive
+ * @Short_description: Fetching message history from an archive
+ *
+ * An #LmArchive fetches messages from a Message Archive Management
+ * (XEP-0313) archive, the user's own or the one of a chat room.
+ *
+ * Paging through an archive one page after the other costs a round trip
+ * per page. lm_archive_fetch() instead splits the time range into
+ * segments, as set with lm_archive_set_segments(), and pages through all
+ * of them at the same time. The messages are still handed to the
+ * application in the order they were archived: those of the oldest
+ * segment that is not done yet as they arrive, the others when it is
+ * their turn. A segment holds on to at most a few pages that way, then
+ * it stops paging until its turn comes.
+ * <informalexample><programlisting><![CDATA[
+ * LmArchive *archive;
+ *
+ * archive = lm_archive_new (connection, NULL);
+ * lm_archive_fetch (archive, NULL, last_sync, time (NULL),
+ *                   message_cb, sync_done_cb, NULL, NULL, NULL);
+ * lm_archive_unref (archive);
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-debug.h"
+#include "lm-error.h"
+#include "lm-internals.h"
+#include "lm-archive.h"
+
+#define XMPP_NS_MAM     "urn:xmpp:mam:2"
+#define XMPP_NS_RSM     "http://jabber.org/protocol/rsm"
+#define XMPP_NS_DATA    "jabber:x:data"
+
+#define ARCHIVE_DEFAULT_SEGMENTS  4
+#define ARCHIVE_DEFAULT_PAGE_SIZE 100
+/* Pages a segment may hold before it waits for its turn */
+#define ARCHIVE_HELD_PAGES        4
+
+/* Length of a XEP-0082 timestamp up to and including the seconds */
+#define ARCHIVE_STAMP_SECONDS 19
+
+typedef struct {
+    LmArchive        *archive;
+    guint             index;
+    gchar            *query_id;
+    gchar            *start;
+    gchar            *end;
+
+    /* Paging */
+    LmMessageHandler *handler;
+    gchar            *last;
+    guint             page_results;
+    gboolean          complete;
+    gboolean          paused;
+
+    /* Results that wait for the segments before this one */
+    GQueue           *held;
+    /* Ids of the results in the last second, which the next segment
+     * may have as well */
+    GHashTable       *edge;
+} ArchiveSegment;
+
+struct _LmArchive {
+    LmConnection     *connection;
+    gchar            *jid;
+    guint             segments;
+    guint             page_size;
+
+    /* The fetch going on */
+    gboolean          running;
+    guint             serial;
+    gchar            *with;
+    GPtrArray        *fetch;
+    guint             current;
+    LmMessageHandler *result_handler;
+    LmArchiveResultFunction  result;
+    LmCallback       *done_cb;
+
+    gint              ref_count;
+};
+
+static void     archive_finish          (LmArchive      *archive,
+                                         gboolean        success);
+static gboolean archive_segment_request (ArchiveSegment *segment,
+                                         GError        **error);
+
+static gchar *
+archive_format_time (time_t t)
+{
+    struct tm tm;
+    gchar     buf[32];
+
+#ifdef HAVE_GMTIME_R
+    gmtime_r (&t, &tm);
+#else
+    /* Thread local where there is no gmtime_r () */
+    tm = *gmtime (&t);
+#endif
+
+    strftime (buf, sizeof (buf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    return g_strdup (buf);
+}
+
+static gboolean
+archive_bare_jid_equal (const gchar *a, const gchar *b)
+{
+    gsize len_a = strcspn (a, "/");
+    gsize len_b = strcspn (b, "/");
+
+    return len_a == len_b && g_ascii_strncasecmp (a, b, len_a) == 0;
+}
+
+/* Only the archive may send results */
+static gboolean
+archive_is_from_archive (LmArchive *archive, LmMessage *m)
+{
+    const gchar *from;
+    const gchar *own;
+
+    from = lm_message_node_get_attribute (m->node, "from");
+    if (!from) {
+        return TRUE;
+    }
+
+    if (archive->jid) {
+        return archive_bare_jid_equal (from, archive->jid);
+    }
+
+    own = lm_connection_get_jid (archive->connection);
+
+    return own && archive_bare_jid_equal (from, own);
+}
+
+static void
+archive_segment_free (ArchiveSegment *segment)
+{
+    if (segment->handler) {
+        lm_message_handler_invalidate (segment->handler);
+        lm_message_handler_unref (segment->handler);
+    }
+
+    while (!g_queue_is_empty (segment->held)) {
+        lm_message_unref (g_queue_pop_head (segment->held));
+    }
+
+    g_queue_free (segment->held);
+    g_hash_table_destroy (segment->edge);
+    g_free (segment->query_id);
+    g_free (segment->start);
+    g_free (segment->end);
+    g_free (segment->last);
+    g_free (segment);
+}
+
+/* Returns FALSE if the fetch was cancelled from the callback */
+static gboolean
+archive_deliver (LmArchive *archive, ArchiveSegment *segment, LmMessage *m)
+{
+    LmMessageNode *result;
+    LmMessageNode *forwarded;
+    LmMessageNode *message;
+    LmMessageNode *delay;
+    const gchar   *id;
+    const gchar   *stamp = NULL;
+    guint          serial = archive->serial;
+
+    result = lm_message_node_get_child (m->node, "result");
+    id = lm_message_node_get_attribute (result, "id");
+    forwarded = lm_message_node_get_child (result, "forwarded");
+    message = lm_message_node_get_child (forwarded, "message");
+
+    delay = lm_message_node_get_child (forwarded, "delay");
+    if (delay) {
+        stamp = lm_message_node_get_attribute (delay, "stamp");
+    }
+
+    if (id && stamp && strlen (stamp) >= ARCHIVE_STAMP_SECONDS) {
+        if (segment->index > 0) {
+            ArchiveSegment *previous;
+
+            previous = g_ptr_array_index (archive->fetch, segment->index - 1);
+            if (g_hash_table_lookup (previous->edge, id)) {
+                return TRUE;
+            }
+        }
+
+        if (strncmp (stamp, segment->end, ARCHIVE_STAMP_SECONDS) == 0) {
+            g_hash_table_insert (segment->edge, g_strdup (id),
+                                 GINT_TO_POINTER (TRUE));
+        }
+    }
+
+    if (archive->result) {
+        (* archive->result) (archive, id, stamp, message,
+                             archive->done_cb->user_data);
+    }
+
+    return archive->running && archive->serial == serial;
+}
+
+/* Hands over what the segments after the current one have been holding
+ * on to, as far as the segments are done */
+static void
+archive_advance (LmArchive *archive)
+{
+    lm_archive_ref (archive);
+
+    while (archive->running) {
+        ArchiveSegment *segment;
+        gboolean        cancelled = FALSE;
+
+        segment = g_ptr_array_index (archive->fetch, archive->current);
+
+        while (!g_queue_is_empty (segment->held)) {
+            LmMessage *m = g_queue_pop_head (segment->held);
+
+            cancelled = !archive_deliver (archive, segment, m);
+            lm_message_unref (m);
+
+            if (cancelled) {
+                break;
+            }
+        }
+
+        if (cancelled) {
+            break;
+        }
+
+        if (!segment->complete) {
+            /* Its turn now, held results are no longer piling up */
+            if (segment->paused) {
+                segment->paused = FALSE;
+
+                if (!archive_segment_request (segment, NULL)) {
+                    archive_finish (archive, FALSE);
+                }
+            }
+            break;
+        }
+
+        if (archive->current + 1 == archive->fetch->len) {
+            archive_finish (archive, TRUE);
+            break;
+        }
+
+        archive->current++;
+    }
+
+    lm_archive_unref (archive);
+}
+
+static ArchiveSegment *
+archive_find_segment (LmArchive *archive, const gchar *query_id)
+{
+    guint i;
+
+    if (!query_id) {
+        return NULL;
+    }
+
+    for (i = 0; i < archive->fetch->len; i++) {
+        ArchiveSegment *segment = g_ptr_array_index (archive->fetch, i);
+
+        if (strcmp (segment->query_id, query_id) == 0) {
+            return segment;
+        }
+    }
+
+    return NULL;
+}
+
+static LmHandlerResult
+archive_result_cb (LmMessageHandler *handler,
+                   LmConnection     *connection,
+                   LmMessage        *m,
+                   LmArchive        *archive)
+{
+    LmMessageNode  *result;
+    LmMessageNode  *forwarded;
+    ArchiveSegment *segment;
+    const gchar    *xmlns;
+    const gchar    *id;
+
+    if (!archive->running) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    result = lm_message_node_get_child (m->node, "result");
+    if (!result) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    xmlns = lm_message_node_get_attribute (result, "xmlns");
+    if (!xmlns || strcmp (xmlns, XMPP_NS_MAM) != 0) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    segment = archive_find_segment (archive,
+                                    lm_message_node_get_attribute (result,
+                                                                   "queryid"));
+    if (!segment || !archive_is_from_archive (archive, m)) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    id = lm_message_node_get_attribute (result, "id");
+    forwarded = lm_message_node_get_child (result, "forwarded");
+    if (!id || !forwarded ||
+        !lm_message_node_get_child (forwarded, "message")) {
+        lm_verbose ("Archive: result without a message\n");
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    segment->page_results++;
+    g_free (segment->last);
+    segment->last = g_strdup (id);
+
+    if (segment->index == archive->current) {
+        archive_deliver (archive, segment, m);
+    } else {
+        g_queue_push_tail (segment->held, lm_message_ref (m));
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static LmHandlerResult
+archive_page_reply (LmMessageHandler *handler,
+                    LmConnection     *connection,
+                    LmMessage        *m,
+                    ArchiveSegment   *segment)
+{
+    LmArchive     *archive = segment->archive;
+    LmMessageNode *fin;
+    LmMessageNode *set;
+    LmMessageNode *last = NULL;
+    const gchar   *complete;
+
+    fin = lm_message_node_get_child (m->node, "fin");
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_RESULT || !fin) {
+        lm_verbose ("Archive: query %s failed\n", segment->query_id);
+        archive_finish (archive, FALSE);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    set = lm_message_node_get_child (fin, "set");
+    if (set) {
+        last = lm_message_node_get_child (set, "last");
+    }
+
+    if (last && lm_message_node_get_value (last)) {
+        g_free (segment->last);
+        segment->last = g_strdup (lm_message_node_get_value (last));
+    }
+
+    complete = lm_message_node_get_attribute (fin, "complete");
+
+    if ((complete && strcmp (complete, "true") == 0) ||
+        !last || segment->page_results == 0) {
+        lm_verbose ("Archive: segment %u done\n", segment->index);
+
+        segment->complete = TRUE;
+
+        if (segment->index == archive->current) {
+            archive_advance (archive);
+        }
+    } else {
+        segment->page_results = 0;
+
+        if (segment->index != archive->current &&
+            g_queue_get_length (segment->held) >=
+            archive->page_size * ARCHIVE_HELD_PAGES) {
+            lm_verbose ("Archive: segment %u waits for its turn\n",
+                        segment->index);
+            segment->paused = TRUE;
+        } else if (!archive_segment_request (segment, NULL)) {
+            archive_finish (archive, FALSE);
+        }
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+archive_add_field (LmMessageNode *x,
+                   const gchar   *var,
+                   const gchar   *type,
+                   const gchar   *value)
+{
+    LmMessageNode *field;
+
+    field = lm_message_node_add_child (x, "field", NULL);
+    lm_message_node_set_attribute (field, "var", var);
+
+    if (type) {
+        lm_message_node_set_attribute (field, "type", type);
+    }
+
+    lm_message_node_add_child (field, "value", value);
+}
+
+static gboolean
+archive_segment_request (ArchiveSegment *segment, GError **error)
+{
+    LmArchive     *archive = segment->archive;
+    LmMessage     *m;
+    LmMessageNode *query;
+    LmMessageNode *x;
+    LmMessageNode *set;
+    gchar         *max;
+    gboolean       result;
+
+    m = lm_message_new_with_sub_type (archive->jid,
+                                      LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_SET);
+
+    query = lm_message_node_add_child (m->node, "query", NULL);
+    lm_message_node_set_attributes (query,
+                                    "xmlns", XMPP_NS_MAM,
+                                    "queryid", segment->query_id,
+                                    NULL);
+
+    x = lm_message_node_add_child (query, "x", NULL);
+    lm_message_node_set_attributes (x,
+                                    "xmlns", XMPP_NS_DATA,
+                                    "type", "submit",
+                                    NULL);
+    archive_add_field (x, "FORM_TYPE", "hidden", XMPP_NS_MAM);
+    if (archive->with) {
+        archive_add_field (x, "with", NULL, archive->with);
+    }
+    archive_add_field (x, "start", NULL, segment->start);
+    archive_add_field (x, "end", NULL, segment->end);
+
+    set = lm_message_node_add_child (query, "set", NULL);
+    lm_message_node_set_attribute (set, "xmlns", XMPP_NS_RSM);
+
+    max = g_strdup_printf ("%u", archive->page_size);
+    lm_message_node_add_child (set, "max", max);
+    g_free (max);
+
+    if (segment->last) {
+        lm_message_node_add_child (set, "after", segment->last);
+    }
+
+    /* The old one is dropped by the connection after the reply */
+    if (segment->handler) {
+        lm_message_handler_unref (segment->handler);
+    }
+
+    segment->handler = lm_message_handler_new ((LmHandleMessageFunction) archive_page_reply,
+                                               segment, NULL);
+    result = lm_connection_send_with_reply (archive->connection, m,
+                                            segment->handler, error);
+    lm_message_unref (m);
+
+    return result;
+}
+
+static void
+archive_finish (LmArchive *archive, gboolean success)
+{
+    LmCallback *cb;
+    guint       i;
+
+    if (!archive->running) {
+        return;
+    }
+
+    lm_verbose ("Archive: fetch %s\n", success ? "done" : "failed");
+
+    archive->running = FALSE;
+
+    lm_connection_unregister_message_handler (archive->connection,
+                                              archive->result_handler,
+                                              LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_handler_invalidate (archive->result_handler);
+    lm_message_handler_unref (archive->result_handler);
+    archive->result_handler = NULL;
+
+    for (i = 0; i < archive->fetch->len; i++) {
+        archive_segment_free (g_ptr_array_index (archive->fetch, i));
+    }
+    g_ptr_array_free (archive->fetch, TRUE);
+    archive->fetch = NULL;
+
+    g_free (archive->with);
+    archive->with = NULL;
+
+    cb = archive->done_cb;
+    archive->done_cb = NULL;
+
+    if (cb->func) {
+        (* ((LmArchiveFunction) cb->func)) (archive, success, cb->user_data);
+    }
+
+    _lm_utils_free_callback (cb);
+
+    /* Taken when the fetch started */
+    lm_archive_unref (archive);
+}
+
+/**
+ * lm_archive_new:
+ * @connection: an authenticated #LmConnection
+ * @jid: the archive to fetch from, %NULL for the user's own
+ *
+ * Creates a new #LmArchive for the archive at @jid.
+ *
+ * Return value: the new #LmArchive
+ **/
+LmArchive *
+lm_archive_new (LmConnection *connection, const gchar *jid)
+{
+    LmArchive *archive;
+
+    g_return_val_if_fail (connection != NULL, NULL);
+
+    archive = g_new0 (LmArchive, 1);
+    archive->ref_count = 1;
+    archive->connection = lm_connection_ref (connection);
+    archive->jid = g_strdup (jid);
+    archive->segments = ARCHIVE_DEFAULT_SEGMENTS;
+    archive->page_size = ARCHIVE_DEFAULT_PAGE_SIZE;
+
+    return archive;
+}
+
+/**
+ * lm_archive_get_segments:
+ * @archive: an #LmArchive
+ *
+ * Fetches the number of segments a fetch is split into.
+ *
+ * Return value: the number of segments
+ **/
+guint
+lm_archive_get_segments (LmArchive *archive)
+{
+    g_return_val_if_fail (archive != NULL, 0);
+
+    return archive->segments;
+}
+
+/**
+ * lm_archive_set_segments:
+ * @archive: an #LmArchive
+ * @segments: the number of segments, at least 1
+ *
+ * Sets the number of segments the time range of a fetch is split into,
+ * each paged through at the same time as the others. Defaults to 4. 1
+ * pages through the archive one page after the other. Takes effect with
+ * the next fetch.
+ **/
+void
+lm_archive_set_segments (LmArchive *archive, guint segments)
+{
+    g_return_if_fail (archive != NULL);
+    g_return_if_fail (segments > 0);
+
+    archive->segments = segments;
+}
+
+/**
+ * lm_archive_get_page_size:
+ * @archive: an #LmArchive
+ *
+ * Fetches the number of messages asked for per page.
+ *
+ * Return value: the page size
+ **/
+guint
+lm_archive_get_page_size (LmArchive *archive)
+{
+    g_return_val_if_fail (archive != NULL, 0);
+
+    return archive->page_size;
+}
+
+/**
+ * lm_archive_set_page_size:
+ * @archive: an #LmArchive
+ * @page_size: the number of messages per page
+ *
+ * Sets the number of messages asked for per page, defaults to 100. The
+ * archive may send fewer.
+ **/
+void
+lm_archive_set_page_size (LmArchive *archive, guint page_size)
+{
+    g_return_if_fail (archive != NULL);
+    g_return_if_fail (page_size > 0);
+
+    archive->page_size = page_size;
+}
+
+/**
+ * lm_archive_fetch:
+ * @archive: an #LmArchive
+ * @with: only fetch messages exchanged with this JID, or %NULL for all
+ * @start: the time of the oldest message to fetch
+ * @end: the time of the newest message to fetch
+ * @result: function called for each message
+ * @function: function called when the fetch is over
+ * @user_data: user data passed to @result and @function
+ * @notify: function to free @user_data, or %NULL
+ * @error: location to store error, or %NULL
+ *
+ * Fetches the messages archived from @start to @end. @result is called
+ * for each of them, oldest first, and @function once all are there or
+ * the fetch failed. Only one fetch at a time can run on an #LmArchive.
+ *
+ * Return value: Returns #TRUE if the fetch was started, otherwise #FALSE.
+ **/
+gboolean
+lm_archive_fetch (LmArchive               *archive,
+                  const gchar             *with,
+                  time_t                   start,
+                  time_t                   end,
+                  LmArchiveResultFunction  result,
+                  LmArchiveFunction        function,
+                  gpointer                 user_data,
+                  GDestroyNotify           notify,
+                  GError                 **error)
+{
+    guint n_segments;
+    guint i;
+
+    g_return_val_if_fail (archive != NULL, FALSE);
+    g_return_val_if_fail (start <= end, FALSE);
+
+    if (!lm_connection_is_authenticated (archive->connection)) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not authenticated");
+        return FALSE;
+    }
+
+    if (archive->running) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_FAILED,
+                     "A fetch is already running");
+        return FALSE;
+    }
+
+    /* Segments are at least a second long */
+    n_segments = MIN ((guint64) archive->segments, (guint64) (end - start) + 1);
+
+    lm_verbose ("Archive: fetching in %u segments\n", n_segments);
+
+    archive->running = TRUE;
+    archive->serial++;
+    archive->with = g_strdup (with);
+    archive->current = 0;
+    archive->result = result;
+    archive->done_cb = _lm_utils_new_callback (function, user_data, notify);
+    archive->fetch = g_ptr_array_sized_new (n_segments);
+
+    for (i = 0; i < n_segments; i++) {
+        ArchiveSegment *segment;
+        guint64         span = (guint64) (end - start);
+
+        segment = g_new0 (ArchiveSegment, 1);
+        segment->archive = archive;
+        segment->index = i;
+        segment->query_id = _lm_utils_generate_id ();
+        segment->start = archive_format_time (start + span * i / n_segments);
+        segment->end = archive_format_time (start + span * (i + 1) / n_segments);
+        segment->held = g_queue_new ();
+        segment->edge = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                               g_free, NULL);
+
+        g_ptr_array_add (archive->fetch, segment);
+    }
+
+    archive->result_handler =
+        lm_message_handler_new ((LmHandleMessageFunction) archive_result_cb,
+                                archive, NULL);
+    lm_connection_register_message_handler (archive->connection,
+                                            archive->result_handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_FIRST);
+
+    /* Dropped when the fetch is over */
+    lm_archive_ref (archive);
+
+    for (i = 0; i < n_segments; i++) {
+        if (!archive_segment_request (g_ptr_array_index (archive->fetch, i),
+                                      error)) {
+            archive->result = NULL;
+            archive->done_cb->func = NULL;
+            archive_finish (archive, FALSE);
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/**
+ * lm_archive_cancel:
+ * @archive: an #LmArchive
+ *
+ * Stops the fetch going on, its function is called with @success set to
+ * #FALSE.
+ **/
+void
+lm_archive_cancel (LmArchive *archive)
+{
+    g_return_if_fail (archive != NULL);
+
+    archive_finish (archive, FALSE);
+}
+
+/**
+ * lm_archive_ref:
+ * @archive: an #LmArchive
+ *
+ * Adds a reference to @archive.
+ *
+ * Return value: Returns the same #LmArchive
+ **/
+LmArchive *
+lm_archive_ref (LmArchive *archive)
+{
+    g_return_val_if_fail (archive != NULL, NULL);
+
+    archive->ref_count++;
+
+    return archive;
+}
+
+/**
+ * lm_archive_unref:
+ * @archive: an #LmArchive
+ *
+ * Removes a reference from @archive. When no more references are present
+ * @archive is freed. A fetch going on keeps its own reference.
+ **/
+void
+lm_archive_unref (LmArchive *archive)
+{
+    g_return_if_fail (archive != NULL);
+
+    archive->ref_count--;
+
+    if (archive->ref_count > 0) {
+        return;
+    }
+
+    lm_connection_unref (archive->connection);
+    g_free (archive->jid);
+    g_free (archive);
+}
@@ -0,0 +1,93 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_ARCHIVE_H__
+#define __LM_ARCHIVE_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <time.h>
+
+#include <loudmouth/lm-connection.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmArchive:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmArchive LmArchive;
+
+/**
+ * LmArchiveResultFunction:
+ * @archive: the #LmArchive
+ * @id: archive id of the message
+ * @stamp: when the message was archived, a XEP-0082 timestamp or %NULL
+ * @message: the archived message
+ * @user_data: user data passed to lm_archive_fetch()
+ *
+ * Called for each archived message, oldest first. @message is only valid
+ * during the call, use lm_message_node_ref() to keep it.
+ */
+typedef void (* LmArchiveResultFunction) (LmArchive     *archive,
+                                          const gchar   *id,
+                                          const gchar   *stamp,
+                                          LmMessageNode *message,
+                                          gpointer       user_data);
+
+/**
+ * LmArchiveFunction:
+ * @archive: the #LmArchive
+ * @success: whether all of the messages were fetched
+ * @user_data: user data passed to lm_archive_fetch()
+ *
+ * Called once when a fetch is over.
+ */
+typedef void (* LmArchiveFunction)       (LmArchive     *archive,
+                                          gboolean       success,
+                                          gpointer       user_data);
+
+LmArchive * lm_archive_new           (LmConnection            *connection,
+                                      const gchar             *jid);
+guint       lm_archive_get_segments  (LmArchive               *archive);
+void        lm_archive_set_segments  (LmArchive               *archive,
+                                      guint                    segments);
+guint       lm_archive_get_page_size (LmArchive               *archive);
+void        lm_archive_set_page_size (LmArchive               *archive,
+                                      guint                    page_size);
+gboolean    lm_archive_fetch         (LmArchive               *archive,
+                                      const gchar             *with,
+                                      time_t                   start,
+                                      time_t                   end,
+                                      LmArchiveResultFunction  result,
+                                      LmArchiveFunction        function,
+                                      gpointer                 user_data,
+                                      GDestroyNotify           notify,
+                                      GError                 **error);
+void        lm_archive_cancel        (LmArchive               *archive);
+LmArchive * lm_archive_ref           (LmArchive               *archive);
+void        lm_archive_unref         (LmArchive               *archive);
+
+G_END_DECLS
+
+#endif /* __LM_ARCHIVE_H__ */
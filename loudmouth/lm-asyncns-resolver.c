@@ -32,6 +32,7 @@
 #include <arpa/nameser.h>
 #include <resolv.h>
 
+#include "lm-debug.h"
 #include "lm-error.h"
 #include "lm-internals.h"
 #include "lm-marshal.h"
@@ -168,6 +169,9 @@ asyncns_resolver_prep (LmResolver *resolver, GError **error)
         return TRUE;
     }
 
+    /* The worker inherits the resolver state */
+    _lm_resolver_res_init ();
+
     priv->asyncns_ctx = asyncns_new (1);
     if (priv->asyncns_ctx == NULL) {
         g_set_error (error,
@@ -230,28 +234,23 @@ asyncns_resolver_srv_done (LmResolver *resolver)
     int                    srv_len;
     gboolean               result = FALSE;
 
-    g_print ("srv_done callback\n");
-
     srv_len = asyncns_res_done (priv->asyncns_ctx, 
                                 priv->resolv_query, &srv_ans);
 
     priv->resolv_query = NULL;
 
     if (srv_len <= 0) {
-        /* FIXME: Report error */
-        g_warning ("Failed to read srv request results");
+        /* No record or no answer, reported as a failed lookup below */
+        lm_verbose ("Failed to read srv request results\n");
     } else {
-        gchar *new_server;
+        gchar *new_server = NULL;
         guint  new_port;
 
-        g_print ("trying to parse srv response\n");
-
         result = _lm_resolver_parse_srv_response (srv_ans, srv_len,
                                                   &new_server,
                                                   &new_port);
         if (result == TRUE) {
-            g_print ("worked, new host/post is %s/%d\n",
-                     new_server, new_port);
+            lm_verbose ("SRV lookup gave %s:%d\n", new_server, new_port);
 
             g_object_set (resolver,
                           "host", new_server,
@@ -265,11 +264,13 @@ asyncns_resolver_srv_done (LmResolver *resolver)
 
     asyncns_resolver_cleanup (resolver);
     
-    if (result == TRUE) {
-        g_object_ref (resolver);
-        _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_OK, NULL);
-        g_object_unref (resolver);
-    }
+    /* Always report back, a missing record (e.g. no _xmpps-client._tcp)
+     * is an answer too and callers are waiting for it. */
+    g_object_ref (resolver);
+    _lm_resolver_set_result (LM_RESOLVER (resolver),
+                             result ? LM_RESOLVER_RESULT_OK : LM_RESOLVER_RESULT_FAILED,
+                             NULL);
+    g_object_unref (resolver);
 }
 
 static void
@@ -289,7 +290,8 @@ asyncns_resolver_lookup_service (LmResolver *resolver)
         
     srv = _lm_resolver_create_srv_string (domain, service, protocol);
         
-    g_print ("ASYNCNS: Looking up service: %s %s %s\n[%s]", domain, service, protocol, srv);
+    lm_verbose ("ASYNCNS: Looking up service: %s %s %s [%s]\n",
+                domain, service, protocol, srv);
 
     if (!asyncns_resolver_prep (resolver, /* Use GError? */ NULL)) {
         g_warning ("Failed to initiate the asyncns library");
@@ -93,7 +93,7 @@ blocking_resolver_lookup_host (LmBlockingResolver *resolver)
 {
     gchar           *host;
     struct addrinfo  req;
-    struct addrinfo *ans;
+    struct addrinfo *ans = NULL;
     int              err;
     gboolean         retval = TRUE;
 
@@ -106,16 +106,11 @@ blocking_resolver_lookup_host (LmBlockingResolver *resolver)
     req.ai_socktype = SOCK_STREAM;
     req.ai_protocol = IPPROTO_TCP;
 
+    /* The resolver state is per thread, set it up in the one asking */
+    _lm_resolver_res_init ();
     err = getaddrinfo (host, NULL, &req, &ans);
 
-    if (err != 0) {
-        _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_FAILED,
-                                 NULL);
-
-        retval = FALSE;
-    }
-
-    if (ans == NULL) {
+    if (err != 0 || ans == NULL) {
         /* Couldn't find any results */
         g_object_ref (resolver);
         _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_FAILED,
@@ -165,12 +160,14 @@ blocking_resolver_lookup_service (LmBlockingResolver *resolver)
 
     srv = _lm_resolver_create_srv_string (domain, service, protocol);
 
-    res_init ();
+    _lm_resolver_res_init ();
 
     len = res_query (srv, C_IN, T_SRV, srv_ans, SRV_LEN);
 
-    result = _lm_resolver_parse_srv_response (srv_ans, len,
-                                              &new_server, &new_port);
+    /* res_query () fails on timeouts and error answers */
+    result = len > 0 &&
+        _lm_resolver_parse_srv_response (srv_ans, len,
+                                         &new_server, &new_port);
     if (result == FALSE) {
         retval = FALSE;
     }
@@ -181,7 +178,9 @@ blocking_resolver_lookup_service (LmBlockingResolver *resolver)
                   NULL);
 
     g_object_ref (resolver);
-    _lm_resolver_set_result (LM_RESOLVER (resolver), LM_RESOLVER_RESULT_OK, NULL);
+    _lm_resolver_set_result (LM_RESOLVER (resolver),
+                             retval ? LM_RESOLVER_RESULT_OK : LM_RESOLVER_RESULT_FAILED,
+                             NULL);
     g_object_unref (resolver);
 
     /* Lookup the new server and the new port */
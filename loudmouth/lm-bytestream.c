@@ -0,0 +1,2296 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-bytestream
+ * @Title: LmBytestream
+ * @Short_description: File transfer outside of the XMPP stream
+ *
+ * An #LmBytestream moves a file between two entities over a TCP
+ * connection of its own, negotiated over an #LmConnection with SOCKS5
+ * bytestreams (XEP-0065). The data never goes through the XML stream,
+ * where it would have to be base64 encoded and hold up other stanzas.
+ * Where the system supports it the data isn't even copied through user
+ * space: it is sent with sendfile() and received with splice().
+ *
+ * The sender offers streamhosts to the receiver. Unless turned off with
+ * lm_bytestream_set_direct() the sender itself is one of them, proxies
+ * found through service discovery are added with
+ * lm_bytestream_add_streamhost(). How the receiver got to know about the
+ * file, with stream initiation or Jingle, is up to the application.
+ *
+ * When the #LmConnection goes through an HTTP proxy, set with
+ * lm_connection_set_proxy(), streamhosts are connected to through the
+ * same proxy, which has to allow tunnels to their ports. The sender
+ * doesn't offer itself then, the receiver couldn't reach it.
+ *
+ * When no streamhost can be reached the data can go in-band instead,
+ * base64 encoded in blocks over the XMPP stream (XEP-0047). A window of
+ * blocks is kept waiting for their results instead of one, so that the
+ * transfer isn't limited to one block per round trip.
+ * <informalexample><programlisting><![CDATA[
+ * LmBytestream *bytestream;
+ *
+ * bytestream = lm_bytestream_new (connection, "juliet@example.com/balcony", sid);
+ * lm_bytestream_add_streamhost (bytestream, "proxy.example.com",
+ *                               "192.0.2.1", 7777);
+ * lm_bytestream_send_file (bytestream, fd, size, transfer_done_cb,
+ *                          NULL, NULL, NULL);
+ * lm_bytestream_unref (bytestream);
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include "lm-debug.h"
+#include "lm-error.h"
+#include "lm-internals.h"
+#include "lm-misc.h"
+#include "lm-resolver.h"
+#include "lm-sha.h"
+#include "lm-sock.h"
+#include "lm-bytestream.h"
+
+#define XMPP_NS_BYTESTREAMS "http://jabber.org/protocol/bytestreams"
+#define XMPP_NS_IBB "http://jabber.org/protocol/ibb"
+#define XMPP_NS_STANZAS "urn:ietf:params:xml:ns:xmpp-stanzas"
+
+/* Moved per sendfile () or splice () call, so that other sources in the
+ * main loop get to run during large transfers */
+#define BYTESTREAM_CHUNK_SIZE (256 * 1024)
+
+/* In-band blocks, the block size is halved down to the minimum when the
+ * peer asks for smaller ones */
+#define IBB_DEFAULT_BLOCK_SIZE 4096
+#define IBB_MIN_BLOCK_SIZE     512
+#define IBB_MAX_BLOCK_SIZE     65535
+#define IBB_DEFAULT_WINDOW     8
+
+#define SOCKS5_VERSION     0x05
+#define SOCKS5_AUTH_NONE   0x00
+#define SOCKS5_CMD_CONNECT 0x01
+#define SOCKS5_ATYP_IPV4   0x01
+#define SOCKS5_ATYP_DOMAIN 0x03
+#define SOCKS5_ATYP_IPV6   0x04
+
+/* Connections from targets allowed in the handshake at once, and how long
+ * each gets to finish it */
+#define BYTESTREAM_MAX_INCOMING      4
+#define BYTESTREAM_HANDSHAKE_TIMEOUT 10000
+
+typedef enum {
+    SOCKS5_STATE_PROXY,
+    SOCKS5_STATE_GREETING,
+    SOCKS5_STATE_REQUEST,
+    SOCKS5_STATE_DONE
+} Socks5State;
+
+typedef struct {
+    gchar *jid;
+    gchar *host;
+    guint  port;
+} BytestreamHost;
+
+/* A connection accepted by the initiator, in the SOCKS5 handshake until
+ * it asks for our session */
+typedef struct {
+    LmBytestream *bytestream;
+    gint          fd;
+    GIOChannel   *channel;
+    GSource      *watch;
+    GSource      *timeout;
+    Socks5State   state;
+    GString      *buf;
+} BytestreamIncoming;
+
+struct _LmBytestream {
+    LmConnection   *connection;
+    GMainContext   *context;
+    gchar          *peer;
+    gchar          *sid;
+    gchar          *own_jid;
+    /* SHA1 of the session id and both JIDs, the address in the SOCKS5
+     * connect request */
+    gchar          *dst_addr;
+
+    gboolean        initiator;
+    gboolean        direct;
+    GSList         *hosts;
+    BytestreamHost *direct_host;
+    /* The streamhost being tried by the target or used by the initiator */
+    GSList         *current_host;
+    gchar          *request_id;
+
+    /* Where the target connects when the initiator is a streamhost */
+    gint            listen_fd;
+    GIOChannel     *listen_channel;
+    GSource        *listen_watch;
+    GSList         *incoming;
+
+    /* The connection data goes over, SOCKS5 handshake first */
+    LmResolver     *resolver;
+    gint            fd;
+    GIOChannel     *channel;
+    GSource        *watch;
+    Socks5State     socks_state;
+    GString        *socks_buf;
+
+    gint            file_fd;
+    guint64         size;
+    guint64         transferred;
+    off_t           offset;
+    gint            pipe_fds[2];
+
+    /* In-band, with up to window blocks waiting for their result */
+    LmBytestreamMethod method;
+    guint           block_size;
+    guint           window;
+    gboolean        ibb_open;
+    gchar          *ibb_id;
+    /* Handles the results of blocks sent, or the blocks received */
+    LmMessageHandler *ibb_handler;
+    guint8         *ibb_buf;
+    guint64         ibb_next;
+    guint           ibb_in_flight;
+    guint16         ibb_seq;
+
+    LmCallback     *result_cb;
+    LmCallback     *progress_cb;
+    gboolean        running;
+
+    gint            ref_count;
+};
+
+static void     bytestream_connect        (LmBytestream *bytestream);
+static void     bytestream_finish         (LmBytestream *bytestream,
+                                           gboolean      success);
+static void     bytestream_ibb_close      (LmBytestream *bytestream);
+static gboolean bytestream_ibb_open       (LmBytestream *bytestream,
+                                           GError      **error);
+
+static void
+bytestream_host_free (BytestreamHost *host)
+{
+    g_free (host->jid);
+    g_free (host->host);
+    g_free (host);
+}
+
+static BytestreamHost *
+bytestream_host_new (const gchar *jid, const gchar *host, guint port)
+{
+    BytestreamHost *bh;
+
+    bh = g_new0 (BytestreamHost, 1);
+    bh->jid = g_strdup (jid);
+    bh->host = g_strdup (host);
+    bh->port = port;
+
+    return bh;
+}
+
+static void
+bytestream_free (LmBytestream *bytestream)
+{
+    g_slist_foreach (bytestream->hosts, (GFunc) bytestream_host_free, NULL);
+    g_slist_free (bytestream->hosts);
+
+    if (bytestream->progress_cb) {
+        _lm_utils_free_callback (bytestream->progress_cb);
+    }
+
+    if (bytestream->context) {
+        g_main_context_unref (bytestream->context);
+    }
+
+    lm_connection_unref (bytestream->connection);
+    g_string_free (bytestream->socks_buf, TRUE);
+    g_free (bytestream->peer);
+    g_free (bytestream->sid);
+    g_free (bytestream->own_jid);
+    g_free (bytestream->dst_addr);
+    g_free (bytestream->request_id);
+    g_free (bytestream->ibb_id);
+    g_free (bytestream);
+}
+
+static void
+bytestream_close_data (LmBytestream *bytestream)
+{
+    if (bytestream->resolver) {
+        lm_resolver_cancel (bytestream->resolver);
+        g_object_unref (bytestream->resolver);
+        bytestream->resolver = NULL;
+    }
+
+    if (bytestream->watch) {
+        g_source_destroy (bytestream->watch);
+        bytestream->watch = NULL;
+    }
+
+    if (bytestream->channel) {
+        g_io_channel_unref (bytestream->channel);
+        bytestream->channel = NULL;
+    }
+
+    if (bytestream->fd >= 0) {
+        _lm_sock_shutdown (bytestream->fd);
+        _lm_sock_close (bytestream->fd);
+        bytestream->fd = -1;
+    }
+
+    bytestream->socks_state = SOCKS5_STATE_GREETING;
+    g_string_truncate (bytestream->socks_buf, 0);
+}
+
+static void
+bytestream_incoming_free (BytestreamIncoming *incoming)
+{
+    if (incoming->watch) {
+        g_source_destroy (incoming->watch);
+    }
+
+    if (incoming->timeout) {
+        g_source_destroy (incoming->timeout);
+    }
+
+    if (incoming->channel) {
+        g_io_channel_unref (incoming->channel);
+    }
+
+    if (incoming->fd >= 0) {
+        _lm_sock_close (incoming->fd);
+    }
+
+    g_string_free (incoming->buf, TRUE);
+    g_free (incoming);
+}
+
+static void
+bytestream_close_incoming (LmBytestream *bytestream)
+{
+    g_slist_foreach (bytestream->incoming,
+                     (GFunc) bytestream_incoming_free, NULL);
+    g_slist_free (bytestream->incoming);
+    bytestream->incoming = NULL;
+}
+
+static void
+bytestream_close_listen (LmBytestream *bytestream)
+{
+    bytestream_close_incoming (bytestream);
+
+    if (bytestream->listen_watch) {
+        g_source_destroy (bytestream->listen_watch);
+        bytestream->listen_watch = NULL;
+    }
+
+    if (bytestream->listen_channel) {
+        g_io_channel_unref (bytestream->listen_channel);
+        bytestream->listen_channel = NULL;
+    }
+
+    if (bytestream->listen_fd >= 0) {
+        _lm_sock_close (bytestream->listen_fd);
+        bytestream->listen_fd = -1;
+    }
+}
+
+static void
+bytestream_finish (LmBytestream *bytestream, gboolean success)
+{
+    LmCallback *cb;
+
+    if (!bytestream->running) {
+        return;
+    }
+
+    lm_verbose ("Bytestream %s %s after %" G_GUINT64_FORMAT " bytes\n",
+                bytestream->sid, success ? "done" : "failed",
+                bytestream->transferred);
+
+    bytestream->running = FALSE;
+
+    bytestream_close_data (bytestream);
+    bytestream_close_listen (bytestream);
+
+    if (bytestream->ibb_open) {
+        bytestream_ibb_close (bytestream);
+    }
+
+    if (bytestream->ibb_handler) {
+        if (!bytestream->initiator) {
+            lm_connection_unregister_message_handler (bytestream->connection,
+                                                      bytestream->ibb_handler,
+                                                      LM_MESSAGE_TYPE_IQ);
+        }
+        lm_message_handler_invalidate (bytestream->ibb_handler);
+        lm_message_handler_unref (bytestream->ibb_handler);
+        bytestream->ibb_handler = NULL;
+    }
+
+    g_free (bytestream->ibb_buf);
+    bytestream->ibb_buf = NULL;
+
+    if (bytestream->pipe_fds[0] >= 0) {
+        close (bytestream->pipe_fds[0]);
+        close (bytestream->pipe_fds[1]);
+        bytestream->pipe_fds[0] = bytestream->pipe_fds[1] = -1;
+    }
+
+    cb = bytestream->result_cb;
+    bytestream->result_cb = NULL;
+
+    if (cb->func) {
+        (* ((LmBytestreamFunction) cb->func)) (bytestream, success,
+                                               cb->user_data);
+    }
+
+    _lm_utils_free_callback (cb);
+
+    /* Taken when the transfer started */
+    lm_bytestream_unref (bytestream);
+}
+
+/* Whether the receiver has what was offered, if it knows how much */
+static gboolean
+bytestream_is_complete (LmBytestream *bytestream)
+{
+    if (bytestream->size && bytestream->transferred != bytestream->size) {
+        lm_verbose ("Bytestream %s: %" G_GUINT64_FORMAT " of %"
+                    G_GUINT64_FORMAT " bytes offered\n", bytestream->sid,
+                    bytestream->transferred, bytestream->size);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+bytestream_progress (LmBytestream *bytestream)
+{
+    LmCallback *cb = bytestream->progress_cb;
+
+    if (cb && cb->func) {
+        (* ((LmBytestreamProgressFunction) cb->func)) (bytestream,
+                                                       bytestream->transferred,
+                                                       bytestream->size,
+                                                       cb->user_data);
+    }
+}
+
+static GSource *
+bytestream_add_watch (LmBytestream *bytestream,
+                      GIOCondition  condition,
+                      GIOFunc       function)
+{
+    return lm_misc_add_io_watch (bytestream->context, bytestream->channel,
+                                 condition, function, bytestream);
+}
+
+/* -- Moving the data -- */
+
+static gboolean
+bytestream_send_cb (GIOChannel   *source,
+                    GIOCondition  condition,
+                    LmBytestream *bytestream)
+{
+    gssize n;
+
+    if (condition & (G_IO_ERR | G_IO_HUP)) {
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, FALSE);
+        return FALSE;
+    }
+
+    n = _lm_sock_send_file (bytestream->fd, bytestream->file_fd,
+                            &bytestream->offset,
+                            MIN (BYTESTREAM_CHUNK_SIZE,
+                                 bytestream->size - bytestream->transferred));
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return TRUE;
+        }
+
+        lm_verbose ("Bytestream send failed: %s\n", g_strerror (errno));
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, FALSE);
+        return FALSE;
+    }
+
+    if (n == 0) {
+        /* The file is shorter than announced */
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, FALSE);
+        return FALSE;
+    }
+
+    bytestream->transferred += n;
+    bytestream_progress (bytestream);
+
+    if (bytestream->transferred >= bytestream->size) {
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, TRUE);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static gboolean
+bytestream_receive_cb (GIOChannel   *source,
+                       GIOCondition  condition,
+                       LmBytestream *bytestream)
+{
+    gssize n;
+
+    n = _lm_sock_recv_file (bytestream->fd, bytestream->file_fd,
+                            bytestream->pipe_fds, BYTESTREAM_CHUNK_SIZE);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return TRUE;
+        }
+
+        lm_verbose ("Bytestream receive failed: %s\n", g_strerror (errno));
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, FALSE);
+        return FALSE;
+    }
+
+    if (n == 0) {
+        /* The sender closes the stream when it is done */
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, bytestream_is_complete (bytestream));
+        return FALSE;
+    }
+
+    bytestream->transferred += n;
+
+    if (bytestream->size && bytestream->transferred > bytestream->size) {
+        lm_verbose ("Bytestream %s: more than the %" G_GUINT64_FORMAT
+                    " bytes offered\n", bytestream->sid, bytestream->size);
+        bytestream->watch = NULL;
+        bytestream_finish (bytestream, FALSE);
+        return FALSE;
+    }
+
+    bytestream_progress (bytestream);
+
+    return TRUE;
+}
+
+static void
+bytestream_start_transfer (LmBytestream *bytestream)
+{
+    lm_verbose ("Bytestream %s established\n", bytestream->sid);
+
+    if (bytestream->watch) {
+        g_source_destroy (bytestream->watch);
+    }
+
+    if (bytestream->initiator) {
+        bytestream->watch = bytestream_add_watch (bytestream,
+                                                  G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                                  (GIOFunc) bytestream_send_cb);
+    } else {
+        bytestream->watch = bytestream_add_watch (bytestream,
+                                                  G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                                  (GIOFunc) bytestream_receive_cb);
+    }
+}
+
+/* -- SOCKS5 -- */
+
+/* The handshake messages are small enough to fit in the socket buffer,
+ * if even that is full the handshake fails rather than being cut short */
+static gboolean
+bytestream_socks_write (gint fd, GString *msg)
+{
+    gsize  sent = 0;
+    gssize n;
+
+    while (sent < msg->len) {
+        n = send (fd, msg->str + sent, msg->len - sent, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+
+        sent += n;
+    }
+
+    n = sent == msg->len;
+    g_string_free (msg, TRUE);
+
+    return n;
+}
+
+static gboolean
+bytestream_socks_read (gint fd, GString *str)
+{
+    gchar  buf[256];
+    gssize n;
+
+    do {
+        n = recv (fd, buf, sizeof (buf), 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && errno == EAGAIN) {
+        return TRUE;
+    }
+
+    if (n <= 0) {
+        return FALSE;
+    }
+
+    g_string_append_len (str, buf, n);
+
+    return TRUE;
+}
+
+static GString *
+bytestream_socks_address_msg (LmBytestream *bytestream, guint8 code)
+{
+    GString *msg;
+    guint8   head[5];
+    guint8   port[2] = { 0, 0 };
+
+    /* A connect request from the client and the reply from the server
+     * look the same, the address is always the hash */
+    head[0] = SOCKS5_VERSION;
+    head[1] = code;
+    head[2] = 0;
+    head[3] = SOCKS5_ATYP_DOMAIN;
+    head[4] = strlen (bytestream->dst_addr);
+
+    msg = g_string_new_len ((gchar *) head, sizeof (head));
+    g_string_append (msg, bytestream->dst_addr);
+    g_string_append_len (msg, (gchar *) port, sizeof (port));
+
+    return msg;
+}
+
+/* Length of the connect request or reply at the start of @buf, 0 if more
+ * has to be read to know */
+static gsize
+bytestream_socks_address_msg_len (const guint8 *buf, gsize len)
+{
+    if (len < 5) {
+        return 0;
+    }
+
+    switch (buf[3]) {
+    case SOCKS5_ATYP_IPV4:
+        return 4 + 4 + 2;
+    case SOCKS5_ATYP_IPV6:
+        return 4 + 16 + 2;
+    default:
+        return 5 + buf[4] + 2;
+    }
+}
+
+/* The initiator's side of a direct connection from the target. Several
+ * may be in the handshake, the first one asking for our session is kept
+ * and the others are dropped. */
+static gboolean
+bytestream_socks_server_cb (GIOChannel         *source,
+                            GIOCondition        condition,
+                            BytestreamIncoming *incoming)
+{
+    LmBytestream *bytestream = incoming->bytestream;
+    const guint8 *buf;
+    gsize         len;
+
+    if (!bytestream_socks_read (incoming->fd, incoming->buf)) {
+        goto fail;
+    }
+
+    buf = (const guint8 *) incoming->buf->str;
+    len = incoming->buf->len;
+
+    if (incoming->state == SOCKS5_STATE_GREETING) {
+        gsize  n_methods;
+        guint8 reply[2] = { SOCKS5_VERSION, SOCKS5_AUTH_NONE };
+
+        if (len < 2 || len < 2 + (gsize) buf[1]) {
+            return TRUE;
+        }
+
+        n_methods = buf[1];
+        if (buf[0] != SOCKS5_VERSION ||
+            !memchr (buf + 2, SOCKS5_AUTH_NONE, n_methods)) {
+            goto fail;
+        }
+
+        if (!bytestream_socks_write (incoming->fd,
+                                     g_string_new_len ((gchar *) reply,
+                                                       sizeof (reply)))) {
+            goto fail;
+        }
+
+        g_string_erase (incoming->buf, 0, 2 + n_methods);
+        incoming->state = SOCKS5_STATE_REQUEST;
+
+        buf = (const guint8 *) incoming->buf->str;
+        len = incoming->buf->len;
+    }
+
+    if (incoming->state == SOCKS5_STATE_REQUEST) {
+        gsize msg_len;
+
+        msg_len = bytestream_socks_address_msg_len (buf, len);
+        if (msg_len == 0 || len < msg_len) {
+            return TRUE;
+        }
+
+        if (buf[0] != SOCKS5_VERSION || buf[1] != SOCKS5_CMD_CONNECT ||
+            buf[3] != SOCKS5_ATYP_DOMAIN ||
+            buf[4] != strlen (bytestream->dst_addr) ||
+            memcmp (buf + 5, bytestream->dst_addr, buf[4]) != 0) {
+            lm_verbose ("Bytestream connection for another session\n");
+            goto fail;
+        }
+
+        if (!bytestream_socks_write (incoming->fd,
+                                     bytestream_socks_address_msg (bytestream, 0))) {
+            goto fail;
+        }
+
+        lm_verbose ("Bytestream %s: direct connection from target\n",
+                    bytestream->sid);
+
+        /* Becomes the data connection, which flows once the target says
+         * it picked us */
+        bytestream->fd = incoming->fd;
+        bytestream->channel = incoming->channel;
+        bytestream->socks_state = SOCKS5_STATE_DONE;
+        incoming->fd = -1;
+        incoming->channel = NULL;
+        incoming->watch = NULL;
+
+        bytestream_close_incoming (bytestream);
+        return FALSE;
+    }
+
+    return TRUE;
+
+ fail:
+    incoming->watch = NULL;
+    bytestream->incoming = g_slist_remove (bytestream->incoming, incoming);
+    bytestream_incoming_free (incoming);
+    return FALSE;
+}
+
+static gboolean
+bytestream_incoming_timeout_cb (BytestreamIncoming *incoming)
+{
+    LmBytestream *bytestream = incoming->bytestream;
+
+    lm_verbose ("Bytestream %s: handshake timed out\n", bytestream->sid);
+
+    incoming->timeout = NULL;
+    bytestream->incoming = g_slist_remove (bytestream->incoming, incoming);
+    bytestream_incoming_free (incoming);
+
+    return FALSE;
+}
+
+static gboolean
+bytestream_accept_cb (GIOChannel   *source,
+                      GIOCondition  condition,
+                      LmBytestream *bytestream)
+{
+    BytestreamIncoming *incoming;
+    gint                fd;
+
+    fd = accept (bytestream->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return TRUE;
+    }
+
+    if (bytestream->fd >= 0 ||
+        g_slist_length (bytestream->incoming) >= BYTESTREAM_MAX_INCOMING) {
+        /* Already have the target, or too busy to tell */
+        _lm_sock_close (fd);
+        return TRUE;
+    }
+
+    _lm_sock_set_blocking (fd, FALSE);
+
+    incoming = g_new0 (BytestreamIncoming, 1);
+    incoming->bytestream = bytestream;
+    incoming->fd = fd;
+    incoming->channel = g_io_channel_unix_new (fd);
+    g_io_channel_set_encoding (incoming->channel, NULL, NULL);
+    g_io_channel_set_buffered (incoming->channel, FALSE);
+    incoming->state = SOCKS5_STATE_GREETING;
+    incoming->buf = g_string_new (NULL);
+    incoming->watch = lm_misc_add_io_watch (bytestream->context,
+                                            incoming->channel,
+                                            G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                            (GIOFunc) bytestream_socks_server_cb,
+                                            incoming);
+    incoming->timeout = lm_misc_add_timeout (bytestream->context,
+                                             BYTESTREAM_HANDSHAKE_TIMEOUT,
+                                             (GSourceFunc) bytestream_incoming_timeout_cb,
+                                             incoming);
+
+    bytestream->incoming = g_slist_prepend (bytestream->incoming, incoming);
+
+    return TRUE;
+}
+
+/* Takes the direct streamhost of an earlier offer out of the list */
+static void
+bytestream_drop_direct_host (LmBytestream *bytestream)
+{
+    if (!bytestream->direct_host) {
+        return;
+    }
+
+    bytestream->hosts = g_slist_remove (bytestream->hosts,
+                                        bytestream->direct_host);
+    bytestream_host_free (bytestream->direct_host);
+    bytestream->direct_host = NULL;
+}
+
+static gboolean
+bytestream_listen (LmBytestream *bytestream)
+{
+    struct addrinfo  hints;
+    struct addrinfo *ai;
+    struct sockaddr_storage addr;
+    socklen_t        addr_len = sizeof (addr);
+    gchar           *host;
+    gchar            port[NI_MAXSERV];
+    gint             fd;
+
+    host = lm_connection_get_local_host (bytestream->connection);
+    if (!host) {
+        return FALSE;
+    }
+
+    memset (&hints, 0, sizeof (hints));
+    hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if (getaddrinfo (host, "0", &hints, &ai) != 0) {
+        g_free (host);
+        return FALSE;
+    }
+
+    fd = _lm_sock_makesocket (ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (!_LM_SOCK_VALID (fd) ||
+        bind (fd, ai->ai_addr, ai->ai_addrlen) < 0 ||
+        listen (fd, BYTESTREAM_MAX_INCOMING) < 0 ||
+        getsockname (fd, (struct sockaddr *) &addr, &addr_len) < 0 ||
+        getnameinfo ((struct sockaddr *) &addr, addr_len, NULL, 0,
+                     port, sizeof (port), NI_NUMERICSERV) != 0) {
+        if (_LM_SOCK_VALID (fd)) {
+            _lm_sock_close (fd);
+        }
+        freeaddrinfo (ai);
+        g_free (host);
+        return FALSE;
+    }
+
+    freeaddrinfo (ai);
+
+    _lm_sock_set_blocking (fd, FALSE);
+
+    bytestream->listen_fd = fd;
+    bytestream->listen_channel = g_io_channel_unix_new (fd);
+    bytestream->listen_watch = lm_misc_add_io_watch (bytestream->context,
+                                                     bytestream->listen_channel,
+                                                     G_IO_IN,
+                                                     (GIOFunc) bytestream_accept_cb,
+                                                     bytestream);
+
+    bytestream->direct_host = bytestream_host_new (bytestream->own_jid, host,
+                                                   atoi (port));
+    bytestream->hosts = g_slist_prepend (bytestream->hosts,
+                                         bytestream->direct_host);
+
+    lm_verbose ("Bytestream %s: listening on %s:%s\n",
+                bytestream->sid, host, port);
+
+    g_free (host);
+
+    return TRUE;
+}
+
+/* -- Connecting to a streamhost -- */
+
+static void
+bytestream_send_reply (LmBytestream *bytestream, BytestreamHost *used)
+{
+    LmMessage     *m;
+    LmMessageNode *query;
+
+    if (used) {
+        m = lm_message_new_with_sub_type (bytestream->peer, LM_MESSAGE_TYPE_IQ,
+                                          LM_MESSAGE_SUB_TYPE_RESULT);
+        query = lm_message_node_add_child (m->node, "query", NULL);
+        lm_message_node_set_attributes (query,
+                                        "xmlns", XMPP_NS_BYTESTREAMS,
+                                        "sid", bytestream->sid,
+                                        NULL);
+        lm_message_node_set_attribute (lm_message_node_add_child (query,
+                                                                  "streamhost-used",
+                                                                  NULL),
+                                       "jid", used->jid);
+    } else {
+        LmMessageNode *error;
+
+        m = lm_message_new_with_sub_type (bytestream->peer, LM_MESSAGE_TYPE_IQ,
+                                          LM_MESSAGE_SUB_TYPE_ERROR);
+        error = lm_message_node_add_child (m->node, "error", NULL);
+        lm_message_node_set_attribute (error, "type", "cancel");
+        lm_message_node_set_attribute (lm_message_node_add_child (error,
+                                                                  "item-not-found",
+                                                                  NULL),
+                                       "xmlns", XMPP_NS_STANZAS);
+    }
+
+    lm_message_node_set_attribute (m->node, "id", bytestream->request_id);
+
+    lm_connection_send (bytestream->connection, m, NULL);
+    lm_message_unref (m);
+}
+
+static LmHandlerResult
+bytestream_activate_reply (LmMessageHandler *handler,
+                           LmConnection     *connection,
+                           LmMessage        *m,
+                           LmBytestream     *bytestream)
+{
+    if (!bytestream->running) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_RESULT) {
+        lm_verbose ("Bytestream proxy refused to activate\n");
+        bytestream_finish (bytestream, FALSE);
+    } else {
+        bytestream_start_transfer (bytestream);
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+bytestream_activate (LmBytestream *bytestream)
+{
+    BytestreamHost   *proxy = bytestream->current_host->data;
+    LmMessage        *m;
+    LmMessageNode    *query;
+    LmMessageHandler *handler;
+
+    m = lm_message_new_with_sub_type (proxy->jid, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_SET);
+    query = lm_message_node_add_child (m->node, "query", NULL);
+    lm_message_node_set_attributes (query,
+                                    "xmlns", XMPP_NS_BYTESTREAMS,
+                                    "sid", bytestream->sid,
+                                    NULL);
+    lm_message_node_add_child (query, "activate", bytestream->peer);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) bytestream_activate_reply,
+                                      lm_bytestream_ref (bytestream),
+                                      (GDestroyNotify) lm_bytestream_unref);
+
+    if (!lm_connection_send_with_reply (bytestream->connection, m,
+                                        handler, NULL)) {
+        bytestream_finish (bytestream, FALSE);
+    }
+
+    lm_message_handler_unref (handler);
+    lm_message_unref (m);
+}
+
+static void
+bytestream_connect_failed (LmBytestream *bytestream)
+{
+    bytestream_close_data (bytestream);
+
+    if (bytestream->initiator) {
+        bytestream_finish (bytestream, FALSE);
+        return;
+    }
+
+    bytestream->current_host = bytestream->current_host->next;
+    if (bytestream->current_host) {
+        bytestream_connect (bytestream);
+        return;
+    }
+
+    /* None of them worked */
+    bytestream_send_reply (bytestream, NULL);
+    bytestream_finish (bytestream, FALSE);
+}
+
+/* The HTTP proxy of the connection, streamhosts are reached through it
+ * as well */
+static LmProxy *
+bytestream_get_proxy (LmBytestream *bytestream)
+{
+    LmProxy *proxy;
+
+    proxy = lm_connection_get_proxy (bytestream->connection);
+    if (proxy && lm_proxy_get_type (proxy) == LM_PROXY_TYPE_HTTP) {
+        return proxy;
+    }
+
+    return NULL;
+}
+
+static gboolean
+bytestream_socks_greet (LmBytestream *bytestream)
+{
+    guint8 greeting[3] = { SOCKS5_VERSION, 1, SOCKS5_AUTH_NONE };
+
+    bytestream->socks_state = SOCKS5_STATE_GREETING;
+
+    return bytestream_socks_write (bytestream->fd,
+                                   g_string_new_len ((gchar *) greeting,
+                                                     sizeof (greeting)));
+}
+
+static gboolean
+bytestream_socks_client_cb (GIOChannel   *source,
+                            GIOCondition  condition,
+                            LmBytestream *bytestream)
+{
+    const guint8 *buf;
+    gsize         len;
+
+    if (!bytestream_socks_read (bytestream->fd, bytestream->socks_buf)) {
+        goto fail;
+    }
+
+    if (bytestream->socks_state == SOCKS5_STATE_PROXY) {
+        const gchar *str = bytestream->socks_buf->str;
+        const gchar *end;
+
+        /* Nothing else comes before we greet the streamhost */
+        end = strstr (str, "\r\n\r\n");
+        if (!end) {
+            return TRUE;
+        }
+
+        if (strncmp (str, "HTTP/1.", 7) != 0 ||
+            strncmp (str + 8, " 200", 4) != 0) {
+            lm_verbose ("Bytestream %s: refused by the proxy\n",
+                        bytestream->sid);
+            goto fail;
+        }
+
+        g_string_truncate (bytestream->socks_buf, 0);
+
+        if (!bytestream_socks_greet (bytestream)) {
+            goto fail;
+        }
+
+        return TRUE;
+    }
+
+    buf = (const guint8 *) bytestream->socks_buf->str;
+    len = bytestream->socks_buf->len;
+
+    if (bytestream->socks_state == SOCKS5_STATE_GREETING) {
+        if (len < 2) {
+            return TRUE;
+        }
+
+        if (buf[0] != SOCKS5_VERSION || buf[1] != SOCKS5_AUTH_NONE) {
+            goto fail;
+        }
+
+        if (!bytestream_socks_write (bytestream->fd,
+                                     bytestream_socks_address_msg (bytestream,
+                                                                   SOCKS5_CMD_CONNECT))) {
+            goto fail;
+        }
+
+        g_string_erase (bytestream->socks_buf, 0, 2);
+        bytestream->socks_state = SOCKS5_STATE_REQUEST;
+
+        buf = (const guint8 *) bytestream->socks_buf->str;
+        len = bytestream->socks_buf->len;
+    }
+
+    if (bytestream->socks_state == SOCKS5_STATE_REQUEST) {
+        gsize msg_len;
+
+        msg_len = bytestream_socks_address_msg_len (buf, len);
+        if (msg_len == 0 || len < msg_len) {
+            return TRUE;
+        }
+
+        if (buf[0] != SOCKS5_VERSION || buf[1] != 0) {
+            goto fail;
+        }
+
+        g_string_truncate (bytestream->socks_buf, 0);
+        bytestream->socks_state = SOCKS5_STATE_DONE;
+        bytestream->watch = NULL;
+
+        if (bytestream->initiator) {
+            bytestream_activate (bytestream);
+        } else {
+            bytestream_send_reply (bytestream,
+                                   bytestream->current_host->data);
+            bytestream_start_transfer (bytestream);
+        }
+
+        return FALSE;
+    }
+
+    return TRUE;
+
+ fail:
+    bytestream->watch = NULL;
+    bytestream_connect_failed (bytestream);
+    return FALSE;
+}
+
+static gboolean
+bytestream_connected_cb (GIOChannel   *source,
+                         GIOCondition  condition,
+                         LmBytestream *bytestream)
+{
+    LmProxy  *proxy;
+    int       err = 0;
+    socklen_t len = sizeof (err);
+    gboolean  result;
+
+    bytestream->watch = NULL;
+
+    _lm_sock_get_error (bytestream->fd, &err, &len);
+    if (err != 0) {
+        bytestream_connect_failed (bytestream);
+        return FALSE;
+    }
+
+    proxy = bytestream_get_proxy (bytestream);
+    if (proxy) {
+        BytestreamHost *host = bytestream->current_host->data;
+        gchar          *request;
+
+        request = _lm_proxy_connect_request (proxy, host->host, host->port);
+        bytestream->socks_state = SOCKS5_STATE_PROXY;
+        result = bytestream_socks_write (bytestream->fd, g_string_new (request));
+        g_free (request);
+    } else {
+        result = bytestream_socks_greet (bytestream);
+    }
+
+    if (!result) {
+        bytestream_connect_failed (bytestream);
+        return FALSE;
+    }
+
+    bytestream->watch = bytestream_add_watch (bytestream,
+                                              G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                              (GIOFunc) bytestream_socks_client_cb);
+
+    return FALSE;
+}
+
+static void
+bytestream_resolved_cb (LmResolver       *resolver,
+                        LmResolverResult  result,
+                        LmBytestream     *bytestream)
+{
+    BytestreamHost  *host = bytestream->current_host->data;
+    LmProxy         *proxy = bytestream_get_proxy (bytestream);
+    guint            port;
+    struct addrinfo *addr;
+    int              res;
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        return;
+    }
+
+    if (result != LM_RESOLVER_RESULT_OK ||
+        !(addr = lm_resolver_results_get_next (resolver))) {
+        bytestream_connect_failed (bytestream);
+        return;
+    }
+
+    port = proxy ? lm_proxy_get_port (proxy) : host->port;
+    if (addr->ai_family == AF_INET6) {
+        ((struct sockaddr_in6 *) addr->ai_addr)->sin6_port = htons (port);
+    } else {
+        ((struct sockaddr_in *) addr->ai_addr)->sin_port = htons (port);
+    }
+
+    bytestream->fd = _lm_sock_makesocket (addr->ai_family,
+                                          addr->ai_socktype,
+                                          addr->ai_protocol);
+    if (!_LM_SOCK_VALID (bytestream->fd)) {
+        bytestream->fd = -1;
+        bytestream_connect_failed (bytestream);
+        return;
+    }
+
+    _lm_sock_set_blocking (bytestream->fd, FALSE);
+
+    bytestream->channel = g_io_channel_unix_new (bytestream->fd);
+    g_io_channel_set_encoding (bytestream->channel, NULL, NULL);
+    g_io_channel_set_buffered (bytestream->channel, FALSE);
+
+    res = _lm_sock_connect (bytestream->fd, addr->ai_addr,
+                            (int) addr->ai_addrlen);
+    if (res < 0 && !_lm_sock_is_blocking_error (_lm_sock_get_last_error ())) {
+        bytestream_connect_failed (bytestream);
+        return;
+    }
+
+    bytestream->watch = bytestream_add_watch (bytestream,
+                                              G_IO_OUT | G_IO_ERR,
+                                              (GIOFunc) bytestream_connected_cb);
+}
+
+static void
+bytestream_connect (LmBytestream *bytestream)
+{
+    BytestreamHost *host = bytestream->current_host->data;
+    LmProxy        *proxy = bytestream_get_proxy (bytestream);
+
+    lm_verbose ("Bytestream %s: trying streamhost %s at %s:%d\n",
+                bytestream->sid, host->jid, host->host, host->port);
+
+    /* The proxy opens the connection to the streamhost for us */
+    bytestream->resolver =
+        lm_resolver_new_for_host (proxy ? lm_proxy_get_server (proxy) : host->host,
+                                  (LmResolverCallback) bytestream_resolved_cb,
+                                  bytestream);
+    if (bytestream->context) {
+        g_object_set (bytestream->resolver,
+                      "context", bytestream->context, NULL);
+    }
+
+    lm_resolver_lookup (bytestream->resolver);
+}
+
+static LmHandlerResult
+bytestream_offer_reply (LmMessageHandler *handler,
+                        LmConnection     *connection,
+                        LmMessage        *m,
+                        LmBytestream     *bytestream)
+{
+    LmMessageNode *node;
+    const gchar   *jid = NULL;
+    GSList        *l;
+
+    if (!bytestream->running) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    node = lm_message_node_find_child (m->node, "streamhost-used");
+    if (node) {
+        jid = lm_message_node_get_attribute (node, "jid");
+    }
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_RESULT || !jid) {
+        lm_verbose ("Bytestream %s refused\n", bytestream->sid);
+        bytestream_finish (bytestream, FALSE);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    for (l = bytestream->hosts; l; l = l->next) {
+        if (strcmp (((BytestreamHost *) l->data)->jid, jid) == 0) {
+            break;
+        }
+    }
+
+    bytestream_close_listen (bytestream);
+
+    if (!l) {
+        bytestream_finish (bytestream, FALSE);
+    }
+    else if (l->data == bytestream->direct_host) {
+        if (bytestream->socks_state != SOCKS5_STATE_DONE) {
+            bytestream_finish (bytestream, FALSE);
+        } else {
+            bytestream_start_transfer (bytestream);
+        }
+    } else {
+        /* Through a proxy, which we need to connect to as well */
+        bytestream_close_data (bytestream);
+        bytestream->current_host = l;
+        bytestream_connect (bytestream);
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+/* Offers the streamhosts to the target */
+static gboolean
+bytestream_send_offer (LmBytestream *bytestream, GError **error)
+{
+    LmMessage        *m;
+    LmMessageNode    *query;
+    LmMessageHandler *handler;
+    GSList           *l;
+    gboolean          result;
+
+    /* Each offer listens anew */
+    bytestream_drop_direct_host (bytestream);
+
+    /* Behind a proxy the target has no way to reach us */
+    if (bytestream->direct && !bytestream_get_proxy (bytestream) &&
+        !bytestream_listen (bytestream)) {
+        lm_verbose ("Bytestream %s: can't offer a direct connection\n",
+                    bytestream->sid);
+    }
+
+    if (!bytestream->hosts) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_FAILED,
+                     "No streamhost to offer");
+        return FALSE;
+    }
+
+    m = lm_message_new_with_sub_type (bytestream->peer, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_SET);
+    query = lm_message_node_add_child (m->node, "query", NULL);
+    lm_message_node_set_attributes (query,
+                                    "xmlns", XMPP_NS_BYTESTREAMS,
+                                    "sid", bytestream->sid,
+                                    "mode", "tcp",
+                                    NULL);
+
+    for (l = bytestream->hosts; l; l = l->next) {
+        BytestreamHost *host = l->data;
+        LmMessageNode  *node;
+        gchar          *port;
+
+        port = g_strdup_printf ("%u", host->port);
+        node = lm_message_node_add_child (query, "streamhost", NULL);
+        lm_message_node_set_attributes (node,
+                                        "jid", host->jid,
+                                        "host", host->host,
+                                        "port", port,
+                                        NULL);
+        g_free (port);
+    }
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) bytestream_offer_reply,
+                                      lm_bytestream_ref (bytestream),
+                                      (GDestroyNotify) lm_bytestream_unref);
+    result = lm_connection_send_with_reply (bytestream->connection, m,
+                                            handler, error);
+    lm_message_handler_unref (handler);
+    lm_message_unref (m);
+
+    return result;
+}
+
+/* -- In-band -- */
+
+static void
+bytestream_ibb_reply (LmBytestream *bytestream,
+                      const gchar  *id,
+                      const gchar  *condition)
+{
+    gchar *str;
+
+    if (condition) {
+        str = g_markup_printf_escaped ("<iq type='error' to='%s' id='%s'>"
+                                       "<error type='cancel'><%s xmlns='%s'/>"
+                                       "</error></iq>",
+                                       bytestream->peer, id ? id : "",
+                                       condition, XMPP_NS_STANZAS);
+    } else {
+        str = g_markup_printf_escaped ("<iq type='result' to='%s' id='%s'/>",
+                                       bytestream->peer, id ? id : "");
+    }
+
+    lm_connection_send_raw (bytestream->connection, str, NULL);
+    g_free (str);
+}
+
+static void
+bytestream_ibb_close (LmBytestream *bytestream)
+{
+    LmMessage *m;
+
+    bytestream->ibb_open = FALSE;
+
+    m = lm_message_new_with_sub_type (bytestream->peer, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_SET);
+    lm_message_node_set_attributes (lm_message_node_add_child (m->node,
+                                                               "close", NULL),
+                                    "xmlns", XMPP_NS_IBB,
+                                    "sid", bytestream->sid,
+                                    NULL);
+
+    lm_connection_send (bytestream->connection, m, NULL);
+    lm_message_unref (m);
+}
+
+/* Sends the next block. The stanza is written out by hand with the data
+ * base64 encoded straight into it, a message tree would mean encoding it
+ * into a string of its own and then copying it during serialization. */
+static gboolean
+bytestream_ibb_send_block (LmBytestream *bytestream)
+{
+    GString *str;
+    gchar   *head;
+    gchar   *id;
+    off_t    offset;
+    gsize    len;
+    gsize    done = 0;
+    gsize    start;
+    gsize    n;
+    gint     state = 0;
+    gint     save = 0;
+    gboolean result;
+
+    offset = bytestream->ibb_next * bytestream->block_size;
+    len = MIN (bytestream->block_size, bytestream->size - offset);
+
+    while (done < len) {
+        gssize r;
+
+        r = pread (bytestream->file_fd, bytestream->ibb_buf + done,
+                   len - done, offset + done);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (r <= 0) {
+            /* The file is shorter than announced */
+            return FALSE;
+        }
+
+        done += r;
+    }
+
+    id = g_strdup_printf ("%s-%" G_GUINT64_FORMAT,
+                          bytestream->ibb_id, bytestream->ibb_next);
+    head = g_markup_printf_escaped ("<iq type='set' to='%s' id='%s'>"
+                                    "<data xmlns='%s' sid='%s' seq='%u'>",
+                                    bytestream->peer, id, XMPP_NS_IBB,
+                                    bytestream->sid,
+                                    (guint) (bytestream->ibb_next & 0xffff));
+
+    str = g_string_sized_new (strlen (head) + (len / 3 + 1) * 4 + 4 + 16);
+    g_string_append (str, head);
+    g_free (head);
+
+    start = str->len;
+    g_string_set_size (str, start + (len / 3 + 1) * 4 + 4);
+    n = g_base64_encode_step (bytestream->ibb_buf, len, FALSE,
+                              str->str + start, &state, &save);
+    n += g_base64_encode_close (FALSE, str->str + start + n, &state, &save);
+    g_string_truncate (str, start + n);
+
+    g_string_append (str, "</data></iq>");
+
+    result = _lm_connection_send_raw_with_reply (bytestream->connection,
+                                                 g_string_free (str, FALSE),
+                                                 id,
+                                                 bytestream->ibb_handler,
+                                                 NULL);
+    g_free (id);
+
+    return result;
+}
+
+static void
+bytestream_ibb_fill_window (LmBytestream *bytestream)
+{
+    while (bytestream->ibb_in_flight < bytestream->window &&
+           bytestream->ibb_next * bytestream->block_size < bytestream->size) {
+        if (!bytestream_ibb_send_block (bytestream)) {
+            bytestream_finish (bytestream, FALSE);
+            return;
+        }
+
+        bytestream->ibb_in_flight++;
+        bytestream->ibb_next++;
+    }
+
+    if (bytestream->ibb_in_flight == 0) {
+        bytestream_finish (bytestream, TRUE);
+    }
+}
+
+static LmHandlerResult
+bytestream_ibb_block_reply (LmMessageHandler *handler,
+                            LmConnection     *connection,
+                            LmMessage        *m,
+                            LmBytestream     *bytestream)
+{
+    const gchar *id;
+    const gchar *index;
+    guint64      offset;
+
+    if (!bytestream->running) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_RESULT) {
+        lm_verbose ("Bytestream %s: block refused\n", bytestream->sid);
+        bytestream->ibb_open = FALSE;
+        bytestream_finish (bytestream, FALSE);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    /* The id ends with the index of the block */
+    id = lm_message_node_get_attribute (m->node, "id");
+    index = strrchr (id, '-');
+    offset = g_ascii_strtoull (index + 1, NULL, 10) * bytestream->block_size;
+
+    bytestream->ibb_in_flight--;
+    bytestream->transferred += MIN (bytestream->block_size,
+                                    bytestream->size - offset);
+    bytestream_progress (bytestream);
+
+    if (bytestream->running) {
+        bytestream_ibb_fill_window (bytestream);
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static LmHandlerResult
+bytestream_ibb_open_reply (LmMessageHandler *handler,
+                           LmConnection     *connection,
+                           LmMessage        *m,
+                           LmBytestream     *bytestream)
+{
+    LmMessageNode *error;
+
+    if (!bytestream->running) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    if (lm_message_get_sub_type (m) == LM_MESSAGE_SUB_TYPE_RESULT) {
+        lm_verbose ("Bytestream %s opened in-band with %u byte blocks\n",
+                    bytestream->sid, bytestream->block_size);
+
+        bytestream->ibb_open = TRUE;
+        bytestream->ibb_buf = g_malloc (bytestream->block_size);
+        g_free (bytestream->ibb_id);
+        bytestream->ibb_id = _lm_utils_generate_id ();
+        bytestream->ibb_handler =
+            lm_message_handler_new ((LmHandleMessageFunction) bytestream_ibb_block_reply,
+                                    lm_bytestream_ref (bytestream),
+                                    (GDestroyNotify) lm_bytestream_unref);
+
+        bytestream_ibb_fill_window (bytestream);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    /* The peer wants smaller blocks */
+    error = lm_message_node_get_child (m->node, "error");
+    if (error &&
+        lm_message_node_get_child (error, "resource-constraint") &&
+        bytestream->block_size > IBB_MIN_BLOCK_SIZE) {
+        bytestream->block_size = MAX (bytestream->block_size / 2,
+                                      IBB_MIN_BLOCK_SIZE);
+        if (bytestream_ibb_open (bytestream, NULL)) {
+            return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+        }
+    }
+
+    lm_verbose ("Bytestream %s refused\n", bytestream->sid);
+    bytestream_finish (bytestream, FALSE);
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static gboolean
+bytestream_ibb_open (LmBytestream *bytestream, GError **error)
+{
+    LmMessage        *m;
+    LmMessageHandler *handler;
+    gchar            *block_size;
+    gboolean          result;
+
+    block_size = g_strdup_printf ("%u", bytestream->block_size);
+
+    m = lm_message_new_with_sub_type (bytestream->peer, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_SET);
+    lm_message_node_set_attributes (lm_message_node_add_child (m->node,
+                                                               "open", NULL),
+                                    "xmlns", XMPP_NS_IBB,
+                                    "block-size", block_size,
+                                    "sid", bytestream->sid,
+                                    "stanza", "iq",
+                                    NULL);
+    g_free (block_size);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) bytestream_ibb_open_reply,
+                                      lm_bytestream_ref (bytestream),
+                                      (GDestroyNotify) lm_bytestream_unref);
+    result = lm_connection_send_with_reply (bytestream->connection, m,
+                                            handler, error);
+    lm_message_handler_unref (handler);
+    lm_message_unref (m);
+
+    return result;
+}
+
+/* Decodes a block into the buffer and writes it to the file */
+static gboolean
+bytestream_ibb_write_block (LmBytestream *bytestream, const gchar *data)
+{
+    gsize  len;
+    gsize  done = 0;
+    gint   state = 0;
+    guint  save = 0;
+
+    len = data ? strlen (data) : 0;
+    if (len / 4 * 3 > bytestream->block_size + 3) {
+        /* Wouldn't fit in the buffer */
+        return FALSE;
+    }
+
+    len = g_base64_decode_step (data, len, bytestream->ibb_buf,
+                                &state, &save);
+    if (len > bytestream->block_size) {
+        return FALSE;
+    }
+
+    if (bytestream->size && bytestream->transferred + len > bytestream->size) {
+        lm_verbose ("Bytestream %s: more than the %" G_GUINT64_FORMAT
+                    " bytes offered\n", bytestream->sid, bytestream->size);
+        return FALSE;
+    }
+
+    while (done < len) {
+        gssize n;
+
+        n = write (bytestream->file_fd, bytestream->ibb_buf + done,
+                   len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            lm_verbose ("Bytestream write failed: %s\n", g_strerror (errno));
+            return FALSE;
+        }
+
+        done += n;
+    }
+
+    bytestream->transferred += len;
+
+    return TRUE;
+}
+
+static LmHandlerResult
+bytestream_ibb_incoming (LmMessageHandler *handler,
+                         LmConnection     *connection,
+                         LmMessage        *m,
+                         LmBytestream     *bytestream)
+{
+    LmMessageNode *node;
+    const gchar   *from;
+    const gchar   *sid;
+    const gchar   *seq;
+    const gchar   *id;
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_SET) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    node = lm_message_node_get_child (m->node, "data");
+    if (!node) {
+        node = lm_message_node_get_child (m->node, "close");
+    }
+
+    from = lm_message_node_get_attribute (m->node, "from");
+    sid = node ? lm_message_node_get_attribute (node, "sid") : NULL;
+
+    if (!bytestream->running || !sid || !from ||
+        strcmp (sid, bytestream->sid) != 0 ||
+        strcmp (from, bytestream->peer) != 0) {
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
+    id = lm_message_node_get_attribute (m->node, "id");
+
+    if (strcmp (node->name, "close") == 0) {
+        bytestream->ibb_open = FALSE;
+        bytestream_ibb_reply (bytestream, id, NULL);
+        bytestream_finish (bytestream, bytestream_is_complete (bytestream));
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    seq = lm_message_node_get_attribute (node, "seq");
+    if (!seq || (guint16) atoi (seq) != bytestream->ibb_seq) {
+        lm_verbose ("Bytestream %s: block out of sequence\n", bytestream->sid);
+        bytestream_ibb_reply (bytestream, id, "unexpected-request");
+        bytestream_finish (bytestream, FALSE);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    if (!bytestream_ibb_write_block (bytestream, node->value)) {
+        bytestream_ibb_reply (bytestream, id, "not-acceptable");
+        bytestream_finish (bytestream, FALSE);
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    bytestream->ibb_seq++;
+    bytestream_ibb_reply (bytestream, id, NULL);
+    bytestream_progress (bytestream);
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+/* Accepts an in-band open request unless its blocks are larger than we
+ * are willing to take, the sender then asks again with smaller ones */
+static gboolean
+bytestream_ibb_accept (LmBytestream   *bytestream,
+                       LmMessageNode  *open,
+                       GError        **error)
+{
+    const gchar *block_size;
+    guint        size;
+
+    block_size = lm_message_node_get_attribute (open, "block-size");
+    size = block_size ? atoi (block_size) : 0;
+
+    if (size == 0 || size > bytestream->block_size) {
+        bytestream_ibb_reply (bytestream, bytestream->request_id,
+                              "resource-constraint");
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_FAILED,
+                     "Block size of %u not accepted", size);
+        return FALSE;
+    }
+
+    bytestream->block_size = size;
+    bytestream->ibb_seq = 0;
+    bytestream->ibb_open = TRUE;
+    /* The decoder may write a few bytes more than a block */
+    bytestream->ibb_buf = g_malloc (size + 6);
+    bytestream->ibb_handler =
+        lm_message_handler_new ((LmHandleMessageFunction) bytestream_ibb_incoming,
+                                lm_bytestream_ref (bytestream),
+                                (GDestroyNotify) lm_bytestream_unref);
+    lm_connection_register_message_handler (bytestream->connection,
+                                            bytestream->ibb_handler,
+                                            LM_MESSAGE_TYPE_IQ,
+                                            LM_HANDLER_PRIORITY_FIRST);
+
+    bytestream_ibb_reply (bytestream, bytestream->request_id, NULL);
+
+    return TRUE;
+}
+
+static gchar *
+bytestream_get_dst_addr (const gchar *sid,
+                         const gchar *initiator,
+                         const gchar *target)
+{
+    gchar *str;
+    gchar *hash;
+
+    str = g_strconcat (sid, initiator, target, NULL);
+    hash = lm_sha_hash (str);
+    g_free (str);
+
+    return hash;
+}
+
+/**
+ * lm_bytestream_new:
+ * @connection: the #LmConnection to negotiate over
+ * @peer: full JID of the other end, or %NULL when receiving
+ * @sid: the stream session id, or %NULL
+ *
+ * Creates a new bytestream with @peer. The session id is the one agreed
+ * on when the transfer was offered, a new one is made up if @sid is
+ * %NULL. A bytestream used with lm_bytestream_receive_file() takes both
+ * from the request.
+ *
+ * Return value: a newly created #LmBytestream, free with lm_bytestream_unref().
+ **/
+LmBytestream *
+lm_bytestream_new (LmConnection *connection,
+                   const gchar  *peer,
+                   const gchar  *sid)
+{
+    LmBytestream *bytestream;
+    GMainContext *context;
+
+    g_return_val_if_fail (connection != NULL, NULL);
+
+    bytestream = g_new0 (LmBytestream, 1);
+    bytestream->ref_count = 1;
+    bytestream->connection = lm_connection_ref (connection);
+    bytestream->peer = g_strdup (peer);
+    bytestream->sid = sid ? g_strdup (sid) : _lm_utils_generate_id ();
+    bytestream->direct = TRUE;
+    bytestream->method = LM_BYTESTREAM_METHOD_SOCKS5;
+    bytestream->block_size = IBB_DEFAULT_BLOCK_SIZE;
+    bytestream->window = IBB_DEFAULT_WINDOW;
+    bytestream->listen_fd = -1;
+    bytestream->fd = -1;
+    bytestream->file_fd = -1;
+    bytestream->pipe_fds[0] = bytestream->pipe_fds[1] = -1;
+    bytestream->socks_buf = g_string_new (NULL);
+
+    context = _lm_connection_get_context (connection);
+    if (context) {
+        bytestream->context = g_main_context_ref (context);
+    }
+
+    return bytestream;
+}
+
+/**
+ * lm_bytestream_add_streamhost:
+ * @bytestream: an #LmBytestream
+ * @jid: JID of the streamhost
+ * @host: address or host name of the streamhost
+ * @port: port of the streamhost
+ *
+ * Adds a SOCKS5 proxy to offer when sending, usually one found through
+ * service discovery on the server. Streamhosts are offered in the order
+ * they are added, after the sender itself.
+ **/
+void
+lm_bytestream_add_streamhost (LmBytestream *bytestream,
+                              const gchar  *jid,
+                              const gchar  *host,
+                              guint         port)
+{
+    g_return_if_fail (bytestream != NULL);
+    g_return_if_fail (jid != NULL);
+    g_return_if_fail (host != NULL);
+
+    bytestream->hosts = g_slist_append (bytestream->hosts,
+                                        bytestream_host_new (jid, host, port));
+}
+
+/**
+ * lm_bytestream_get_direct:
+ * @bytestream: an #LmBytestream
+ *
+ * Get whether the sender offers itself as a streamhost.
+ *
+ * Return value: %TRUE if direct connections are offered.
+ **/
+gboolean
+lm_bytestream_get_direct (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, FALSE);
+
+    return bytestream->direct;
+}
+
+/**
+ * lm_bytestream_set_direct:
+ * @bytestream: an #LmBytestream
+ * @direct: whether to offer direct connections
+ *
+ * Sets whether the sender offers itself as a streamhost, listening on the
+ * local address of the connection. On by default, turn it off when the
+ * receiver can't reach that address, for example behind a NAT. Ignored
+ * when the connection goes through a proxy.
+ **/
+void
+lm_bytestream_set_direct (LmBytestream *bytestream, gboolean direct)
+{
+    g_return_if_fail (bytestream != NULL);
+
+    bytestream->direct = direct;
+}
+
+/**
+ * lm_bytestream_get_method:
+ * @bytestream: an #LmBytestream
+ *
+ * Get how the data of @bytestream is transferred.
+ *
+ * Return value: the method of @bytestream.
+ **/
+LmBytestreamMethod
+lm_bytestream_get_method (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, LM_BYTESTREAM_METHOD_SOCKS5);
+
+    return bytestream->method;
+}
+
+/**
+ * lm_bytestream_set_method:
+ * @bytestream: an #LmBytestream
+ * @method: the method to send with
+ *
+ * Sets how lm_bytestream_send_file() transfers the data, with SOCKS5 by
+ * default. When receiving the method is the one the sender asked for.
+ **/
+void
+lm_bytestream_set_method (LmBytestream *bytestream, LmBytestreamMethod method)
+{
+    g_return_if_fail (bytestream != NULL);
+    g_return_if_fail (!bytestream->running);
+
+    bytestream->method = method;
+}
+
+/**
+ * lm_bytestream_get_block_size:
+ * @bytestream: an #LmBytestream
+ *
+ * Get the size of in-band blocks. Once a transfer has started this is
+ * the size agreed on with the peer.
+ *
+ * Return value: the block size in bytes.
+ **/
+guint
+lm_bytestream_get_block_size (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, 0);
+
+    return bytestream->block_size;
+}
+
+/**
+ * lm_bytestream_set_block_size:
+ * @bytestream: an #LmBytestream
+ * @block_size: the block size in bytes, at most 65535
+ *
+ * Sets the size of in-band blocks, 4096 bytes by default. The sender
+ * starts with this size and halves it for as long as the peer asks for
+ * smaller blocks. The receiver refuses blocks larger than this.
+ **/
+void
+lm_bytestream_set_block_size (LmBytestream *bytestream, guint block_size)
+{
+    g_return_if_fail (bytestream != NULL);
+    g_return_if_fail (!bytestream->running);
+    g_return_if_fail (block_size > 0 && block_size <= IBB_MAX_BLOCK_SIZE);
+
+    bytestream->block_size = block_size;
+}
+
+/**
+ * lm_bytestream_get_window:
+ * @bytestream: an #LmBytestream
+ *
+ * Get the number of in-band blocks that may be waiting for their result.
+ *
+ * Return value: the window in blocks.
+ **/
+guint
+lm_bytestream_get_window (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, 0);
+
+    return bytestream->window;
+}
+
+/**
+ * lm_bytestream_set_window:
+ * @bytestream: an #LmBytestream
+ * @window: number of blocks, at least 1
+ *
+ * Sets how many in-band blocks are sent before the result of the first
+ * one has come back, 8 by default. A window of 1 waits for every block,
+ * which limits the transfer to one block per round trip. A larger one
+ * fills the link at the cost of more data queued up at the server.
+ **/
+void
+lm_bytestream_set_window (LmBytestream *bytestream, guint window)
+{
+    g_return_if_fail (bytestream != NULL);
+    g_return_if_fail (window > 0);
+
+    bytestream->window = window;
+}
+
+/**
+ * lm_bytestream_get_size:
+ * @bytestream: an #LmBytestream
+ *
+ * Gets the size of the file being transferred.
+ *
+ * Return value: the size in bytes, 0 if not known.
+ **/
+guint64
+lm_bytestream_get_size (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, 0);
+
+    return bytestream->size;
+}
+
+/**
+ * lm_bytestream_set_size:
+ * @bytestream: an #LmBytestream
+ * @size: size in bytes offered by the sender, 0 if not known
+ *
+ * Sets the size of the file to receive, as offered in the file transfer
+ * negotiation that set up @bytestream. Call it before
+ * lm_bytestream_receive_file(). The transfer then fails if the sender
+ * sends more than this or closes the stream before all of it arrived.
+ * lm_bytestream_send_file() sets the size itself.
+ **/
+void
+lm_bytestream_set_size (LmBytestream *bytestream, guint64 size)
+{
+    g_return_if_fail (bytestream != NULL);
+    g_return_if_fail (!bytestream->running);
+
+    bytestream->size = size;
+}
+
+/**
+ * lm_bytestream_set_progress_function:
+ * @bytestream: an #LmBytestream
+ * @function: function to call as data is transferred
+ * @user_data: user data passed to @function
+ * @notify: function to free @user_data, or %NULL
+ *
+ * Sets a function to be called as data is transferred.
+ **/
+void
+lm_bytestream_set_progress_function (LmBytestream                 *bytestream,
+                                     LmBytestreamProgressFunction  function,
+                                     gpointer                      user_data,
+                                     GDestroyNotify                notify)
+{
+    g_return_if_fail (bytestream != NULL);
+
+    if (bytestream->progress_cb) {
+        _lm_utils_free_callback (bytestream->progress_cb);
+    }
+
+    bytestream->progress_cb = _lm_utils_new_callback (function, user_data,
+                                                      notify);
+}
+
+/**
+ * lm_bytestream_send_file:
+ * @bytestream: an #LmBytestream
+ * @fd: file descriptor to send from
+ * @size: number of bytes to send
+ * @function: function to call when the transfer is over
+ * @user_data: user data passed to @function
+ * @notify: function to free @user_data, or %NULL
+ * @error: location to store error, or %NULL
+ *
+ * Offers the streamhosts to the peer and sends @size bytes of @fd from
+ * its start over the one the peer connects to. With the in-band method
+ * the data is sent in blocks over @connection instead. @fd has to stay
+ * open until @function has been called.
+ *
+ * Return value: %TRUE if the offer was sent.
+ **/
+gboolean
+lm_bytestream_send_file (LmBytestream          *bytestream,
+                         gint                   fd,
+                         guint64                size,
+                         LmBytestreamFunction   function,
+                         gpointer               user_data,
+                         GDestroyNotify         notify,
+                         GError               **error)
+{
+    gboolean result;
+
+    g_return_val_if_fail (bytestream != NULL, FALSE);
+    g_return_val_if_fail (bytestream->peer != NULL, FALSE);
+    g_return_val_if_fail (fd >= 0, FALSE);
+    g_return_val_if_fail (!bytestream->running, FALSE);
+
+    if (!lm_connection_get_full_jid (bytestream->connection)) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not authenticated");
+        return FALSE;
+    }
+
+    g_free (bytestream->own_jid);
+    bytestream->own_jid =
+        g_strdup (lm_connection_get_full_jid (bytestream->connection));
+
+    g_free (bytestream->dst_addr);
+    bytestream->dst_addr = bytestream_get_dst_addr (bytestream->sid,
+                                                    bytestream->own_jid,
+                                                    bytestream->peer);
+
+    bytestream->initiator = TRUE;
+    bytestream->file_fd = fd;
+    bytestream->size = size;
+    bytestream->offset = 0;
+    bytestream->transferred = 0;
+    bytestream->ibb_next = 0;
+    bytestream->ibb_in_flight = 0;
+
+    bytestream->result_cb = _lm_utils_new_callback (function, user_data,
+                                                    notify);
+    bytestream->running = TRUE;
+    lm_bytestream_ref (bytestream);
+
+    if (bytestream->method == LM_BYTESTREAM_METHOD_IBB) {
+        result = bytestream_ibb_open (bytestream, error);
+    } else {
+        result = bytestream_send_offer (bytestream, error);
+    }
+
+    if (!result) {
+        _lm_utils_free_callback (bytestream->result_cb);
+        bytestream->result_cb = NULL;
+        bytestream->running = FALSE;
+        bytestream_close_listen (bytestream);
+        lm_bytestream_unref (bytestream);
+    }
+
+    return result;
+}
+
+/**
+ * lm_bytestream_receive_file:
+ * @bytestream: an #LmBytestream
+ * @request: the streamhost offer from the sender
+ * @fd: file descriptor to write the data to
+ * @function: function to call when the transfer is over
+ * @user_data: user data passed to @function
+ * @notify: function to free @user_data, or %NULL
+ * @error: location to store error, or %NULL
+ *
+ * Accepts the streamhost offer @request, as received by a message handler
+ * for &lt;query xmlns="http://jabber.org/protocol/bytestreams"/&gt;, and
+ * writes what is received to @fd. The streamhosts are tried in the
+ * order offered. The transfer is over when the sender closes the stream.
+ *
+ * @request can also be an in-band open request,
+ * &lt;open xmlns="http://jabber.org/protocol/ibb"/&gt;. If its blocks are
+ * larger than the block size of @bytestream it is refused and the sender
+ * may ask again with smaller ones.
+ *
+ * Return value: %TRUE if @request could be accepted.
+ **/
+gboolean
+lm_bytestream_receive_file (LmBytestream          *bytestream,
+                            LmMessage             *request,
+                            gint                   fd,
+                            LmBytestreamFunction   function,
+                            gpointer               user_data,
+                            GDestroyNotify         notify,
+                            GError               **error)
+{
+    LmMessageNode *query;
+    LmMessageNode *node;
+    const gchar   *sid;
+    const gchar   *from;
+
+    g_return_val_if_fail (bytestream != NULL, FALSE);
+    g_return_val_if_fail (request != NULL, FALSE);
+    g_return_val_if_fail (fd >= 0, FALSE);
+    g_return_val_if_fail (!bytestream->running, FALSE);
+
+    query = lm_message_node_get_child (request->node, "query");
+    if (!query) {
+        /* An in-band open request */
+        query = lm_message_node_get_child (request->node, "open");
+    }
+
+    from = lm_message_node_get_attribute (request->node, "from");
+    sid = query ? lm_message_node_get_attribute (query, "sid") : NULL;
+
+    if (!sid || !from) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_FAILED,
+                     "Not a bytestream request");
+        return FALSE;
+    }
+
+    if (!lm_connection_get_full_jid (bytestream->connection)) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not authenticated");
+        return FALSE;
+    }
+
+    g_free (bytestream->sid);
+    bytestream->sid = g_strdup (sid);
+    g_free (bytestream->peer);
+    bytestream->peer = g_strdup (from);
+    g_free (bytestream->request_id);
+    bytestream->request_id =
+        g_strdup (lm_message_node_get_attribute (request->node, "id"));
+    g_free (bytestream->own_jid);
+    bytestream->own_jid =
+        g_strdup (lm_connection_get_full_jid (bytestream->connection));
+
+    g_free (bytestream->dst_addr);
+    bytestream->dst_addr = bytestream_get_dst_addr (bytestream->sid,
+                                                    bytestream->peer,
+                                                    bytestream->own_jid);
+
+    bytestream->initiator = FALSE;
+    bytestream->file_fd = fd;
+    bytestream->transferred = 0;
+
+    if (strcmp (query->name, "open") == 0) {
+        bytestream->method = LM_BYTESTREAM_METHOD_IBB;
+
+        if (!bytestream_ibb_accept (bytestream, query, error)) {
+            return FALSE;
+        }
+
+        bytestream->result_cb = _lm_utils_new_callback (function, user_data,
+                                                        notify);
+        bytestream->running = TRUE;
+        lm_bytestream_ref (bytestream);
+
+        return TRUE;
+    }
+
+    bytestream->method = LM_BYTESTREAM_METHOD_SOCKS5;
+
+    g_slist_foreach (bytestream->hosts, (GFunc) bytestream_host_free, NULL);
+    g_slist_free (bytestream->hosts);
+    bytestream->hosts = NULL;
+    bytestream->direct_host = NULL;
+
+    for (node = query->children; node; node = node->next) {
+        const gchar *jid, *host, *port;
+
+        if (strcmp (node->name, "streamhost") != 0) {
+            continue;
+        }
+
+        jid = lm_message_node_get_attribute (node, "jid");
+        host = lm_message_node_get_attribute (node, "host");
+        port = lm_message_node_get_attribute (node, "port");
+
+        if (jid && host && port) {
+            lm_bytestream_add_streamhost (bytestream, jid, host, atoi (port));
+        }
+    }
+
+    bytestream->result_cb = _lm_utils_new_callback (function, user_data,
+                                                    notify);
+    bytestream->running = TRUE;
+    lm_bytestream_ref (bytestream);
+
+    if (!bytestream->hosts) {
+        bytestream_send_reply (bytestream, NULL);
+        bytestream_finish (bytestream, FALSE);
+        return TRUE;
+    }
+
+    bytestream->current_host = bytestream->hosts;
+    bytestream_connect (bytestream);
+
+    return TRUE;
+}
+
+/**
+ * lm_bytestream_cancel:
+ * @bytestream: an #LmBytestream
+ *
+ * Stops a running transfer, the function passed when starting it is
+ * called with success %FALSE.
+ **/
+void
+lm_bytestream_cancel (LmBytestream *bytestream)
+{
+    g_return_if_fail (bytestream != NULL);
+
+    bytestream_finish (bytestream, FALSE);
+}
+
+/**
+ * lm_bytestream_get_transferred:
+ * @bytestream: an #LmBytestream
+ *
+ * Get the number of bytes transferred so far.
+ *
+ * Return value: number of bytes sent or received.
+ **/
+guint64
+lm_bytestream_get_transferred (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, 0);
+
+    return bytestream->transferred;
+}
+
+/**
+ * lm_bytestream_get_sid:
+ * @bytestream: an #LmBytestream
+ *
+ * Get the session id of @bytestream.
+ *
+ * Return value: the session id.
+ **/
+const gchar *
+lm_bytestream_get_sid (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, NULL);
+
+    return bytestream->sid;
+}
+
+/**
+ * lm_bytestream_ref:
+ * @bytestream: an #LmBytestream
+ *
+ * Adds a reference to @bytestream.
+ *
+ * Return value: the bytestream
+ **/
+LmBytestream *
+lm_bytestream_ref (LmBytestream *bytestream)
+{
+    g_return_val_if_fail (bytestream != NULL, NULL);
+
+    bytestream->ref_count++;
+
+    return bytestream;
+}
+
+/**
+ * lm_bytestream_unref:
+ * @bytestream: an #LmBytestream
+ *
+ * Removes a reference from @bytestream. A running transfer keeps a
+ * reference of its own until it is over.
+ **/
+void
+lm_bytestream_unref (LmBytestream *bytestream)
+{
+    g_return_if_fail (bytestream != NULL);
+
+    bytestream->ref_count--;
+
+    if (bytestream->ref_count == 0) {
+        bytestream_free (bytestream);
+    }
+}
@@ -0,0 +1,125 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_BYTESTREAM_H__
+#define __LM_BYTESTREAM_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-connection.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmBytestream:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmBytestream LmBytestream;
+
+/**
+ * LmBytestreamMethod:
+ * @LM_BYTESTREAM_METHOD_SOCKS5: over a connection of its own through a SOCKS5 streamhost (XEP-0065)
+ * @LM_BYTESTREAM_METHOD_IBB: in-band, in base64 encoded blocks over the #LmConnection (XEP-0047)
+ *
+ * Describes how the data of a bytestream is transferred.
+ */
+typedef enum {
+    LM_BYTESTREAM_METHOD_SOCKS5,
+    LM_BYTESTREAM_METHOD_IBB
+} LmBytestreamMethod;
+
+/**
+ * LmBytestreamFunction:
+ * @bytestream: the #LmBytestream
+ * @success: whether all of the data was transferred
+ * @user_data: user data passed when the transfer was started
+ *
+ * Called once when a transfer is over.
+ */
+typedef void (* LmBytestreamFunction)         (LmBytestream *bytestream,
+                                               gboolean      success,
+                                               gpointer      user_data);
+
+/**
+ * LmBytestreamProgressFunction:
+ * @bytestream: the #LmBytestream
+ * @transferred: number of bytes transferred so far
+ * @total: number of bytes to transfer, 0 if not known
+ * @user_data: user data passed to lm_bytestream_set_progress_function()
+ *
+ * Called as data is transferred.
+ */
+typedef void (* LmBytestreamProgressFunction) (LmBytestream *bytestream,
+                                               guint64       transferred,
+                                               guint64       total,
+                                               gpointer      user_data);
+
+LmBytestream * lm_bytestream_new               (LmConnection         *connection,
+                                                const gchar          *peer,
+                                                const gchar          *sid);
+void           lm_bytestream_add_streamhost    (LmBytestream         *bytestream,
+                                                const gchar          *jid,
+                                                const gchar          *host,
+                                                guint                 port);
+gboolean       lm_bytestream_get_direct        (LmBytestream         *bytestream);
+void           lm_bytestream_set_direct        (LmBytestream         *bytestream,
+                                                gboolean              direct);
+LmBytestreamMethod lm_bytestream_get_method   (LmBytestream         *bytestream);
+void           lm_bytestream_set_method        (LmBytestream         *bytestream,
+                                                LmBytestreamMethod    method);
+guint          lm_bytestream_get_block_size    (LmBytestream         *bytestream);
+void           lm_bytestream_set_block_size    (LmBytestream         *bytestream,
+                                                guint                 block_size);
+guint          lm_bytestream_get_window        (LmBytestream         *bytestream);
+void           lm_bytestream_set_window        (LmBytestream         *bytestream,
+                                                guint                 window);
+guint64        lm_bytestream_get_size          (LmBytestream         *bytestream);
+void           lm_bytestream_set_size          (LmBytestream         *bytestream,
+                                                guint64               size);
+void           lm_bytestream_set_progress_function (LmBytestream     *bytestream,
+                                                LmBytestreamProgressFunction function,
+                                                gpointer              user_data,
+                                                GDestroyNotify        notify);
+gboolean       lm_bytestream_send_file         (LmBytestream         *bytestream,
+                                                gint                  fd,
+                                                guint64               size,
+                                                LmBytestreamFunction  function,
+                                                gpointer              user_data,
+                                                GDestroyNotify        notify,
+                                                GError              **error);
+gboolean       lm_bytestream_receive_file      (LmBytestream         *bytestream,
+                                                LmMessage            *request,
+                                                gint                  fd,
+                                                LmBytestreamFunction  function,
+                                                gpointer              user_data,
+                                                GDestroyNotify        notify,
+                                                GError              **error);
+void           lm_bytestream_cancel            (LmBytestream         *bytestream);
+guint64        lm_bytestream_get_transferred   (LmBytestream         *bytestream);
+const gchar *  lm_bytestream_get_sid           (LmBytestream         *bytestream);
+LmBytestream * lm_bytestream_ref               (LmBytestream         *bytestream);
+void           lm_bytestream_unref             (LmBytestream         *bytestream);
+
+G_END_DECLS
+
+#endif /* __LM_BYTESTREAM_H__ */
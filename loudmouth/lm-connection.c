@@ -67,6 +67,7 @@
 
 #include <config.h>
 
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h> 
 #include <sys/types.h>
@@ -86,9 +87,12 @@
 #include "lm-sock.h"
 #include "lm-debug.h"
 #include "lm-error.h"
+#include "lm-exi.h"
 #include "lm-feature-ping.h"
+#include "lm-handler-table.h"
 #include "lm-internals.h"
 #include "lm-message-queue.h"
+#include "lm-outgoing-queue.h"
 #include "lm-misc.h"
 #include "lm-ssl-internals.h"
 #include "lm-parser.h"
@@ -98,57 +102,137 @@
 #include "lm-old-socket.h"
 #include "lm-sasl.h"
 
+typedef enum {
+    MULTICAST_UNKNOWN,
+    MULTICAST_DISCOVERING,
+    MULTICAST_SUPPORTED,
+    MULTICAST_UNSUPPORTED
+} MulticastSupport;
+
+/* Steps of turning on EXI compression (XEP-0322) */
+typedef enum {
+    EXI_STATE_OFF,
+    EXI_STATE_SETUP,
+    EXI_STATE_COMPRESS,
+    EXI_STATE_ACTIVE
+} ExiState;
+
+/* A stanza serialized once for many recipients, the recipient goes
+ * between @prefix and @suffix. @open and @close surround the children, to
+ * add the <addresses/> block. */
+typedef struct {
+    gchar  *prefix;
+    gchar  *suffix;
+    gchar  *open;
+    gchar  *close;
+    gchar **recipients;
+} MulticastSend;
+
+/* A stanza sent with lm_connection_send_with_callback () on its way to
+ * the socket */
 typedef struct {
-    LmHandlerPriority  priority;
-    LmMessageHandler  *handler;
-} HandlerData;
+    LmConnection *connection;
+    LmCallback   *cb;
+    LmSendTimes   times;
+} SendTracker;
 
 struct _LmConnection {
-    /* Parameters */
+    /* Used for every stanza sent or received, kept together at the top so
+     * dispatching touches as few cache lines as possible. @state is read
+     * by threads sending, only through connection_get_state(). */
+    LmConnectionState  state;
+    gint               ref_count;
+    LmParser          *parser;
+    LmMessageQueue    *queue;
+    GHashTable        *id_handlers;   /* Under id_handlers_lock */
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    GMutex             id_handlers_lock;
+#else
+    GStaticMutex       id_handlers_lock;
+#endif
+    LmHandlerTable    *handlers;
+    LmOldSocket       *socket;
     GMainContext      *context;
-    
+
+    /* Stanzas sent from threads not running the connection's context */
+    LmOutgoingQueue   *out_queue;
+
+    /* Parameters */
     /* TODO: Clean up this and make some parameter object for server, jid, effective jid etc */
     gchar             *server;
     gchar             *jid;
     gchar             *effective_jid;
     guint              port;
 
-    LmOldSocket       *socket;
     LmSSL             *ssl;
     LmProxy           *proxy;
-    LmParser          *parser;
 
     gchar             *stream_id;
 
-    GHashTable        *id_handlers;
-    GSList            *handlers[LM_MESSAGE_TYPE_UNKNOWN];
-
     /* XMPP1.0 stuff (SASL, resource binding, StartTLS) */
     gboolean           use_sasl;
+    gboolean           tls_started;
     LmSASL            *sasl;
     gchar             *resource;
     LmMessageHandler  *features_cb;
     LmMessageHandler  *starttls_cb;
-    gboolean           tls_started;
+    gchar             *fast_token;
 
     /* Communication */
     guint              open_id;
-    LmCallback        *open_cb;
-
     gboolean           cancel_open;
+    LmCallback        *open_cb;
     LmCallback        *auth_cb;
 
     LmCallback        *disconnect_cb;
 
-    LmMessageQueue    *queue;
-
-    LmConnectionState  state;
-
     /* TODO: Move the rate to use the one in LmFeaturePing instead of keeping the two in sync */
     guint              keep_alive_rate;
     LmFeaturePing     *feature_ping;
 
-    gint               ref_count;
+    /* Learned LmFeaturePingPaths by local address */
+    gboolean           keep_alive_adaptive;
+    GHashTable        *keep_alive_paths;
+
+    /* Built-in responders, see connection_respond () */
+    gboolean           respond_ping;
+    gchar             *disco_info;
+    gchar             *disco_node;
+
+    /* XEP-0033 service found with service discovery. @multicast and
+     * @multicast_service are read by threads sending, under
+     * @multicast_lock, the rest is only touched by the thread running
+     * the context. */
+    MulticastSupport   multicast;
+    gchar             *multicast_service;
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    GMutex             multicast_lock;
+#else
+    GStaticMutex       multicast_lock;
+#endif
+    guint              multicast_queries;
+    GSource           *multicast_timeout;
+
+    /* EXI compression, set up after authentication when the server
+     * offers it. @exi is there while it is active. */
+    gboolean           use_exi;
+    ExiState           exi_state;
+    LmExi             *exi;
+    /* Value partition limits agreed on in the setup */
+    gint               exi_value_max_length;
+    gint               exi_capacity;
+
+    /* Client State Indication (XEP-0352). @client_state is what the
+     * application wants the server to know, @csi_sent what it was told.
+     * Stanzas sent by the application set @csi_activity, from any
+     * thread, which brings the client back when it timed out. */
+    gboolean           csi_supported;
+    LmClientState      client_state;
+    LmClientState      csi_sent;
+    guint              inactivity_timeout;
+    GSource           *inactivity_source;
+    guint64            last_activity;
+    gint               csi_activity;
 };
 
 typedef enum {
@@ -160,6 +244,27 @@ typedef enum {
 #define XMPP_NS_BIND "urn:ietf:params:xml:ns:xmpp-bind"
 #define XMPP_NS_SESSION "urn:ietf:params:xml:ns:xmpp-session"
 #define XMPP_NS_STARTTLS "urn:ietf:params:xml:ns:xmpp-tls"
+#define XMPP_NS_PING "urn:xmpp:ping"
+#define XMPP_NS_DISCO_INFO "http://jabber.org/protocol/disco#info"
+#define XMPP_NS_ADDRESS "http://jabber.org/protocol/address"
+#define XMPP_NS_COMPRESS "http://jabber.org/protocol/compress"
+#define XMPP_NS_STREAMS "http://etherx.jabber.org/streams"
+#define XMPP_NS_CSI "urn:xmpp:csi:0"
+
+/* XEP-0033 leaves the limit to the service, this is what the common
+ * servers accept */
+#define MULTICAST_MAX_ADDRESSES 50
+/* Stanzas held back for discovery go out one per recipient after this */
+#define MULTICAST_DISCO_TIMEOUT 10000
+#define XMPP_NS_DISCO_ITEMS "http://jabber.org/protocol/disco#items"
+
+enum {
+    RESPOND_PING,
+    RESPOND_PING_NS,
+    RESPOND_QUERY,
+    RESPOND_DISCO_INFO_NS,
+    RESPOND_LAST
+};
 
 static void     connection_free              (LmConnection        *connection);
 static void     connection_handle_message    (LmConnection        *connection,
@@ -192,22 +297,32 @@ static void     connection_stream_received   (LmConnection        *connection,
                                               LmMessage           *m);
 static void     connection_stream_error      (LmConnection        *connection, 
                                               LmMessage           *m);
-static gint      
-connection_handler_compare_func              (HandlerData         *a,
-                                              HandlerData         *b);
 static void     connection_start_keep_alive  (LmConnection        *connection);
 static void     connection_stop_keep_alive   (LmConnection        *connection);
+static void     connection_multicast_reset   (LmConnection        *connection);
 static gboolean connection_send              (LmConnection        *connection, 
                                               const gchar         *str, 
                                               gint                 len, 
                                               GError             **error);
 static void     connection_message_queue_cb  (LmMessageQueue      *queue,
                                               LmConnection        *connection);
+static void     connection_outgoing_queue_cb (LmOutgoingQueue     *queue,
+                                              const gchar         *batch,
+                                              gsize                len,
+                                              LmConnection        *connection);
+static gboolean connection_send_or_queue_full (LmConnection       *connection,
+                                              gchar              *str,
+                                              SendTracker        *tracker,
+                                              GError            **error);
+static gboolean connection_send_or_queue     (LmConnection        *connection,
+                                              gchar               *str,
+                                              GError             **error);
 static void      
 connection_signal_disconnect                 (LmConnection        *connection,
                                               LmDisconnectReason   reason);
 static void     connection_incoming_data     (LmOldSocket         *socket, 
                                               const gchar         *buf,
+                                              gsize                len,
                                               LmConnection        *connection);
 static void     connection_socket_closed_cb  (LmOldSocket            *socket,
                                               LmDisconnectReason   reason,
@@ -229,25 +344,47 @@ connection_features_cb                       (LmMessageHandler    *handler,
 static gboolean connection_old_auth          (LmConnection        *connection,
                                               LmAuthParameters    *auth_params,
                                               GError             **errror);
-
+static gboolean connection_exi_negotiate     (LmConnection        *connection,
+                                              LmMessageNode       *node);
+static void     connection_exi_reset         (LmConnection        *connection);
+static void     connection_csi_update        (LmConnection        *connection,
+                                              gboolean             in_send);
+static void     connection_csi_track         (LmConnection        *connection);
+static void     connection_csi_reset         (LmConnection        *connection);
+static void     connection_csi_check_activity (LmConnection       *connection);
+
+/* Reply handlers are registered by whichever thread sends */
 static void
-connection_free_handlers (LmConnection *connection)
+connection_lock_id_handlers (LmConnection *connection)
 {
-    int i;
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_lock (&connection->id_handlers_lock);
+#else
+    g_static_mutex_lock (&connection->id_handlers_lock);
+#endif
+}
 
-    /* Unref handlers */
-    for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
-        GSList *l;
+static void
+connection_unlock_id_handlers (LmConnection *connection)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_unlock (&connection->id_handlers_lock);
+#else
+    g_static_mutex_unlock (&connection->id_handlers_lock);
+#endif
+}
 
-        for (l = connection->handlers[i]; l; l = l->next) {
-            HandlerData *hd = (HandlerData *) l->data;
-            
-            lm_message_handler_unref (hd->handler);
-            g_free (hd);
-        }
+/* Sending is allowed from any thread, which checks the state first */
+static LmConnectionState
+connection_get_state (LmConnection *connection)
+{
+    return (LmConnectionState) g_atomic_int_get ((gint *) &connection->state);
+}
 
-        g_slist_free (connection->handlers[i]);
-    }
+static void
+connection_set_state (LmConnection *connection, LmConnectionState state)
+{
+    g_atomic_int_set ((gint *) &connection->state, (gint) state);
 }
 
 static void
@@ -257,7 +394,7 @@ connection_free (LmConnection *connection)
      * It used to be run after the handlers where freed which lead to a crash
      * when the connection was freed prior to running lm_connection_close.
      */
-    if (connection->state >= LM_CONNECTION_STATE_OPENING) {
+    if (connection_get_state (connection) >= LM_CONNECTION_STATE_OPENING) {
         connection_do_close (connection);
     }
 
@@ -266,6 +403,9 @@ connection_free (LmConnection *connection)
     g_free (connection->effective_jid);
     g_free (connection->stream_id);
     g_free (connection->resource);
+    g_free (connection->fast_token);
+    g_free (connection->disco_info);
+    g_free (connection->disco_node);
 
     if (connection->sasl) {
         lm_sasl_free (connection->sasl);
@@ -275,9 +415,20 @@ connection_free (LmConnection *connection)
         lm_parser_free (connection->parser);
     }
 
-    connection_free_handlers (connection);
+    lm_handler_table_free (connection->handlers);
     
     g_hash_table_destroy (connection->id_handlers);
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_clear (&connection->id_handlers_lock);
+    g_mutex_clear (&connection->multicast_lock);
+#else
+    g_static_mutex_free (&connection->id_handlers_lock);
+    g_static_mutex_free (&connection->multicast_lock);
+#endif
+
+    if (connection->keep_alive_paths) {
+        g_hash_table_destroy (connection->keep_alive_paths);
+    }
     
     if (connection->open_cb) {
         _lm_utils_free_callback (connection->open_cb);
@@ -294,6 +445,7 @@ connection_free (LmConnection *connection)
     }
 
     lm_message_queue_unref (connection->queue);
+    lm_outgoing_queue_unref (connection->out_queue);
 
     if (connection->context) {
         g_main_context_unref (connection->context);
@@ -309,7 +461,8 @@ connection_free (LmConnection *connection)
 static LmHandlerResult
 connection_run_message_handler (LmConnection *connection, LmMessage *m)
 {
-    LmMessageHandler *handler;
+    gpointer          handler = NULL;
+    gpointer          key = NULL;
     const gchar      *id;
     LmHandlerResult   result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
@@ -318,13 +471,20 @@ connection_run_message_handler (LmConnection *connection, LmMessage *m)
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    handler = g_hash_table_lookup (connection->id_handlers, id);
+    /* Taken out before running it, the handler may send with a reply */
+    connection_lock_id_handlers (connection);
+    if (g_hash_table_lookup_extended (connection->id_handlers, id,
+                                      &key, &handler)) {
+        g_hash_table_steal (connection->id_handlers, id);
+    }
+    connection_unlock_id_handlers (connection);
+
     if (handler) {
         result = _lm_message_handler_handle_message (handler,
                                                      connection,
                                                      m);
-        g_hash_table_remove (connection->id_handlers,
-                             id);
+        lm_message_handler_unref (handler);
+        g_free (key);
     }
 
     return result;
@@ -333,7 +493,6 @@ connection_run_message_handler (LmConnection *connection, LmMessage *m)
 static void
 connection_handle_message (LmConnection *connection, LmMessage *m)
 {
-    GSList          *l;
     LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
 
     lm_connection_ref (connection);
@@ -348,15 +507,8 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
         goto out;
     }
 
-    for (l = connection->handlers[lm_message_get_type (m)]; 
-         l && result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS; 
-         l = l->next) {
-        HandlerData *hd = (HandlerData *) l->data;
-        
-        result = _lm_message_handler_handle_message (hd->handler,
-                                                     connection,
-                                                     m);
-    }
+    result = lm_handler_table_handle_message (connection->handlers,
+                                              connection, m);
 
     if (lm_message_get_type (m) == LM_MESSAGE_TYPE_STREAM_ERROR) {
         connection_stream_error (connection, m);
@@ -369,6 +521,118 @@ connection_handle_message (LmConnection *connection, LmMessage *m)
     return;
 }
 
+/* Dispatches @m as if it had just been received, for the tests */
+void
+_lm_connection_handle_message (LmConnection *connection, LmMessage *m)
+{
+    connection_handle_message (connection, m);
+}
+
+static gpointer
+connection_init_respond_ids (gpointer data)
+{
+    GQuark *ids;
+
+    ids = g_new (GQuark, RESPOND_LAST);
+    ids[RESPOND_PING] = g_quark_from_static_string ("ping");
+    ids[RESPOND_PING_NS] = g_quark_from_static_string (XMPP_NS_PING);
+    ids[RESPOND_QUERY] = g_quark_from_static_string ("query");
+    ids[RESPOND_DISCO_INFO_NS] = g_quark_from_static_string (XMPP_NS_DISCO_INFO);
+
+    return ids;
+}
+
+/* Answers pings and disco#info queries straight from the parser when the
+ * built-in responders are enabled, so that they don't wait behind the
+ * message queue and the handlers. Returns %TRUE if @m was answered. */
+static gboolean
+connection_respond (LmConnection *connection, LmMessage *m)
+{
+    static GOnce   once = G_ONCE_INIT;
+    GQuark        *ids;
+    LmMessageNode *child;
+    const gchar   *body = NULL;
+    const gchar   *id;
+    const gchar   *from;
+    GString       *reply;
+    gchar         *escaped;
+
+    if (!connection->respond_ping && !connection->disco_info) {
+        return FALSE;
+    }
+
+    if (lm_message_get_type (m) != LM_MESSAGE_TYPE_IQ ||
+        lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_GET) {
+        return FALSE;
+    }
+
+    child = m->node->children;
+    if (!child || child->next) {
+        return FALSE;
+    }
+
+    id = lm_message_node_get_attribute (m->node, "id");
+    if (!id) {
+        return FALSE;
+    }
+
+    ids = g_once (&once, connection_init_respond_ids, NULL);
+
+    if (connection->respond_ping &&
+        lm_message_node_get_name_id (child) == ids[RESPOND_PING] &&
+        lm_message_node_get_ns_id (child) == ids[RESPOND_PING_NS]) {
+        body = "";
+    }
+    else if (connection->disco_info &&
+             lm_message_node_get_name_id (child) == ids[RESPOND_QUERY] &&
+             lm_message_node_get_ns_id (child) == ids[RESPOND_DISCO_INFO_NS]) {
+        const gchar *node;
+
+        /* Other nodes, like entity capabilities of older versions, are
+         * left to the application */
+        node = lm_message_node_get_attribute (child, "node");
+        if (node || connection->disco_node) {
+            if (!node || !connection->disco_node ||
+                strcmp (node, connection->disco_node) != 0) {
+                return FALSE;
+            }
+        }
+
+        body = connection->disco_info;
+    }
+
+    if (!body) {
+        return FALSE;
+    }
+
+    reply = g_string_new ("<iq type=\"result\" id=\"");
+    escaped = g_markup_escape_text (id, -1);
+    g_string_append (reply, escaped);
+    g_free (escaped);
+
+    from = lm_message_node_get_attribute (m->node, "from");
+    if (from) {
+        g_string_append (reply, "\" to=\"");
+        escaped = g_markup_escape_text (from, -1);
+        g_string_append (reply, escaped);
+        g_free (escaped);
+    }
+
+    if (*body) {
+        g_string_append_printf (reply, "\">%s</iq>", body);
+    } else {
+        g_string_append (reply, "\"/>");
+    }
+
+    lm_verbose ("Answered %s from %s\n",
+                lm_message_node_get_name (child), from ? from : "server");
+
+    connection_send (connection, reply->str, reply->len, NULL);
+    g_string_free (reply, TRUE);
+
+    return TRUE;
+}
+
 static void
 connection_new_message_cb (LmParser     *parser,
                            LmMessage    *m,
@@ -376,6 +640,16 @@ connection_new_message_cb (LmParser     *parser,
 {
     const gchar *from;
     
+    if (connection_respond (connection, m)) {
+        return;
+    }
+
+    /* <failure/> of XEP-0138 is a known message type */
+    if (connection->exi_state == EXI_STATE_COMPRESS &&
+        connection_exi_negotiate (connection, m->node)) {
+        return;
+    }
+
     lm_message_ref (m);
 
     from = lm_message_node_get_attribute (m->node, "from");
@@ -398,16 +672,54 @@ connection_ping_timed_out (LmFeaturePing *fp, LmConnection *connection)
                                   LM_DISCONNECT_REASON_PING_TIME_OUT);
 }
 
+/* Idle time outs are a property of the network the connection goes
+ * through, which the local address stands in for */
+static LmFeaturePingPath *
+connection_get_keep_alive_path (LmConnection *connection)
+{
+    LmFeaturePingPath *path;
+    gchar             *local_host;
+
+    if (!connection->keep_alive_paths) {
+        connection->keep_alive_paths = g_hash_table_new_full (g_str_hash,
+                                                              g_str_equal,
+                                                              g_free,
+                                                              g_free);
+    }
+
+    local_host = lm_old_socket_get_local_host (connection->socket);
+    if (!local_host) {
+        local_host = g_strdup ("");
+    }
+
+    path = g_hash_table_lookup (connection->keep_alive_paths, local_host);
+    if (!path) {
+        path = g_new0 (LmFeaturePingPath, 1);
+        g_hash_table_insert (connection->keep_alive_paths, local_host, path);
+    } else {
+        g_free (local_host);
+    }
+
+    return path;
+}
+
 static void
 connection_start_keep_alive (LmConnection *connection)
 {
+    LmFeaturePingPath *path = NULL;
+
     if (connection->feature_ping) {
         connection_stop_keep_alive (connection);
     }
 
+    if (connection->keep_alive_adaptive) {
+        path = connection_get_keep_alive_path (connection);
+    }
+
     connection->feature_ping = g_object_new (LM_TYPE_FEATURE_PING,
                                              "connection", connection,
                                              "rate", connection->keep_alive_rate,
+                                             "path", path,
                                              NULL);
 
     g_signal_connect (connection->feature_ping, "timed-out",
@@ -444,15 +756,97 @@ connection_log_send (LmConnection *connection,
            "-----------------------------------\n");
 }
 
+static gboolean
+connection_write (LmConnection  *connection,
+                  const gchar   *str,
+                  gint           len,
+                  GError       **error)
+{
+    gint b_written;
+
+    /* Check to see if there already is an output buffer, if so, add to the
+       buffer and return */
+
+    b_written = lm_old_socket_write (connection->socket, str, len);
+
+    if (b_written < 0) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Server closed the connection");
+        return FALSE;
+    }
+
+    if (connection->feature_ping) {
+        lm_feature_ping_sent (connection->feature_ping);
+    }
+
+    return TRUE;
+}
+
+/* Only called with EXI active */
+static gboolean
+connection_send_exi (LmConnection   *connection,
+                     LmMessageNode  *node,
+                     SendTracker    *tracker,
+                     GError        **error)
+{
+    GString  *out;
+    gboolean  result;
+
+    connection_csi_check_activity (connection);
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET, "\nSEND EXI: <%s/>\n", node->name);
+
+    out = g_string_new (NULL);
+    _lm_exi_encode (connection->exi, node, out);
+    if (tracker) {
+        tracker->times.serialized = lm_misc_get_timestamp ();
+    }
+    result = connection_write (connection, out->str, out->len, error);
+    g_string_free (out, TRUE);
+
+    return result;
+}
+
+/* Text from the send paths that have no node, each complete element in
+ * it goes out as an EXI document of its own */
+static gboolean
+connection_send_exi_xml (LmConnection  *connection,
+                         const gchar   *str,
+                         gint           len,
+                         GError       **error)
+{
+    GString  *out;
+    gboolean  result = TRUE;
+
+    out = g_string_sized_new (len);
+
+    if (!_lm_exi_encode_xml (connection->exi, str, len, out)) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_FAILED,
+                     "Data sent on an EXI stream must be well formed XML");
+        result = FALSE;
+    }
+
+    if (out->len > 0 &&
+        !connection_write (connection, out->str, out->len,
+                           result ? error : NULL)) {
+        result = FALSE;
+    }
+
+    g_string_free (out, TRUE);
+
+    return result;
+}
+
 static gboolean
 connection_send (LmConnection  *connection, 
                  const gchar   *str, 
                  gint           len, 
                  GError       **error)
 {
-    gint b_written;
-
-    if (connection->state < LM_CONNECTION_STATE_OPENING) {
+    if (connection_get_state (connection) < LM_CONNECTION_STATE_OPENING) {
         g_log (LM_LOG_DOMAIN,LM_LOG_LEVEL_NET,
                "Connection is not open.\n");
 
@@ -467,22 +861,84 @@ connection_send (LmConnection  *connection,
         len = strlen (str);
     }
 
+    connection_csi_check_activity (connection);
     connection_log_send (connection, str, len);
 
-    /* Check to see if there already is an output buffer, if so, add to the
-       buffer and return */
+    if (connection->exi) {
+        return connection_send_exi_xml (connection, str, len, error);
+    }
 
-    b_written = lm_old_socket_write (connection->socket, str, len);
+    return connection_write (connection, str, len, error);
+}
 
-    if (b_written < 0) {
-        g_set_error (error,
-                     LM_ERROR,
-                     LM_ERROR_CONNECTION_FAILED,
-                     "Server closed the connection");
-        return FALSE;
+static SendTracker *
+connection_send_tracker_new (LmConnection   *connection,
+                             LmSendFunction  function,
+                             gpointer        user_data,
+                             GDestroyNotify  notify)
+{
+    SendTracker *tracker;
+
+    tracker = g_slice_new0 (SendTracker);
+    tracker->times.enqueued = lm_misc_get_timestamp ();
+    tracker->connection = connection;
+    tracker->cb = _lm_utils_new_callback (function, user_data, notify);
+
+    return tracker;
+}
+
+static void
+connection_send_tracker_free (SendTracker *tracker)
+{
+    _lm_utils_free_callback (tracker->cb);
+    g_slice_free (SendTracker, tracker);
+}
+
+static void
+connection_send_done (LmOldSocket  *socket,
+                      gboolean      written,
+                      SendTracker  *tracker)
+{
+    if (written) {
+        tracker->times.written = lm_misc_get_timestamp ();
     }
 
-    return TRUE;
+    if (tracker->cb->func) {
+        (* ((LmSendFunction) tracker->cb->func)) (tracker->connection,
+                                                  written,
+                                                  &tracker->times,
+                                                  tracker->cb->user_data);
+    }
+
+    connection_send_tracker_free (tracker);
+}
+
+/* Called once the bytes of the stanza have been given to the socket, the
+ * socket knows when they are out */
+static void
+connection_send_track (LmConnection *connection, SendTracker *tracker)
+{
+    if (!connection->socket) {
+        connection_send_done (NULL, FALSE, tracker);
+        return;
+    }
+
+    lm_old_socket_add_write_mark (connection->socket,
+                                  (WriteMarkFunc) connection_send_done,
+                                  tracker);
+}
+
+static void
+connection_outgoing_mark_cb (LmOutgoingQueue *queue,
+                             SendTracker     *tracker,
+                             gboolean         sent,
+                             LmConnection    *connection)
+{
+    if (sent) {
+        connection_send_track (connection, tracker);
+    } else {
+        connection_send_done (NULL, FALSE, tracker);
+    }
 }
 
 static void
@@ -498,6 +954,88 @@ connection_message_queue_cb (LmMessageQueue *queue, LmConnection *connection)
     }
 }
 
+static void
+connection_outgoing_queue_cb (LmOutgoingQueue *queue,
+                              const gchar     *batch,
+                              gsize            len,
+                              LmConnection    *connection)
+{
+    GError *error = NULL;
+
+    if (connection_send (connection, batch, len, &error)) {
+        return;
+    }
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "Failed to send queued stanzas: %s\n", error->message);
+    g_error_free (error);
+
+    /* Nobody is left to return the error to, the sender was told it was
+     * queued. Closed already if the rest of the batch fails as well. */
+    if (connection_get_state (connection) >= LM_CONNECTION_STATE_OPENING) {
+        connection_do_close (connection);
+        connection_signal_disconnect (connection, LM_DISCONNECT_REASON_ERROR);
+    }
+}
+
+/* Takes ownership of @str. When called from a thread other than the one
+ * running the connection's context the string is handed over to that
+ * thread through the outgoing queue instead of touching the socket.
+ * @tracker is taken as well unless %FALSE is returned. */
+static gboolean
+connection_send_or_queue_full (LmConnection *connection,
+                               gchar        *str,
+                               SendTracker  *tracker,
+                               GError      **error)
+{
+    gboolean result;
+
+    if (!g_main_context_acquire (connection->context)) {
+        if (connection_get_state (connection) < LM_CONNECTION_STATE_OPENING) {
+            g_set_error (error,
+                         LM_ERROR,
+                         LM_ERROR_CONNECTION_NOT_OPEN,
+                         "Connection is not open, call lm_connection_open() first");
+            g_free (str);
+            return FALSE;
+        }
+
+        /* Closed meanwhile, it must not go out on the next stream */
+        if (!lm_outgoing_queue_push_with_mark (connection->out_queue,
+                                               str, -1, tracker)) {
+            g_set_error (error,
+                         LM_ERROR,
+                         LM_ERROR_CONNECTION_NOT_OPEN,
+                         "Connection is not open, call lm_connection_open() first");
+            g_free (str);
+            return FALSE;
+        }
+        return TRUE;
+    }
+
+    /* Stanzas queued by other threads go out first to keep the order */
+    lm_outgoing_queue_drain (connection->out_queue);
+
+    result = connection_send (connection, str, -1, error);
+    g_free (str);
+
+    if (result && tracker) {
+        connection_send_track (connection, tracker);
+    }
+
+    g_main_context_release (connection->context);
+
+    return result;
+}
+
+static gboolean
+connection_send_or_queue (LmConnection *connection,
+                          gchar        *str,
+                          GError      **error)
+{
+    return connection_send_or_queue_full (connection, str, NULL, error);
+}
+
 /* Returns directly */
 /* Setups all data needed to start the connection attempts */
 static gboolean
@@ -537,8 +1075,9 @@ connection_do_open (LmConnection *connection, GError **error)
     }
 
     lm_message_queue_attach (connection->queue, connection->context);
+    lm_outgoing_queue_attach (connection->out_queue, connection->context);
     
-    connection->state = LM_CONNECTION_STATE_OPENING;
+    connection_set_state (connection, LM_CONNECTION_STATE_OPENING);
 
     return TRUE;
 }
@@ -553,14 +1092,20 @@ connection_do_close (LmConnection *connection)
     }
 
     lm_message_queue_detach (connection->queue);
+    lm_outgoing_queue_detach (connection->out_queue);
+
+    /* The next server might not be the same */
+    connection_multicast_reset (connection);
+    connection_exi_reset (connection);
+    connection_csi_reset (connection);
     
     if (!lm_connection_is_open (connection)) {
         /* lm_connection_is_open is FALSE for state OPENING as well */
-        connection->state = LM_CONNECTION_STATE_CLOSED;
+        connection_set_state (connection, LM_CONNECTION_STATE_CLOSED);
         return;
     }
     
-    connection->state = LM_CONNECTION_STATE_CLOSED;
+    connection_set_state (connection, LM_CONNECTION_STATE_CLOSED);
 
     if (connection->sasl) {
         lm_sasl_free (connection->sasl);
@@ -702,11 +1247,11 @@ connection_auth_reply (LmMessageHandler *handler,
     type = lm_message_node_get_attribute (m->node, "type");
     if (strcmp (type, "result") == 0) {
         result = TRUE;
-        connection->state = LM_CONNECTION_STATE_AUTHENTICATED;
+        connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATED);
     } 
     else if (strcmp (type, "error") == 0) {
         result = FALSE;
-        connection->state = LM_CONNECTION_STATE_OPEN;
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
     
     lm_verbose ("AUTH reply: %d\n", result);
@@ -796,8 +1341,8 @@ connection_stream_received (LmConnection *connection, LmMessage *m)
                     connection->stream_id);
     }
     
-    if (connection->state < LM_CONNECTION_STATE_OPEN) {
-        connection->state = LM_CONNECTION_STATE_OPEN;
+    if (connection_get_state (connection) < LM_CONNECTION_STATE_OPEN) {
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
     
     /* Check to see if the stream is correctly set up */
@@ -854,12 +1399,6 @@ connection_stream_error (LmConnection *connection, LmMessage *m)
     connection_signal_disconnect (connection, reason);
 }
 
-static gint
-connection_handler_compare_func (HandlerData *a, HandlerData *b)
-{
-    return b->priority - a->priority;
-}
-
 static void
 connection_signal_disconnect (LmConnection       *connection,
                               LmDisconnectReason  reason)
@@ -878,16 +1417,38 @@ connection_signal_disconnect (LmConnection       *connection,
 static void
 connection_incoming_data (LmOldSocket  *socket, 
                           const gchar  *buf, 
+                          gsize         len,
                           LmConnection *connection)
 {
-    lm_parser_parse (connection->parser, buf);
-}
+    if (connection->feature_ping) {
+        lm_feature_ping_received (connection->feature_ping);
+    }
+
+    if (connection->exi) {
+        if (!_lm_exi_decode (connection->exi, buf, len)) {
+            /* The tables are out of step with the server's now, nothing
+             * after this can be decoded */
+            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+                   "Couldn't decode EXI data from the server\n");
+            connection_do_close (connection);
+            connection_signal_disconnect (connection,
+                                          LM_DISCONNECT_REASON_ERROR);
+        }
+        return;
+    }
+
+    lm_parser_parse (connection->parser, buf);
+}
 
 static void
 connection_socket_closed_cb (LmOldSocket        *socket,
                              LmDisconnectReason reason,
                              LmConnection       *connection)
 {
+    if (connection->feature_ping && reason != LM_DISCONNECT_REASON_OK) {
+        lm_feature_ping_lost (connection->feature_ping);
+    }
+
     connection_do_close (connection);
     connection_signal_disconnect (connection, reason);
 }
@@ -1001,9 +1562,15 @@ static void
 connection_call_auth_cb (LmConnection *connection, gboolean success)
 {
     if (success) {
-        connection->state = LM_CONNECTION_STATE_AUTHENTICATED;
+        connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATED);
+
+        /* A new session starts out active */
+        connection->csi_sent = LM_CLIENT_STATE_ACTIVE;
+        connection->last_activity = lm_misc_get_time ();
+        connection_csi_update (connection, FALSE);
+        connection_csi_track (connection);
     } else {
-        connection->state = LM_CONNECTION_STATE_OPEN;
+        connection_set_state (connection, LM_CONNECTION_STATE_OPEN);
     }
 
     if (connection->auth_cb) {
@@ -1073,6 +1640,432 @@ connection_bind_reply (LmMessageHandler *handler,
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
+static void
+connection_send_bind (LmConnection *connection)
+{
+    LmMessageHandler *bind_handler;
+    LmMessage        *bind_msg;
+    LmMessageNode    *bind_node;
+    int               result;
+
+    bind_msg = lm_message_new_with_sub_type (NULL,
+                                             LM_MESSAGE_TYPE_IQ, 
+                                             LM_MESSAGE_SUB_TYPE_SET);
+
+    bind_node = lm_message_node_add_child (bind_msg->node, 
+                                           "bind", NULL);
+    lm_message_node_set_attributes (bind_node,
+                                    "xmlns", XMPP_NS_BIND,
+                                    NULL);
+
+    lm_message_node_add_child (bind_node, "resource",
+                               connection->resource);
+
+    bind_handler = lm_message_handler_new (connection_bind_reply,
+                                           NULL, NULL);
+    result = lm_connection_send_with_reply (connection, bind_msg, 
+                                            bind_handler, NULL);
+    lm_message_handler_unref (bind_handler);
+    lm_message_unref (bind_msg);
+
+    if (result < 0) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL, 
+               "%s: can't send resource binding request\n", G_STRFUNC);
+        connection_do_close (connection);
+    }
+}
+
+static gboolean
+connection_exi_offered (LmConnection *connection, LmMessageNode *features)
+{
+    LmMessageNode *compression;
+    LmMessageNode *method;
+
+    if (!connection->use_exi || connection->exi_state != EXI_STATE_OFF) {
+        return FALSE;
+    }
+
+    compression = lm_message_node_get_child (features, "compression");
+    if (!compression) {
+        return FALSE;
+    }
+
+    for (method = compression->children; method; method = method->next) {
+        if (strcmp (method->name, "method") == 0 &&
+            method->value && strcmp (method->value, "exi") == 0) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void
+connection_exi_setup (LmConnection *connection)
+{
+    gchar *str;
+
+    lm_verbose ("Setting up EXI compression\n");
+
+    connection->exi_state = EXI_STATE_SETUP;
+
+    /* Schema-less, so there are no schemas to agree on */
+    str = g_strdup_printf ("<setup xmlns='" LM_EXI_NS "' version='1' "
+                           "strict='false' sessionWideBuffers='true' "
+                           "valueMaxLength='%d' "
+                           "valuePartitionCapacity='%d'/>",
+                           LM_EXI_VALUE_MAX_LENGTH,
+                           LM_EXI_VALUE_PARTITION_CAPACITY);
+
+    if (!connection_send (connection, str, -1, NULL)) {
+        connection_do_close (connection);
+    }
+
+    g_free (str);
+}
+
+/* The value of @key in the setup response if it is within @max, @max if
+ * the server left it out. -1 when the server wants more. */
+static gint
+connection_exi_limit (LmMessageNode *node, const gchar *key, gint max)
+{
+    const gchar *str;
+    gchar       *end;
+    glong        value;
+
+    str = lm_message_node_get_attribute (node, key);
+    if (!str) {
+        return max;
+    }
+
+    value = strtol (str, &end, 10);
+    if (*str == '\0' || *end != '\0' || value < 0 || value > max) {
+        return -1;
+    }
+
+    return (gint) value;
+}
+
+/* The stream goes on without compression */
+static void
+connection_exi_failed (LmConnection *connection)
+{
+    lm_verbose ("EXI compression refused by the server\n");
+
+    connection->exi_state = EXI_STATE_OFF;
+    connection_send_bind (connection);
+}
+
+/* The stream header of an EXI stream, turned into the stream:stream
+ * message the rest of the connection knows */
+static void
+connection_exi_stream_start (LmConnection *connection, LmMessageNode *node)
+{
+    LmMessageNode *stream;
+    LmMessage     *m;
+    const gchar   *attributes[] = { "id", "from", "version", NULL };
+    gint           i;
+
+    stream = _lm_message_node_new ("stream:stream");
+
+    for (i = 0; attributes[i]; ++i) {
+        const gchar *value;
+
+        value = lm_message_node_get_attribute (node, attributes[i]);
+        if (value) {
+            lm_message_node_set_attribute (stream, attributes[i], value);
+        }
+    }
+
+    m = _lm_message_new_from_node (stream);
+    connection_new_message_cb (NULL, m, connection);
+    lm_message_unref (m);
+    lm_message_node_unref (stream);
+}
+
+static void
+connection_exi_node_cb (LmExi         *exi,
+                        LmMessageNode *node,
+                        LmConnection  *connection)
+{
+    LmMessage *m;
+
+    if (lm_message_node_get_ns_id (node) ==
+        g_quark_from_static_string (LM_EXI_NS)) {
+        /* Nothing to do for streamEnd, the server closes the socket */
+        if (strcmp (node->name, "streamStart") == 0) {
+            connection_exi_stream_start (connection, node);
+        }
+        return;
+    }
+
+    m = _lm_message_new_from_node (node);
+    if (!m) {
+        connection_exi_negotiate (connection, node);
+        return;
+    }
+
+    connection_new_message_cb (NULL, m, connection);
+    lm_message_unref (m);
+}
+
+static void
+connection_exi_start (LmConnection *connection)
+{
+    LmMessageNode *start;
+    LmMessageNode *child;
+    gchar         *server;
+
+    lm_verbose ("EXI compression active\n");
+
+    connection->exi = _lm_exi_new ("jabber:client", TRUE,
+                                   (LmExiNodeFunction) connection_exi_node_cb,
+                                   connection);
+    _lm_exi_set_value_limits (connection->exi,
+                              connection->exi_value_max_length,
+                              connection->exi_capacity);
+    connection->exi_state = EXI_STATE_ACTIVE;
+
+    /* The stream restarts like after SASL, with the header in EXI */
+    server = _lm_connection_get_server (connection);
+
+    start = _lm_message_node_new ("streamStart");
+    lm_message_node_set_attributes (start,
+                                    "xmlns", LM_EXI_NS,
+                                    "to", server,
+                                    "version", "1.0",
+                                    NULL);
+
+    child = lm_message_node_add_child (start, "xmlns", NULL);
+    lm_message_node_set_attributes (child,
+                                    "prefix", "",
+                                    "namespace", "jabber:client",
+                                    NULL);
+
+    child = lm_message_node_add_child (start, "xmlns", NULL);
+    lm_message_node_set_attributes (child,
+                                    "prefix", "stream",
+                                    "namespace", XMPP_NS_STREAMS,
+                                    NULL);
+
+    g_free (server);
+
+    if (!connection_send_exi (connection, start, NULL, NULL)) {
+        connection_do_close (connection);
+    }
+
+    lm_message_node_unref (start);
+}
+
+/* Handles the answers to the EXI setup and to the request for
+ * compression. Returns TRUE if @node was one of them. */
+static gboolean
+connection_exi_negotiate (LmConnection *connection, LmMessageNode *node)
+{
+    GQuark ns_id;
+
+    ns_id = lm_message_node_get_ns_id (node);
+
+    if (connection->exi_state == EXI_STATE_SETUP &&
+        ns_id == g_quark_from_static_string (LM_EXI_NS) &&
+        strcmp (node->name, "setupResponse") == 0) {
+        const gchar *agreement;
+
+        agreement = lm_message_node_get_attribute (node, "agreement");
+        if (!agreement || strcmp (agreement, "true") != 0) {
+            connection_exi_failed (connection);
+            return TRUE;
+        }
+
+        /* Less is fine, more than asked for would let the server fill
+         * our tables */
+        connection->exi_value_max_length =
+            connection_exi_limit (node, "valueMaxLength",
+                                  LM_EXI_VALUE_MAX_LENGTH);
+        connection->exi_capacity =
+            connection_exi_limit (node, "valuePartitionCapacity",
+                                  LM_EXI_VALUE_PARTITION_CAPACITY);
+
+        if (connection->exi_value_max_length < 0 ||
+            connection->exi_capacity < 0) {
+            lm_verbose ("EXI setup asks for larger tables than offered\n");
+            connection_exi_failed (connection);
+            return TRUE;
+        }
+
+        connection->exi_state = EXI_STATE_COMPRESS;
+
+        if (!connection_send (connection,
+                              "<compress xmlns='" XMPP_NS_COMPRESS "'>"
+                              "<method>exi</method></compress>", -1,
+                              NULL)) {
+            connection_do_close (connection);
+        }
+
+        return TRUE;
+    }
+
+    if (connection->exi_state == EXI_STATE_COMPRESS &&
+        ns_id == g_quark_from_static_string (XMPP_NS_COMPRESS)) {
+        if (strcmp (node->name, "compressed") == 0) {
+            connection_exi_start (connection);
+        } else {
+            connection_exi_failed (connection);
+        }
+
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static void
+connection_unknown_node_cb (LmParser      *parser,
+                            LmMessageNode *node,
+                            LmConnection  *connection)
+{
+    if (connection->sasl &&
+        lm_sasl_handle_continue (connection->sasl, node)) {
+        return;
+    }
+
+    if (!connection_exi_negotiate (connection, node)) {
+        lm_verbose ("Ignoring unknown element: %s\n", node->name);
+    }
+}
+
+static void
+connection_exi_reset (LmConnection *connection)
+{
+    if (connection->exi) {
+        _lm_exi_free (connection->exi);
+        connection->exi = NULL;
+    }
+
+    connection->exi_state = EXI_STATE_OFF;
+}
+
+/* Tells the server about a change of @client_state, once it can be told.
+ * With @in_send we are about to write something, possibly a batch the
+ * outgoing queue is draining, and the nonza goes out right in front of
+ * it. Draining the queue again there would put stanzas queued since in
+ * front of the batch. */
+static void
+connection_csi_update (LmConnection *connection, gboolean in_send)
+{
+    const gchar *str;
+
+    if (connection_get_state (connection) != LM_CONNECTION_STATE_AUTHENTICATED ||
+        !connection->csi_supported ||
+        connection->csi_sent == connection->client_state) {
+        return;
+    }
+
+    if (connection->client_state == LM_CLIENT_STATE_INACTIVE) {
+        str = "<inactive xmlns='" XMPP_NS_CSI "'/>";
+    } else {
+        str = "<active xmlns='" XMPP_NS_CSI "'/>";
+    }
+
+    lm_verbose ("Telling the server the client is %s\n",
+                connection->client_state == LM_CLIENT_STATE_INACTIVE ?
+                "inactive" : "active");
+
+    connection->csi_sent = connection->client_state;
+
+    if (in_send) {
+        connection_send (connection, str, -1, NULL);
+    } else {
+        connection_send_or_queue (connection, g_strdup (str), NULL);
+    }
+}
+
+static gboolean
+connection_csi_timed_out (LmConnection *connection)
+{
+    guint64 timeout;
+    guint64 idle;
+
+    connection->inactivity_source = NULL;
+
+    /* Stanzas from other threads may still be waiting to go out */
+    connection_csi_check_activity (connection);
+
+    timeout = (guint64) connection->inactivity_timeout * 1000;
+    idle = lm_misc_get_time () - connection->last_activity;
+
+    if (idle < timeout) {
+        connection->inactivity_source =
+            lm_misc_add_timeout (connection->context, timeout - idle,
+                                 (GSourceFunc) connection_csi_timed_out,
+                                 connection);
+        return FALSE;
+    }
+
+    lm_verbose ("Nothing sent in %u seconds\n",
+                connection->inactivity_timeout);
+
+    connection->client_state = LM_CLIENT_STATE_INACTIVE;
+    connection_csi_update (connection, FALSE);
+
+    return FALSE;
+}
+
+/* Counts down to going inactive while the client is active and the
+ * application wants it to happen on its own. Activity doesn't reset the
+ * timeout, connection_csi_timed_out () looks at when it last was. */
+static void
+connection_csi_track (LmConnection *connection)
+{
+    if (connection->inactivity_source) {
+        g_source_destroy (connection->inactivity_source);
+        connection->inactivity_source = NULL;
+    }
+
+    if (connection->inactivity_timeout == 0 ||
+        connection_get_state (connection) != LM_CONNECTION_STATE_AUTHENTICATED ||
+        connection->client_state != LM_CLIENT_STATE_ACTIVE) {
+        return;
+    }
+
+    connection->inactivity_source =
+        lm_misc_add_timeout (connection->context,
+                             connection->inactivity_timeout * 1000,
+                             (GSourceFunc) connection_csi_timed_out,
+                             connection);
+}
+
+/* Called before anything is written, on the thread running the context,
+ * picks up the application sending stanzas since the last time */
+static void
+connection_csi_check_activity (LmConnection *connection)
+{
+    if (!g_atomic_int_compare_and_exchange (&connection->csi_activity, 1, 0)) {
+        return;
+    }
+
+    connection->last_activity = lm_misc_get_time ();
+
+    if (connection->inactivity_timeout > 0 &&
+        connection->client_state == LM_CLIENT_STATE_INACTIVE) {
+        connection->client_state = LM_CLIENT_STATE_ACTIVE;
+        connection_csi_update (connection, TRUE);
+        connection_csi_track (connection);
+    }
+}
+
+static void
+connection_csi_reset (LmConnection *connection)
+{
+    if (connection->inactivity_source) {
+        g_source_destroy (connection->inactivity_source);
+        connection->inactivity_source = NULL;
+    }
+
+    connection->csi_supported = FALSE;
+    connection->csi_sent = LM_CLIENT_STATE_ACTIVE;
+}
+
 static LmHandlerResult
 connection_features_cb (LmMessageHandler *handler,
                         LmConnection     *connection,
@@ -1083,6 +2076,7 @@ connection_features_cb (LmMessageHandler *handler,
     LmMessageNode *starttls_node;
     LmMessageNode *old_auth;
     LmMessageNode *sasl_mechanisms;
+    LmMessageNode *csi_node;
     
     starttls_node = lm_message_node_find_child (message->node, "starttls");
     if (connection->ssl && lm_old_socket_get_use_starttls (connection->socket)) {
@@ -1114,42 +2108,31 @@ connection_features_cb (LmMessageHandler *handler,
         }
     }
 
-    bind_node = lm_message_node_find_child (message->node, "bind");
+    csi_node = lm_message_node_get_child (message->node, "csi");
+    if (csi_node) {
+        const gchar *ns;
+
+        ns = lm_message_node_get_attribute (csi_node, "xmlns");
+        if (ns && strcmp (ns, XMPP_NS_CSI) == 0) {
+            connection->csi_supported = TRUE;
+        }
+    }
+
+    /* Direct child only, SASL2 advertises Bind 2 nested in <authentication/> */
+    bind_node = lm_message_node_get_child (message->node, "bind");
     if (bind_node) {
-        LmMessageHandler *bind_handler;
-        LmMessage        *bind_msg;
-        const gchar      *ns;
-        int               result;
+        const gchar *ns;
 
         ns = lm_message_node_get_attribute (bind_node, "xmlns");
         if (!ns || strcmp (ns, XMPP_NS_BIND) != 0) {
             return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
         }
 
-        bind_msg = lm_message_new_with_sub_type (NULL,
-                                                 LM_MESSAGE_TYPE_IQ, 
-                                                 LM_MESSAGE_SUB_TYPE_SET);
-
-        bind_node = lm_message_node_add_child (bind_msg->node, 
-                                               "bind", NULL);
-        lm_message_node_set_attributes (bind_node,
-                                        "xmlns", XMPP_NS_BIND,
-                                        NULL);
-
-        lm_message_node_add_child (bind_node, "resource",
-                                   connection->resource);
-
-        bind_handler = lm_message_handler_new (connection_bind_reply,
-                                               NULL, NULL);
-        result = lm_connection_send_with_reply (connection, bind_msg, 
-                                                bind_handler, NULL);
-        lm_message_handler_unref (bind_handler);
-        lm_message_unref (bind_msg);
-
-        if (result < 0) {
-            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL, 
-                   "%s: can't send resource binding request\n", G_STRFUNC);
-            connection_do_close (connection);
+        /* Binding waits for the stream restart after compression */
+        if (connection_exi_offered (connection, message->node)) {
+            connection_exi_setup (connection);
+        } else {
+            connection_send_bind (connection);
         }
     }
 
@@ -1196,7 +2179,6 @@ LmConnection *
 lm_connection_new (const gchar *server)
 {
     LmConnection *connection;
-    gint          i;
 
     g_type_init (); /* Ensure that the GLib type library is initialized */
     lm_debug_init ();
@@ -1211,21 +2193,32 @@ lm_connection_new (const gchar *server)
     connection->port        = LM_CONNECTION_DEFAULT_PORT;
     connection->queue       = lm_message_queue_new ((LmMessageQueueCallback) connection_message_queue_cb, 
                                                           connection);
+    connection->out_queue   = lm_outgoing_queue_new ((LmOutgoingQueueFunc) connection_outgoing_queue_cb,
+                                                     connection);
+    lm_outgoing_queue_set_mark_func (connection->out_queue,
+                                     (LmOutgoingQueueMarkFunc) connection_outgoing_mark_cb);
     connection->state       = LM_CONNECTION_STATE_CLOSED;
     
     connection->id_handlers = g_hash_table_new_full (g_str_hash, 
                                                      g_str_equal,
                                                      g_free, 
                                                      (GDestroyNotify) lm_message_handler_unref);
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_init (&connection->id_handlers_lock);
+    g_mutex_init (&connection->multicast_lock);
+#else
+    g_static_mutex_init (&connection->id_handlers_lock);
+    g_static_mutex_init (&connection->multicast_lock);
+#endif
     connection->ref_count   = 1;
     
-    for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
-        connection->handlers[i] = NULL;
-    }
+    connection->handlers    = lm_handler_table_new ();
 
     connection->parser = lm_parser_new 
         ((LmParserMessageFunction) connection_new_message_cb, 
          connection, NULL);
+    lm_parser_set_node_function (connection->parser,
+                                 (LmParserNodeFunction) connection_unknown_node_cb);
 
     return connection;
 }
@@ -1371,7 +2364,7 @@ lm_connection_close (LmConnection *connection, GError **error)
         lm_old_socket_asyncns_cancel (connection->socket);
     }
 
-    if (connection->state == LM_CONNECTION_STATE_CLOSED) {
+    if (connection_get_state (connection) == LM_CONNECTION_STATE_CLOSED) {
         g_set_error (error,
                      LM_ERROR,
                      LM_ERROR_CONNECTION_NOT_OPEN,
@@ -1383,7 +2376,15 @@ lm_connection_close (LmConnection *connection, GError **error)
                 connection->server, connection->port);
     
     if (lm_connection_is_open (connection)) {
-        if (!connection_send (connection, "</stream:stream>", -1, error)) {
+        if (connection->exi) {
+            LmMessageNode *end;
+
+            end = _lm_message_node_new ("streamEnd");
+            lm_message_node_set_attribute (end, "xmlns", LM_EXI_NS);
+            no_errors = connection_send_exi (connection, end, NULL, error);
+            lm_message_node_unref (end);
+        }
+        else if (!connection_send (connection, "</stream:stream>", -1, error)) {
             no_errors = FALSE;
         }
 
@@ -1402,13 +2403,40 @@ connection_sasl_auth_finished (LmSASL       *sasl,
                                gboolean      success,
                                const gchar  *reason)
 {
+    const gchar *jid;
+
+    if (lm_sasl_is_sasl2 (sasl)) {
+        /* Keep the token for the next login, it may have been rotated
+         * or dropped after being rejected */
+        g_free (connection->fast_token);
+        connection->fast_token = g_strdup (lm_sasl_get_fast_token (sasl));
+    }
+
     if (!success) {
         lm_verbose ("SASL authentication failed, closing connection\n");
         connection_call_auth_cb (connection, FALSE);
         return;
     }
 
-    connection_send_stream_header (connection);
+    if (!lm_sasl_is_sasl2 (sasl)) {
+        connection_send_stream_header (connection);
+        return;
+    }
+
+    /* SASL2 continues on the same stream, no restart and no new features */
+    jid = lm_sasl_get_authorization_identifier (sasl);
+    if (jid) {
+        g_free (connection->effective_jid);
+        connection->effective_jid = g_strdup (jid);
+    }
+
+    if (lm_sasl_get_bound (sasl)) {
+        lm_verbose ("Resource bound inline (XEP-0386): %s\n",
+                    connection->effective_jid);
+        connection_call_auth_cb (connection, TRUE);
+    } else {
+        connection_send_bind (connection);
+    }
 }
 
 /**
@@ -1454,7 +2482,7 @@ lm_connection_authenticate (LmConnection      *connection,
         return FALSE;
     }
 
-    connection->state = LM_CONNECTION_STATE_AUTHENTICATING;
+    connection_set_state (connection, LM_CONNECTION_STATE_AUTHENTICATING);
     
     connection->auth_cb = _lm_utils_new_callback (function, 
                                                   user_data, 
@@ -1468,6 +2496,7 @@ lm_connection_authenticate (LmConnection      *connection,
     /* TODO: Break out Credentials (or use the already existing AuthReqData struct for *
      *       Username/Password and Resource                                            */
     if (connection->use_sasl) {
+        lm_sasl_set_fast_token (connection->sasl, connection->fast_token);
         lm_sasl_authenticate (connection->sasl, auth_params, connection->server,
                               connection_sasl_auth_finished);
 
@@ -1609,35 +2638,371 @@ lm_connection_set_keep_alive_rate (LmConnection *connection, guint rate)
 }
 
 /**
- * lm_connection_is_open:
- * @connection: #LmConnection to check if it is open.
- * 
- * Check if the @connection is currently open.
- * 
- * Return value: #TRUE if connection is open and #FALSE if it is closed.
+ * lm_connection_get_keep_alive_adaptive:
+ * @connection: an #LmConnection
+ *
+ * Get whether the keep alive interval adapts to the network, see
+ * lm_connection_set_keep_alive_adaptive().
+ *
+ * Return value: %TRUE if adaptive keep alive is used.
  **/
 gboolean
-lm_connection_is_open (LmConnection *connection)
+lm_connection_get_keep_alive_adaptive (LmConnection *connection)
 {
     g_return_val_if_fail (connection != NULL, FALSE);
-    
-    return connection->state >= LM_CONNECTION_STATE_OPEN;
+
+    return connection->keep_alive_adaptive;
 }
 
 /**
- * lm_connection_is_authenticated:
- * @connection: #LmConnection to check if it is authenticated
- * 
- * Check if @connection is authenticated.
- * 
- * Return value: #TRUE if connection is authenticated, #FALSE otherwise.
+ * lm_connection_set_keep_alive_adaptive:
+ * @connection: an #LmConnection
+ * @adaptive: whether to adapt the keep alive interval
+ *
+ * Makes the keep alive interval adapt to how long the network lets the
+ * connection sit idle. NATs and firewalls silently drop connections that
+ * have been idle for a while, and how long that is differs between
+ * networks. Starting from the keep alive rate, the interval is doubled
+ * for as long as pings are answered. Once the connection has been lost
+ * after some interval, later connections narrow in on it and settle just
+ * below, keeping keep alive traffic to what the network needs.
+ *
+ * What was learned is kept per local address for as long as @connection
+ * exists, so reconnecting over the same network starts at the interval
+ * known to work. The keep alive rate has to be set for this to have any
+ * effect.
  **/
-gboolean 
-lm_connection_is_authenticated (LmConnection *connection)
+void
+lm_connection_set_keep_alive_adaptive (LmConnection *connection,
+                                       gboolean      adaptive)
 {
-    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_if_fail (connection != NULL);
+
+    connection->keep_alive_adaptive = adaptive;
+
+    if (connection->feature_ping) {
+        connection_start_keep_alive (connection);
+    }
+}
+
+/**
+ * lm_connection_get_keep_alive_interval:
+ * @connection: an #LmConnection
+ *
+ * Get the number of seconds between keep alive pings. Unless adaptive
+ * keep alive is used, this is the same as the keep alive rate.
+ *
+ * Return value: the keep alive interval in seconds.
+ **/
+guint
+lm_connection_get_keep_alive_interval (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    if (!connection->feature_ping) {
+        return connection->keep_alive_rate;
+    }
+
+    return lm_feature_ping_get_interval (connection->feature_ping);
+}
+
+/**
+ * lm_connection_get_rtt:
+ * @connection: an #LmConnection
+ *
+ * Get the smoothed round trip time to the server, measured with the keep
+ * alive pings. Zero is returned if no keep alive rate has been set or no
+ * ping has been answered yet.
+ *
+ * Return value: the round trip time in milliseconds.
+ **/
+guint
+lm_connection_get_rtt (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    if (!connection->feature_ping) {
+        return 0;
+    }
+
+    return lm_feature_ping_get_rtt (connection->feature_ping);
+}
+
+/**
+ * lm_connection_get_rtt_jitter:
+ * @connection: an #LmConnection
+ *
+ * Get how much the round trip times of the keep alive pings vary from
+ * one ping to the next, smoothed like RTP interarrival jitter.
+ *
+ * Return value: the jitter in milliseconds.
+ **/
+guint
+lm_connection_get_rtt_jitter (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    if (!connection->feature_ping) {
+        return 0;
+    }
+
+    return lm_feature_ping_get_jitter (connection->feature_ping);
+}
+
+/**
+ * lm_connection_get_health:
+ * @connection: an #LmConnection
+ *
+ * Get a score for how well the connection is doing, based on the keep
+ * alive pings. 1.0 means every ping is answered about as fast as the best
+ * round trip seen so far. Lost pings, slower and more varying round trips
+ * bring the score down, and it goes towards 0.0 while pings are going
+ * unanswered, before the connection is closed with
+ * #LM_DISCONNECT_REASON_PING_TIME_OUT. A connection that isn't open
+ * scores 0.0, one without keep alive pings 1.0.
+ *
+ * Return value: the health score, between 0.0 and 1.0.
+ **/
+gdouble
+lm_connection_get_health (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0.0);
+
+    if (!lm_connection_is_open (connection)) {
+        return 0.0;
+    }
+
+    if (!connection->feature_ping) {
+        return 1.0;
+    }
+
+    return lm_feature_ping_get_health (connection->feature_ping);
+}
+
+/**
+ * lm_connection_get_ping_responder:
+ * @connection: an #LmConnection
+ *
+ * Get whether pings are answered by Loudmouth, see
+ * lm_connection_set_ping_responder().
+ *
+ * Return value: %TRUE if pings are answered by Loudmouth.
+ **/
+gboolean
+lm_connection_get_ping_responder (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return connection->respond_ping;
+}
+
+/**
+ * lm_connection_set_ping_responder:
+ * @connection: an #LmConnection
+ * @enabled: whether Loudmouth should answer pings
+ *
+ * Makes Loudmouth answer pings (XEP-0199) from the server and from
+ * contacts as soon as they are read, without passing them to the message
+ * handlers. Servers close connections that leave their pings unanswered,
+ * with this the connection stays up even while the application is too
+ * busy to run its handlers.
+ **/
+void
+lm_connection_set_ping_responder (LmConnection *connection, gboolean enabled)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->respond_ping = enabled;
+}
+
+/**
+ * lm_connection_set_disco_info:
+ * @connection: an #LmConnection
+ * @query: the query node to answer with, or %NULL
+ *
+ * Makes Loudmouth answer service discovery information requests
+ * (XEP-0030) as soon as they are read, without passing them to the
+ * message handlers. @query is the
+ * &lt;query xmlns="http://jabber.org/protocol/disco#info"/&gt; node with
+ * the identities and features to answer with. It is copied, later
+ * changes to it have no effect. Only requests for the node set on @query,
+ * if any, are answered. Pass %NULL to leave all requests to the
+ * application again.
+ **/
+void
+lm_connection_set_disco_info (LmConnection  *connection,
+                              LmMessageNode *query)
+{
+    g_return_if_fail (connection != NULL);
+
+    g_free (connection->disco_info);
+    g_free (connection->disco_node);
+    connection->disco_info = NULL;
+    connection->disco_node = NULL;
+
+    if (!query) {
+        return;
+    }
+
+    g_return_if_fail (strcmp (lm_message_node_get_name (query), "query") == 0);
+
+    connection->disco_info = lm_message_node_to_string (query);
+    connection->disco_node =
+        g_strdup (lm_message_node_get_attribute (query, "node"));
+}
+
+/**
+ * lm_connection_get_exi:
+ * @connection: an #LmConnection
+ *
+ * Get whether EXI compression is used when the server offers it, see
+ * lm_connection_set_exi().
+ *
+ * Return value: %TRUE if EXI compression is used.
+ **/
+gboolean
+lm_connection_get_exi (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return connection->use_exi;
+}
+
+/**
+ * lm_connection_set_exi:
+ * @connection: an #LmConnection
+ * @use_exi: whether to use EXI compression
+ *
+ * Makes @connection switch to Efficient XML Interchange (XEP-0322) after
+ * authentication when the server offers it, before binding the resource.
+ * Stanzas are then sent and received in a binary form that is a fraction
+ * of the size of their XML, which mostly pays off on slow or metered
+ * links. It is off by default and only used with SASL logins that restart
+ * the stream. Changes take effect the next time the connection logs in.
+ **/
+void
+lm_connection_set_exi (LmConnection *connection, gboolean use_exi)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->use_exi = use_exi;
+}
+
+/**
+ * lm_connection_get_client_state:
+ * @connection: an #LmConnection
+ *
+ * Get what the server is told about the client, see
+ * lm_connection_set_client_state().
+ *
+ * Return value: The state of the client.
+ **/
+LmClientState
+lm_connection_get_client_state (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, LM_CLIENT_STATE_ACTIVE);
+
+    return connection->client_state;
+}
+
+/**
+ * lm_connection_set_client_state:
+ * @connection: an #LmConnection
+ * @state: the new state of the client
+ *
+ * Tells the server whether someone is using the client, with Client State
+ * Indication (XEP-0352). While the client is inactive the server may hold
+ * back presence updates and other traffic of little value and deliver it
+ * in batches later, which saves both ends a lot of work when only some
+ * messages matter. It is sent as soon as the connection is authenticated
+ * and never to servers that don't support it. The state is kept across
+ * reconnects. Has to be called from the thread running the main context
+ * of @connection.
+ **/
+void
+lm_connection_set_client_state (LmConnection *connection, LmClientState state)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->client_state = state;
+
+    if (state == LM_CLIENT_STATE_ACTIVE) {
+        connection->last_activity = lm_misc_get_time ();
+    }
+
+    connection_csi_update (connection, FALSE);
+    connection_csi_track (connection);
+}
+
+/**
+ * lm_connection_get_inactivity_timeout:
+ * @connection: an #LmConnection
+ *
+ * Get the number of seconds without anything sent before the client is
+ * inactive, see lm_connection_set_inactivity_timeout().
+ *
+ * Return value: The timeout in seconds, 0 if it is turned off.
+ **/
+guint
+lm_connection_get_inactivity_timeout (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, 0);
+
+    return connection->inactivity_timeout;
+}
 
-    return connection->state >= LM_CONNECTION_STATE_AUTHENTICATED;
+/**
+ * lm_connection_set_inactivity_timeout:
+ * @connection: an #LmConnection
+ * @timeout: seconds before the client is inactive, 0 to turn it off
+ *
+ * Makes the client state of @connection follow what the application
+ * does: once it hasn't sent a message or presence for @timeout seconds
+ * the server is told the client is inactive, and with the next one it
+ * sends that it is active again. Replies sent from message handlers count
+ * as well. See lm_connection_set_client_state(), which can still be used
+ * to change the state in between. Has to be called from the thread
+ * running the main context of @connection.
+ **/
+void
+lm_connection_set_inactivity_timeout (LmConnection *connection, guint timeout)
+{
+    g_return_if_fail (connection != NULL);
+
+    connection->inactivity_timeout = timeout;
+    connection_csi_track (connection);
+}
+
+/**
+ * lm_connection_is_open:
+ * @connection: #LmConnection to check if it is open.
+ * 
+ * Check if the @connection is currently open.
+ * 
+ * Return value: #TRUE if connection is open and #FALSE if it is closed.
+ **/
+gboolean
+lm_connection_is_open (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+    
+    return connection_get_state (connection) >= LM_CONNECTION_STATE_OPEN;
+}
+
+/**
+ * lm_connection_is_authenticated:
+ * @connection: #LmConnection to check if it is authenticated
+ * 
+ * Check if @connection is authenticated.
+ * 
+ * Return value: #TRUE if connection is authenticated, #FALSE otherwise.
+ **/
+gboolean 
+lm_connection_is_authenticated (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, FALSE);
+
+    return connection_get_state (connection) >= LM_CONNECTION_STATE_AUTHENTICATED;
 }
 
 /**
@@ -1731,6 +3096,48 @@ lm_connection_set_jid (LmConnection *connection, const gchar *jid)
 
     g_free (connection->jid);
     connection->jid = g_strdup (jid);
+
+    /* FAST tokens belong to an account */
+    g_free (connection->fast_token);
+    connection->fast_token = NULL;
+}
+
+/**
+ * lm_connection_get_fast_token:
+ * @connection: an #LmConnection
+ * 
+ * Fetches the FAST (XEP-0484) token the server handed out during the last
+ * SASL2 authentication. Store it together with the account to skip the
+ * password exchange on the next login.
+ * 
+ * Return value: the token or %NULL if there is none.
+ **/
+const gchar *
+lm_connection_get_fast_token (LmConnection *connection)
+{
+    g_return_val_if_fail (connection != NULL, NULL);
+
+    return connection->fast_token;
+}
+
+/**
+ * lm_connection_set_fast_token:
+ * @connection: an #LmConnection
+ * @token: a token from lm_connection_get_fast_token() or %NULL
+ * 
+ * Sets the FAST token to authenticate with. When the server offers SASL2
+ * with FAST, lm_connection_authenticate() uses the token instead of the
+ * password and binds the resource in the same round trip. A rejected
+ * token makes it fall back to the password. The token is dropped when
+ * the JID changes.
+ **/
+void
+lm_connection_set_fast_token (LmConnection *connection, const gchar *token)
+{
+    g_return_if_fail (connection != NULL);
+
+    g_free (connection->fast_token);
+    connection->fast_token = g_strdup (token);
 }
 
 /**
@@ -1853,6 +3260,55 @@ lm_connection_set_proxy (LmConnection *connection, LmProxy *proxy)
     }
 }
 
+/* @tracker is taken unless %FALSE is returned */
+static gboolean
+connection_send_message (LmConnection  *connection,
+                         LmMessage     *message,
+                         SendTracker   *tracker,
+                         GError       **error)
+{
+    gchar         *xml_str;
+    gchar         *ch;
+    LmMessageType  type;
+
+    /* What the application sends to others, IQs are mostly housekeeping */
+    type = lm_message_get_type (message);
+    if (type == LM_MESSAGE_TYPE_MESSAGE || type == LM_MESSAGE_TYPE_PRESENCE) {
+        g_atomic_int_set (&connection->csi_activity, 1);
+    }
+
+    /* With EXI the node is encoded as it is, serializing it would only
+     * have it parsed again */
+    if (connection->exi && g_main_context_acquire (connection->context)) {
+        if (connection->exi) {
+            gboolean result;
+
+            lm_outgoing_queue_drain (connection->out_queue);
+            result = connection_send_exi (connection, message->node,
+                                          tracker, error);
+            if (result && tracker) {
+                connection_send_track (connection, tracker);
+            }
+            g_main_context_release (connection->context);
+
+            return result;
+        }
+
+        g_main_context_release (connection->context);
+    }
+
+    xml_str = lm_message_node_to_string (message->node);
+    if ((ch = strstr (xml_str, "</stream:stream>"))) {
+        *ch = '\0';
+    }
+
+    if (tracker) {
+        tracker->times.serialized = lm_misc_get_timestamp ();
+    }
+
+    return connection_send_or_queue_full (connection, xml_str, tracker, error);
+}
+
 /**
  * lm_connection_send: 
  * @connection: #LmConnection to send message over.
@@ -1860,6 +3316,12 @@ lm_connection_set_proxy (LmConnection *connection, LmProxy *proxy)
  * @error: location to store error, or %NULL
  * 
  * Asynchronous call to send a message.
+ *
+ * This function may be called from any thread. If another thread is
+ * running the main context of @connection the message is queued and
+ * written by that thread on its next iteration, together with any other
+ * messages queued in the meantime. Write errors for queued messages are
+ * reported through the disconnect callback rather than @error.
  * 
  * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
  **/
@@ -1868,20 +3330,553 @@ lm_connection_send (LmConnection  *connection,
                     LmMessage     *message, 
                     GError       **error)
 {
-    gchar    *xml_str;
-    gchar    *ch;
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+
+    return connection_send_message (connection, message, NULL, error);
+}
+
+/**
+ * lm_connection_send_with_callback:
+ * @connection: #LmConnection to send message over.
+ * @message: #LmMessage to send.
+ * @function: called once @message has left the process
+ * @user_data: user data passed to @function
+ * @notify: function to free @user_data, or %NULL
+ * @error: location to store error, or %NULL
+ * 
+ * Like lm_connection_send(), and @function is called when the last byte
+ * of @message has been accepted by the kernel, or by the TLS layer and
+ * then the kernel. Until then it may only have been buffered, which
+ * lm_connection_send() doesn't tell. That may be before this returns, and
+ * otherwise from the thread running the main context of @connection. If
+ * the connection closes first @function is called with @success %FALSE.
+ *
+ * The #LmSendTimes given to @function tell how long @message was
+ * serialized and buffered for, which callers can use to pace themselves
+ * or to measure latency.
+ * 
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise, in which case @function is not called.
+ **/
+gboolean
+lm_connection_send_with_callback (LmConnection    *connection,
+                                  LmMessage       *message,
+                                  LmSendFunction   function,
+                                  gpointer         user_data,
+                                  GDestroyNotify   notify,
+                                  GError         **error)
+{
+    SendTracker *tracker;
+
+    g_return_val_if_fail (connection != NULL, FALSE);
+    g_return_val_if_fail (message != NULL, FALSE);
+    g_return_val_if_fail (function != NULL, FALSE);
+
+    tracker = connection_send_tracker_new (connection, function,
+                                           user_data, notify);
+
+    if (!connection_send_message (connection, message, tracker, error)) {
+        connection_send_tracker_free (tracker);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void
+connection_lock_multicast (LmConnection *connection)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_lock (&connection->multicast_lock);
+#else
+    g_static_mutex_lock (&connection->multicast_lock);
+#endif
+}
+
+static void
+connection_unlock_multicast (LmConnection *connection)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    g_mutex_unlock (&connection->multicast_lock);
+#else
+    g_static_mutex_unlock (&connection->multicast_lock);
+#endif
+}
+
+static MulticastSupport
+connection_multicast_get (LmConnection *connection)
+{
+    MulticastSupport multicast;
+
+    connection_lock_multicast (connection);
+    multicast = connection->multicast;
+    connection_unlock_multicast (connection);
+
+    return multicast;
+}
+
+static void
+connection_multicast_send_free (MulticastSend *send)
+{
+    g_free (send->prefix);
+    g_free (send->suffix);
+    g_free (send->open);
+    g_free (send->close);
+    g_strfreev (send->recipients);
+    g_free (send);
+}
+
+static void
+connection_multicast_reset (LmConnection *connection)
+{
+    if (connection->multicast_timeout) {
+        g_source_destroy (connection->multicast_timeout);
+        connection->multicast_timeout = NULL;
+    }
+
+    connection->multicast_queries = 0;
+
+    connection_lock_multicast (connection);
+    g_free (connection->multicast_service);
+    connection->multicast_service = NULL;
+    connection->multicast = MULTICAST_UNKNOWN;
+    connection_unlock_multicast (connection);
+}
+
+static MulticastSend *
+connection_multicast_send_new (LmMessage *message, const gchar **recipients)
+{
+    MulticastSend *send;
+    LmMessageNode *node = message->node;
+    gchar         *to;
+    gchar         *id;
+    gchar         *str;
+    gchar         *ch;
+    gsize          len;
+
+    /* Serialized with an empty recipient which is then cut out. Escaped
+     * attribute values can't hold a quote, so the first empty 'to' is the
+     * one of the stanza itself. Every stanza sent gets an id of its own
+     * after the recipient, the one of @message is left out. */
+    to = g_strdup (lm_message_node_get_attribute (node, "to"));
+    id = g_strdup (lm_message_node_get_attribute (node, "id"));
+    lm_message_node_set_attribute (node, "to", "");
+    _lm_message_node_remove_attribute (node, "id");
+    str = lm_message_node_to_string (node);
+
+    if (to) {
+        lm_message_node_set_attribute (node, "to", to);
+        g_free (to);
+    } else {
+        _lm_message_node_remove_attribute (node, "to");
+    }
+
+    if (id) {
+        lm_message_node_set_attribute (node, "id", id);
+        g_free (id);
+    }
+
+    ch = strstr (str, " to=\"\"") + strlen (" to=\"");
+
+    send = g_new0 (MulticastSend, 1);
+    send->prefix = g_strndup (str, ch - str);
+    send->suffix = g_strdup (ch);
+    send->recipients = g_strdupv ((gchar **) recipients);
+
+    len = strlen (send->suffix);
+    if (len >= 2 && strcmp (send->suffix + len - 2, "/>") == 0) {
+        send->open = g_strdup_printf ("%.*s>", (gint) (len - 2), send->suffix);
+        send->close = g_strdup_printf ("</%s>", node->name);
+    } else {
+        ch = g_strrstr (send->suffix, "</");
+        send->open = g_strndup (send->suffix, ch - send->suffix);
+        send->close = g_strdup (ch);
+    }
+
+    g_free (str);
+
+    return send;
+}
+
+/* The start of a stanza to @to, up to the quote closing its id */
+static GString *
+connection_multicast_start_stanza (MulticastSend *send, const gchar *to)
+{
+    GString *str;
+    gchar   *escaped;
+    gchar   *id;
+
+    escaped = g_markup_escape_text (to, -1);
+    id = _lm_utils_generate_id ();
+
+    str = g_string_new (send->prefix);
+    g_string_append (str, escaped);
+    g_string_append (str, "\" id=\"");
+    g_string_append (str, id);
+
+    g_free (escaped);
+    g_free (id);
+
+    return str;
+}
+
+/* Falls back to one stanza per recipient */
+static gboolean
+connection_multicast_send_each (LmConnection   *connection,
+                                MulticastSend  *send,
+                                GError        **error)
+{
+    gchar **recipient;
+
+    for (recipient = send->recipients; *recipient; recipient++) {
+        GString *str;
+
+        str = connection_multicast_start_stanza (send, *recipient);
+        g_string_append (str, send->suffix);
+
+        if (!connection_send_or_queue (connection,
+                                       g_string_free (str, FALSE), error)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Sends through @service, in chunks of at most MULTICAST_MAX_ADDRESSES
+ * recipients */
+static gboolean
+connection_multicast_send_addressed (LmConnection   *connection,
+                                     MulticastSend  *send,
+                                     const gchar    *service,
+                                     GError        **error)
+{
+    gchar **recipient = send->recipients;
+
+    while (*recipient) {
+        GString *str;
+        guint    i;
+
+        str = connection_multicast_start_stanza (send, service);
+        g_string_append (str, send->open);
+        g_string_append (str, "<addresses xmlns=\"" XMPP_NS_ADDRESS "\">");
+
+        for (i = 0; *recipient && i < MULTICAST_MAX_ADDRESSES; i++) {
+            gchar *jid;
+
+            jid = g_markup_escape_text (*recipient, -1);
+            g_string_append_printf (str, "<address type=\"bcc\" jid=\"%s\"/>",
+                                    jid);
+            g_free (jid);
+
+            recipient++;
+        }
+
+        g_string_append (str, "</addresses>");
+        g_string_append (str, send->close);
+
+        if (!connection_send_or_queue (connection,
+                                       g_string_free (str, FALSE), error)) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/* Discovery is over, with @service or without one */
+static void
+connection_multicast_settle (LmConnection *connection, const gchar *service)
+{
+    if (connection->multicast_timeout) {
+        g_source_destroy (connection->multicast_timeout);
+        connection->multicast_timeout = NULL;
+    }
+
+    connection_lock_multicast (connection);
+    if (service) {
+        connection->multicast = MULTICAST_SUPPORTED;
+        connection->multicast_service = g_strdup (service);
+        lm_verbose ("Multicast service: %s\n", service);
+    } else {
+        connection->multicast = MULTICAST_UNSUPPORTED;
+        lm_verbose ("No multicast service found\n");
+    }
+    connection_unlock_multicast (connection);
+}
+
+static gboolean
+connection_multicast_timeout_cb (LmConnection *connection)
+{
+    connection->multicast_timeout = NULL;
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+           "No answer to multicast service discovery\n");
+    connection_multicast_settle (connection, NULL);
+
+    return FALSE;
+}
+
+static LmHandlerResult connection_multicast_info_reply  (LmMessageHandler *handler,
+                                                         LmConnection     *connection,
+                                                         LmMessage        *m,
+                                                         gpointer          user_data);
+static LmHandlerResult connection_multicast_items_reply (LmMessageHandler *handler,
+                                                         LmConnection     *connection,
+                                                         LmMessage        *m,
+                                                         gpointer          user_data);
+
+/* Sends a disco#info or disco#items query to @jid, the answer goes to
+ * @function along with @jid */
+static gboolean
+connection_multicast_query (LmConnection            *connection,
+                            const gchar             *jid,
+                            const gchar             *xmlns,
+                            LmHandleMessageFunction  function)
+{
+    LmMessage        *m;
+    LmMessageHandler *handler;
+    gboolean          result;
+
+    m = lm_message_new_with_sub_type (jid, LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_GET);
+    lm_message_node_set_attribute (lm_message_node_add_child (m->node,
+                                                              "query", NULL),
+                                   "xmlns", xmlns);
+
+    handler = lm_message_handler_new (function, g_strdup (jid), g_free);
+    result = lm_connection_send_with_reply (connection, m, handler, NULL);
+    lm_message_handler_unref (handler);
+    lm_message_unref (m);
+
+    if (result) {
+        connection->multicast_queries++;
+    }
+
+    return result;
+}
+
+/* One query less to wait for, gives up when none are left */
+static void
+connection_multicast_query_done (LmConnection *connection)
+{
+    connection->multicast_queries--;
+
+    if (connection->multicast_queries == 0) {
+        connection_multicast_settle (connection, NULL);
+    }
+}
+
+static LmHandlerResult
+connection_multicast_info_reply (LmMessageHandler *handler,
+                                 LmConnection     *connection,
+                                 LmMessage        *m,
+                                 gpointer          user_data)
+{
+    const gchar   *jid = user_data;
+    LmMessageNode *query;
+    LmMessageNode *node;
+
+    if (connection_multicast_get (connection) != MULTICAST_DISCOVERING) {
+        /* Settled already or the connection was closed in between */
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    query = lm_message_node_get_child (m->node, "query");
+    if (lm_message_get_sub_type (m) == LM_MESSAGE_SUB_TYPE_RESULT && query) {
+        for (node = query->children; node; node = node->next) {
+            const gchar *var;
+
+            if (strcmp (node->name, "feature") != 0) {
+                continue;
+            }
+
+            var = lm_message_node_get_attribute (node, "var");
+            if (var && strcmp (var, XMPP_NS_ADDRESS) == 0) {
+                connection_multicast_settle (connection, jid);
+                return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+            }
+        }
+    }
+
+    connection_multicast_query_done (connection);
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+/* Asks each item of the server whether it is the multicast service */
+static LmHandlerResult
+connection_multicast_items_reply (LmMessageHandler *handler,
+                                  LmConnection     *connection,
+                                  LmMessage        *m,
+                                  gpointer          user_data)
+{
+    LmMessageNode *query;
+    LmMessageNode *node;
+
+    if (connection_multicast_get (connection) != MULTICAST_DISCOVERING) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    query = lm_message_node_get_child (m->node, "query");
+    if (lm_message_get_sub_type (m) == LM_MESSAGE_SUB_TYPE_RESULT && query) {
+        for (node = query->children; node; node = node->next) {
+            const gchar *jid;
+
+            if (strcmp (node->name, "item") != 0) {
+                continue;
+            }
+
+            jid = lm_message_node_get_attribute (node, "jid");
+            if (jid && !lm_message_node_get_attribute (node, "node")) {
+                connection_multicast_query (connection, jid,
+                                            XMPP_NS_DISCO_INFO,
+                                            connection_multicast_info_reply);
+            }
+        }
+    }
+
+    connection_multicast_query_done (connection);
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+/* The server itself may be the service, otherwise one of its items is.
+ * Runs on the thread owning the context, which keeps the queries. */
+static void
+connection_multicast_discover (LmConnection *connection)
+{
+    gchar    *server;
     gboolean  result;
-    
+
+    if (connection_multicast_get (connection) != MULTICAST_DISCOVERING ||
+        connection->multicast_timeout) {
+        /* Closed meanwhile, or already asking */
+        return;
+    }
+
+    server = _lm_connection_get_server (connection);
+    result = connection_multicast_query (connection, server,
+                                         XMPP_NS_DISCO_INFO,
+                                         connection_multicast_info_reply) &&
+             connection_multicast_query (connection, server,
+                                         XMPP_NS_DISCO_ITEMS,
+                                         connection_multicast_items_reply);
+    g_free (server);
+
+    if (!result) {
+        connection->multicast_queries = 0;
+        connection_multicast_settle (connection, NULL);
+        return;
+    }
+
+    connection->multicast_timeout =
+        lm_misc_add_timeout (connection->context,
+                             MULTICAST_DISCO_TIMEOUT,
+                             (GSourceFunc) connection_multicast_timeout_cb,
+                             connection);
+}
+
+static gboolean
+connection_multicast_discover_cb (LmConnection *connection)
+{
+    if (connection_get_state (connection) >= LM_CONNECTION_STATE_OPENING) {
+        connection_multicast_discover (connection);
+    }
+
+    lm_connection_unref (connection);
+
+    return FALSE;
+}
+
+/**
+ * lm_connection_send_multicast:
+ * @connection: #LmConnection used to send message.
+ * @message: #LmMessage to send.
+ * @recipients: %NULL terminated array of JIDs to send @message to.
+ * @error: location to store error, or %NULL
+ *
+ * Sends @message to every JID in @recipients. If the server supports
+ * extended stanza addressing (XEP-0033) a single stanza is sent, with
+ * the recipients listed in an &lt;addresses/&gt; block, split over a few
+ * stanzas for many recipients. Otherwise one stanza is sent to each
+ * recipient. Either way @message is only serialized once. The 'to'
+ * attribute of @message is ignored, and each stanza sent gets an 'id' of
+ * its own.
+ *
+ * The service is looked for the first time this is called with more
+ * than one recipient, on the server and on the items the server lists.
+ * Until it is found, one stanza is sent to each recipient, so @message
+ * still goes out before anything sent after it. Like lm_connection_send()
+ * this may be called from any thread.
+ *
+ * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
+ **/
+gboolean
+lm_connection_send_multicast (LmConnection  *connection,
+                              LmMessage     *message,
+                              const gchar  **recipients,
+                              GError       **error)
+{
+    MulticastSend *send;
+    gchar         *service = NULL;
+    gboolean       discover = FALSE;
+    gboolean       result;
+
     g_return_val_if_fail (connection != NULL, FALSE);
     g_return_val_if_fail (message != NULL, FALSE);
+    g_return_val_if_fail (recipients != NULL, FALSE);
 
-    xml_str = lm_message_node_to_string (message->node);
-    if ((ch = strstr (xml_str, "</stream:stream>"))) {
-        *ch = '\0';
+    if (!recipients[0]) {
+        return TRUE;
     }
-    
-    result = connection_send (connection, xml_str, -1, error);
-    g_free (xml_str);
+
+    if (connection_get_state (connection) < LM_CONNECTION_STATE_OPENING) {
+        g_set_error (error,
+                     LM_ERROR,
+                     LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not open, call lm_connection_open() first");
+        return FALSE;
+    }
+
+    g_atomic_int_set (&connection->csi_activity, 1);
+
+    /* Nothing to save with a single recipient */
+    if (recipients[1]) {
+        connection_lock_multicast (connection);
+        if (connection->multicast == MULTICAST_UNKNOWN) {
+            connection->multicast = MULTICAST_DISCOVERING;
+            discover = TRUE;
+        }
+        else if (connection->multicast == MULTICAST_SUPPORTED) {
+            service = g_strdup (connection->multicast_service);
+        }
+        connection_unlock_multicast (connection);
+    }
+
+    if (discover) {
+        if (g_main_context_acquire (connection->context)) {
+            connection_multicast_discover (connection);
+            g_main_context_release (connection->context);
+        } else {
+            /* The thread running the connection keeps the queries */
+            lm_misc_add_idle (connection->context,
+                              (GSourceFunc) connection_multicast_discover_cb,
+                              lm_connection_ref (connection));
+        }
+    }
+
+    send = connection_multicast_send_new (message, recipients);
+
+    if (service) {
+        result = connection_multicast_send_addressed (connection, send,
+                                                      service, error);
+    } else {
+        result = connection_multicast_send_each (connection, send, error);
+    }
+
+    connection_multicast_send_free (send);
+    g_free (service);
 
     return result;
 }
@@ -1894,6 +3889,9 @@ lm_connection_send (LmConnection  *connection,
  * @error: location to store error, or %NULL
  * 
  * Send a #LmMessage which will result in a reply. 
+ *
+ * Like lm_connection_send() this may be called from any thread, @handler
+ * is run by the thread running the main context of @connection.
  * 
  * Return value: Returns #TRUE if no errors where detected while sending, #FALSE otherwise.
  **/
@@ -1917,12 +3915,31 @@ lm_connection_send_with_reply (LmConnection      *connection,
         lm_message_node_set_attributes (message->node, "id", id, NULL);
     }
     
+    connection_lock_id_handlers (connection);
     g_hash_table_insert (connection->id_handlers, 
                          id, lm_message_handler_ref (handler));
+    connection_unlock_id_handlers (connection);
     
     return lm_connection_send (connection, message, error);
 }
 
+/* Like lm_connection_send_with_reply() for a stanza that is already
+ * serialized with @id, takes ownership of @str */
+gboolean
+_lm_connection_send_raw_with_reply (LmConnection      *connection,
+                                    gchar             *str,
+                                    const gchar       *id,
+                                    LmMessageHandler  *handler,
+                                    GError           **error)
+{
+    connection_lock_id_handlers (connection);
+    g_hash_table_insert (connection->id_handlers,
+                         g_strdup (id), lm_message_handler_ref (handler));
+    connection_unlock_id_handlers (connection);
+
+    return connection_send_or_queue (connection, str, error);
+}
+
 /**
  * lm_connection_send_with_reply_and_block:
  * @connection: an #LmConnection
@@ -1944,7 +3961,7 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
     g_return_val_if_fail (connection != NULL, NULL);
     g_return_val_if_fail (message != NULL, NULL);
 
-    if (connection->state < LM_CONNECTION_STATE_OPENING) {
+    if (connection_get_state (connection) < LM_CONNECTION_STATE_OPENING) {
         g_set_error (error,
                      LM_ERROR,
                      LM_ERROR_CONNECTION_NOT_OPEN,
@@ -2005,6 +4022,10 @@ lm_connection_send_with_reply_and_block (LmConnection  *connection,
  * 
  * Registers a #LmMessageHandler to handle incoming messages of a certain type.
  * To unregister the handler call lm_connection_unregister_message_handler().
+ *
+ * This function may be called from any thread, also while messages are
+ * being dispatched. Messages already being dispatched are not passed to
+ * @handler.
  **/
 void
 lm_connection_register_message_handler  (LmConnection      *connection,
@@ -2012,19 +4033,11 @@ lm_connection_register_message_handler  (LmConnection      *connection,
                                          LmMessageType      type,
                                          LmHandlerPriority  priority)
 {
-    HandlerData *hd;
-    
     g_return_if_fail (connection != NULL);
     g_return_if_fail (handler != NULL);
     g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
 
-    hd = g_new0 (HandlerData, 1);
-    hd->priority = priority;
-    hd->handler  = lm_message_handler_ref (handler);
-
-    connection->handlers[type] = g_slist_insert_sorted (connection->handlers[type],
-                                                        hd, 
-                                                        (GCompareFunc) connection_handler_compare_func);
+    lm_handler_table_add (connection->handlers, type, handler, priority);
 }
 
 /**
@@ -2035,29 +4048,20 @@ lm_connection_register_message_handler  (LmConnection      *connection,
  * 
  * Unregisters a handler for @connection. @handler will no longer be called 
  * when incoming messages of @type arrive.
+ *
+ * Like lm_connection_register_message_handler() this may be called from any
+ * thread. A message already being dispatched may still reach @handler.
  **/
 void
 lm_connection_unregister_message_handler (LmConnection     *connection,
                                           LmMessageHandler *handler,
                                           LmMessageType     type)
 {
-    GSList *l;
-    
     g_return_if_fail (connection != NULL);
     g_return_if_fail (handler != NULL);
     g_return_if_fail (type != LM_MESSAGE_TYPE_UNKNOWN);
 
-    for (l = connection->handlers[type]; l; l = l->next) {
-        HandlerData *hd = (HandlerData *) l->data;
-        
-        if (handler == hd->handler) {
-            connection->handlers[type] = g_slist_remove_link (connection->handlers[type], l);
-            g_slist_free (l);
-            lm_message_handler_unref (hd->handler);
-            g_free (hd);
-            break;
-        }
-    }
+    lm_handler_table_remove (connection->handlers, type, handler);
 }
 
 /**
@@ -2097,6 +4101,7 @@ lm_connection_set_disconnect_function (LmConnection         *connection,
  * @error: Set if error was detected during sending.
  * 
  * Asynchronous call to send a raw string. Useful for debugging and testing.
+ * Like lm_connection_send() this may be called from any thread.
  * 
  * Return value: Returns #TRUE if no errors was detected during sending, 
  * #FALSE otherwise.
@@ -2109,7 +4114,7 @@ lm_connection_send_raw (LmConnection  *connection,
     g_return_val_if_fail (connection != NULL, FALSE);
     g_return_val_if_fail (str != NULL, FALSE);
 
-    return connection_send (connection, str, -1, error);
+    return connection_send_or_queue (connection, g_strdup (str), error);
 }
 /**
  * lm_connection_get_state:
@@ -2125,7 +4130,7 @@ lm_connection_get_state (LmConnection *connection)
     g_return_val_if_fail (connection != NULL, 
                           LM_CONNECTION_STATE_CLOSED);
 
-    return connection->state;
+    return connection_get_state (connection);
 }
 
 /**
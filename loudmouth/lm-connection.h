@@ -120,6 +120,18 @@ typedef enum {
     LM_CONNECTION_STATE_AUTHENTICATED
 } LmConnectionState;
 
+/**
+ * LmClientState:
+ * @LM_CLIENT_STATE_ACTIVE: Someone is using the client, the server sends everything as it comes.
+ * @LM_CLIENT_STATE_INACTIVE: Nobody is looking, the server may hold back or drop traffic of little value such as presence updates.
+ * 
+ * What the server is told about the client with Client State Indication (XEP-0352), see lm_connection_set_client_state().
+ */
+typedef enum {
+    LM_CLIENT_STATE_ACTIVE,
+    LM_CLIENT_STATE_INACTIVE
+} LmClientState;
+
 /**
  * LmResultFunction:
  * @connection: an #LmConnection
@@ -144,6 +156,34 @@ typedef void         (* LmDisconnectFunction) (LmConnection       *connection,
                                                LmDisconnectReason  reason,
                                                gpointer            user_data);
 
+/**
+ * LmSendTimes:
+ * @enqueued: when the stanza was given to lm_connection_send_with_callback()
+ * @serialized: when it had been turned into the bytes to send
+ * @written: when the last of those bytes was accepted by the kernel, or by the TLS layer and then the kernel
+ * 
+ * Timestamps of a stanza on its way out, in microseconds on the monotonic clock where there is one. Only the differences between them mean something.
+ */
+typedef struct {
+    gint64 enqueued;
+    gint64 serialized;
+    gint64 written;
+} LmSendTimes;
+
+/**
+ * LmSendFunction:
+ * @connection: an #LmConnection
+ * @success: %TRUE if the stanza was written, %FALSE if the connection closed first
+ * @times: when the stanza got where, @written is 0 unless @success
+ * @user_data: User data passed when function being called.
+ * 
+ * Callback for a stanza sent with lm_connection_send_with_callback().
+ */
+typedef void         (* LmSendFunction)       (LmConnection       *connection,
+                                               gboolean            success,
+                                               const LmSendTimes  *times,
+                                               gpointer            user_data);
+
 LmConnection *lm_connection_new               (const gchar        *server);
 LmConnection *lm_connection_new_with_context  (const gchar        *server,
                                                GMainContext       *context);
@@ -176,6 +216,27 @@ lm_connection_authenticate_and_block          (LmConnection       *connection,
 guint         lm_connection_get_keep_alive_rate (LmConnection     *connection);
 void        lm_connection_set_keep_alive_rate (LmConnection       *connection,
                                                guint               rate);
+gboolean      lm_connection_get_keep_alive_adaptive (LmConnection *connection);
+void          lm_connection_set_keep_alive_adaptive (LmConnection *connection,
+                                                     gboolean      adaptive);
+guint         lm_connection_get_keep_alive_interval (LmConnection *connection);
+guint         lm_connection_get_rtt           (LmConnection       *connection);
+guint         lm_connection_get_rtt_jitter    (LmConnection       *connection);
+gdouble       lm_connection_get_health        (LmConnection       *connection);
+gboolean      lm_connection_get_ping_responder (LmConnection      *connection);
+void          lm_connection_set_ping_responder (LmConnection      *connection,
+                                                gboolean           enabled);
+void          lm_connection_set_disco_info    (LmConnection       *connection,
+                                               LmMessageNode      *query);
+gboolean      lm_connection_get_exi           (LmConnection       *connection);
+void          lm_connection_set_exi           (LmConnection       *connection,
+                                               gboolean            use_exi);
+LmClientState lm_connection_get_client_state  (LmConnection       *connection);
+void          lm_connection_set_client_state  (LmConnection       *connection,
+                                               LmClientState       state);
+guint         lm_connection_get_inactivity_timeout (LmConnection  *connection);
+void          lm_connection_set_inactivity_timeout (LmConnection  *connection,
+                                                    guint          timeout);
 
 gboolean      lm_connection_is_open           (LmConnection       *connection);
 gboolean      lm_connection_is_authenticated  (LmConnection       *connection);
@@ -186,6 +247,9 @@ void          lm_connection_set_server        (LmConnection       *connection,
 void          lm_connection_set_jid           (LmConnection       *connection,
                                                const gchar        *jid);
 const gchar * lm_connection_get_jid           (LmConnection       *connection);
+const gchar * lm_connection_get_fast_token    (LmConnection       *connection);
+void          lm_connection_set_fast_token    (LmConnection       *connection,
+                                               const gchar        *token);
 gchar *       lm_connection_get_full_jid      (LmConnection       *connection);
 
 guint         lm_connection_get_port          (LmConnection       *connection);
@@ -201,6 +265,16 @@ void          lm_connection_set_proxy         (LmConnection       *connection,
 gboolean      lm_connection_send              (LmConnection       *connection,
                                                LmMessage          *message,
                                                GError            **error);
+gboolean      lm_connection_send_with_callback (LmConnection     *connection,
+                                                LmMessage        *message,
+                                                LmSendFunction    function,
+                                                gpointer          user_data,
+                                                GDestroyNotify    notify,
+                                                GError          **error);
+gboolean      lm_connection_send_multicast    (LmConnection       *connection,
+                                               LmMessage          *message,
+                                               const gchar       **recipients,
+                                               GError            **error);
 gboolean      lm_connection_send_with_reply   (LmConnection       *connection,
                                                LmMessage          *message,
                                                LmMessageHandler   *handler,
@@ -0,0 +1,1601 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Efficient XML Interchange for EXI compressed streams (XEP-0322).
+ *
+ * Every stanza is a document of its own in the bit-packed EXI 1.0 format
+ * without schema, using the default options: no cookie or options in the
+ * header, and comments, processing instructions, DTDs and prefixes are
+ * not preserved. Elements are described by the built-in grammars, which
+ * learn the attributes, children and text each element name has been
+ * seen with so that repeated structure costs a few bits.
+ *
+ * With session wide buffers the string tables and the learned grammars
+ * are kept from one document to the next, which is where most of the
+ * saving on small stanzas comes from. Both ends have to go through the
+ * same steps, so the decoder records what it learns while decoding a
+ * document and takes it back when the document turns out to be
+ * incomplete.
+ *
+ * The value partitions follow the valueMaxLength and
+ * valuePartitionCapacity agreed on in the setup: longer strings aren't
+ * remembered, and once the global partition is full every new string
+ * takes the place of the oldest one. The names and grammars learned
+ * from the other end have fixed limits, a peer going past them is taken
+ * for broken.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-debug.h"
+#include "lm-internals.h"
+#include "lm-parser.h"
+#include "lm-exi.h"
+
+#define EXI_NS_XML     "http://www.w3.org/XML/1998/namespace"
+#define EXI_NS_XSI     "http://www.w3.org/2001/XMLSchema-instance"
+#define EXI_NS_STREAMS "http://etherx.jabber.org/streams"
+
+/* Distinguishing bits, no options and version 1 */
+#define EXI_HEADER     0x80
+#define EXI_COOKIE     "$EXI"
+
+/* Limits on what is accepted from the other end */
+#define EXI_MAX_DEPTH       256
+#define EXI_MAX_STRING      (1024 * 1024)
+#define EXI_MAX_BUFFER      (4 * 1024 * 1024)
+#define EXI_MAX_URIS        256
+#define EXI_MAX_NAMES       8192
+#define EXI_MAX_PRODUCTIONS 65536
+
+/* Ordered like the second level of the StartTagContent event codes */
+typedef enum {
+    EXI_EE,
+    EXI_AT,
+    EXI_SE,
+    EXI_CH
+} ExiEvent;
+
+typedef struct _ExiUri   ExiUri;
+typedef struct _ExiQName ExiQName;
+
+typedef struct {
+    ExiEvent  event;
+    ExiQName *qname;    /* For AT and SE */
+} ExiProduction;
+
+struct _ExiUri {
+    gchar      *uri;
+    guint       id;
+    GPtrArray  *names;
+    GHashTable *names_by_str;
+};
+
+struct _ExiQName {
+    ExiUri    *uri;
+    gchar     *name;
+    guint      id;
+
+    /* Built-in element grammar, learned productions with the newest last.
+     * The newest one gets event code 0. */
+    GArray    *start;
+    GArray    *content;
+
+    /* Local value partition */
+    GPtrArray *values;
+};
+
+typedef struct _ExiValue ExiValue;
+
+struct _ExiValue {
+    gchar    *str;
+    guint     id;
+    ExiQName *qname;
+    guint     local_id;
+
+    /* The one that had @id before, until the document is committed */
+    ExiValue *replaced;
+};
+
+typedef enum {
+    EXI_UNDO_URI,
+    EXI_UNDO_NAME,
+    EXI_UNDO_VALUE,
+    EXI_UNDO_PRODUCTION
+} ExiUndoType;
+
+typedef struct {
+    ExiUndoType type;
+    gpointer    data;
+} ExiUndo;
+
+typedef struct {
+    GPtrArray  *uris;
+    GPtrArray  *values;
+
+    /* From the setup, -1 for no limit */
+    gint        value_max_length;
+    gint        capacity;
+    /* Global id of the next value once the partition is full */
+    guint       next_id;
+
+    /* Learned from the other end, checked against the EXI_MAX_ limits */
+    guint       n_names;
+    guint       n_productions;
+
+    /* Lookups by string, only needed when encoding */
+    GHashTable *uris_by_str;
+    GHashTable *values_by_str;
+
+    /* What was added while decoding the current document */
+    GArray     *journal;
+} ExiTables;
+
+typedef struct {
+    GString  *out;
+    guint     bits;
+    guint     n_bits;
+} ExiWriter;
+
+typedef struct {
+    const guint8 *buf;
+    gsize         len;      /* In bits */
+    gsize         pos;
+    gboolean      more;     /* Ran out of input */
+    gboolean      bad;
+} ExiReader;
+
+struct _LmExi {
+    gchar             *default_ns;
+    gboolean           session_wide;
+    gint               value_max_length;
+    gint               capacity;
+
+    ExiTables         *encoder;
+    ExiTables         *decoder;
+
+    GByteArray        *in;
+    gboolean           decoding;
+    gboolean           freed;
+
+    /* Turns serialized stanzas into nodes for encoding */
+    LmParser          *parser;
+    GString           *xml_out;
+
+    LmExiNodeFunction  function;
+    gpointer           user_data;
+};
+
+static void
+exi_journal (ExiTables *t, ExiUndoType type, gpointer data)
+{
+    ExiUndo undo;
+
+    if (!t->journal) {
+        return;
+    }
+
+    undo.type = type;
+    undo.data = data;
+    g_array_append_val (t->journal, undo);
+}
+
+static ExiUri *
+exi_add_uri (ExiTables *t, const gchar *str)
+{
+    ExiUri *uri;
+
+    uri = g_new0 (ExiUri, 1);
+    uri->uri = g_strdup (str);
+    uri->id = t->uris->len;
+    uri->names = g_ptr_array_new ();
+
+    g_ptr_array_add (t->uris, uri);
+
+    if (t->uris_by_str) {
+        uri->names_by_str = g_hash_table_new (g_str_hash, g_str_equal);
+        g_hash_table_insert (t->uris_by_str, uri->uri, uri);
+    }
+
+    exi_journal (t, EXI_UNDO_URI, uri);
+
+    return uri;
+}
+
+static ExiQName *
+exi_add_name (ExiTables *t, ExiUri *uri, const gchar *name)
+{
+    ExiQName *qname;
+
+    qname = g_new0 (ExiQName, 1);
+    qname->uri = uri;
+    qname->name = g_strdup (name);
+    qname->id = uri->names->len;
+    qname->start = g_array_new (FALSE, FALSE, sizeof (ExiProduction));
+    qname->content = g_array_new (FALSE, FALSE, sizeof (ExiProduction));
+    qname->values = g_ptr_array_new ();
+
+    g_ptr_array_add (uri->names, qname);
+    t->n_names++;
+
+    if (uri->names_by_str) {
+        g_hash_table_insert (uri->names_by_str, qname->name, qname);
+    }
+
+    exi_journal (t, EXI_UNDO_NAME, qname);
+
+    return qname;
+}
+
+static void
+exi_value_free (ExiValue *value)
+{
+    g_free (value->str);
+    g_free (value);
+}
+
+/* Takes @value out of the lookups, its local id stays taken */
+static void
+exi_evict_value (ExiTables *t, ExiValue *value)
+{
+    g_ptr_array_index (value->qname->values, value->local_id) = NULL;
+
+    if (t->values_by_str &&
+        (ExiValue *) g_hash_table_lookup (t->values_by_str,
+                                          value->str) == value) {
+        g_hash_table_remove (t->values_by_str, value->str);
+    }
+}
+
+static void
+exi_add_value (ExiTables *t, ExiQName *qname, const gchar *str)
+{
+    ExiValue *value;
+
+    if (t->capacity == 0 ||
+        (t->value_max_length >= 0 &&
+         g_utf8_strlen (str, -1) > t->value_max_length)) {
+        return;
+    }
+
+    value = g_new0 (ExiValue, 1);
+    value->str = g_strdup (str);
+    value->qname = qname;
+    value->local_id = qname->values->len;
+
+    g_ptr_array_add (qname->values, value);
+
+    if (t->capacity < 0 || t->values->len < (guint) t->capacity) {
+        value->id = t->values->len;
+        g_ptr_array_add (t->values, value);
+    } else {
+        /* Full, the oldest one makes room */
+        value->id = t->next_id;
+        value->replaced = g_ptr_array_index (t->values, value->id);
+        exi_evict_value (t, value->replaced);
+        g_ptr_array_index (t->values, value->id) = value;
+    }
+
+    if (t->capacity > 0) {
+        t->next_id = (value->id + 1) % t->capacity;
+    }
+
+    if (t->values_by_str) {
+        g_hash_table_replace (t->values_by_str, value->str, value);
+    }
+
+    if (t->journal) {
+        exi_journal (t, EXI_UNDO_VALUE, value);
+    } else if (value->replaced) {
+        exi_value_free (value->replaced);
+        value->replaced = NULL;
+    }
+}
+
+static void
+exi_learn (ExiTables *t, GArray *grammar, ExiEvent event, ExiQName *qname)
+{
+    ExiProduction production;
+
+    production.event = event;
+    production.qname = qname;
+    g_array_append_val (grammar, production);
+    t->n_productions++;
+
+    exi_journal (t, EXI_UNDO_PRODUCTION, grammar);
+}
+
+static void
+exi_qname_free (ExiQName *qname)
+{
+    g_free (qname->name);
+    g_array_free (qname->start, TRUE);
+    g_array_free (qname->content, TRUE);
+    g_ptr_array_free (qname->values, TRUE);
+    g_free (qname);
+}
+
+static void
+exi_uri_free (ExiUri *uri)
+{
+    guint i;
+
+    for (i = 0; i < uri->names->len; ++i) {
+        exi_qname_free (g_ptr_array_index (uri->names, i));
+    }
+
+    if (uri->names_by_str) {
+        g_hash_table_destroy (uri->names_by_str);
+    }
+
+    g_ptr_array_free (uri->names, TRUE);
+    g_free (uri->uri);
+    g_free (uri);
+}
+
+static ExiTables *
+exi_tables_new (LmExi *exi, gboolean encoding)
+{
+    ExiTables *t;
+    ExiUri    *uri;
+
+    t = g_new0 (ExiTables, 1);
+    t->uris = g_ptr_array_new ();
+    t->values = g_ptr_array_new ();
+    t->value_max_length = exi->value_max_length;
+    t->capacity = exi->capacity;
+
+    if (encoding) {
+        t->uris_by_str = g_hash_table_new (g_str_hash, g_str_equal);
+        t->values_by_str = g_hash_table_new (g_str_hash, g_str_equal);
+    }
+
+    /* Initial entries of the string table, EXI 1.0 appendix D */
+    exi_add_uri (t, "");
+
+    uri = exi_add_uri (t, EXI_NS_XML);
+    exi_add_name (t, uri, "base");
+    exi_add_name (t, uri, "id");
+    exi_add_name (t, uri, "lang");
+    exi_add_name (t, uri, "space");
+
+    uri = exi_add_uri (t, EXI_NS_XSI);
+    exi_add_name (t, uri, "nil");
+    exi_add_name (t, uri, "type");
+
+    if (!encoding) {
+        t->journal = g_array_new (FALSE, FALSE, sizeof (ExiUndo));
+    }
+
+    return t;
+}
+
+/* The document decoded is complete, what it replaced is gone for good */
+static void
+exi_tables_commit (ExiTables *t)
+{
+    guint i;
+
+    for (i = 0; i < t->journal->len; ++i) {
+        ExiUndo *undo = &g_array_index (t->journal, ExiUndo, i);
+
+        if (undo->type == EXI_UNDO_VALUE) {
+            ExiValue *value = undo->data;
+
+            if (value->replaced) {
+                exi_value_free (value->replaced);
+                value->replaced = NULL;
+            }
+        }
+    }
+
+    g_array_set_size (t->journal, 0);
+}
+
+static void
+exi_tables_free (ExiTables *t)
+{
+    guint i;
+
+    if (t->journal) {
+        exi_tables_commit (t);
+    }
+
+    for (i = 0; i < t->values->len; ++i) {
+        exi_value_free (g_ptr_array_index (t->values, i));
+    }
+
+    for (i = 0; i < t->uris->len; ++i) {
+        exi_uri_free (g_ptr_array_index (t->uris, i));
+    }
+
+    if (t->uris_by_str) {
+        g_hash_table_destroy (t->uris_by_str);
+        g_hash_table_destroy (t->values_by_str);
+    }
+
+    if (t->journal) {
+        g_array_free (t->journal, TRUE);
+    }
+
+    g_ptr_array_free (t->uris, TRUE);
+    g_ptr_array_free (t->values, TRUE);
+    g_free (t);
+}
+
+/* Undoes everything added since the last commit, newest first so that
+ * names go before their URI and values before their qname */
+static void
+exi_tables_rollback (ExiTables *t)
+{
+    while (t->journal->len > 0) {
+        ExiUndo *undo;
+
+        undo = &g_array_index (t->journal, ExiUndo, t->journal->len - 1);
+
+        switch (undo->type) {
+        case EXI_UNDO_URI: {
+            ExiUri *uri = undo->data;
+
+            g_ptr_array_remove_index (t->uris, uri->id);
+            exi_uri_free (uri);
+            break;
+        }
+        case EXI_UNDO_NAME: {
+            ExiQName *qname = undo->data;
+
+            g_ptr_array_remove_index (qname->uri->names, qname->id);
+            exi_qname_free (qname);
+            t->n_names--;
+            break;
+        }
+        case EXI_UNDO_VALUE: {
+            ExiValue *value = undo->data;
+            ExiValue *old = value->replaced;
+
+            g_ptr_array_remove_index (value->qname->values, value->local_id);
+
+            if (old) {
+                g_ptr_array_index (t->values, value->id) = old;
+                g_ptr_array_index (old->qname->values, old->local_id) = old;
+            } else {
+                g_ptr_array_remove_index (t->values, value->id);
+            }
+
+            if (t->capacity > 0) {
+                t->next_id = value->id;
+            }
+
+            exi_value_free (value);
+            break;
+        }
+        case EXI_UNDO_PRODUCTION: {
+            GArray *grammar = undo->data;
+
+            g_array_set_size (grammar, grammar->len - 1);
+            t->n_productions--;
+            break;
+        }
+        }
+
+        g_array_set_size (t->journal, t->journal->len - 1);
+    }
+}
+
+/* Number of bits needed for @n different codes */
+static guint
+exi_width (guint n)
+{
+    guint width = 0;
+
+    while (width < 32 && (1U << width) < n) {
+        width++;
+    }
+
+    return width;
+}
+
+static void
+exi_write_bits (ExiWriter *w, guint value, guint n_bits)
+{
+    while (n_bits > 0) {
+        n_bits--;
+
+        w->bits = (w->bits << 1) | ((value >> n_bits) & 1);
+        if (++w->n_bits == 8) {
+            g_string_append_c (w->out, (gchar) w->bits);
+            w->bits = 0;
+            w->n_bits = 0;
+        }
+    }
+}
+
+/* Pads the document to a whole byte */
+static void
+exi_write_flush (ExiWriter *w)
+{
+    if (w->n_bits > 0) {
+        exi_write_bits (w, 0, 8 - w->n_bits);
+    }
+}
+
+/* Seven bits at a time, least significant first, with the top bit of
+ * each octet telling whether another one follows */
+static void
+exi_write_uint (ExiWriter *w, guint value)
+{
+    do {
+        guint octet = value & 0x7f;
+
+        value >>= 7;
+        if (value) {
+            octet |= 0x80;
+        }
+
+        exi_write_bits (w, octet, 8);
+    } while (value);
+}
+
+/* Length and code points of @str, which may come from anywhere so bytes
+ * that aren't UTF-8 are sent as U+FFFD */
+static void
+exi_write_string (ExiWriter *w, const gchar *str, guint offset)
+{
+    const gchar *p;
+    const gchar *end;
+    guint        len = 0;
+
+    end = str + strlen (str);
+
+    for (p = str; p < end; len++) {
+        gunichar c = g_utf8_get_char_validated (p, end - p);
+
+        p = (c == (gunichar) -1 || c == (gunichar) -2) ?
+            p + 1 : g_utf8_next_char (p);
+    }
+
+    exi_write_uint (w, len + offset);
+
+    for (p = str; p < end;) {
+        gunichar c = g_utf8_get_char_validated (p, end - p);
+
+        if (c == (gunichar) -1 || c == (gunichar) -2) {
+            exi_write_uint (w, 0xfffd);
+            p++;
+        } else {
+            exi_write_uint (w, c);
+            p = g_utf8_next_char (p);
+        }
+    }
+}
+
+static guint
+exi_read_bits (ExiReader *r, guint n_bits)
+{
+    guint value = 0;
+
+    if (r->more || r->bad) {
+        return 0;
+    }
+
+    if (r->pos + n_bits > r->len) {
+        r->more = TRUE;
+        return 0;
+    }
+
+    while (n_bits-- > 0) {
+        value = (value << 1) | ((r->buf[r->pos >> 3] >> (7 - (r->pos & 7))) & 1);
+        r->pos++;
+    }
+
+    return value;
+}
+
+static guint
+exi_read_uint (ExiReader *r)
+{
+    guint value = 0;
+    guint shift = 0;
+    guint octet;
+
+    do {
+        octet = exi_read_bits (r, 8);
+
+        if (shift > 28 || (shift == 28 && (octet & 0x7f) > 0xf)) {
+            r->bad = TRUE;
+            return 0;
+        }
+
+        value |= (octet & 0x7f) << shift;
+        shift += 7;
+    } while (octet & 0x80);
+
+    return value;
+}
+
+static gboolean
+exi_reader_failed (ExiReader *r)
+{
+    return r->more || r->bad;
+}
+
+/* Reads @len code points */
+static gchar *
+exi_read_chars (ExiReader *r, guint len)
+{
+    GString *str;
+
+    if (len > EXI_MAX_STRING) {
+        r->bad = TRUE;
+        return NULL;
+    }
+
+    /* Every code point takes at least a byte */
+    if (len > (r->len - r->pos) / 8) {
+        r->more = TRUE;
+        return NULL;
+    }
+
+    str = g_string_sized_new (len);
+
+    while (len-- > 0) {
+        gunichar c = exi_read_uint (r);
+
+        if (exi_reader_failed (r)) {
+            break;
+        }
+
+        if (c == 0 || !g_unichar_validate (c)) {
+            r->bad = TRUE;
+            break;
+        }
+
+        g_string_append_unichar (str, c);
+    }
+
+    if (exi_reader_failed (r)) {
+        g_string_free (str, TRUE);
+        return NULL;
+    }
+
+    return g_string_free (str, FALSE);
+}
+
+static ExiQName *
+exi_write_qname (ExiTables   *t,
+                 ExiWriter   *w,
+                 const gchar *uri_str,
+                 const gchar *name)
+{
+    ExiUri   *uri;
+    ExiQName *qname;
+    guint     width;
+
+    width = exi_width (t->uris->len + 1);
+
+    uri = g_hash_table_lookup (t->uris_by_str, uri_str);
+    if (uri) {
+        exi_write_bits (w, uri->id + 1, width);
+    } else {
+        exi_write_bits (w, 0, width);
+        exi_write_string (w, uri_str, 0);
+        uri = exi_add_uri (t, uri_str);
+    }
+
+    qname = g_hash_table_lookup (uri->names_by_str, name);
+    if (qname) {
+        exi_write_uint (w, 0);
+        exi_write_bits (w, qname->id, exi_width (uri->names->len));
+    } else {
+        exi_write_string (w, name, 1);
+        qname = exi_add_name (t, uri, name);
+    }
+
+    return qname;
+}
+
+static ExiQName *
+exi_read_qname (ExiTables *t, ExiReader *r)
+{
+    ExiUri *uri;
+    guint   id;
+    guint   len;
+
+    id = exi_read_bits (r, exi_width (t->uris->len + 1));
+    if (exi_reader_failed (r)) {
+        return NULL;
+    }
+
+    if (id > 0) {
+        if (id > t->uris->len) {
+            r->bad = TRUE;
+            return NULL;
+        }
+
+        uri = g_ptr_array_index (t->uris, id - 1);
+    } else {
+        gchar *str;
+
+        if (t->uris->len >= EXI_MAX_URIS) {
+            r->bad = TRUE;
+            return NULL;
+        }
+
+        str = exi_read_chars (r, exi_read_uint (r));
+        if (!str) {
+            return NULL;
+        }
+
+        uri = exi_add_uri (t, str);
+        g_free (str);
+    }
+
+    len = exi_read_uint (r);
+    if (exi_reader_failed (r)) {
+        return NULL;
+    }
+
+    if (len == 0) {
+        id = exi_read_bits (r, exi_width (uri->names->len));
+        if (exi_reader_failed (r)) {
+            return NULL;
+        }
+
+        if (id >= uri->names->len) {
+            r->bad = TRUE;
+            return NULL;
+        }
+
+        return g_ptr_array_index (uri->names, id);
+    } else {
+        ExiQName *qname;
+        gchar    *name;
+
+        if (t->n_names >= EXI_MAX_NAMES) {
+            r->bad = TRUE;
+            return NULL;
+        }
+
+        name = exi_read_chars (r, len - 1);
+        if (!name) {
+            return NULL;
+        }
+
+        qname = exi_add_name (t, uri, name);
+        g_free (name);
+
+        return qname;
+    }
+}
+
+/* A hit in the local partition of @qname, a hit in the global one, or
+ * the string itself which then goes into both */
+static void
+exi_write_value (ExiTables   *t,
+                 ExiWriter   *w,
+                 ExiQName    *qname,
+                 const gchar *str)
+{
+    ExiValue *value;
+
+    value = g_hash_table_lookup (t->values_by_str, str);
+
+    if (value && value->qname == qname) {
+        exi_write_uint (w, 0);
+        exi_write_bits (w, value->local_id, exi_width (qname->values->len));
+    }
+    else if (value) {
+        exi_write_uint (w, 1);
+        exi_write_bits (w, value->id, exi_width (t->values->len));
+    } else {
+        exi_write_string (w, str, 2);
+
+        if (*str) {
+            exi_add_value (t, qname, str);
+        }
+    }
+}
+
+static gchar *
+exi_read_value (ExiTables *t, ExiReader *r, ExiQName *qname)
+{
+    GPtrArray *partition;
+    ExiValue  *value;
+    guint      code;
+    guint      id;
+    gchar     *str;
+
+    code = exi_read_uint (r);
+    if (exi_reader_failed (r)) {
+        return NULL;
+    }
+
+    if (code >= 2) {
+        str = exi_read_chars (r, code - 2);
+        if (str && *str) {
+            exi_add_value (t, qname, str);
+        }
+
+        return str;
+    }
+
+    partition = code == 0 ? qname->values : t->values;
+
+    id = exi_read_bits (r, exi_width (partition->len));
+    if (exi_reader_failed (r)) {
+        return NULL;
+    }
+
+    if (id >= partition->len) {
+        r->bad = TRUE;
+        return NULL;
+    }
+
+    value = g_ptr_array_index (partition, id);
+    if (!value) {
+        /* Replaced since, the other end can't know it any more */
+        r->bad = TRUE;
+        return NULL;
+    }
+
+    return g_strdup (value->str);
+}
+
+/* Writes the event code for @event in the current grammar of @element
+ * and learns from it. The qname of AT and SE events is written when it
+ * isn't known from an earlier production and is returned either way. */
+static ExiQName *
+exi_write_event (ExiTables   *t,
+                 ExiWriter   *w,
+                 ExiQName    *element,
+                 gboolean     start,
+                 ExiEvent     event,
+                 const gchar *uri,
+                 const gchar *name)
+{
+    GArray   *grammar;
+    ExiQName *qname = NULL;
+    guint     n;
+    gint      i;
+
+    grammar = start ? element->start : element->content;
+    n = grammar->len;
+
+    if (uri) {
+        ExiUri *u = g_hash_table_lookup (t->uris_by_str, uri);
+
+        qname = u ? g_hash_table_lookup (u->names_by_str, name) : NULL;
+    }
+
+    if (!uri || qname) {
+        for (i = n - 1; i >= 0; --i) {
+            ExiProduction *p = &g_array_index (grammar, ExiProduction, i);
+
+            if (p->event == event && p->qname == qname) {
+                exi_write_bits (w, n - 1 - i,
+                                exi_width (start ? n + 1 : n + 2));
+                return qname;
+            }
+        }
+    }
+
+    if (start) {
+        exi_write_bits (w, n, exi_width (n + 1));
+        exi_write_bits (w, event, 2);
+    }
+    else if (event == EXI_EE) {
+        /* Always there in ElementContent, nothing to learn */
+        exi_write_bits (w, n, exi_width (n + 2));
+        return NULL;
+    } else {
+        exi_write_bits (w, n + 1, exi_width (n + 2));
+        exi_write_bits (w, event == EXI_CH, 1);
+    }
+
+    if (uri) {
+        qname = exi_write_qname (t, w, uri, name);
+    }
+
+    exi_learn (t, grammar, event, qname);
+
+    return qname;
+}
+
+static ExiEvent
+exi_read_event (ExiTables  *t,
+                ExiReader  *r,
+                ExiQName   *element,
+                gboolean    start,
+                ExiQName  **qname)
+{
+    GArray   *grammar;
+    ExiEvent  event;
+    guint     n;
+    guint     code;
+
+    grammar = start ? element->start : element->content;
+    n = grammar->len;
+    *qname = NULL;
+
+    code = exi_read_bits (r, exi_width (start ? n + 1 : n + 2));
+    if (exi_reader_failed (r)) {
+        return EXI_EE;
+    }
+
+    if (code < n) {
+        ExiProduction *p;
+
+        p = &g_array_index (grammar, ExiProduction, n - 1 - code);
+        *qname = p->qname;
+
+        return p->event;
+    }
+
+    if (start && code == n) {
+        event = exi_read_bits (r, 2);
+    }
+    else if (!start && code == n) {
+        return EXI_EE;
+    }
+    else if (!start && code == n + 1) {
+        event = exi_read_bits (r, 1) ? EXI_CH : EXI_SE;
+    } else {
+        r->bad = TRUE;
+        return EXI_EE;
+    }
+
+    if (event == EXI_AT || event == EXI_SE) {
+        *qname = exi_read_qname (t, r);
+    }
+
+    if (t->n_productions >= EXI_MAX_PRODUCTIONS) {
+        r->bad = TRUE;
+    }
+
+    if (!exi_reader_failed (r)) {
+        exi_learn (t, grammar, event, *qname);
+    }
+
+    return event;
+}
+
+static gboolean
+exi_node_has_raw_mode (LmMessageNode *node)
+{
+    LmMessageNode *child;
+
+    if (node->raw_mode) {
+        return TRUE;
+    }
+
+    for (child = node->children; child; child = child->next) {
+        if (exi_node_has_raw_mode (child)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static const gchar *
+exi_local_name (const gchar *name)
+{
+    const gchar *colon;
+
+    colon = strchr (name, ':');
+
+    return colon ? colon + 1 : name;
+}
+
+static const gchar *
+exi_node_uri (LmExi *exi, LmMessageNode *node)
+{
+    const gchar *ns;
+
+    ns = _lm_message_node_get_ns (node);
+    if (ns) {
+        return ns;
+    }
+
+    if (strncmp (node->name, "stream:", 7) == 0) {
+        return EXI_NS_STREAMS;
+    }
+
+    return exi->default_ns;
+}
+
+/* Namespace and local part of the attribute @key of @node */
+static const gchar *
+exi_attribute_uri (LmMessageNode  *node,
+                   const gchar    *key,
+                   const gchar   **local)
+{
+    LmMessageNode *l;
+    const gchar   *colon;
+    const gchar   *ns = NULL;
+    gchar         *attribute;
+
+    *local = key;
+
+    colon = strchr (key, ':');
+    if (!colon) {
+        return "";
+    }
+
+    if (colon - key == 3 && strncmp (key, "xml", 3) == 0) {
+        *local = colon + 1;
+        return EXI_NS_XML;
+    }
+
+    attribute = g_strconcat ("xmlns:", key, NULL);
+    attribute[6 + (colon - key)] = '\0';
+
+    for (l = node; l && !ns; l = l->parent) {
+        ns = lm_message_node_get_attribute (l, attribute);
+    }
+
+    g_free (attribute);
+
+    if (!ns) {
+        return "";
+    }
+
+    *local = colon + 1;
+
+    return ns;
+}
+
+typedef struct {
+    LmExi          *exi;
+    ExiWriter      *w;
+    LmMessageNode  *node;
+    ExiQName       *element;
+} ExiAttributeData;
+
+static void
+exi_encode_attribute (const gchar      *key,
+                      const gchar      *value,
+                      ExiAttributeData *data)
+{
+    ExiTables   *t = data->exi->encoder;
+    ExiQName    *qname;
+    const gchar *uri;
+    const gchar *local;
+
+    /* Namespace declarations are carried by the qnames */
+    if (strcmp (key, "xmlns") == 0 || strncmp (key, "xmlns:", 6) == 0) {
+        return;
+    }
+
+    uri = exi_attribute_uri (data->node, key, &local);
+
+    qname = exi_write_event (t, data->w, data->element, TRUE, EXI_AT,
+                             uri, local);
+    exi_write_value (t, data->w, qname, value);
+}
+
+static void
+exi_encode_element (LmExi         *exi,
+                    ExiWriter     *w,
+                    LmMessageNode *node,
+                    ExiQName      *element)
+{
+    ExiTables        *t = exi->encoder;
+    ExiAttributeData  data;
+    LmMessageNode    *child;
+    gboolean          start = TRUE;
+
+    data.exi = exi;
+    data.w = w;
+    data.node = node;
+    data.element = element;
+
+    _lm_message_node_foreach_attribute (node, (GHFunc) exi_encode_attribute,
+                                        &data);
+
+    if (node->value && *node->value) {
+        exi_write_event (t, w, element, start, EXI_CH, NULL, NULL);
+        exi_write_value (t, w, element, node->value);
+        start = FALSE;
+    }
+
+    for (child = node->children; child; child = child->next) {
+        ExiQName *qname;
+
+        qname = exi_write_event (t, w, element, start, EXI_SE,
+                                 exi_node_uri (exi, child),
+                                 exi_local_name (child->name));
+        start = FALSE;
+
+        exi_encode_element (exi, w, child, qname);
+    }
+
+    exi_write_event (t, w, element, start, EXI_EE, NULL, NULL);
+}
+
+static void
+exi_encode_document (LmExi *exi, LmMessageNode *node, GString *out)
+{
+    ExiWriter  w;
+    ExiQName  *qname;
+
+    if (!exi->session_wide) {
+        exi_tables_free (exi->encoder);
+        exi->encoder = exi_tables_new (exi, TRUE);
+    }
+
+    w.out = out;
+    w.bits = 0;
+    w.n_bits = 0;
+
+    exi_write_bits (&w, EXI_HEADER, 8);
+
+    /* The document grammar has nothing but SE(*), which takes no bits */
+    qname = exi_write_qname (exi->encoder, &w, exi_node_uri (exi, node),
+                             exi_local_name (node->name));
+    exi_encode_element (exi, &w, node, qname);
+
+    exi_write_flush (&w);
+}
+
+static const gchar *
+exi_decoded_uri (LmExi *exi, LmMessageNode *node)
+{
+    const gchar *ns;
+
+    if (!node) {
+        return exi->default_ns;
+    }
+
+    ns = _lm_message_node_get_ns (node);
+
+    return ns ? ns : "";
+}
+
+/* Names the node like the XML parser would have, declaring the
+ * namespace where it changes */
+static LmMessageNode *
+exi_new_node (LmExi *exi, ExiQName *qname, LmMessageNode *parent)
+{
+    LmMessageNode *node;
+    const gchar   *uri = qname->uri->uri;
+
+    if (strcmp (uri, EXI_NS_STREAMS) == 0) {
+        gchar *name;
+
+        name = g_strconcat ("stream:", qname->name, NULL);
+        node = _lm_message_node_new (name);
+        g_free (name);
+    } else {
+        node = _lm_message_node_new (qname->name);
+
+        if (strcmp (uri, exi_decoded_uri (exi, parent)) != 0) {
+            lm_message_node_set_attribute (node, "xmlns", uri);
+        }
+    }
+
+    if (*uri) {
+        _lm_message_node_set_ns (node, g_quark_try_string (uri), uri);
+    }
+
+    if (parent) {
+        _lm_message_node_add_child_node (parent, node);
+        lm_message_node_unref (node);
+    }
+
+    return node;
+}
+
+/* Attributes come in the order they are stored on the encoding side,
+ * @attributes has them the other way round as name and value pairs.
+ * Setting them in that order restores the original one. */
+static void
+exi_set_attributes (LmMessageNode *node, GSList **attributes)
+{
+    GSList *l;
+
+    for (l = *attributes; l; l = l->next->next) {
+        lm_message_node_set_attribute (node, l->data, l->next->data);
+        g_free (l->data);
+        g_free (l->next->data);
+    }
+
+    g_slist_free (*attributes);
+    *attributes = NULL;
+}
+
+static void
+exi_add_attribute (GSList      **attributes,
+                   ExiQName     *qname,
+                   gchar        *value,
+                   guint        *n_prefixes)
+{
+    const gchar *uri = qname->uri->uri;
+    gchar       *name;
+
+    if (!*uri) {
+        name = g_strdup (qname->name);
+    }
+    else if (strcmp (uri, EXI_NS_XML) == 0) {
+        name = g_strconcat ("xml:", qname->name, NULL);
+    } else {
+        gchar *prefix;
+
+        prefix = g_strdup_printf ("ns%u", (*n_prefixes)++);
+        name = g_strconcat (prefix, ":", qname->name, NULL);
+
+        *attributes = g_slist_prepend (*attributes, g_strdup (uri));
+        *attributes = g_slist_prepend (*attributes,
+                                       g_strconcat ("xmlns:", prefix, NULL));
+        g_free (prefix);
+    }
+
+    *attributes = g_slist_prepend (*attributes, value);
+    *attributes = g_slist_prepend (*attributes, name);
+}
+
+/* Returns the element, which belongs to @parent if there is one. NULL
+ * and @r marked when the document is cut short or broken. */
+static LmMessageNode *
+exi_decode_element (LmExi         *exi,
+                    ExiReader     *r,
+                    ExiQName      *element,
+                    LmMessageNode *parent,
+                    guint          depth)
+{
+    ExiTables     *t = exi->decoder;
+    LmMessageNode *node;
+    GSList        *attributes = NULL;
+    guint          n_prefixes = 0;
+    gboolean       start = TRUE;
+
+    if (depth > EXI_MAX_DEPTH) {
+        r->bad = TRUE;
+        return NULL;
+    }
+
+    node = exi_new_node (exi, element, parent);
+
+    while (TRUE) {
+        ExiQName *qname;
+        ExiEvent  event;
+        gchar    *value;
+
+        event = exi_read_event (t, r, element, start, &qname);
+        if (exi_reader_failed (r)) {
+            break;
+        }
+
+        if (event == EXI_AT) {
+            value = exi_read_value (t, r, qname);
+            if (!value) {
+                break;
+            }
+
+            exi_add_attribute (&attributes, qname, value, &n_prefixes);
+            continue;
+        }
+
+        if (start) {
+            exi_set_attributes (node, &attributes);
+            start = FALSE;
+        }
+
+        if (event == EXI_EE) {
+            return node;
+        }
+
+        if (event == EXI_SE) {
+            if (!exi_decode_element (exi, r, qname, node, depth + 1)) {
+                break;
+            }
+        } else {
+            value = exi_read_value (t, r, element);
+            if (!value) {
+                break;
+            }
+
+            if (node->value) {
+                gchar *str;
+
+                str = g_strconcat (node->value, value, NULL);
+                lm_message_node_set_value (node, str);
+                g_free (str);
+            } else {
+                lm_message_node_set_value (node, value);
+            }
+
+            g_free (value);
+        }
+    }
+
+    /* Set or not, the strings go */
+    exi_set_attributes (node, &attributes);
+
+    if (!parent) {
+        lm_message_node_unref (node);
+    }
+
+    return NULL;
+}
+
+static LmMessageNode *
+exi_decode_document (LmExi *exi, ExiReader *r)
+{
+    LmMessageNode *node;
+    ExiQName      *qname;
+
+    if (r->len >= 8 && r->buf[0] == EXI_COOKIE[0]) {
+        if (r->len < 32) {
+            r->more = TRUE;
+            return NULL;
+        }
+
+        if (memcmp (r->buf, EXI_COOKIE, 4) != 0) {
+            r->bad = TRUE;
+            return NULL;
+        }
+
+        r->pos = 32;
+    }
+
+    /* Only the header we send ourselves is understood */
+    if (exi_read_bits (r, 8) != EXI_HEADER) {
+        if (!r->more) {
+            r->bad = TRUE;
+        }
+        return NULL;
+    }
+
+    qname = exi_read_qname (exi->decoder, r);
+    if (!qname) {
+        return NULL;
+    }
+
+    node = exi_decode_element (exi, r, qname, NULL, 1);
+    if (node) {
+        r->pos = (r->pos + 7) & ~((gsize) 7);
+    }
+
+    return node;
+}
+
+static void
+exi_parser_message_cb (LmParser *parser, LmMessage *m, LmExi *exi)
+{
+    /* The stream header set up by exi_parser_start () */
+    if (lm_message_get_type (m) == LM_MESSAGE_TYPE_STREAM) {
+        return;
+    }
+
+    if (exi->xml_out) {
+        exi_encode_document (exi, m->node, exi->xml_out);
+    }
+}
+
+static void
+exi_parser_node_cb (LmParser *parser, LmMessageNode *node, LmExi *exi)
+{
+    if (exi->xml_out) {
+        exi_encode_document (exi, node, exi->xml_out);
+    }
+}
+
+/* Stanzas on their own are parsed as if they were in a stream, which
+ * gives them its default namespace */
+static void
+exi_parser_start (LmExi *exi)
+{
+    gchar *header;
+
+    header = g_strdup_printf ("<stream:stream xmlns='%s' "
+                              "xmlns:stream='" EXI_NS_STREAMS "'>",
+                              exi->default_ns);
+    lm_parser_parse (exi->parser, header);
+    g_free (header);
+}
+
+/* @default_ns is the namespace of stanzas that don't declare one, with
+ * @session_wide the tables are shared by all documents. @function is
+ * called with what _lm_exi_decode () finds. */
+LmExi *
+_lm_exi_new (const gchar       *default_ns,
+             gboolean           session_wide,
+             LmExiNodeFunction  function,
+             gpointer           user_data)
+{
+    LmExi *exi;
+
+    g_return_val_if_fail (default_ns != NULL, NULL);
+
+    exi = g_new0 (LmExi, 1);
+    exi->default_ns = g_strdup (default_ns);
+    exi->session_wide = session_wide;
+    exi->value_max_length = -1;
+    exi->capacity = -1;
+    exi->encoder = exi_tables_new (exi, TRUE);
+    exi->decoder = exi_tables_new (exi, FALSE);
+    exi->in = g_byte_array_new ();
+    exi->function = function;
+    exi->user_data = user_data;
+
+    exi->parser = lm_parser_new ((LmParserMessageFunction) exi_parser_message_cb,
+                                 exi, NULL);
+    lm_parser_set_node_function (exi->parser,
+                                 (LmParserNodeFunction) exi_parser_node_cb);
+    exi_parser_start (exi);
+
+    return exi;
+}
+
+/* The valueMaxLength and valuePartitionCapacity from the setup, -1 for
+ * the EXI default of no limit. Only before the first document. */
+void
+_lm_exi_set_value_limits (LmExi *exi, gint max_length, gint capacity)
+{
+    g_return_if_fail (exi != NULL);
+
+    exi->value_max_length = max_length;
+    exi->capacity = capacity;
+
+    exi->encoder->value_max_length = max_length;
+    exi->encoder->capacity = capacity;
+    exi->decoder->value_max_length = max_length;
+    exi->decoder->capacity = capacity;
+}
+
+void
+_lm_exi_free (LmExi *exi)
+{
+    g_return_if_fail (exi != NULL);
+
+    /* Freed from the node function, _lm_exi_decode () finishes it */
+    if (exi->decoding) {
+        exi->freed = TRUE;
+        return;
+    }
+
+    exi_tables_free (exi->encoder);
+    exi_tables_free (exi->decoder);
+    g_byte_array_free (exi->in, TRUE);
+    lm_parser_free (exi->parser);
+    g_free (exi->default_ns);
+    g_free (exi);
+}
+
+/* Takes the next @len bytes of the stream. Returns FALSE when they
+ * aren't valid EXI, the rest of the stream can't be decoded then. */
+gboolean
+_lm_exi_decode (LmExi *exi, const gchar *buf, gsize len)
+{
+    gboolean result = TRUE;
+
+    g_return_val_if_fail (exi != NULL, FALSE);
+
+    if (exi->in->len + len > EXI_MAX_BUFFER) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+               "EXI document too large\n");
+        g_byte_array_set_size (exi->in, 0);
+        return FALSE;
+    }
+
+    g_byte_array_append (exi->in, (const guint8 *) buf, len);
+
+    exi->decoding = TRUE;
+
+    while (exi->in->len > 0 && !exi->freed) {
+        ExiReader      r;
+        LmMessageNode *node;
+
+        if (!exi->session_wide) {
+            exi_tables_free (exi->decoder);
+            exi->decoder = exi_tables_new (exi, FALSE);
+        }
+
+        memset (&r, 0, sizeof (ExiReader));
+        r.buf = exi->in->data;
+        r.len = (gsize) exi->in->len * 8;
+
+        node = exi_decode_document (exi, &r);
+        if (!node) {
+            exi_tables_rollback (exi->decoder);
+
+            if (r.bad) {
+                g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+                       "Invalid EXI document\n");
+                g_byte_array_set_size (exi->in, 0);
+                result = FALSE;
+            }
+
+            break;
+        }
+
+        exi_tables_commit (exi->decoder);
+        g_byte_array_remove_range (exi->in, 0, r.pos / 8);
+
+        if (exi->function) {
+            (* exi->function) (exi, node, exi->user_data);
+        }
+
+        lm_message_node_unref (node);
+    }
+
+    exi->decoding = FALSE;
+
+    if (exi->freed) {
+        _lm_exi_free (exi);
+    }
+
+    return result;
+}
+
+/* Appends @node as an EXI document to @out */
+void
+_lm_exi_encode (LmExi *exi, LmMessageNode *node, GString *out)
+{
+    g_return_if_fail (exi != NULL);
+    g_return_if_fail (node != NULL);
+    g_return_if_fail (out != NULL);
+
+    /* Raw values are markup the encoder can only see once it is parsed */
+    if (exi_node_has_raw_mode (node)) {
+        gchar *str;
+
+        str = lm_message_node_to_string (node);
+        _lm_exi_encode_xml (exi, str, -1, out);
+        g_free (str);
+        return;
+    }
+
+    exi_encode_document (exi, node, out);
+}
+
+/* Appends each complete element in @str as a document of its own to
+ * @out. Elements may be split over several calls. */
+gboolean
+_lm_exi_encode_xml (LmExi       *exi,
+                    const gchar *str,
+                    gssize       len,
+                    GString     *out)
+{
+    gboolean result;
+
+    g_return_val_if_fail (exi != NULL, FALSE);
+    g_return_val_if_fail (str != NULL, FALSE);
+    g_return_val_if_fail (out != NULL, FALSE);
+
+    if (len < 0) {
+        len = strlen (str);
+    }
+
+    exi->xml_out = out;
+    result = lm_parser_parse_len (exi->parser, str, len);
+    exi->xml_out = NULL;
+
+    if (!result) {
+        /* The parser starts over with a new context */
+        exi_parser_start (exi);
+    }
+
+    return result;
+}
@@ -0,0 +1,65 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_EXI_H__
+#define __LM_EXI_H__
+
+#include <glib.h>
+
+#include "lm-message-node.h"
+
+G_BEGIN_DECLS
+
+#define LM_EXI_NS "http://jabber.org/protocol/compress/exi"
+
+/* What is asked for in the setup, the most accepted from the other end */
+#define LM_EXI_VALUE_MAX_LENGTH          256
+#define LM_EXI_VALUE_PARTITION_CAPACITY  4096
+
+typedef struct _LmExi LmExi;
+
+/* Called with the root of every document decoded, the node is only valid
+ * during the call */
+typedef void (* LmExiNodeFunction) (LmExi         *exi,
+                                    LmMessageNode *node,
+                                    gpointer       user_data);
+
+LmExi *  _lm_exi_new        (const gchar       *default_ns,
+                             gboolean           session_wide,
+                             LmExiNodeFunction  function,
+                             gpointer           user_data);
+void     _lm_exi_set_value_limits (LmExi       *exi,
+                                   gint         max_length,
+                                   gint         capacity);
+void     _lm_exi_free       (LmExi             *exi);
+gboolean _lm_exi_decode     (LmExi             *exi,
+                             const gchar       *buf,
+                             gsize              len);
+void     _lm_exi_encode     (LmExi             *exi,
+                             LmMessageNode     *node,
+                             GString           *out);
+gboolean _lm_exi_encode_xml (LmExi             *exi,
+                             const gchar       *str,
+                             gssize             len,
+                             GString           *out);
+
+G_END_DECLS
+
+#endif /* __LM_EXI_H__ */
@@ -30,6 +30,21 @@
 
 #define XMPP_NS_PING "urn:xmpp:ping"
 
+/* A ping is given up on after the retransmission timeout, which follows
+ * the round trip time like TCP's does (RFC 6298). The peer is considered
+ * gone after this many pings in a row without a reply and without
+ * anything else arriving, a busy server that still sends is not a dead
+ * one. */
+#define PING_MAX_MISSES  3
+#define PING_INITIAL_RTO 3000
+#define PING_MIN_RTO     1000
+#define PING_MAX_RTO     60000
+
+/* Adaptive keep alive doubles the interval until the path is lost and
+ * then narrows in on the idle time out, in seconds */
+#define PING_ADAPTIVE_MAX_INTERVAL 1800
+#define PING_ADAPTIVE_RESOLUTION   5
+
 #define GET_PRIV(obj) (G_TYPE_INSTANCE_GET_PRIVATE ((obj), LM_TYPE_FEATURE_PING, LmFeaturePingPriv))
 
 typedef struct LmFeaturePingPriv LmFeaturePingPriv;
@@ -37,9 +52,38 @@ struct LmFeaturePingPriv {
     LmConnection *connection;
     guint         keep_alive_rate;
     GSource      *keep_alive_source;
-    guint         keep_alive_counter;
+
+    /* Adaptive keep alive, path is NULL when the interval is fixed */
+    LmFeaturePingPath *path;
+    guint         interval;
+    guint         probe_interval;
+
+    /* Last read or write, pings are only needed once it is this long ago */
+    guint64       idle_since;
+
+    /* Set while a ping waits for its reply */
+    GSource      *reply_timeout_source;
+    guint         misses;
+    guint         rto;
+    guint64       ping_sent_at;
+    guint64       last_received;
+
+    /* Round trip statistics, all times in ms */
+    guint         samples;
+    guint         last_rtt;
+    guint         min_rtt;
+    gdouble       srtt;
+    gdouble       rttvar;
+    gdouble       jitter;
+    gdouble       loss;
 };
 
+typedef struct {
+    LmFeaturePing *fp;
+    guint64        sent_at;
+    guint          interval; /* Idle time before the ping, in seconds */
+} PingData;
+
 static void     feature_ping_finalize            (GObject           *object);
 static void     feature_ping_get_property        (GObject           *object,
                                                   guint              param_id,
@@ -56,13 +100,15 @@ feature_ping_keep_alive_reply                    (LmMessageHandler *handler,
                                                   LmMessage        *m,
                                                   gpointer          user_data);
 static gboolean feature_ping_send_keep_alive     (LmFeaturePing    *fp);
+static void     feature_ping_send_ping           (LmFeaturePing    *fp);
 
 G_DEFINE_TYPE (LmFeaturePing, lm_feature_ping, G_TYPE_OBJECT)
 
 enum {
     PROP_0,
     PROP_CONNECTION,
-    PROP_RATE
+    PROP_RATE,
+    PROP_PATH
 };
 
 enum {
@@ -97,6 +143,13 @@ lm_feature_ping_class_init (LmFeaturePingClass *class)
                                                         0,
                                                         G_PARAM_READWRITE));
 
+    g_object_class_install_property (object_class,
+                                     PROP_PATH,
+                                     g_param_spec_pointer ("path",
+                                                           "Path",
+                                                           "The LmFeaturePingPath to adapt the rate with",
+                                                           G_PARAM_WRITABLE | G_PARAM_CONSTRUCT_ONLY));
+
     signals[TIMED_OUT] = 
         g_signal_new ("timed-out",
                       G_OBJECT_CLASS_TYPE (object_class),
@@ -116,6 +169,7 @@ lm_feature_ping_init (LmFeaturePing *feature_ping)
 
     priv = GET_PRIV (feature_ping);
 
+    priv->rto = PING_INITIAL_RTO;
 }
 
 static void
@@ -125,6 +179,10 @@ feature_ping_finalize (GObject *object)
 
     priv = GET_PRIV (object);
 
+    if (priv->reply_timeout_source) {
+        g_source_destroy (priv->reply_timeout_source);
+    }
+
     (G_OBJECT_CLASS (lm_feature_ping_parent_class)->finalize) (object);
 }
 
@@ -166,50 +224,234 @@ feature_ping_set_property (GObject      *object,
         priv->keep_alive_rate = g_value_get_uint (value);
         /* Restart the pings */
         break;
+    case PROP_PATH:
+        priv->path = g_value_get_pointer (value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID (object, param_id, pspec);
         break;
     };
 }
 
+static void
+ping_data_free (PingData *data)
+{
+    if (data->fp) {
+        g_object_remove_weak_pointer (G_OBJECT (data->fp),
+                                      (gpointer *) &data->fp);
+    }
+
+    g_free (data);
+}
+
+static guint
+feature_ping_clamp_rto (gdouble rto)
+{
+    return (guint) CLAMP (rto, PING_MIN_RTO, PING_MAX_RTO);
+}
+
+static void
+feature_ping_add_sample (LmFeaturePing *fp, guint rtt)
+{
+    LmFeaturePingPriv *priv;
+    gdouble            rto;
+
+    priv = GET_PRIV (fp);
+
+    if (priv->samples == 0) {
+        priv->srtt = rtt;
+        priv->rttvar = rtt / 2.0;
+        priv->min_rtt = rtt;
+    } else {
+        /* Interarrival jitter as in RFC 3550 */
+        priv->jitter += (ABS ((gdouble) rtt - priv->last_rtt) - priv->jitter) / 16;
+
+        priv->rttvar = 0.75 * priv->rttvar + 0.25 * ABS (priv->srtt - rtt);
+        priv->srtt = 0.875 * priv->srtt + 0.125 * rtt;
+        priv->min_rtt = MIN (priv->min_rtt, rtt);
+    }
+
+    priv->last_rtt = rtt;
+    priv->samples++;
+    priv->loss *= 0.875;
+
+    rto = priv->srtt + 4 * priv->rttvar;
+    priv->rto = feature_ping_clamp_rto (rto);
+
+    lm_verbose ("Ping RTT %u ms, smoothed %.1f ms, jitter %.1f ms\n",
+                rtt, priv->srtt, priv->jitter);
+}
+
+static void
+feature_ping_schedule_in (LmFeaturePing *fp, guint delay)
+{
+    LmFeaturePingPriv *priv;
+
+    priv = GET_PRIV (fp);
+
+    if (priv->keep_alive_source) {
+        g_source_destroy (priv->keep_alive_source);
+    }
+
+    priv->keep_alive_source =
+        lm_misc_add_timeout (_lm_connection_get_context (priv->connection),
+                             delay,
+                             (GSourceFunc) feature_ping_send_keep_alive,
+                             fp);
+}
+
+static void
+feature_ping_schedule (LmFeaturePing *fp)
+{
+    feature_ping_schedule_in (fp, GET_PRIV (fp)->interval * 1000);
+}
+
+/* The path stayed open for @interval seconds. Probe further out, half way
+ * to where it was lost if that is known, until that is close enough. */
+static void
+feature_ping_path_answered (LmFeaturePing *fp, guint interval)
+{
+    LmFeaturePingPriv *priv;
+    LmFeaturePingPath *path;
+    guint              good;
+
+    priv = GET_PRIV (fp);
+    path = priv->path;
+
+    path->good = MAX (path->good, interval);
+    if (path->bad > 0 && path->good >= path->bad) {
+        /* Not the network it was */
+        path->bad = 0;
+    }
+
+    good = MAX (path->good, priv->keep_alive_rate);
+
+    if (path->bad == 0) {
+        priv->interval = MIN (good * 2, PING_ADAPTIVE_MAX_INTERVAL);
+    }
+    else if (path->bad - good <= MAX (path->bad / 10, PING_ADAPTIVE_RESOLUTION)) {
+        priv->interval = good;
+    } else {
+        priv->interval = good + (path->bad - good) / 2;
+    }
+
+    /* Pings are what keeps the path open, count from the reply */
+    feature_ping_schedule (fp);
+}
+
+/* The path was lost with a ping outstanding */
+static void
+feature_ping_path_lost (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+    LmFeaturePingPath *path;
+    guint              interval;
+
+    priv = GET_PRIV (fp);
+    path = priv->path;
+    interval = priv->probe_interval;
+
+    if (interval <= priv->keep_alive_rate) {
+        /* Not something a shorter interval would fix */
+        return;
+    }
+
+    if (interval <= path->good) {
+        /* It used to stay open for longer, start over */
+        path->good = 0;
+    }
+
+    path->bad = path->bad > 0 ? MIN (path->bad, interval) : interval;
+
+    lm_verbose ("Path lost after %u s idle, keeping it below that\n",
+                interval);
+}
+
 static LmHandlerResult
 feature_ping_keep_alive_reply (LmMessageHandler *handler,
                                LmConnection     *connection,
                                LmMessage        *m,
                                gpointer          user_data)
 {
+    PingData          *data = user_data;
     LmFeaturePingPriv *priv;
 
-    priv = GET_PRIV (user_data);
+    if (!data->fp) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    priv = GET_PRIV (data->fp);
+
+    /* Replies to earlier pings count too, each has a time of its own */
+    feature_ping_add_sample (data->fp,
+                             lm_misc_get_time () - data->sent_at);
+
+    priv->misses = 0;
+    if (priv->reply_timeout_source) {
+        g_source_destroy (priv->reply_timeout_source);
+        priv->reply_timeout_source = NULL;
+    }
+
+    if (priv->path && priv->keep_alive_source) {
+        feature_ping_path_answered (data->fp, data->interval);
+    }
 
-    priv->keep_alive_counter = 0;
-    
     return LM_HANDLER_RESULT_REMOVE_MESSAGE;
 }
 
 static gboolean
-feature_ping_send_keep_alive (LmFeaturePing *fp)
+feature_ping_reply_timed_out (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+
+    priv = GET_PRIV (fp);
+
+    priv->reply_timeout_source = NULL;
+
+    if (priv->last_received > priv->ping_sent_at) {
+        /* The reply may be stuck behind other traffic, the peer is there */
+        lm_verbose ("No ping reply within %u ms, but data arrived\n",
+                    priv->rto);
+        priv->misses = 0;
+        return FALSE;
+    }
+
+    priv->misses++;
+    priv->loss = 0.875 * priv->loss + 0.125;
+
+    lm_verbose ("No ping reply within %u ms (%u in a row)\n",
+                priv->rto, priv->misses);
+
+    if (priv->misses >= PING_MAX_MISSES) {
+        if (priv->path) {
+            feature_ping_path_lost (fp);
+        }
+
+        /* Might drop the last reference to us */
+        g_signal_emit (fp, signals[TIMED_OUT], 0);
+        return FALSE;
+    }
+
+    /* Ask again right away instead of waiting for the next keep alive,
+     * backing off like a TCP retransmission */
+    priv->rto = feature_ping_clamp_rto (priv->rto * 2.0);
+    feature_ping_send_ping (fp);
+
+    return FALSE;
+}
+
+static void
+feature_ping_send_ping (LmFeaturePing *fp)
 {
     LmFeaturePingPriv *priv;
     LmMessage         *ping;
     LmMessageNode     *ping_node;
     LmMessageHandler  *keep_alive_handler;
+    PingData          *data;
     gchar             *server;
 
     priv = GET_PRIV (fp);
 
-    priv->keep_alive_counter++;
-    if (priv->keep_alive_counter > 3) {
-        g_signal_emit (fp, signals[TIMED_OUT], 0);
-        /* FIXME */
-#if 0 /* Should be moved to signal callback in LmConnection */
-        connection_do_close (connection);
-        connection_signal_disconnect (connection,
-                                      LM_DISCONNECT_REASON_PING_TIME_OUT);
-#endif
-
-    }
-
     server = _lm_connection_get_server (priv->connection);
     
     ping = lm_message_new_with_sub_type (server,
@@ -220,10 +462,18 @@ feature_ping_send_keep_alive (LmFeaturePing *fp)
 
     lm_message_node_set_attribute (ping_node, "xmlns", XMPP_NS_PING);
 
+    /* The handler can outlive us if the reply never comes */
+    data = g_new0 (PingData, 1);
+    data->fp = fp;
+    data->sent_at = lm_misc_get_time ();
+    data->interval = priv->probe_interval;
+    priv->ping_sent_at = data->sent_at;
+    g_object_add_weak_pointer (G_OBJECT (fp), (gpointer *) &data->fp);
+
     keep_alive_handler =
         lm_message_handler_new (feature_ping_keep_alive_reply,
-                                fp,
-                                FALSE);
+                                data,
+                                (GDestroyNotify) ping_data_free);
 
     if (!lm_connection_send_with_reply (priv->connection,
                                         ping,
@@ -236,9 +486,38 @@ feature_ping_send_keep_alive (LmFeaturePing *fp)
     lm_message_unref (ping);
     g_free (server);
 
-    return TRUE;
+    priv->reply_timeout_source =
+        lm_misc_add_timeout (_lm_connection_get_context (priv->connection),
+                             priv->rto,
+                             (GSourceFunc) feature_ping_reply_timed_out,
+                             fp);
 }
 
+static gboolean
+feature_ping_send_keep_alive (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+    guint64            idle;
+
+    priv = GET_PRIV (fp);
+
+    idle = lm_misc_get_time () - priv->idle_since;
+    if (idle < (guint64) priv->interval * 1000) {
+        /* Other traffic kept the path open, count from the last of it */
+        feature_ping_schedule_in (fp, priv->interval * 1000 - idle);
+        return FALSE;
+    }
+
+    /* The reply timeout takes care of pings that go unanswered */
+    if (!priv->reply_timeout_source) {
+        priv->probe_interval = (guint) (idle / 1000);
+        feature_ping_send_ping (fp);
+    }
+
+    feature_ping_schedule (fp);
+
+    return FALSE;
+}
 
 void
 lm_feature_ping_start (LmFeaturePing *fp)
@@ -254,12 +533,18 @@ lm_feature_ping_start (LmFeaturePing *fp)
     }
 
     if (priv->keep_alive_rate > 0) {
-        priv->keep_alive_counter = 0;
-        priv->keep_alive_source =
-            lm_misc_add_timeout (_lm_connection_get_context (priv->connection),
-                                 priv->keep_alive_rate * 1000,
-                                 (GSourceFunc) feature_ping_send_keep_alive,
-                                 fp);
+        priv->misses = 0;
+        priv->rto = feature_ping_clamp_rto (priv->rto);
+
+        priv->idle_since = lm_misc_get_time ();
+
+        /* Start out with what is known to work */
+        priv->interval = priv->keep_alive_rate;
+        if (priv->path) {
+            priv->interval = MAX (priv->interval, priv->path->good);
+        }
+
+        feature_ping_schedule (fp);
     }
 }
 
@@ -276,7 +561,104 @@ lm_feature_ping_stop (LmFeaturePing *fp)
         g_source_destroy (priv->keep_alive_source);
     }
 
+    if (priv->reply_timeout_source) {
+        g_source_destroy (priv->reply_timeout_source);
+    }
+
     priv->keep_alive_source = NULL;
+    priv->reply_timeout_source = NULL;
+}
+
+/* Called for everything read from the connection, which shows the peer
+ * is alive as well as a ping reply does */
+void
+lm_feature_ping_received (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+
+    g_return_if_fail (LM_IS_FEATURE_PING (fp));
+
+    priv = GET_PRIV (fp);
+
+    priv->last_received = lm_misc_get_time ();
+    priv->idle_since = priv->last_received;
+    priv->misses = 0;
+}
+
+/* Called for everything written to the connection */
+void
+lm_feature_ping_sent (LmFeaturePing *fp)
+{
+    g_return_if_fail (LM_IS_FEATURE_PING (fp));
+
+    GET_PRIV (fp)->idle_since = lm_misc_get_time ();
+}
+
+/* Called when the connection was lost some other way than through
+ * "timed-out", a ping waiting for its reply means the path went. */
+void
+lm_feature_ping_lost (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+
+    g_return_if_fail (LM_IS_FEATURE_PING (fp));
+
+    priv = GET_PRIV (fp);
+
+    if (priv->path && priv->reply_timeout_source) {
+        feature_ping_path_lost (fp);
+    }
+}
+
+/* Seconds between pings, the rate unless adapting to a path */
+guint
+lm_feature_ping_get_interval (LmFeaturePing *fp)
+{
+    g_return_val_if_fail (LM_IS_FEATURE_PING (fp), 0);
+
+    return GET_PRIV (fp)->interval;
+}
+
+/* Smoothed round trip time in ms, 0 before the first reply */
+guint
+lm_feature_ping_get_rtt (LmFeaturePing *fp)
+{
+    g_return_val_if_fail (LM_IS_FEATURE_PING (fp), 0);
+
+    return (guint) (GET_PRIV (fp)->srtt + 0.5);
+}
+
+guint
+lm_feature_ping_get_jitter (LmFeaturePing *fp)
+{
+    g_return_val_if_fail (LM_IS_FEATURE_PING (fp), 0);
+
+    return (guint) (GET_PRIV (fp)->jitter + 0.5);
+}
+
+/* 1.0 for a link that answers every ping as fast as it ever did. Lost
+ * pings, round trip times above the minimum seen and jitter bring it
+ * down, and pings going unanswered right now take it towards 0.0 as the
+ * peer gets closer to being declared gone. */
+gdouble
+lm_feature_ping_get_health (LmFeaturePing *fp)
+{
+    LmFeaturePingPriv *priv;
+    gdouble            health;
+
+    g_return_val_if_fail (LM_IS_FEATURE_PING (fp), 0.0);
+
+    priv = GET_PRIV (fp);
+
+    health = 1.0 - priv->loss;
+
+    if (priv->samples > 0 && priv->srtt > 0) {
+        health *= priv->min_rtt / (priv->srtt + priv->jitter);
+    }
+
+    health *= 1.0 - (gdouble) priv->misses / PING_MAX_MISSES;
+
+    return CLAMP (health, 0.0, 1.0);
 }
 
 
@@ -43,10 +43,27 @@ struct LmFeaturePingClass {
     GObjectClass parent_class;
 };
 
+/* What adaptive keep alive has learned about the idle time out of a
+ * network path, in seconds. Owned by the connection so it outlives the
+ * LmFeaturePing of a connection that was dropped. */
+typedef struct {
+    guint good; /* Longest interval a ping was answered after */
+    guint bad;  /* Shortest interval the path was lost after, 0 if unknown */
+} LmFeaturePingPath;
+
 GType   lm_feature_ping_get_type  (void);
 
 void    lm_feature_ping_start     (LmFeaturePing *fp);
 void    lm_feature_ping_stop      (LmFeaturePing *fp);
+void    lm_feature_ping_lost      (LmFeaturePing *fp);
+void    lm_feature_ping_received  (LmFeaturePing *fp);
+void    lm_feature_ping_sent      (LmFeaturePing *fp);
+
+guint   lm_feature_ping_get_interval (LmFeaturePing *fp);
+
+guint   lm_feature_ping_get_rtt    (LmFeaturePing *fp);
+guint   lm_feature_ping_get_jitter (LmFeaturePing *fp);
+gdouble lm_feature_ping_get_health (LmFeaturePing *fp);
 
 G_END_DECLS
 
@@ -0,0 +1,328 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Message handler tables that can be changed from any thread.
+ *
+ * For every message type the registered handlers are kept in an
+ * immutable, priority sorted snapshot. Registering or unregistering a
+ * handler builds a new snapshot and swaps it in with a compare-and-swap,
+ * retrying if another thread got there first. Dispatching only loads the
+ * current snapshot, so it never waits for a writer.
+ *
+ * Replaced snapshots are put on a retired list. They are freed once no
+ * dispatch or writer is active, since any of those might still be
+ * looking at them. Writers and dispatches both register themselves in
+ * active before loading a snapshot; the retired list is always stolen
+ * before active is checked so that a snapshot can't be retired and freed
+ * between the two.
+ */
+
+#include <config.h>
+
+#include "lm-handler-table.h"
+
+typedef struct {
+    LmHandlerPriority  priority;
+    LmMessageHandler  *handler;
+} HandlerData;
+
+typedef struct _HandlerSnapshot HandlerSnapshot;
+
+struct _HandlerSnapshot {
+    HandlerSnapshot *next_retired;
+    guint            n_handlers;
+    HandlerData      handlers[1];
+};
+
+struct _LmHandlerTable {
+    /* HandlerSnapshot per message type, NULL when empty */
+    gpointer snapshots[LM_MESSAGE_TYPE_UNKNOWN];
+
+    /* HandlerSnapshot stack waiting to be freed */
+    gpointer retired;
+
+    /* Number of dispatches and writers currently using snapshots */
+    gint     active;
+};
+
+static HandlerSnapshot *
+handler_snapshot_new (guint n_handlers)
+{
+    HandlerSnapshot *snapshot;
+
+    snapshot = g_malloc (sizeof (HandlerSnapshot) +
+                         (MAX (n_handlers, 1) - 1) * sizeof (HandlerData));
+    snapshot->next_retired = NULL;
+    snapshot->n_handlers = n_handlers;
+
+    return snapshot;
+}
+
+static void
+handler_snapshot_free (HandlerSnapshot *snapshot)
+{
+    guint i;
+
+    for (i = 0; i < snapshot->n_handlers; ++i) {
+        lm_message_handler_unref (snapshot->handlers[i].handler);
+    }
+
+    g_free (snapshot);
+}
+
+static void
+handler_table_push_retired (LmHandlerTable  *table,
+                            HandlerSnapshot *first,
+                            HandlerSnapshot *last)
+{
+    gpointer head;
+
+    do {
+        head = g_atomic_pointer_get (&table->retired);
+        last->next_retired = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&table->retired,
+                                                     head, first));
+}
+
+static void
+handler_table_reclaim (LmHandlerTable *table)
+{
+    HandlerSnapshot *retired;
+    HandlerSnapshot *last;
+
+    do {
+        retired = g_atomic_pointer_get (&table->retired);
+        if (!retired) {
+            return;
+        }
+    } while (!g_atomic_pointer_compare_and_exchange (&table->retired,
+                                                     retired, NULL));
+
+    if (g_atomic_int_get (&table->active) > 0) {
+        /* Someone may still be reading these, try again later */
+        for (last = retired; last->next_retired; last = last->next_retired) {
+            /* Find the tail */
+        }
+        handler_table_push_retired (table, retired, last);
+        return;
+    }
+
+    while (retired) {
+        HandlerSnapshot *next = retired->next_retired;
+
+        handler_snapshot_free (retired);
+        retired = next;
+    }
+}
+
+/* Swaps @new_snapshot in for @old_snapshot. On success the old snapshot
+ * is retired, on failure @new_snapshot is freed and the caller retries. */
+static gboolean
+handler_table_swap (LmHandlerTable  *table,
+                    LmMessageType    type,
+                    HandlerSnapshot *old_snapshot,
+                    HandlerSnapshot *new_snapshot)
+{
+    if (!g_atomic_pointer_compare_and_exchange (&table->snapshots[type],
+                                                old_snapshot,
+                                                new_snapshot)) {
+        if (new_snapshot) {
+            handler_snapshot_free (new_snapshot);
+        }
+        return FALSE;
+    }
+
+    if (old_snapshot) {
+        handler_table_push_retired (table, old_snapshot, old_snapshot);
+    }
+
+    return TRUE;
+}
+
+LmHandlerTable *
+lm_handler_table_new (void)
+{
+    return g_new0 (LmHandlerTable, 1);
+}
+
+void
+lm_handler_table_free (LmHandlerTable *table)
+{
+    HandlerSnapshot *snapshot;
+    int              i;
+
+    g_return_if_fail (table != NULL);
+
+    for (i = 0; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
+        snapshot = table->snapshots[i];
+        if (snapshot) {
+            handler_snapshot_free (snapshot);
+        }
+    }
+
+    snapshot = table->retired;
+    while (snapshot) {
+        HandlerSnapshot *next = snapshot->next_retired;
+
+        handler_snapshot_free (snapshot);
+        snapshot = next;
+    }
+
+    g_free (table);
+}
+
+void
+lm_handler_table_add (LmHandlerTable    *table,
+                      LmMessageType      type,
+                      LmMessageHandler  *handler,
+                      LmHandlerPriority  priority)
+{
+    HandlerSnapshot *old_snapshot;
+    HandlerSnapshot *new_snapshot;
+
+    g_return_if_fail (table != NULL);
+    g_return_if_fail (handler != NULL);
+    g_return_if_fail (type < LM_MESSAGE_TYPE_UNKNOWN);
+
+    g_atomic_int_inc (&table->active);
+
+    do {
+        guint n_old;
+        guint i, j;
+
+        old_snapshot = g_atomic_pointer_get (&table->snapshots[type]);
+        n_old = old_snapshot ? old_snapshot->n_handlers : 0;
+
+        new_snapshot = handler_snapshot_new (n_old + 1);
+
+        /* New handlers go before existing ones of the same priority */
+        for (i = 0, j = 0; i < n_old + 1; ++i) {
+            HandlerData *hd = &new_snapshot->handlers[i];
+
+            if (j == i && (j == n_old ||
+                           old_snapshot->handlers[j].priority <= priority)) {
+                hd->priority = priority;
+                hd->handler = lm_message_handler_ref (handler);
+            } else {
+                *hd = old_snapshot->handlers[j++];
+                lm_message_handler_ref (hd->handler);
+            }
+        }
+    } while (!handler_table_swap (table, type, old_snapshot, new_snapshot));
+
+    g_atomic_int_add (&table->active, -1);
+
+    handler_table_reclaim (table);
+}
+
+void
+lm_handler_table_remove (LmHandlerTable   *table,
+                         LmMessageType     type,
+                         LmMessageHandler *handler)
+{
+    HandlerSnapshot *old_snapshot;
+    HandlerSnapshot *new_snapshot;
+
+    g_return_if_fail (table != NULL);
+    g_return_if_fail (handler != NULL);
+    g_return_if_fail (type < LM_MESSAGE_TYPE_UNKNOWN);
+
+    g_atomic_int_inc (&table->active);
+
+    do {
+        guint i, j;
+        guint found;
+
+        old_snapshot = g_atomic_pointer_get (&table->snapshots[type]);
+        if (!old_snapshot) {
+            break;
+        }
+
+        for (found = 0; found < old_snapshot->n_handlers; ++found) {
+            if (old_snapshot->handlers[found].handler == handler) {
+                break;
+            }
+        }
+
+        if (found == old_snapshot->n_handlers) {
+            /* Not registered */
+            break;
+        }
+
+        if (old_snapshot->n_handlers == 1) {
+            new_snapshot = NULL;
+        } else {
+            new_snapshot = handler_snapshot_new (old_snapshot->n_handlers - 1);
+
+            for (i = 0, j = 0; i < old_snapshot->n_handlers; ++i) {
+                if (i == found) {
+                    continue;
+                }
+
+                new_snapshot->handlers[j] = old_snapshot->handlers[i];
+                lm_message_handler_ref (new_snapshot->handlers[j].handler);
+                j++;
+            }
+        }
+    } while (!handler_table_swap (table, type, old_snapshot, new_snapshot));
+
+    g_atomic_int_add (&table->active, -1);
+
+    handler_table_reclaim (table);
+}
+
+/* Runs the handlers registered for the type of @message in priority order
+ * until one of them asks to remove the message. Handlers registered or
+ * unregistered while this runs take effect for the next message. */
+LmHandlerResult
+lm_handler_table_handle_message (LmHandlerTable *table,
+                                 LmConnection   *connection,
+                                 LmMessage      *message)
+{
+    HandlerSnapshot *snapshot;
+    LmHandlerResult  result = LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    LmMessageType    type;
+    guint            i;
+
+    g_return_val_if_fail (table != NULL, result);
+
+    type = lm_message_get_type (message);
+    if (type >= LM_MESSAGE_TYPE_UNKNOWN) {
+        return result;
+    }
+
+    handler_table_reclaim (table);
+
+    g_atomic_int_inc (&table->active);
+
+    snapshot = g_atomic_pointer_get (&table->snapshots[type]);
+
+    for (i = 0; snapshot && i < snapshot->n_handlers &&
+             result == LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS; ++i) {
+        result = _lm_message_handler_handle_message (snapshot->handlers[i].handler,
+                                                     connection,
+                                                     message);
+    }
+
+    g_atomic_int_add (&table->active, -1);
+
+    return result;
+}
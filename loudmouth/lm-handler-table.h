@@ -0,0 +1,47 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_HANDLER_TABLE_H__
+#define __LM_HANDLER_TABLE_H__
+
+#include <glib.h>
+
+#include "lm-internals.h"
+
+G_BEGIN_DECLS
+
+typedef struct _LmHandlerTable LmHandlerTable;
+
+LmHandlerTable * lm_handler_table_new             (void);
+void             lm_handler_table_free            (LmHandlerTable    *table);
+void             lm_handler_table_add             (LmHandlerTable    *table,
+                                                   LmMessageType      type,
+                                                   LmMessageHandler  *handler,
+                                                   LmHandlerPriority  priority);
+void             lm_handler_table_remove          (LmHandlerTable    *table,
+                                                   LmMessageType      type,
+                                                   LmMessageHandler  *handler);
+LmHandlerResult  lm_handler_table_handle_message  (LmHandlerTable    *table,
+                                                   LmConnection      *connection,
+                                                   LmMessage         *message);
+
+G_END_DECLS
+
+#endif /* __LM_HANDLER_TABLE_H__ */
@@ -0,0 +1,1057 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/**
+ * SECTION:lm-http-upload
+ * @Title: LmHttpUpload
+ * @Short_description: Sharing files through an HTTP upload service
+ *
+ * An #LmHttpUpload puts files on an HTTP File Upload service (XEP-0363).
+ * For each file it asks the service for a slot over the #LmConnection and
+ * then sends the file straight from its file descriptor with an HTTP PUT
+ * to the URL it got, never holding more than a chunk of it in memory.
+ * Over plain HTTP the file is sent with sendfile() where the system
+ * supports it. HTTPS goes through the same SSL backend as the
+ * connection.
+ *
+ * Files are uploaded a few at a time as set with
+ * lm_http_upload_set_max_uploads(), the rest wait for their turn. The
+ * service is usually found through service discovery on the server.
+ * <informalexample><programlisting><![CDATA[
+ * LmHttpUpload *upload;
+ *
+ * upload = lm_http_upload_new (connection, "upload.example.com");
+ * lm_http_upload_send_file (upload, fd, "photo.jpg", size, "image/jpeg",
+ *                           NULL, upload_done_cb, NULL, NULL, NULL);
+ * lm_http_upload_unref (upload);
+ * ]]></programlisting></informalexample>
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <netinet/in.h>
+
+#include "lm-debug.h"
+#include "lm-error.h"
+#include "lm-internals.h"
+#include "lm-misc.h"
+#include "lm-resolver.h"
+#include "lm-sock.h"
+#include "lm-ssl.h"
+#include "lm-ssl-internals.h"
+#include "lm-http-upload.h"
+
+#define XMPP_NS_HTTP_UPLOAD "urn:xmpp:http:upload:0"
+
+#define HTTP_UPLOAD_DEFAULT_MAX_UPLOADS 2
+#define HTTP_UPLOAD_DEFAULT_TYPE        "application/octet-stream"
+
+/* Sent per sendfile () call, so that other sources in the main loop get
+ * to run during large uploads */
+#define HTTP_UPLOAD_CHUNK_SIZE (256 * 1024)
+/* Over TLS the file is read in pieces of one record */
+#define HTTP_UPLOAD_TLS_CHUNK_SIZE (16 * 1024)
+
+typedef enum {
+    UPLOAD_STATE_QUEUED,
+    UPLOAD_STATE_SLOT,
+    UPLOAD_STATE_CONNECTING,
+    UPLOAD_STATE_SENDING,
+    UPLOAD_STATE_RESPONSE,
+    UPLOAD_STATE_DONE
+} UploadState;
+
+typedef struct {
+    LmHttpUpload *upload;
+    UploadState   state;
+
+    gint          file_fd;
+    gchar        *filename;
+    gchar        *content_type;
+    guint64       size;
+    guint64       sent;
+    off_t         offset;
+
+    /* From the slot */
+    gchar        *get_url;
+    gchar        *host;
+    guint         port;
+    gboolean      https;
+    GString      *request;
+    gsize         request_sent;
+
+    LmResolver   *resolver;
+    gint          fd;
+    GIOChannel   *channel;
+    GSource      *watch;
+    LmSSL        *ssl;
+    /* A piece of the file read for TLS, kept until it is written since a
+     * write that would block has to be repeated with the same data */
+    gchar        *buf;
+    gsize         buf_len;
+    GString      *response;
+
+    LmHttpUploadProgressFunction  progress;
+    LmCallback   *result_cb;
+
+    gint          ref_count;
+} UploadFile;
+
+struct _LmHttpUpload {
+    LmConnection *connection;
+    GMainContext *context;
+    gchar        *service;
+    guint         max_uploads;
+    LmCallback   *ssl_cb;
+
+    GQueue       *queued;
+    GList        *active;
+    gboolean      cancelling;
+
+    gint          ref_count;
+};
+
+static void     upload_schedule      (LmHttpUpload *upload);
+static void     upload_file_finish   (UploadFile   *file,
+                                      gboolean      success);
+
+static UploadFile *
+upload_file_ref (UploadFile *file)
+{
+    file->ref_count++;
+
+    return file;
+}
+
+static void
+upload_file_unref (UploadFile *file)
+{
+    file->ref_count--;
+
+    if (file->ref_count > 0) {
+        return;
+    }
+
+    if (file->request) {
+        g_string_free (file->request, TRUE);
+    }
+
+    if (file->response) {
+        g_string_free (file->response, TRUE);
+    }
+
+    g_free (file->filename);
+    g_free (file->content_type);
+    g_free (file->get_url);
+    g_free (file->host);
+    g_free (file->buf);
+    g_free (file);
+}
+
+static void
+upload_file_close (UploadFile *file)
+{
+    if (file->resolver) {
+        lm_resolver_cancel (file->resolver);
+        g_object_unref (file->resolver);
+        file->resolver = NULL;
+    }
+
+    if (file->watch) {
+        g_source_destroy (file->watch);
+        file->watch = NULL;
+    }
+
+    if (file->ssl) {
+        _lm_ssl_close (file->ssl);
+        lm_ssl_unref (file->ssl);
+        file->ssl = NULL;
+    }
+
+    if (file->channel) {
+        g_io_channel_unref (file->channel);
+        file->channel = NULL;
+    }
+
+    if (file->fd >= 0) {
+        _lm_sock_shutdown (file->fd);
+        _lm_sock_close (file->fd);
+        file->fd = -1;
+    }
+}
+
+static void
+upload_file_finish (UploadFile *file, gboolean success)
+{
+    LmHttpUpload *upload = file->upload;
+    LmCallback   *cb;
+
+    if (file->state == UPLOAD_STATE_DONE) {
+        return;
+    }
+
+    lm_verbose ("Upload of %s %s after %" G_GUINT64_FORMAT " bytes\n",
+                file->filename, success ? "done" : "failed", file->sent);
+
+    if (file->state == UPLOAD_STATE_QUEUED) {
+        g_queue_remove (upload->queued, file);
+    } else {
+        upload->active = g_list_remove (upload->active, file);
+    }
+
+    file->state = UPLOAD_STATE_DONE;
+    upload_file_close (file);
+
+    cb = file->result_cb;
+    file->result_cb = NULL;
+
+    if (cb->func) {
+        (* ((LmHttpUploadFunction) cb->func)) (upload,
+                                               success ? file->get_url : NULL,
+                                               cb->user_data);
+    }
+
+    _lm_utils_free_callback (cb);
+    upload_file_unref (file);
+
+    upload_schedule (upload);
+
+    /* Taken when the file was added */
+    lm_http_upload_unref (upload);
+}
+
+static GSource *
+upload_file_add_watch (UploadFile   *file,
+                       GIOCondition  condition,
+                       GIOFunc       function)
+{
+    return lm_misc_add_io_watch (file->upload->context, file->channel,
+                                 condition, function, file);
+}
+
+/* -- HTTP -- */
+
+static gboolean
+upload_file_response_cb (GIOChannel   *source,
+                         GIOCondition  condition,
+                         UploadFile   *file)
+{
+    gchar      buf[1024];
+    gsize      len = 0;
+    GIOStatus  status;
+    gchar     *eol;
+    gint       code;
+
+    if (file->ssl) {
+        status = _lm_ssl_read (file->ssl, buf, sizeof (buf), &len);
+    } else {
+        gssize n;
+
+        do {
+            n = recv (file->fd, buf, sizeof (buf), 0);
+        } while (n < 0 && errno == EINTR);
+
+        if (n > 0) {
+            len = n;
+            status = G_IO_STATUS_NORMAL;
+        } else if (n < 0 && errno == EAGAIN) {
+            status = G_IO_STATUS_AGAIN;
+        } else {
+            status = n == 0 ? G_IO_STATUS_EOF : G_IO_STATUS_ERROR;
+        }
+    }
+
+    if (status == G_IO_STATUS_AGAIN) {
+        return TRUE;
+    }
+
+    if (status != G_IO_STATUS_NORMAL) {
+        file->watch = NULL;
+        upload_file_finish (file, FALSE);
+        return FALSE;
+    }
+
+    g_string_append_len (file->response, buf, len);
+
+    /* Only the status line matters */
+    eol = strstr (file->response->str, "\r\n");
+    if (!eol) {
+        return TRUE;
+    }
+
+    *eol = '\0';
+    code = 0;
+    if (g_str_has_prefix (file->response->str, "HTTP/1.")) {
+        code = atoi (file->response->str + strlen ("HTTP/1.x "));
+    }
+
+    lm_verbose ("Upload of %s: %s\n", file->filename, file->response->str);
+
+    file->watch = NULL;
+    upload_file_finish (file, code >= 200 && code < 300);
+
+    return FALSE;
+}
+
+/* Returns 0 when the socket is full, the watch then calls again */
+static gssize
+upload_file_write (UploadFile *file, const gchar *buf, gsize len)
+{
+    gssize n;
+
+    if (file->ssl) {
+        GIOStatus status;
+        gsize     written;
+
+        status = _lm_ssl_write (file->ssl, buf, len, &written);
+        if (status == G_IO_STATUS_AGAIN) {
+            return 0;
+        }
+
+        return status == G_IO_STATUS_NORMAL ? (gssize) written : -1;
+    }
+
+    do {
+        n = send (file->fd, buf, len, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+
+    return n;
+}
+
+/* Sends the next piece of the file. Over TLS it has to be read in and
+ * encrypted, over plain HTTP it goes straight from the file to the
+ * socket. */
+static gssize
+upload_file_send_body (UploadFile *file)
+{
+    gsize  len;
+    gssize n;
+
+    len = MIN (file->ssl ? HTTP_UPLOAD_TLS_CHUNK_SIZE : HTTP_UPLOAD_CHUNK_SIZE,
+               file->size - file->sent);
+
+    if (!file->ssl) {
+        n = _lm_sock_send_file (file->fd, file->file_fd, &file->offset, len);
+        if (n < 0 && errno == EAGAIN) {
+            return 0;
+        }
+
+        /* A file shorter than announced shows up as 0 */
+        return n == 0 ? -1 : n;
+    }
+
+    if (!file->buf) {
+        file->buf = g_malloc (HTTP_UPLOAD_TLS_CHUNK_SIZE);
+    }
+
+    if (file->buf_len == 0) {
+        do {
+            n = pread (file->file_fd, file->buf, len, file->offset);
+        } while (n < 0 && errno == EINTR);
+
+        if (n <= 0) {
+            return -1;
+        }
+
+        file->buf_len = n;
+    }
+
+    /* A whole record is written or none of it */
+    n = upload_file_write (file, file->buf, file->buf_len);
+    if (n > 0) {
+        file->offset += n;
+        file->buf_len = 0;
+    }
+
+    return n;
+}
+
+static gboolean
+upload_file_send_cb (GIOChannel   *source,
+                     GIOCondition  condition,
+                     UploadFile   *file)
+{
+    gssize n;
+
+    if (condition & (G_IO_ERR | G_IO_HUP)) {
+        file->watch = NULL;
+        upload_file_finish (file, FALSE);
+        return FALSE;
+    }
+
+    if (file->request_sent < file->request->len) {
+        n = upload_file_write (file,
+                               file->request->str + file->request_sent,
+                               file->request->len - file->request_sent);
+        if (n < 0) {
+            file->watch = NULL;
+            upload_file_finish (file, FALSE);
+            return FALSE;
+        }
+
+        file->request_sent += n;
+        return TRUE;
+    }
+
+    if (file->sent < file->size) {
+        n = upload_file_send_body (file);
+        if (n < 0) {
+            lm_verbose ("Upload of %s failed: %s\n",
+                        file->filename, g_strerror (errno));
+            file->watch = NULL;
+            upload_file_finish (file, FALSE);
+            return FALSE;
+        }
+
+        if (n == 0) {
+            return TRUE;
+        }
+
+        file->sent += n;
+
+        if (file->progress) {
+            gboolean done;
+
+            /* The upload may be cancelled from the callback */
+            upload_file_ref (file);
+            file->progress (file->upload, file->sent, file->size,
+                            file->result_cb->user_data);
+            done = file->state == UPLOAD_STATE_DONE;
+            upload_file_unref (file);
+
+            if (done) {
+                return FALSE;
+            }
+        }
+
+        if (file->sent < file->size) {
+            return TRUE;
+        }
+    }
+
+    file->state = UPLOAD_STATE_RESPONSE;
+    file->response = g_string_new (NULL);
+    file->watch = upload_file_add_watch (file,
+                                         G_IO_IN | G_IO_ERR | G_IO_HUP,
+                                         (GIOFunc) upload_file_response_cb);
+
+    return FALSE;
+}
+
+static gboolean
+upload_file_start_tls (UploadFile *file)
+{
+    LmCallback *cb = file->upload->ssl_cb;
+    LmSSL      *connection_ssl;
+    GError     *error = NULL;
+
+    if (!lm_ssl_is_supported ()) {
+        lm_verbose ("Upload of %s: no SSL support for HTTPS\n",
+                    file->filename);
+        return FALSE;
+    }
+
+    /* Without a function of our own a bad certificate stops the upload,
+     * the default of LmSSL would go on regardless */
+    file->ssl = _lm_ssl_new (NULL,
+                             cb ? (LmSSLFunction) cb->func :
+                                  _lm_ssl_func_always_stop,
+                             cb ? cb->user_data : NULL,
+                             NULL);
+
+    /* Held to the same protocol versions and ciphers as the connection */
+    connection_ssl = lm_connection_get_ssl (file->upload->connection);
+    if (connection_ssl) {
+        _lm_ssl_copy_settings (file->ssl, connection_ssl);
+    }
+
+    _lm_ssl_initialize (file->ssl);
+
+#ifdef HAVE_GNUTLS
+    /* GNU TLS requires the socket to be blocking */
+    _lm_sock_set_blocking (file->fd, TRUE);
+#endif
+
+    if (!_lm_ssl_begin (file->ssl, file->fd, file->host, &error)) {
+        if (error) {
+            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_NET,
+                   "%s\n", error->message);
+            g_error_free (error);
+        }
+
+        return FALSE;
+    }
+
+#ifdef HAVE_GNUTLS
+    _lm_sock_set_blocking (file->fd, FALSE);
+#endif
+
+    return TRUE;
+}
+
+static gboolean
+upload_file_connected_cb (GIOChannel   *source,
+                          GIOCondition  condition,
+                          UploadFile   *file)
+{
+    int       err = 0;
+    socklen_t len = sizeof (err);
+
+    file->watch = NULL;
+
+    _lm_sock_get_error (file->fd, &err, &len);
+    if (err != 0 || (file->https && !upload_file_start_tls (file))) {
+        upload_file_finish (file, FALSE);
+        return FALSE;
+    }
+
+    lm_verbose ("Upload of %s: connected to %s:%u\n",
+                file->filename, file->host, file->port);
+
+    file->state = UPLOAD_STATE_SENDING;
+    file->watch = upload_file_add_watch (file,
+                                         G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                         (GIOFunc) upload_file_send_cb);
+
+    return FALSE;
+}
+
+static void
+upload_file_resolved_cb (LmResolver       *resolver,
+                         LmResolverResult  result,
+                         UploadFile       *file)
+{
+    struct addrinfo *addr;
+    int              res;
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        return;
+    }
+
+    if (result != LM_RESOLVER_RESULT_OK ||
+        !(addr = lm_resolver_results_get_next (resolver))) {
+        upload_file_finish (file, FALSE);
+        return;
+    }
+
+    if (addr->ai_family == AF_INET6) {
+        ((struct sockaddr_in6 *) addr->ai_addr)->sin6_port = htons (file->port);
+    } else {
+        ((struct sockaddr_in *) addr->ai_addr)->sin_port = htons (file->port);
+    }
+
+    file->fd = _lm_sock_makesocket (addr->ai_family,
+                                    addr->ai_socktype,
+                                    addr->ai_protocol);
+    if (!_LM_SOCK_VALID (file->fd)) {
+        file->fd = -1;
+        upload_file_finish (file, FALSE);
+        return;
+    }
+
+    _lm_sock_set_blocking (file->fd, FALSE);
+
+    file->channel = g_io_channel_unix_new (file->fd);
+    g_io_channel_set_encoding (file->channel, NULL, NULL);
+    g_io_channel_set_buffered (file->channel, FALSE);
+
+    res = _lm_sock_connect (file->fd, addr->ai_addr, (int) addr->ai_addrlen);
+    if (res < 0 && !_lm_sock_is_blocking_error (_lm_sock_get_last_error ())) {
+        upload_file_finish (file, FALSE);
+        return;
+    }
+
+    file->watch = upload_file_add_watch (file, G_IO_OUT | G_IO_ERR,
+                                         (GIOFunc) upload_file_connected_cb);
+}
+
+/* Splits an http or https URL, returning the path and query */
+static gchar *
+upload_parse_url (const gchar  *url,
+                  gboolean     *https,
+                  gchar       **host,
+                  guint        *port)
+{
+    const gchar *start;
+    const gchar *path;
+    const gchar *colon;
+
+    if (g_ascii_strncasecmp (url, "https://", 8) == 0) {
+        *https = TRUE;
+        *port = 443;
+        start = url + 8;
+    } else if (g_ascii_strncasecmp (url, "http://", 7) == 0) {
+        *https = FALSE;
+        *port = 80;
+        start = url + 7;
+    } else {
+        return NULL;
+    }
+
+    path = strchr (start, '/');
+    if (!path) {
+        path = start + strlen (start);
+    }
+
+    if (*start == '[') {
+        /* IPv6 address */
+        const gchar *end = strchr (start, ']');
+
+        if (!end || end > path) {
+            return NULL;
+        }
+
+        *host = g_strndup (start + 1, end - start - 1);
+        colon = end[1] == ':' ? end + 1 : NULL;
+    } else {
+        colon = memchr (start, ':', path - start);
+        *host = g_strndup (start, (colon ? colon : path) - start);
+    }
+
+    if (colon) {
+        *port = atoi (colon + 1);
+    }
+
+    if (**host == '\0' || *port == 0 || *port > 65535) {
+        g_free (*host);
+        *host = NULL;
+        return NULL;
+    }
+
+    return g_strdup (*path ? path : "/");
+}
+
+/* Only these headers may be passed on from the slot, without line
+ * breaks that would let the service add others */
+static void
+upload_append_header (GString *request, LmMessageNode *node)
+{
+    const gchar *name;
+    const gchar *value;
+
+    name = lm_message_node_get_attribute (node, "name");
+    value = lm_message_node_get_value (node);
+
+    if (!name || !value || strpbrk (value, "\r\n") ||
+        (g_ascii_strcasecmp (name, "Authorization") != 0 &&
+         g_ascii_strcasecmp (name, "Cookie") != 0 &&
+         g_ascii_strcasecmp (name, "Expires") != 0)) {
+        return;
+    }
+
+    g_string_append_printf (request, "%s: %s\r\n", name, value);
+}
+
+static gboolean
+upload_file_start (UploadFile *file, LmMessageNode *slot)
+{
+    LmMessageNode *put;
+    LmMessageNode *get;
+    LmMessageNode *node;
+    const gchar   *put_url;
+    gchar         *path;
+
+    put = lm_message_node_get_child (slot, "put");
+    get = lm_message_node_get_child (slot, "get");
+    put_url = put ? lm_message_node_get_attribute (put, "url") : NULL;
+
+    if (!put_url || !get || !lm_message_node_get_attribute (get, "url")) {
+        return FALSE;
+    }
+
+    path = upload_parse_url (put_url, &file->https, &file->host, &file->port);
+    if (!path) {
+        lm_verbose ("Upload of %s: can't use %s\n", file->filename, put_url);
+        return FALSE;
+    }
+
+    file->get_url = g_strdup (lm_message_node_get_attribute (get, "url"));
+
+    file->request = g_string_new (NULL);
+    g_string_append_printf (file->request,
+                            "PUT %s HTTP/1.1\r\n"
+                            "Host: %s%s%s",
+                            path,
+                            strchr (file->host, ':') ? "[" : "",
+                            file->host,
+                            strchr (file->host, ':') ? "]" : "");
+    if (file->port != (file->https ? 443 : 80)) {
+        g_string_append_printf (file->request, ":%u", file->port);
+    }
+    g_string_append_printf (file->request,
+                            "\r\n"
+                            "Content-Length: %" G_GUINT64_FORMAT "\r\n"
+                            "Content-Type: %s\r\n"
+                            "Connection: close\r\n",
+                            file->size, file->content_type);
+    g_free (path);
+
+    for (node = put->children; node; node = node->next) {
+        if (strcmp (node->name, "header") == 0) {
+            upload_append_header (file->request, node);
+        }
+    }
+
+    g_string_append (file->request, "\r\n");
+
+    file->state = UPLOAD_STATE_CONNECTING;
+    file->resolver =
+        lm_resolver_new_for_host (file->host,
+                                  (LmResolverCallback) upload_file_resolved_cb,
+                                  file);
+    if (file->upload->context) {
+        g_object_set (file->resolver,
+                      "context", file->upload->context, NULL);
+    }
+
+    lm_resolver_lookup (file->resolver);
+
+    return TRUE;
+}
+
+/* -- Slots -- */
+
+static LmHandlerResult
+upload_slot_reply (LmMessageHandler *handler,
+                   LmConnection     *connection,
+                   LmMessage        *m,
+                   UploadFile       *file)
+{
+    LmMessageNode *slot;
+
+    if (file->state != UPLOAD_STATE_SLOT) {
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
+    slot = lm_message_node_get_child (m->node, "slot");
+
+    if (lm_message_get_sub_type (m) != LM_MESSAGE_SUB_TYPE_RESULT || !slot ||
+        !upload_file_start (file, slot)) {
+        lm_verbose ("Upload of %s: no slot\n", file->filename);
+        upload_file_finish (file, FALSE);
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static gboolean
+upload_file_request_slot (UploadFile *file)
+{
+    LmMessage        *m;
+    LmMessageNode    *request;
+    LmMessageHandler *handler;
+    gchar            *size;
+    gboolean          result;
+
+    size = g_strdup_printf ("%" G_GUINT64_FORMAT, file->size);
+
+    m = lm_message_new_with_sub_type (file->upload->service,
+                                      LM_MESSAGE_TYPE_IQ,
+                                      LM_MESSAGE_SUB_TYPE_GET);
+    request = lm_message_node_add_child (m->node, "request", NULL);
+    lm_message_node_set_attributes (request,
+                                    "xmlns", XMPP_NS_HTTP_UPLOAD,
+                                    "filename", file->filename,
+                                    "size", size,
+                                    "content-type", file->content_type,
+                                    NULL);
+    g_free (size);
+
+    file->state = UPLOAD_STATE_SLOT;
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) upload_slot_reply,
+                                      upload_file_ref (file),
+                                      (GDestroyNotify) upload_file_unref);
+    result = lm_connection_send_with_reply (file->upload->connection, m,
+                                            handler, NULL);
+    lm_message_handler_unref (handler);
+    lm_message_unref (m);
+
+    return result;
+}
+
+/* Starts queued files while there is room */
+static void
+upload_schedule (LmHttpUpload *upload)
+{
+    while (!upload->cancelling &&
+           g_list_length (upload->active) < upload->max_uploads &&
+           !g_queue_is_empty (upload->queued)) {
+        UploadFile *file = g_queue_pop_head (upload->queued);
+
+        upload->active = g_list_prepend (upload->active, file);
+
+        if (!upload_file_request_slot (file)) {
+            upload_file_finish (file, FALSE);
+        }
+    }
+}
+
+/**
+ * lm_http_upload_new:
+ * @connection: the #LmConnection to request slots over
+ * @service: JID of the upload service
+ *
+ * Creates a new uploader for files to @service.
+ *
+ * Return value: a newly created #LmHttpUpload, free with lm_http_upload_unref().
+ **/
+LmHttpUpload *
+lm_http_upload_new (LmConnection *connection, const gchar *service)
+{
+    LmHttpUpload *upload;
+    GMainContext *context;
+
+    g_return_val_if_fail (connection != NULL, NULL);
+    g_return_val_if_fail (service != NULL, NULL);
+
+    upload = g_new0 (LmHttpUpload, 1);
+    upload->ref_count = 1;
+    upload->connection = lm_connection_ref (connection);
+    upload->service = g_strdup (service);
+    upload->max_uploads = HTTP_UPLOAD_DEFAULT_MAX_UPLOADS;
+    upload->queued = g_queue_new ();
+
+    context = _lm_connection_get_context (connection);
+    if (context) {
+        upload->context = g_main_context_ref (context);
+    }
+
+    return upload;
+}
+
+/**
+ * lm_http_upload_get_max_uploads:
+ * @upload: an #LmHttpUpload
+ *
+ * Get the number of files uploaded at the same time.
+ *
+ * Return value: the most files uploaded at once.
+ **/
+guint
+lm_http_upload_get_max_uploads (LmHttpUpload *upload)
+{
+    g_return_val_if_fail (upload != NULL, 0);
+
+    return upload->max_uploads;
+}
+
+/**
+ * lm_http_upload_set_max_uploads:
+ * @upload: an #LmHttpUpload
+ * @max_uploads: the most files to upload at once, at least 1
+ *
+ * Sets how many files are uploaded at the same time, 2 by default. Files
+ * added beyond that wait until an upload is over.
+ **/
+void
+lm_http_upload_set_max_uploads (LmHttpUpload *upload, guint max_uploads)
+{
+    g_return_if_fail (upload != NULL);
+    g_return_if_fail (max_uploads > 0);
+
+    upload->max_uploads = max_uploads;
+
+    upload_schedule (upload);
+}
+
+/**
+ * lm_http_upload_set_ssl_function:
+ * @upload: an #LmHttpUpload
+ * @function: function checking the certificates of HTTPS servers
+ * @user_data: user data passed to @function
+ * @notify: function to free @user_data, or %NULL
+ *
+ * Sets the function that decides whether to go on with an upload when
+ * something is wrong with the certificate of the HTTPS server. Without
+ * one the upload fails on any certificate problem. The protocol versions
+ * and ciphers are taken from the #LmSSL of the connection, if it has one.
+ **/
+void
+lm_http_upload_set_ssl_function (LmHttpUpload   *upload,
+                                 LmSSLFunction   function,
+                                 gpointer        user_data,
+                                 GDestroyNotify  notify)
+{
+    g_return_if_fail (upload != NULL);
+
+    if (upload->ssl_cb) {
+        _lm_utils_free_callback (upload->ssl_cb);
+    }
+
+    upload->ssl_cb = _lm_utils_new_callback (function, user_data, notify);
+}
+
+/**
+ * lm_http_upload_send_file:
+ * @upload: an #LmHttpUpload
+ * @fd: file descriptor to send from
+ * @filename: name of the file, without a path
+ * @size: number of bytes to send from the start of @fd
+ * @content_type: MIME type of the file, or %NULL
+ * @progress: function to call as the file is sent, or %NULL
+ * @function: function to call when the upload is over
+ * @user_data: user data passed to @progress and @function
+ * @notify: function to free @user_data, or %NULL
+ * @error: location to store error, or %NULL
+ *
+ * Adds a file to upload. Once its turn comes a slot is requested from
+ * the service and the file is sent to it. @fd has to stay open until
+ * @function has been called with the URL to share, or %NULL if the
+ * upload failed.
+ *
+ * Return value: %TRUE if the file was added.
+ **/
+gboolean
+lm_http_upload_send_file (LmHttpUpload                 *upload,
+                          gint                          fd,
+                          const gchar                  *filename,
+                          guint64                       size,
+                          const gchar                  *content_type,
+                          LmHttpUploadProgressFunction  progress,
+                          LmHttpUploadFunction          function,
+                          gpointer                      user_data,
+                          GDestroyNotify                notify,
+                          GError                      **error)
+{
+    UploadFile *file;
+
+    g_return_val_if_fail (upload != NULL, FALSE);
+    g_return_val_if_fail (fd >= 0, FALSE);
+    g_return_val_if_fail (filename != NULL, FALSE);
+
+    if (!lm_connection_is_authenticated (upload->connection)) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_NOT_OPEN,
+                     "Connection is not authenticated");
+        return FALSE;
+    }
+
+    file = g_new0 (UploadFile, 1);
+    file->ref_count = 1;
+    file->upload = upload;
+    file->state = UPLOAD_STATE_QUEUED;
+    file->file_fd = fd;
+    file->fd = -1;
+    file->filename = g_strdup (filename);
+    file->content_type = g_strdup (content_type ? content_type :
+                                   HTTP_UPLOAD_DEFAULT_TYPE);
+    file->size = size;
+    file->progress = progress;
+    file->result_cb = _lm_utils_new_callback (function, user_data, notify);
+
+    /* Dropped when the file is done */
+    lm_http_upload_ref (upload);
+
+    g_queue_push_tail (upload->queued, file);
+    upload_schedule (upload);
+
+    return TRUE;
+}
+
+/**
+ * lm_http_upload_cancel:
+ * @upload: an #LmHttpUpload
+ *
+ * Stops all uploads, running and waiting. Their functions are called
+ * with a %NULL URL.
+ **/
+void
+lm_http_upload_cancel (LmHttpUpload *upload)
+{
+    g_return_if_fail (upload != NULL);
+
+    lm_http_upload_ref (upload);
+
+    /* Nothing queued may start while the running ones are stopped */
+    upload->cancelling = TRUE;
+
+    while (upload->active) {
+        upload_file_finish (upload->active->data, FALSE);
+    }
+
+    while (!g_queue_is_empty (upload->queued)) {
+        upload_file_finish (g_queue_peek_head (upload->queued), FALSE);
+    }
+
+    upload->cancelling = FALSE;
+
+    lm_http_upload_unref (upload);
+}
+
+/**
+ * lm_http_upload_ref:
+ * @upload: an #LmHttpUpload
+ *
+ * Adds a reference to @upload.
+ *
+ * Return value: the uploader
+ **/
+LmHttpUpload *
+lm_http_upload_ref (LmHttpUpload *upload)
+{
+    g_return_val_if_fail (upload != NULL, NULL);
+
+    upload->ref_count++;
+
+    return upload;
+}
+
+/**
+ * lm_http_upload_unref:
+ * @upload: an #LmHttpUpload
+ *
+ * Removes a reference from @upload. Files still to be uploaded keep a
+ * reference of their own until they are done.
+ **/
+void
+lm_http_upload_unref (LmHttpUpload *upload)
+{
+    g_return_if_fail (upload != NULL);
+
+    upload->ref_count--;
+
+    if (upload->ref_count > 0) {
+        return;
+    }
+
+    if (upload->ssl_cb) {
+        _lm_utils_free_callback (upload->ssl_cb);
+    }
+
+    if (upload->context) {
+        g_main_context_unref (upload->context);
+    }
+
+    lm_connection_unref (upload->connection);
+    g_queue_free (upload->queued);
+    g_free (upload->service);
+    g_free (upload);
+}
@@ -0,0 +1,91 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_HTTP_UPLOAD_H__
+#define __LM_HTTP_UPLOAD_H__
+
+#if !defined (LM_INSIDE_LOUDMOUTH_H) && !defined (LM_COMPILATION)
+#error "Only <loudmouth/loudmouth.h> can be included directly, this file may disappear or change contents."
+#endif
+
+#include <loudmouth/lm-connection.h>
+#include <loudmouth/lm-ssl.h>
+
+G_BEGIN_DECLS
+
+/**
+ * LmHttpUpload:
+ *
+ * This should not be accessed directly. Use the accessor functions as described below.
+ */
+typedef struct _LmHttpUpload LmHttpUpload;
+
+/**
+ * LmHttpUploadFunction:
+ * @upload: the #LmHttpUpload
+ * @get_url: URL the file can be downloaded from, %NULL if the upload failed
+ * @user_data: user data passed to lm_http_upload_send_file()
+ *
+ * Called once when the upload of a file is over.
+ */
+typedef void (* LmHttpUploadFunction)         (LmHttpUpload *upload,
+                                               const gchar  *get_url,
+                                               gpointer      user_data);
+
+/**
+ * LmHttpUploadProgressFunction:
+ * @upload: the #LmHttpUpload
+ * @sent: number of bytes of the file sent so far
+ * @total: size of the file
+ * @user_data: user data passed to lm_http_upload_send_file()
+ *
+ * Called as the file is sent.
+ */
+typedef void (* LmHttpUploadProgressFunction) (LmHttpUpload *upload,
+                                               guint64       sent,
+                                               guint64       total,
+                                               gpointer      user_data);
+
+LmHttpUpload * lm_http_upload_new              (LmConnection         *connection,
+                                                const gchar          *service);
+guint          lm_http_upload_get_max_uploads  (LmHttpUpload         *upload);
+void           lm_http_upload_set_max_uploads  (LmHttpUpload         *upload,
+                                                guint                 max_uploads);
+void           lm_http_upload_set_ssl_function (LmHttpUpload         *upload,
+                                                LmSSLFunction         function,
+                                                gpointer              user_data,
+                                                GDestroyNotify        notify);
+gboolean       lm_http_upload_send_file        (LmHttpUpload         *upload,
+                                                gint                  fd,
+                                                const gchar          *filename,
+                                                guint64               size,
+                                                const gchar          *content_type,
+                                                LmHttpUploadProgressFunction progress,
+                                                LmHttpUploadFunction  function,
+                                                gpointer              user_data,
+                                                GDestroyNotify        notify,
+                                                GError              **error);
+void           lm_http_upload_cancel           (LmHttpUpload         *upload);
+LmHttpUpload * lm_http_upload_ref              (LmHttpUpload         *upload);
+void           lm_http_upload_unref            (LmHttpUpload         *upload);
+
+G_END_DECLS
+
+#endif /* __LM_HTTP_UPLOAD_H__ */
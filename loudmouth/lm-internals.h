@@ -62,6 +62,13 @@ typedef struct {
 GMainContext *   _lm_connection_get_context       (LmConnection       *conn);
 /* Need to free the return value */
 gchar *          _lm_connection_get_server        (LmConnection       *conn);
+gboolean         _lm_connection_send_raw_with_reply (LmConnection     *conn,
+                                                     gchar            *str,
+                                                     const gchar      *id,
+                                                     LmMessageHandler *handler,
+                                                     GError          **error);
+void             _lm_connection_handle_message    (LmConnection       *conn,
+                                                   LmMessage          *m);
 gboolean         _lm_old_socket_failed_with_error (LmConnectData         *data,
                                                    int                    error);
 gboolean         _lm_old_socket_failed            (LmConnectData         *data);
@@ -83,10 +90,25 @@ void
 _lm_message_node_add_child_node               (LmMessageNode         *node,
                                                LmMessageNode         *child);
 LmMessageNode *  _lm_message_node_new         (const gchar           *name);
+void
+_lm_message_node_remove_attribute             (LmMessageNode         *node,
+                                               const gchar           *name);
+void
+_lm_message_node_foreach_attribute            (LmMessageNode         *node,
+                                               GHFunc                 func,
+                                               gpointer               user_data);
+const gchar *    _lm_message_node_local_name  (const gchar           *name);
+void             _lm_message_node_set_ns      (LmMessageNode         *node,
+                                               GQuark                 ns_id,
+                                               const gchar           *ns);
+const gchar *    _lm_message_node_get_ns      (LmMessageNode         *node);
 void             _lm_debug_init               (void);
 gboolean         _lm_proxy_connect_cb         (GIOChannel            *source,
                                                GIOCondition           condition,
                                                gpointer               data);
+gchar *          _lm_proxy_connect_request    (LmProxy               *proxy,
+                                               const gchar           *server,
+                                               guint                  port);
 LmHandlerResult    
 _lm_message_handler_handle_message            (LmMessageHandler      *handler,
                                                LmConnection          *conn,
@@ -116,4 +138,12 @@ gchar       *    _lm_sock_get_local_host      (LmOldSocketT              sock);
 
 gboolean         _lm_sock_set_keepalive       (LmOldSocketT              sock,
                                                int                    delay);
+gssize           _lm_sock_send_file           (LmOldSocketT              sock,
+                                               gint                   fd,
+                                               off_t                 *offset,
+                                               gsize                  count);
+gssize           _lm_sock_recv_file           (LmOldSocketT              sock,
+                                               gint                   fd,
+                                               gint                  *pipe_fds,
+                                               gsize                  count);
 #endif /* __LM_INTERNALS_H__ */
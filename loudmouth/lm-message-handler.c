@@ -138,7 +138,7 @@ lm_message_handler_ref (LmMessageHandler *handler)
 {
     g_return_val_if_fail (handler != NULL, NULL);
         
-    handler->ref_count++;
+    g_atomic_int_inc (&handler->ref_count);
 
     return handler;
 }
@@ -155,9 +155,7 @@ lm_message_handler_unref (LmMessageHandler *handler)
 {
     g_return_if_fail (handler != NULL);
         
-    handler->ref_count --;
-        
-    if (handler->ref_count == 0) {
+    if (g_atomic_int_dec_and_test (&handler->ref_count)) {
         if (handler->notify) {
             (* handler->notify) (handler->user_data);
         }
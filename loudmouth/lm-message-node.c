@@ -30,13 +30,71 @@
 #include "lm-internals.h"
 #include "lm-message-node.h"
 
+#define XML_NS "http://www.w3.org/XML/1998/namespace"
+
 typedef struct {
     gchar *key;
     gchar *value;
 } KeyValuePair;
 
+/* Ids are only ever looked up, never made from names and namespaces
+ * read off the wire, so a peer can't grow the quark table. Names
+ * nobody interned have no id and are compared as strings. */
+typedef struct {
+    LmMessageNode  node;
+
+    GQuark         ns_id;
+    GQuark         name_id;
+    gchar         *ns;      /* Only for a namespace without an id */
+} MessageNodePriv;
+
+#define PRIV(node) ((MessageNodePriv *) (node))
+
+/* What the library itself matches on, interned before the first node */
+static const gchar *known_names[] = {
+    "jabber:client",
+    "http://etherx.jabber.org/streams",
+    XML_NS,
+    "urn:ietf:params:xml:ns:xmpp-sasl",
+    "urn:ietf:params:xml:ns:xmpp-tls",
+    "urn:ietf:params:xml:ns:xmpp-bind",
+    "urn:ietf:params:xml:ns:xmpp-session",
+    "urn:ietf:params:xml:ns:xmpp-stanzas",
+    "urn:xmpp:sasl:2",
+    "urn:xmpp:bind:0",
+    "urn:xmpp:fast:0",
+    "urn:xmpp:ping",
+    "urn:xmpp:csi:0",
+    "http://jabber.org/protocol/disco#info",
+    "http://jabber.org/protocol/disco#items",
+    "http://jabber.org/protocol/address",
+    "http://jabber.org/protocol/compress",
+    "http://jabber.org/protocol/compress/exi",
+    "http://jabber.org/protocol/bytestreams",
+    "http://jabber.org/protocol/ibb",
+
+    "stream",
+    "features",
+    "error",
+    "message",
+    "presence",
+    "iq",
+    "auth",
+    "challenge",
+    "response",
+    "success",
+    "failure",
+    "proceed",
+    "starttls",
+    "ping",
+    "query",
+    "compressed",
+    NULL
+};
+
 static void            message_node_free            (LmMessageNode    *node);
 static LmMessageNode * message_node_last_child      (LmMessageNode    *node);
+static const gchar *   message_node_find_ns         (LmMessageNode    *node);
 
 static void
 message_node_free (LmMessageNode *node)
@@ -65,6 +123,7 @@ message_node_free (LmMessageNode *node)
     }
         
     g_slist_free (node->attributes);
+    g_free (PRIV (node)->ns);
     g_free (node);
 }
 
@@ -88,12 +147,27 @@ message_node_last_child (LmMessageNode *node)
     return l;
 }
 
+static gpointer
+message_node_intern_known (gpointer data)
+{
+    gint i;
+
+    for (i = 0; known_names[i]; ++i) {
+        g_quark_from_static_string (known_names[i]);
+    }
+
+    return NULL;
+}
+
 LmMessageNode *
 _lm_message_node_new (const gchar *name)
 {
+    static GOnce   once = G_ONCE_INIT;
     LmMessageNode *node;
 
-    node = g_new0 (LmMessageNode, 1);
+    g_once (&once, message_node_intern_known, NULL);
+
+    node = (LmMessageNode *) g_new0 (MessageNodePriv, 1);
         
     node->name       = g_strdup (name);
     node->value      = NULL;
@@ -106,8 +180,55 @@ _lm_message_node_new (const gchar *name)
 
     node->ref_count  = 1;
 
+    PRIV (node)->name_id =
+        g_quark_try_string (_lm_message_node_local_name (name));
+
     return node;
 }
+
+/* The part of the qualified @name after the prefix */
+const gchar *
+_lm_message_node_local_name (const gchar *name)
+{
+    const gchar *colon;
+
+    colon = strchr (name, ':');
+
+    return colon ? colon + 1 : name;
+}
+
+/* Sets the namespace the parser found for @node, @ns is only kept if
+ * it has no @ns_id */
+void
+_lm_message_node_set_ns (LmMessageNode *node,
+                         GQuark         ns_id,
+                         const gchar   *ns)
+{
+    MessageNodePriv *priv = PRIV (node);
+
+    g_free (priv->ns);
+
+    priv->ns_id = ns_id;
+    priv->ns    = ns_id ? NULL : g_strdup (ns);
+}
+
+/* The namespace of @node, NULL if it isn't in one */
+const gchar *
+_lm_message_node_get_ns (LmMessageNode *node)
+{
+    MessageNodePriv *priv = PRIV (node);
+
+    if (priv->ns_id) {
+        return g_quark_to_string (priv->ns_id);
+    }
+
+    if (priv->ns) {
+        return priv->ns;
+    }
+
+    return message_node_find_ns (node);
+}
+
 void
 _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
 {
@@ -128,6 +249,46 @@ _lm_message_node_add_child_node (LmMessageNode *node, LmMessageNode *child)
     child->parent = node;
 }
 
+void
+_lm_message_node_remove_attribute (LmMessageNode *node, const gchar *name)
+{
+    GSList *l;
+
+    g_return_if_fail (node != NULL);
+    g_return_if_fail (name != NULL);
+
+    for (l = node->attributes; l; l = l->next) {
+        KeyValuePair *kvp = (KeyValuePair *) l->data;
+
+        if (strcmp (kvp->key, name) == 0) {
+            node->attributes = g_slist_delete_link (node->attributes, l);
+            g_free (kvp->key);
+            g_free (kvp->value);
+            g_free (kvp);
+            break;
+        }
+    }
+}
+
+/* Calls @func with the name and value of each attribute, in the order
+ * they are stored in */
+void
+_lm_message_node_foreach_attribute (LmMessageNode *node,
+                                    GHFunc         func,
+                                    gpointer       user_data)
+{
+    GSList *l;
+
+    g_return_if_fail (node != NULL);
+    g_return_if_fail (func != NULL);
+
+    for (l = node->attributes; l; l = l->next) {
+        KeyValuePair *kvp = (KeyValuePair *) l->data;
+
+        (* func) (kvp->key, kvp->value, user_data);
+    }
+}
+
 /**
  * lm_message_node_get_value:
  * @node: an #LmMessageNode
@@ -360,6 +521,130 @@ lm_message_node_find_child (LmMessageNode *node,
     return NULL;
 }
 
+/**
+ * lm_message_node_get_ns_id:
+ * @node: an #LmMessageNode
+ *
+ * Gets the namespace @node is in as a #GQuark, so it can be compared with
+ * g_quark_from_static_string() of the namespace instead of comparing
+ * strings. Nodes from the parser know about namespaces declared anywhere
+ * in the stream, including the stream header. For nodes built with
+ * lm_message_node_add_child() only declarations on @node and its parents
+ * are taken into account. Namespaces are never interned here, one nobody
+ * has interned has no id.
+ *
+ * Return value: the namespace id or 0 if @node isn't in a namespace or
+ * it has no id
+ **/
+GQuark
+lm_message_node_get_ns_id (LmMessageNode *node)
+{
+    const gchar *ns;
+
+    g_return_val_if_fail (node != NULL, 0);
+
+    if (PRIV (node)->ns_id) {
+        return PRIV (node)->ns_id;
+    }
+
+    ns = _lm_message_node_get_ns (node);
+
+    return ns ? g_quark_try_string (ns) : 0;
+}
+
+/* Looks for the declaration of the prefix of @node on it and its
+ * parents */
+static const gchar *
+message_node_find_ns (LmMessageNode *node)
+{
+    LmMessageNode *l;
+    const gchar   *colon;
+    gsize          len = 0;
+
+    colon = strchr (node->name, ':');
+    if (colon) {
+        len = colon - node->name;
+
+        if (len == 3 && strncmp (node->name, "xml", 3) == 0) {
+            return XML_NS;
+        }
+    }
+
+    for (l = node; l; l = l->parent) {
+        GSList *list;
+
+        for (list = l->attributes; list; list = list->next) {
+            KeyValuePair *kvp = (KeyValuePair *) list->data;
+
+            if (strncmp (kvp->key, "xmlns", 5) != 0) {
+                continue;
+            }
+
+            if (colon ? (kvp->key[5] == ':' &&
+                         strncmp (kvp->key + 6, node->name, len) == 0 &&
+                         kvp->key[6 + len] == '\0') : kvp->key[5] == '\0') {
+                return kvp->value;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * lm_message_node_get_name_id:
+ * @node: an #LmMessageNode
+ *
+ * Gets the name of @node without its namespace prefix as a #GQuark.
+ * Like for lm_message_node_get_ns_id() the name isn't interned.
+ *
+ * Return value: the local name id or 0 if it has none
+ **/
+GQuark
+lm_message_node_get_name_id (LmMessageNode *node)
+{
+    g_return_val_if_fail (node != NULL, 0);
+
+    if (PRIV (node)->name_id) {
+        return PRIV (node)->name_id;
+    }
+
+    /* Interned by someone after @node was made */
+    return g_quark_try_string (_lm_message_node_local_name (node->name));
+}
+
+/**
+ * lm_message_node_get_child_by_id:
+ * @node: an #LmMessageNode
+ * @ns_id: namespace id of the child or 0 to allow any namespace
+ * @name_id: local name id of the child
+ *
+ * Like lm_message_node_get_child() but matches on namespace and local
+ * name, see lm_message_node_get_ns_id() and lm_message_node_get_name_id().
+ * Whatever prefix the other end chose for the namespace doesn't matter.
+ *
+ * Return value: the child node or %NULL if not found
+ **/
+LmMessageNode *
+lm_message_node_get_child_by_id (LmMessageNode *node,
+                                 GQuark         ns_id,
+                                 GQuark         name_id)
+{
+    LmMessageNode *l;
+
+    g_return_val_if_fail (node != NULL, NULL);
+    g_return_val_if_fail (name_id != 0, NULL);
+
+    for (l = node->children; l; l = l->next) {
+        if (lm_message_node_get_name_id (l) == name_id &&
+            (ns_id == 0 || lm_message_node_get_ns_id (l) == ns_id)) {
+            return l;
+        }
+    }
+
+    return NULL;
+}
+
 /**
  * lm_message_node_get_raw_mode:
  * @node: an #LmMessageNode
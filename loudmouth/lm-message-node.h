@@ -76,6 +76,11 @@ LmMessageNode *lm_message_node_get_child      (LmMessageNode *node,
                                                const gchar   *child_name);
 LmMessageNode *lm_message_node_find_child     (LmMessageNode *node,
                                                const gchar   *child_name);
+GQuark         lm_message_node_get_ns_id      (LmMessageNode *node);
+GQuark         lm_message_node_get_name_id    (LmMessageNode *node);
+LmMessageNode *lm_message_node_get_child_by_id (LmMessageNode *node,
+                                                GQuark         ns_id,
+                                                GQuark         name_id);
 gboolean       lm_message_node_get_raw_mode   (LmMessageNode *node);
 void           lm_message_node_set_raw_mode   (LmMessageNode *node,
                                                gboolean       raw_mode);
@@ -20,10 +20,20 @@
 
 #include <config.h>
 
+#include <string.h>
+
 #include "lm-message-queue.h"
 
+#define MESSAGE_QUEUE_MIN_SIZE 16
+
+/* The messages are kept in a ring buffer. The first message is at
+ * messages[head] and the following ones wrap around the end of the
+ * array. The size is always a power of two so positions can be masked. */
 struct _LmMessageQueue {
-    GQueue                  *messages;
+    LmMessage              **messages;
+    guint                    size;
+    guint                    head;
+    guint                    length;
 
     GMainContext            *context;
     GSource                 *source;
@@ -54,23 +64,46 @@ static GSourceFuncs source_funcs = {
     NULL
 };
 
-static void
-foreach_free_message (LmMessage *m, gpointer user_data)
-{
-    lm_message_unref (m);
-}
+#define MESSAGE_QUEUE_SLOT(q,n) (((q)->head + (n)) & ((q)->size - 1))
 
 static void
 message_queue_free (LmMessageQueue *queue)
 {
+    guint i;
+
     lm_message_queue_detach (queue);
-    
-    g_queue_foreach (queue->messages, (GFunc) foreach_free_message, NULL);
-    g_queue_free (queue->messages);
+
+    for (i = 0; i < queue->length; ++i) {
+        lm_message_unref (queue->messages[MESSAGE_QUEUE_SLOT (queue, i)]);
+    }
+    g_free (queue->messages);
 
     g_free (queue);
 }
 
+static void
+message_queue_grow (LmMessageQueue *queue)
+{
+    LmMessage **messages;
+    guint       size;
+    guint       first;
+
+    size = queue->size * 2;
+    messages = g_new (LmMessage *, size);
+
+    /* Unwrap so that the first message ends up at index 0 */
+    first = MIN (queue->length, queue->size - queue->head);
+    memcpy (messages, queue->messages + queue->head,
+            first * sizeof (LmMessage *));
+    memcpy (messages + first, queue->messages,
+            (queue->length - first) * sizeof (LmMessage *));
+
+    g_free (queue->messages);
+    queue->messages = messages;
+    queue->size = size;
+    queue->head = 0;
+}
+
 static gboolean
 message_queue_prepare_func (GSource *source, gint *timeout)
 {
@@ -78,7 +111,7 @@ message_queue_prepare_func (GSource *source, gint *timeout)
 
     queue = ((MessageQueueSource *)source)->queue;
 
-    return !g_queue_is_empty (queue->messages);
+    return queue->length > 0;
 }
 
 static gboolean
@@ -111,7 +144,10 @@ lm_message_queue_new (LmMessageQueueCallback  callback,
 
     queue = g_new0 (LmMessageQueue, 1);
 
-    queue->messages = g_queue_new ();
+    queue->size = MESSAGE_QUEUE_MIN_SIZE;
+    queue->messages = g_new (LmMessage *, queue->size);
+    queue->head = 0;
+    queue->length = 0;
     queue->context = NULL;
     queue->source = NULL;
     queue->ref_count = 1;
@@ -168,7 +204,12 @@ lm_message_queue_push_tail (LmMessageQueue *queue, LmMessage *m)
     g_return_if_fail (queue != NULL);
     g_return_if_fail (m != NULL);
 
-    g_queue_push_tail (queue->messages, m);
+    if (queue->length == queue->size) {
+        message_queue_grow (queue);
+    }
+
+    queue->messages[MESSAGE_QUEUE_SLOT (queue, queue->length)] = m;
+    queue->length++;
 }
 
 LmMessage *
@@ -176,15 +217,45 @@ lm_message_queue_peek_nth (LmMessageQueue *queue, guint n)
 {
     g_return_val_if_fail (queue != NULL, NULL);
 
-    return (LmMessage *) g_queue_peek_nth (queue->messages, n);
+    if (n >= queue->length) {
+        return NULL;
+    }
+
+    return queue->messages[MESSAGE_QUEUE_SLOT (queue, n)];
 }
 
 LmMessage *
 lm_message_queue_pop_nth (LmMessageQueue *queue, guint n)
 {
+    LmMessage *m;
+    guint      i;
+
     g_return_val_if_fail (queue != NULL, NULL);
 
-    return (LmMessage *) g_queue_pop_nth (queue->messages, n);
+    if (n >= queue->length) {
+        return NULL;
+    }
+
+    m = queue->messages[MESSAGE_QUEUE_SLOT (queue, n)];
+
+    /* Close the gap from whichever end is closer, popping the first or
+     * the last message doesn't move anything */
+    if (n < queue->length / 2) {
+        for (i = n; i > 0; --i) {
+            queue->messages[MESSAGE_QUEUE_SLOT (queue, i)] =
+                queue->messages[MESSAGE_QUEUE_SLOT (queue, i - 1)];
+        }
+        queue->head = MESSAGE_QUEUE_SLOT (queue, 1);
+    } else {
+        for (i = n; i + 1 < queue->length; ++i) {
+            queue->messages[MESSAGE_QUEUE_SLOT (queue, i)] =
+                queue->messages[MESSAGE_QUEUE_SLOT (queue, i + 1)];
+        }
+    }
+
+    queue->length--;
+
+    return m;
 }
 
 guint
@@ -192,7 +263,7 @@ lm_message_queue_get_length (LmMessageQueue *queue)
 {
     g_return_val_if_fail (queue != NULL, 0);
 
-    return g_queue_get_length (queue->messages);
+    return queue->length;
 }
 
 gboolean 
@@ -200,7 +271,7 @@ lm_message_queue_is_empty (LmMessageQueue *queue)
 {
     g_return_val_if_fail (queue != NULL, TRUE);
 
-    return g_queue_is_empty (queue->messages);
+    return queue->length == 0;
 }
 
 LmMessageQueue *
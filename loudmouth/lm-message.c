@@ -34,6 +34,8 @@
 
 #define PRIV(o) ((LmMessage *)o)->priv
 
+#define XMPP_NS_STREAMS "http://etherx.jabber.org/streams"
+
 static struct TypeNames 
 {
     LmMessageType  type;
@@ -102,6 +104,64 @@ message_type_from_string (const gchar *type_str)
     return LM_MESSAGE_TYPE_UNKNOWN;
 }
 
+/* Local names of the types, indexed like type_names */
+static gpointer
+message_init_type_ids (gpointer data)
+{
+    GQuark *ids;
+    gint    i;
+
+    ids = g_new0 (GQuark, LM_MESSAGE_TYPE_UNKNOWN + 1);
+
+    for (i = LM_MESSAGE_TYPE_MESSAGE; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
+        ids[i] = g_quark_from_static_string (
+            _lm_message_node_local_name (type_names[i].name));
+    }
+
+    /* Also keeps the namespace of the stream elements */
+    ids[LM_MESSAGE_TYPE_UNKNOWN] = g_quark_from_static_string (XMPP_NS_STREAMS);
+
+    return ids;
+}
+
+/* Compares interned namespace and local name, so the stream elements are
+ * found whatever prefix the server uses for them */
+static LmMessageType
+message_type_from_node (LmMessageNode *node)
+{
+    static GOnce  once = G_ONCE_INIT;
+    GQuark       *ids;
+    GQuark        ns_id;
+    GQuark        name_id;
+    gboolean      in_stream_ns;
+    gint          i;
+
+    ns_id = lm_message_node_get_ns_id (node);
+    name_id = lm_message_node_get_name_id (node);
+
+    if (!ns_id || !name_id) {
+        /* Built without namespace information or not a name we know,
+         * go by the name */
+        return message_type_from_string (node->name);
+    }
+
+    ids = g_once (&once, message_init_type_ids, NULL);
+    in_stream_ns = ns_id == ids[LM_MESSAGE_TYPE_UNKNOWN];
+
+    for (i = LM_MESSAGE_TYPE_MESSAGE; i < LM_MESSAGE_TYPE_UNKNOWN; ++i) {
+        gboolean is_stream_type;
+
+        is_stream_type = (i == LM_MESSAGE_TYPE_STREAM ||
+                          i == LM_MESSAGE_TYPE_STREAM_ERROR ||
+                          i == LM_MESSAGE_TYPE_STREAM_FEATURES);
+
+        if (ids[i] == name_id && is_stream_type == in_stream_ns) {
+            return type_names[i].type;
+        }
+    }
+
+    return LM_MESSAGE_TYPE_UNKNOWN;
+}
 
 const gchar *
 _lm_message_type_to_string (LmMessageType type)
@@ -179,7 +239,7 @@ _lm_message_new_from_node (LmMessageNode *node)
     LmMessageSubType  sub_type;
     const gchar      *sub_type_str;
     
-    type = message_type_from_string (node->name);
+    type = message_type_from_node (node);
 
     if (type == LM_MESSAGE_TYPE_UNKNOWN) {
         return NULL;
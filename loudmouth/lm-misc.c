@@ -24,6 +24,11 @@
 
 #include "lm-misc.h"
 
+static LmMiscTimeoutFunc timeout_func = NULL;
+static gpointer          timeout_func_data = NULL;
+static LmMiscTimeFunc    time_func = NULL;
+static gpointer          time_func_data = NULL;
+
 static void
 misc_setup_source (GMainContext *context,
                    GSource      *source,
@@ -77,12 +82,73 @@ lm_misc_add_timeout (GMainContext *context,
                                                                                 
     g_return_val_if_fail (function != NULL, 0);
                                                                                 
-    source = g_timeout_source_new (interval);
+    if (timeout_func) {
+        source = (timeout_func) (interval, timeout_func_data);
+    } else {
+        source = g_timeout_source_new (interval);
+    }
     misc_setup_source (context, source, function, data);
   
     return source;
 }
 
+/* Lets tests replace the clock used by all Loudmouth timeouts. The
+ * returned source is attached by lm_misc_add_timeout() and has to behave
+ * like one from g_timeout_source_new(). Pass NULL to restore the default. */
+void
+_lm_misc_set_timeout_func (LmMiscTimeoutFunc func, gpointer user_data)
+{
+    timeout_func = func;
+    timeout_func_data = user_data;
+}
+
+/* Milliseconds on the clock driving lm_misc_add_timeout(), only useful
+ * for measuring intervals */
+guint64
+lm_misc_get_time (void)
+{
+#if !GLIB_CHECK_VERSION (2, 28, 0)
+    GTimeVal now;
+#endif
+
+    if (time_func) {
+        return (time_func) (time_func_data);
+    }
+
+#if GLIB_CHECK_VERSION (2, 28, 0)
+    return g_get_monotonic_time () / 1000;
+#else
+    g_get_current_time (&now);
+
+    return (guint64) now.tv_sec * 1000 + now.tv_usec / 1000;
+#endif
+}
+
+/* Microseconds on the monotonic clock where there is one, never replaced
+ * by tests since it measures the time spent by the process itself */
+gint64
+lm_misc_get_timestamp (void)
+{
+#if GLIB_CHECK_VERSION (2, 28, 0)
+    return g_get_monotonic_time ();
+#else
+    GTimeVal now;
+
+    g_get_current_time (&now);
+
+    return (gint64) now.tv_sec * G_USEC_PER_SEC + now.tv_usec;
+#endif
+}
+
+/* Replaces lm_misc_get_time() along with the timeouts, pass NULL to
+ * restore the default */
+void
+_lm_misc_set_time_func (LmMiscTimeFunc func, gpointer user_data)
+{
+    time_func = func;
+    time_func_data = user_data;
+}
+
 const char *
 lm_misc_io_condition_to_str  (GIOCondition condition)
 {
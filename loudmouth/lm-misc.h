@@ -23,6 +23,10 @@
 
 #include <glib.h>
 
+typedef GSource * (* LmMiscTimeoutFunc)         (guint         interval,
+                                                 gpointer      user_data);
+typedef guint64   (* LmMiscTimeFunc)            (gpointer      user_data);
+
 GSource *          lm_misc_add_io_watch         (GMainContext *context,
                                                  GIOChannel   *chan,
                                                  GIOCondition  condition,
@@ -36,8 +40,16 @@ GSource *          lm_misc_add_timeout          (GMainContext *context,
                                                  GSourceFunc   function,
                                                  gpointer      data);
 
+guint64            lm_misc_get_time             (void);
+gint64             lm_misc_get_timestamp        (void);
+
 const char *       lm_misc_io_condition_to_str  (GIOCondition    condition);
 
+void               _lm_misc_set_timeout_func    (LmMiscTimeoutFunc func,
+                                                 gpointer          user_data);
+void               _lm_misc_set_time_func       (LmMiscTimeFunc    func,
+                                                 gpointer          user_data);
+
 
 #endif /* __LM_MISC_H__ */
 
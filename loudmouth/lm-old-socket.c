@@ -53,42 +53,72 @@
 #define IN_BUFFER_SIZE 1024
 #define SRV_LEN 8192
 
+/* Address lookup started before we know if it will be needed, see
+ * old_socket_lookup_start () */
+typedef struct {
+    LmResolver       *resolver;
+    gchar            *host;
+    gboolean          done;
+    LmResolverResult  result;
+} OldSocketLookup;
+
+typedef struct {
+    guint64        offset;
+    WriteMarkFunc  func;
+    gpointer       user_data;
+} WriteMark;
+
 struct _LmOldSocket {
-    LmConnection      *connection;
-    GMainContext      *context;
+    /* Touched on every read and write, kept together at the top */
+    LmOldSocketT       fd;
+    gboolean           ssl_started;
+    GIOChannel        *io_channel;
+    LmSSL             *ssl;
+    GString           *out_buf;
+    GSource           *watch_out;
+    IncomingDataFunc   data_func;
+    gpointer           user_data;
 
-    gchar             *domain;
-    gchar             *server;
-    guint              port;
+    /* Bytes handed to lm_old_socket_write() and accepted by the kernel,
+     * WriteMarks wait for the second to catch up with their offset */
+    guint64            bytes_queued;
+    guint64            bytes_written;
+    GQueue            *write_marks;
+    gboolean           write_failed;
 
-    LmSSL             *ssl;
-    gboolean           ssl_started;
-    LmProxy           *proxy;
+    LmConnection      *connection;
+    GMainContext      *context;
+    guint              ref_count;
 
-    GIOChannel        *io_channel;
     GSource           *watch_in;
     GSource           *watch_err;
     GSource           *watch_hup;
 
-    LmOldSocketT       fd;
-
-    GSource           *watch_connect;
+    SocketClosedFunc   closed_func;
+    ConnectResultFunc  connect_func;
 
+    /* Connecting */
+    gchar             *domain;
+    gchar             *server;
+    guint              port;
     gboolean           cancel_open;
 
-    GSource           *watch_out;
-    GString           *out_buf;
+    LmProxy           *proxy;
 
+    GSource           *watch_connect;
     LmConnectData     *connect_data;
 
-    IncomingDataFunc   data_func;
-    SocketClosedFunc   closed_func;
-    ConnectResultFunc  connect_func;
-    gpointer           user_data;
+    LmResolver        *resolver;
 
-    guint              ref_count;
+    /* XEP-0368: _xmpps-client._tcp lookup running next to the
+     * _xmpp-client._tcp one, direct_tls is set once we settled on
+     * a target that speaks TLS from the first byte. */
+    LmResolver        *tls_resolver;
+    guint              srv_pending;
+    gboolean           direct_tls;
 
-    LmResolver        *resolver;
+    /* OldSocketLookups running next to the SRV lookups */
+    GSList            *lookups;
 };
 
 static void         socket_free                    (LmOldSocket    *socket);
@@ -116,9 +146,58 @@ static void         old_socket_setup_output_buffer (LmOldSocket    *socket,
                                                     const gchar    *buffer,
                                                     gint            len);
 
+static void
+old_socket_lookup_free (OldSocketLookup *lookup)
+{
+    if (!lookup->done) {
+        lm_resolver_cancel (lookup->resolver);
+    }
+
+    g_object_unref (lookup->resolver);
+    g_free (lookup->host);
+    g_free (lookup);
+}
+
+static void
+old_socket_lookups_free (LmOldSocket *socket)
+{
+    g_slist_foreach (socket->lookups, (GFunc) old_socket_lookup_free, NULL);
+    g_slist_free (socket->lookups);
+    socket->lookups = NULL;
+}
+
+/* Calls back the marks the bytes written so far have reached */
+static void
+old_socket_marks_written (LmOldSocket *socket)
+{
+    WriteMark *mark;
+
+    while ((mark = g_queue_peek_head (socket->write_marks)) &&
+           mark->offset <= socket->bytes_written) {
+        g_queue_pop_head (socket->write_marks);
+        (mark->func) (socket, TRUE, mark->user_data);
+        g_slice_free (WriteMark, mark);
+    }
+}
+
+static void
+old_socket_marks_failed (LmOldSocket *socket)
+{
+    WriteMark *mark;
+
+    while ((mark = g_queue_pop_head (socket->write_marks))) {
+        (mark->func) (socket, FALSE, mark->user_data);
+        g_slice_free (WriteMark, mark);
+    }
+}
+
 static void
 socket_free (LmOldSocket *socket)
 {
+    old_socket_lookups_free (socket);
+    old_socket_marks_failed (socket);
+    g_queue_free (socket->write_marks);
+
     g_free (socket->server);
     g_free (socket->domain);
 
@@ -138,6 +217,10 @@ socket_free (LmOldSocket *socket)
         g_object_unref (socket->resolver);
     }
 
+    if (socket->tls_resolver) {
+        g_object_unref (socket->tls_resolver);
+    }
+
     g_free (socket);
 }
 
@@ -175,21 +258,66 @@ lm_old_socket_write (LmOldSocket *socket, const gchar *buf, gint len)
     gint b_written;
 
     if (old_socket_output_is_buffered (socket, buf, len)) {
+        socket->bytes_queued += len;
         return len;
     }
 
     b_written = old_socket_do_write (socket, buf, len);
 
-    if (b_written < len && b_written != -1) {
+    if (b_written == -1) {
+        socket->write_failed = TRUE;
+        old_socket_marks_failed (socket);
+        return -1;
+    }
+
+    socket->bytes_queued += len;
+    socket->bytes_written += b_written;
+
+    if (b_written < len) {
         old_socket_setup_output_buffer (socket,
                                         buf + b_written,
                                         len - b_written);
         return len;
     }
 
+    if (!g_queue_is_empty (socket->write_marks)) {
+        old_socket_marks_written (socket);
+    }
+
     return b_written;
 }
 
+/* Calls @func once everything given to lm_old_socket_write() up to now
+ * has been accepted by the kernel, which may be right away. With TLS
+ * that is once the TLS layer has passed it on. */
+void
+lm_old_socket_add_write_mark (LmOldSocket   *socket,
+                              WriteMarkFunc  func,
+                              gpointer       user_data)
+{
+    WriteMark *mark;
+
+    g_return_if_fail (socket != NULL);
+    g_return_if_fail (func != NULL);
+
+    if (socket->write_failed) {
+        (func) (socket, FALSE, user_data);
+        return;
+    }
+
+    if (socket->bytes_written >= socket->bytes_queued) {
+        (func) (socket, TRUE, user_data);
+        return;
+    }
+
+    mark = g_slice_new (WriteMark);
+    mark->offset = socket->bytes_queued;
+    mark->func = func;
+    mark->user_data = user_data;
+
+    g_queue_push_tail (socket->write_marks, mark);
+}
+
 static gboolean
 socket_read_incoming (LmOldSocket *socket,
                       gchar    *buf,
@@ -268,7 +396,15 @@ socket_in_event (GIOChannel   *source,
 
         lm_verbose ("Read: %d chars\n", (int)bytes_read);
 
-        (socket->data_func) (socket, buf, socket->user_data);
+        /* The connection may close us over data it can't make sense of */
+        lm_old_socket_ref (socket);
+        (socket->data_func) (socket, buf, bytes_read, socket->user_data);
+
+        if (!socket->io_channel) {
+            lm_old_socket_unref (socket);
+            return FALSE;
+        }
+        lm_old_socket_unref (socket);
 
         read_anything = TRUE;
     }
@@ -336,8 +472,9 @@ _lm_old_socket_ssl_init (LmOldSocket *socket, gboolean delayed)
 
     /* If we're using StartTLS, the correct thing is to verify against
      * the domain. If we're using old SSL, we should verify against the
-     * hostname. */
-    if (delayed)
+     * hostname. Direct TLS found through SRV (XEP-0368) verifies against
+     * the domain as well since the target host came from DNS. */
+    if (delayed || socket->direct_tls)
         ssl_verify_domain = socket->domain;
     else
         ssl_verify_domain = socket->server;
@@ -410,8 +547,9 @@ _lm_old_socket_succeeded (LmConnectData *connect_data)
     socket->connect_data = NULL;
     g_free (connect_data);
 
-    /* old-style ssl should be started immediately */
-    if (socket->ssl && (lm_ssl_get_use_starttls (socket->ssl) == FALSE)) {
+    /* old-style ssl and direct TLS should be started immediately */
+    if (socket->ssl &&
+        (socket->direct_tls || lm_ssl_get_use_starttls (socket->ssl) == FALSE)) {
         if (!_lm_old_socket_ssl_init (socket, FALSE)) {
             return;
         }
@@ -712,6 +850,7 @@ socket_buffered_write_cb (GIOChannel   *source,
 {
     gint     b_written;
     GString *out_buf;
+    gboolean keep_watch;
 
     out_buf = socket->out_buf;
     if (!out_buf) {
@@ -722,11 +861,15 @@ socket_buffered_write_cb (GIOChannel   *source,
     b_written = old_socket_do_write (socket, out_buf->str, out_buf->len);
 
     if (b_written < 0) {
+        socket->write_failed = TRUE;
+        old_socket_marks_failed (socket);
         (socket->closed_func) (socket, LM_DISCONNECT_REASON_ERROR,
                                socket->user_data);
         return FALSE;
     }
 
+    socket->bytes_written += b_written;
+
     g_string_erase (out_buf, 0, (gsize) b_written);
     if (out_buf->len == 0) {
         lm_verbose ("Output buffer is empty, going back to normal output\n");
@@ -738,10 +881,16 @@ socket_buffered_write_cb (GIOChannel   *source,
 
         g_string_free (out_buf, TRUE);
         socket->out_buf = NULL;
-        return FALSE;
+        keep_watch = FALSE;
+    } else {
+        keep_watch = TRUE;
     }
 
-    return TRUE;
+    /* Last, the callbacks may send more or close the socket and must
+     * find the buffer as it is now */
+    old_socket_marks_written (socket);
+
+    return keep_watch;
 }
 
 static void
@@ -808,47 +957,226 @@ old_socket_resolver_host_cb (LmResolver       *resolver,
        error, while having no ref to said mainloop */
 }
 
+static void
+old_socket_resolver_lookup_cb (LmResolver       *resolver,
+                               LmResolverResult  result,
+                               gpointer          user_data)
+{
+    LmOldSocket *socket = (LmOldSocket *) user_data;
+    GSList      *l;
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        return;
+    }
+
+    if (resolver == socket->resolver) {
+        /* Picked while it was still running */
+        old_socket_resolver_host_cb (resolver, result, user_data);
+        return;
+    }
+
+    for (l = socket->lookups; l; l = l->next) {
+        OldSocketLookup *lookup = l->data;
+
+        if (lookup->resolver == resolver) {
+            lm_verbose ("Looked up %s ahead of time\n", lookup->host);
+            lookup->done = TRUE;
+            lookup->result = result;
+            break;
+        }
+    }
+}
+
+/* Looks up @host while the SRV lookups are still running, so that the
+ * answer is there when it turns out to be the host to connect to. */
+static void
+old_socket_lookup_start (LmOldSocket *socket, const gchar *host)
+{
+    OldSocketLookup *lookup;
+    GSList          *l;
+
+    for (l = socket->lookups; l; l = l->next) {
+        lookup = l->data;
+
+        if (strcmp (lookup->host, host) == 0) {
+            return;
+        }
+    }
+
+    lookup = g_new0 (OldSocketLookup, 1);
+    lookup->host = g_strdup (host);
+    lookup->resolver = lm_resolver_new_for_host (host,
+                                                 old_socket_resolver_lookup_cb,
+                                                 socket);
+    if (socket->context) {
+        g_object_set (lookup->resolver, "context", socket->context, NULL);
+    }
+
+    socket->lookups = g_slist_prepend (socket->lookups, lookup);
+
+    lm_resolver_lookup (lookup->resolver);
+}
+
+/* Takes the lookup for @host out of the running ones, %NULL if @host
+ * wasn't looked up ahead of time. */
+static OldSocketLookup *
+old_socket_lookup_steal (LmOldSocket *socket, const gchar *host)
+{
+    GSList *l;
+
+    for (l = socket->lookups; l; l = l->next) {
+        OldSocketLookup *lookup = l->data;
+
+        if (strcmp (lookup->host, host) == 0) {
+            socket->lookups = g_slist_delete_link (socket->lookups, l);
+            return lookup;
+        }
+    }
+
+    return NULL;
+}
+
 /* FIXME: Need to have a way to only get srv reply and then decide if the
  *        resolver should continue to look the host up.
  *
  *        This is needed for the case when we do a SRV lookup to lookup the
  *        real host of the service and then connect to it through a proxy.
  */
+static void
+old_socket_resolve_host (LmOldSocket *socket)
+{
+    const gchar     *remote_addr;
+    OldSocketLookup *lookup;
+
+    if (socket->proxy) {
+        remote_addr = lm_proxy_get_server (socket->proxy);
+    } else if (socket->server) {
+        remote_addr = socket->server;
+    }
+    else {
+        remote_addr = socket->domain;
+    }
+
+    g_object_unref (socket->resolver);
+
+    if (socket->tls_resolver) {
+        g_object_unref (socket->tls_resolver);
+        socket->tls_resolver = NULL;
+    }
+
+    lookup = old_socket_lookup_steal (socket, remote_addr);
+
+    /* Nothing else is going to be needed */
+    old_socket_lookups_free (socket);
+
+    if (lookup) {
+        LmResolverResult result = lookup->result;
+        gboolean         done = lookup->done;
+
+        socket->resolver = lookup->resolver;
+        g_free (lookup->host);
+        g_free (lookup);
+
+        if (done) {
+            old_socket_resolver_host_cb (socket->resolver, result, socket);
+        }
+
+        /* Otherwise old_socket_resolver_lookup_cb () takes it from here */
+        return;
+    }
+
+    socket->resolver =
+            lm_resolver_new_for_host (remote_addr,
+                                      old_socket_resolver_host_cb,
+                                      socket);
+
+    if (socket->context) {
+        g_object_set (socket->resolver, "context", socket->context, NULL);
+    }
+
+    lm_resolver_lookup (socket->resolver);
+}
+
 static void
 old_socket_resolver_srv_cb (LmResolver       *resolver,
                             LmResolverResult  result,
                             gpointer          user_data)
 {
     LmOldSocket *socket = (LmOldSocket *) user_data;
-    const gchar *remote_addr;
 
     lm_verbose ("LmOldSocket::srv_cb (result=%d)\n", result);
 
+    if (socket->direct_tls || result == LM_RESOLVER_RESULT_CANCELLED) {
+        /* In favour of the _xmpps-client target, or the connect was
+         * cancelled altogether */
+        return;
+    }
+
     if (result != LM_RESOLVER_RESULT_OK) {
         lm_verbose ("SRV lookup failed, trying jid domain\n");
         socket->server = g_strdup (socket->domain);
     } else {
         g_object_get (resolver, "host", &socket->server, NULL);
         g_object_get (resolver, "port", &socket->port, NULL);
+
+        if (!socket->proxy) {
+            old_socket_lookup_start (socket, socket->server);
+        }
     }
 
-    if (socket->proxy) {
-        remote_addr = lm_proxy_get_server (socket->proxy);
-    } else if (socket->server) {
-        remote_addr = socket->server;
+    if (--socket->srv_pending > 0) {
+        lm_verbose ("Waiting for the _xmpps-client SRV answer\n");
+        return;
     }
-    else {
-        remote_addr = socket->domain;
+
+    old_socket_resolve_host (socket);
+}
+
+static void
+old_socket_resolver_tls_srv_cb (LmResolver       *resolver,
+                                LmResolverResult  result,
+                                gpointer          user_data)
+{
+    LmOldSocket *socket = (LmOldSocket *) user_data;
+    gchar       *host = NULL;
+    guint        port = 0;
+
+    lm_verbose ("LmOldSocket::tls_srv_cb (result=%d)\n", result);
+
+    if (result == LM_RESOLVER_RESULT_CANCELLED) {
+        /* The connect was cancelled, nothing is waiting for us */
+        return;
     }
 
-    g_object_unref (socket->resolver);
+    if (result == LM_RESOLVER_RESULT_OK) {
+        g_object_get (resolver, "host", &host, "port", &port, NULL);
+    }
 
-    socket->resolver =
-            lm_resolver_new_for_host (remote_addr,
-                                      old_socket_resolver_host_cb,
-                                      socket);
+    if (!host) {
+        lm_verbose ("No direct TLS target, using STARTTLS\n");
 
-    lm_resolver_lookup (socket->resolver);
+        if (--socket->srv_pending > 0) {
+            return;
+        }
+
+        old_socket_resolve_host (socket);
+        return;
+    }
+
+    lm_verbose ("Using direct TLS target %s:%d\n", host, port);
+
+    g_free (socket->server);
+    socket->server = host;
+    socket->port = port;
+    socket->direct_tls = TRUE;
+
+    if (socket->srv_pending > 1) {
+        /* No need to wait for the _xmpp-client._tcp answer */
+        lm_resolver_cancel (socket->resolver);
+    }
+    socket->srv_pending = 0;
+
+    old_socket_resolve_host (socket);
 }
 
 LmOldSocket *
@@ -886,6 +1214,7 @@ lm_old_socket_create (GMainContext      *context,
     socket->ssl = ssl;
     socket->ssl_started = FALSE;
     socket->proxy = NULL;
+    socket->write_marks = g_queue_new ();
 
     if (context) {
         socket->context = g_main_context_ref (context);
@@ -907,6 +1236,19 @@ lm_old_socket_create (GMainContext      *context,
                                                         "tcp",
                                                         old_socket_resolver_srv_cb,
                                                         socket);
+        socket->srv_pending = 1;
+
+        /* Look for direct TLS endpoints (XEP-0368) at the same time,
+         * they are preferred over STARTTLS when found. */
+        if (socket->ssl) {
+            socket->tls_resolver =
+                lm_resolver_new_for_service (socket->domain,
+                                             "xmpps-client",
+                                             "tcp",
+                                             old_socket_resolver_tls_srv_cb,
+                                             socket);
+            socket->srv_pending++;
+        }
     } else {
         socket->resolver =
             lm_resolver_new_for_host (socket->server ? socket->server : socket->domain,
@@ -916,6 +1258,10 @@ lm_old_socket_create (GMainContext      *context,
 
     if (socket->context) {
         g_object_set (socket->resolver, "context", context, NULL);
+
+        if (socket->tls_resolver) {
+            g_object_set (socket->tls_resolver, "context", context, NULL);
+        }
     }
 
     socket->data_func = data_func;
@@ -925,6 +1271,19 @@ lm_old_socket_create (GMainContext      *context,
 
     lm_resolver_lookup (socket->resolver);
 
+    if (socket->tls_resolver) {
+        lm_resolver_lookup (socket->tls_resolver);
+    }
+
+    /* The JID domain (or the proxy) is where we connect if there is no SRV
+     * record, look it up at the same time instead of after the SRV answer */
+    if (!server) {
+        old_socket_lookup_start (socket,
+                                 socket->proxy ?
+                                 lm_proxy_get_server (socket->proxy) :
+                                 socket->domain);
+    }
+
     return socket;
 }
 
@@ -991,6 +1350,10 @@ lm_old_socket_close (LmOldSocket *socket)
     if (socket->ssl) {
         _lm_ssl_close (socket->ssl);
     }
+
+    /* What is still buffered will never be written */
+    socket->write_failed = TRUE;
+    old_socket_marks_failed (socket);
 }
 
 gchar *
@@ -1034,6 +1397,12 @@ lm_old_socket_set_keepalive (LmOldSocket *socket, int delay)
 void
 lm_old_socket_asyncns_cancel (LmOldSocket *socket)
 {
+    old_socket_lookups_free (socket);
+
+    if (socket->tls_resolver) {
+        lm_resolver_cancel (socket->tls_resolver);
+    }
+
     if (!socket->resolver) {
         return;
     }
@@ -1044,7 +1413,7 @@ lm_old_socket_asyncns_cancel (LmOldSocket *socket)
 gboolean
 lm_old_socket_get_use_starttls (LmOldSocket *socket)
 {
-    if (!socket->ssl) {
+    if (!socket->ssl || socket->direct_tls) {
         return FALSE;
     }
 
@@ -1054,7 +1423,7 @@ lm_old_socket_get_use_starttls (LmOldSocket *socket)
 gboolean
 lm_old_socket_get_require_starttls (LmOldSocket *socket)
 {
-    if (!socket->ssl) {
+    if (!socket->ssl || socket->direct_tls) {
         return FALSE;
     }
 
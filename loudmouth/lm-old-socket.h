@@ -27,8 +27,10 @@
 
 typedef struct _LmOldSocket LmOldSocket;
 
+/* @buf is NUL terminated for text, @len counts the bytes of binary data */
 typedef void    (* IncomingDataFunc)  (LmOldSocket         *socket,
                                        const gchar         *buf,
+                                       gsize                len,
                                        gpointer             user_data);
 
 typedef void    (* SocketClosedFunc)  (LmOldSocket         *socket,
@@ -39,6 +41,11 @@ typedef void    (* ConnectResultFunc) (LmOldSocket         *socket,
                                        gboolean             result,
                                        gpointer             user_data);
 
+/* @written is FALSE when the socket closed before all bytes got out */
+typedef void    (* WriteMarkFunc)     (LmOldSocket         *socket,
+                                       gboolean             written,
+                                       gpointer             user_data);
+
 LmOldSocket * lm_old_socket_create          (GMainContext       *context, 
                                              IncomingDataFunc    data_func,
                                              SocketClosedFunc    closed_func,
@@ -54,6 +61,9 @@ LmOldSocket * lm_old_socket_create          (GMainContext       *context,
 gint           lm_old_socket_write          (LmOldSocket       *socket,
                                              const gchar       *buf,
                                              gint               len);
+void           lm_old_socket_add_write_mark (LmOldSocket        *socket,
+                                             WriteMarkFunc       func,
+                                             gpointer            user_data);
 void           lm_old_socket_flush          (LmOldSocket        *socket);
 void           lm_old_socket_close          (LmOldSocket        *socket);
 LmOldSocket *  lm_old_socket_ref            (LmOldSocket        *socket);
@@ -0,0 +1,416 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Multiple producer, single consumer queue for serialized stanzas.
+ *
+ * Any thread may push strings onto the queue. Pushing is lock free: new
+ * items are linked onto an intrusive stack with a compare-and-swap. The
+ * thread running the queue's main context takes the whole stack in one
+ * atomic exchange, restores the push order and hands the batch to the
+ * callback as a single buffer so it can be written with one call.
+ *
+ * Only the producer that finds the stack empty wakes the context up, so
+ * a burst of pushes costs one wakeup regardless of its size.
+ *
+ * While the queue is detached the stack is closed, the head is then a
+ * marker instead of an item. A push that races a detach either lands
+ * before it and is dropped with the rest, or is refused, it can't stay
+ * behind for the next stream.
+ *
+ * A string can carry a mark for the consumer to learn when it has been
+ * handed over. Marks are only given out once the whole batch is, and in
+ * push order across nested drains, so a mark function that sends more
+ * can't get ahead of strings that were pushed before.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "lm-outgoing-queue.h"
+
+typedef struct _OutgoingItem OutgoingItem;
+
+struct _OutgoingItem {
+    OutgoingItem *next;
+    gchar        *str;
+    gsize         len;
+    gpointer      mark;
+};
+
+/* The head of a detached queue */
+static gchar outgoing_queue_closed;
+#define OUTGOING_QUEUE_CLOSED ((gpointer) &outgoing_queue_closed)
+
+struct _LmOutgoingQueue {
+    /* OutgoingItem stack, newest first, or OUTGOING_QUEUE_CLOSED. Only
+     * accessed atomically. */
+    gpointer             head;
+
+    /* Kept from the first attach until the queue is freed, producers
+     * that pushed just before a detach may still wake it up. Published
+     * to them by the compare-and-swap opening the stack. */
+    GMainContext        *context;
+    GSource             *source;
+
+    LmOutgoingQueueFunc  func;
+    LmOutgoingQueueMarkFunc mark_func;
+    gpointer             user_data;
+
+    /* Marks of strings handed over, given out by the outermost drain */
+    GQueue              *marks;
+    gboolean             in_marks;
+
+    gint                 ref_count;
+};
+
+typedef struct {
+    GSource          source;
+    LmOutgoingQueue *queue;
+} OutgoingQueueSource;
+
+static void         outgoing_queue_free          (LmOutgoingQueue *queue);
+static OutgoingItem *outgoing_queue_take         (LmOutgoingQueue *queue,
+                                                  gpointer         head);
+static OutgoingItem *outgoing_queue_steal        (LmOutgoingQueue *queue);
+static void         outgoing_queue_free_items    (LmOutgoingQueue *queue,
+                                                  OutgoingItem    *items);
+static gboolean     outgoing_queue_prepare_func  (GSource         *source,
+                                                  gint            *timeout);
+static gboolean     outgoing_queue_check_func    (GSource         *source);
+static gboolean     outgoing_queue_dispatch_func (GSource         *source,
+                                                  GSourceFunc      callback,
+                                                  gpointer         user_data);
+
+static GSourceFuncs source_funcs = {
+    outgoing_queue_prepare_func,
+    outgoing_queue_check_func,
+    outgoing_queue_dispatch_func,
+    NULL
+};
+
+static void
+outgoing_queue_free (LmOutgoingQueue *queue)
+{
+    lm_outgoing_queue_detach (queue);
+
+    if (queue->context) {
+        g_main_context_unref (queue->context);
+    }
+    g_queue_free (queue->marks);
+
+    g_free (queue);
+}
+
+/* Takes every pushed item off the stack, leaving @head in its place, and
+ * returns them oldest first. A closed stack is left alone. */
+static OutgoingItem *
+outgoing_queue_take (LmOutgoingQueue *queue, gpointer head)
+{
+    OutgoingItem *items;
+    OutgoingItem *reversed = NULL;
+
+    do {
+        items = g_atomic_pointer_get (&queue->head);
+        if (items == OUTGOING_QUEUE_CLOSED || items == head) {
+            return NULL;
+        }
+    } while (!g_atomic_pointer_compare_and_exchange (&queue->head,
+                                                     items, head));
+
+    while (items) {
+        OutgoingItem *next = items->next;
+
+        items->next = reversed;
+        reversed = items;
+        items = next;
+    }
+
+    return reversed;
+}
+
+static OutgoingItem *
+outgoing_queue_steal (LmOutgoingQueue *queue)
+{
+    return outgoing_queue_take (queue, NULL);
+}
+
+/* Marks of items that were never handed over are dropped */
+static void
+outgoing_queue_free_items (LmOutgoingQueue *queue, OutgoingItem *items)
+{
+    while (items) {
+        OutgoingItem *next = items->next;
+
+        if (items->mark && queue->mark_func) {
+            (queue->mark_func) (queue, items->mark, FALSE, queue->user_data);
+        }
+
+        g_free (items->str);
+        g_slice_free (OutgoingItem, items);
+        items = next;
+    }
+}
+
+static gboolean
+outgoing_queue_prepare_func (GSource *source, gint *timeout)
+{
+    LmOutgoingQueue *queue;
+
+    queue = ((OutgoingQueueSource *)source)->queue;
+
+    return !lm_outgoing_queue_is_empty (queue);
+}
+
+static gboolean
+outgoing_queue_check_func (GSource *source)
+{
+    LmOutgoingQueue *queue;
+
+    queue = ((OutgoingQueueSource *)source)->queue;
+
+    /* Items may have been pushed while the context was polling */
+    return !lm_outgoing_queue_is_empty (queue);
+}
+
+static gboolean
+outgoing_queue_dispatch_func (GSource     *source,
+                              GSourceFunc  callback,
+                              gpointer     user_data)
+{
+    LmOutgoingQueue *queue;
+
+    queue = ((OutgoingQueueSource *)source)->queue;
+
+    /* The callback may close the connection and drop its queue */
+    lm_outgoing_queue_ref (queue);
+    lm_outgoing_queue_drain (queue);
+    lm_outgoing_queue_unref (queue);
+
+    return TRUE;
+}
+
+LmOutgoingQueue *
+lm_outgoing_queue_new (LmOutgoingQueueFunc func, gpointer user_data)
+{
+    LmOutgoingQueue *queue;
+
+    queue = g_new0 (LmOutgoingQueue, 1);
+
+    queue->head = OUTGOING_QUEUE_CLOSED;
+    queue->context = NULL;
+    queue->source = NULL;
+    queue->ref_count = 1;
+    queue->marks = g_queue_new ();
+
+    queue->func = func;
+    queue->user_data = user_data;
+
+    return queue;
+}
+
+/* Opens the queue for pushes. A queue is only ever attached to one
+ * context, the one of its connection. */
+void
+lm_outgoing_queue_attach (LmOutgoingQueue *queue, GMainContext *context)
+{
+    GSource *source;
+
+    if (queue->source) {
+        /* Already attached */
+        return;
+    }
+
+    if (context && !queue->context)  {
+        queue->context = g_main_context_ref (context);
+    }
+    g_return_if_fail (queue->context == context);
+
+    source = g_source_new (&source_funcs, sizeof (OutgoingQueueSource));
+    ((OutgoingQueueSource *)source)->queue = queue;
+    queue->source = source;
+
+    g_source_attach (source, queue->context);
+
+    g_atomic_pointer_compare_and_exchange (&queue->head,
+                                           OUTGOING_QUEUE_CLOSED, NULL);
+}
+
+/* Strings still in the queue belong to the stream that is going away and
+ * are dropped, later pushes are refused until it is attached again. */
+void
+lm_outgoing_queue_detach (LmOutgoingQueue *queue)
+{
+    if (queue->source) {
+        g_source_destroy (queue->source);
+        g_source_unref (queue->source);
+    }
+
+    queue->source = NULL;
+
+    outgoing_queue_free_items (queue,
+                               outgoing_queue_take (queue,
+                                                    OUTGOING_QUEUE_CLOSED));
+}
+
+/* Set before anything is pushed with a mark */
+void
+lm_outgoing_queue_set_mark_func (LmOutgoingQueue         *queue,
+                                 LmOutgoingQueueMarkFunc  func)
+{
+    g_return_if_fail (queue != NULL);
+
+    queue->mark_func = func;
+}
+
+/* May be called from any thread. Takes ownership of @str, unless the
+ * queue is detached and %FALSE is returned. */
+gboolean
+lm_outgoing_queue_push (LmOutgoingQueue *queue, gchar *str, gssize len)
+{
+    return lm_outgoing_queue_push_with_mark (queue, str, len, NULL);
+}
+
+/* Like lm_outgoing_queue_push(), @mark is given to the mark function once
+ * @str has been handed over, unless it is NULL */
+gboolean
+lm_outgoing_queue_push_with_mark (LmOutgoingQueue *queue,
+                                  gchar           *str,
+                                  gssize           len,
+                                  gpointer         mark)
+{
+    OutgoingItem *item;
+    gpointer      head;
+
+    g_return_val_if_fail (queue != NULL, FALSE);
+    g_return_val_if_fail (str != NULL, FALSE);
+
+    item = g_slice_new (OutgoingItem);
+    item->str = str;
+    item->len = len < 0 ? strlen (str) : (gsize) len;
+    item->mark = mark;
+
+    do {
+        head = g_atomic_pointer_get (&queue->head);
+        if (head == OUTGOING_QUEUE_CLOSED) {
+            g_slice_free (OutgoingItem, item);
+            return FALSE;
+        }
+        item->next = head;
+    } while (!g_atomic_pointer_compare_and_exchange (&queue->head,
+                                                     head, item));
+
+    if (!head) {
+        /* First item of a new batch, make sure the context notices it */
+        g_main_context_wakeup (queue->context);
+    }
+
+    return TRUE;
+}
+
+/* Must be called from the thread owning the queue's context. */
+void
+lm_outgoing_queue_drain (LmOutgoingQueue *queue)
+{
+    OutgoingItem *items;
+    OutgoingItem *item;
+    GString      *batch;
+
+    g_return_if_fail (queue != NULL);
+
+    items = outgoing_queue_steal (queue);
+    if (!items) {
+        return;
+    }
+
+    if (!items->next) {
+        /* Common case, nothing to concatenate */
+        if (queue->func) {
+            (queue->func) (queue, items->str, items->len, queue->user_data);
+        }
+    } else {
+        batch = g_string_sized_new (1024);
+        for (item = items; item; item = item->next) {
+            g_string_append_len (batch, item->str, item->len);
+        }
+
+        if (queue->func) {
+            (queue->func) (queue, batch->str, batch->len, queue->user_data);
+        }
+        g_string_free (batch, TRUE);
+    }
+
+    for (item = items; item; item = item->next) {
+        if (item->mark) {
+            g_queue_push_tail (queue->marks, item->mark);
+            item->mark = NULL;
+        }
+    }
+    outgoing_queue_free_items (queue, items);
+
+    if (queue->in_marks) {
+        /* Drained from a mark function, the outer drain gives them out
+         * after the marks that came before */
+        return;
+    }
+
+    queue->in_marks = TRUE;
+    while (!g_queue_is_empty (queue->marks)) {
+        gpointer mark = g_queue_pop_head (queue->marks);
+
+        if (queue->mark_func) {
+            (queue->mark_func) (queue, mark, TRUE, queue->user_data);
+        }
+    }
+    queue->in_marks = FALSE;
+}
+
+gboolean
+lm_outgoing_queue_is_empty (LmOutgoingQueue *queue)
+{
+    gpointer head;
+
+    g_return_val_if_fail (queue != NULL, TRUE);
+
+    head = g_atomic_pointer_get (&queue->head);
+
+    return head == NULL || head == OUTGOING_QUEUE_CLOSED;
+}
+
+LmOutgoingQueue *
+lm_outgoing_queue_ref (LmOutgoingQueue *queue)
+{
+    g_return_val_if_fail (queue != NULL, NULL);
+
+    g_atomic_int_inc (&queue->ref_count);
+
+    return queue;
+}
+
+void
+lm_outgoing_queue_unref (LmOutgoingQueue *queue)
+{
+    g_return_if_fail (queue != NULL);
+
+    if (g_atomic_int_dec_and_test (&queue->ref_count)) {
+        outgoing_queue_free (queue);
+    }
+}
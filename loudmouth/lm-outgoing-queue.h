@@ -0,0 +1,67 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#ifndef __LM_OUTGOING_QUEUE_H__
+#define __LM_OUTGOING_QUEUE_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _LmOutgoingQueue LmOutgoingQueue;
+
+/* Called in the queue's context with all strings pushed since the last
+ * drain, concatenated in the order they were pushed. */
+typedef void (* LmOutgoingQueueFunc) (LmOutgoingQueue *queue,
+                                      const gchar     *batch,
+                                      gsize            len,
+                                      gpointer         user_data);
+
+/* Called in the queue's context for a mark once the batch it was pushed in
+ * has been handed to the LmOutgoingQueueFunc, or with @sent FALSE when it
+ * is dropped. It may send and drain the queue again. */
+typedef void (* LmOutgoingQueueMarkFunc) (LmOutgoingQueue *queue,
+                                          gpointer         mark,
+                                          gboolean         sent,
+                                          gpointer         user_data);
+
+LmOutgoingQueue * lm_outgoing_queue_new       (LmOutgoingQueueFunc  func,
+                                               gpointer             user_data);
+void              lm_outgoing_queue_set_mark_func (LmOutgoingQueue *queue,
+                                                   LmOutgoingQueueMarkFunc func);
+void              lm_outgoing_queue_attach    (LmOutgoingQueue     *queue,
+                                               GMainContext        *context);
+void              lm_outgoing_queue_detach    (LmOutgoingQueue     *queue);
+gboolean          lm_outgoing_queue_push      (LmOutgoingQueue     *queue,
+                                               gchar               *str,
+                                               gssize               len);
+gboolean          lm_outgoing_queue_push_with_mark (LmOutgoingQueue *queue,
+                                                    gchar           *str,
+                                                    gssize           len,
+                                                    gpointer         mark);
+void              lm_outgoing_queue_drain     (LmOutgoingQueue     *queue);
+gboolean          lm_outgoing_queue_is_empty  (LmOutgoingQueue     *queue);
+
+LmOutgoingQueue * lm_outgoing_queue_ref       (LmOutgoingQueue     *queue);
+void              lm_outgoing_queue_unref     (LmOutgoingQueue     *queue);
+
+G_END_DECLS
+
+#endif /* __LM_OUTGOING_QUEUE_H__ */
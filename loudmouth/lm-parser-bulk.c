@@ -0,0 +1,443 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Bulk parsing of recorded XMPP streams.
+ *
+ * The file is mapped into memory and the calling thread scans it for the
+ * boundaries of top level stanzas. This only needs to track tags, quotes,
+ * comments and CDATA sections, so it is much cheaper than parsing. The
+ * stanzas are grouped into chunks which are parsed into LmMessages by a
+ * pool of worker threads, each using its own LmParser. Parsed chunks are
+ * handed back to the calling thread which delivers the messages in file
+ * order. Only a bounded number of chunks is in flight at any time so
+ * memory use doesn't depend on the size of the file.
+ */
+
+#include <config.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "lm-debug.h"
+#include "lm-internals.h"
+#include "lm-parser.h"
+
+/* Roughly how many bytes of stanzas each worker job parses */
+#define BULK_CHUNK_SIZE     (256 * 1024)
+/* Chunks in flight per worker thread */
+#define BULK_CHUNKS_PER_THREAD 4
+#define BULK_DEFAULT_THREADS   4
+
+/* Fed to worker parsers for stanzas before any stream header, so they are
+ * still parsed as stream children */
+#define BULK_STREAM_OPENER "<stream:stream xmlns:stream='http://etherx.jabber.org/streams'>"
+
+typedef struct {
+    const gchar *start;
+    gsize        len;
+} BulkRange;
+
+typedef struct {
+    const gchar *pos;
+    const gchar *end;
+    /* The header of the stream being scanned */
+    BulkRange    header;
+} BulkScanner;
+
+typedef struct {
+    guint        index;
+    /* Stanzas of a chunk all come from the same stream, the worker parser
+     * is given its header first for the default namespace */
+    BulkRange    header;
+    GArray      *ranges;
+    GPtrArray   *messages;
+    gboolean     collecting;
+} BulkChunk;
+
+typedef struct {
+    GAsyncQueue *done;
+} BulkContext;
+
+static const gchar *
+bulk_skip_tag (const gchar *p, const gchar *end)
+{
+    gchar quote = 0;
+
+    /* Attribute values may contain '>' */
+    for (p++; p < end; p++) {
+        if (quote) {
+            if (*p == quote) {
+                quote = 0;
+            }
+        }
+        else if (*p == '"' || *p == '\'') {
+            quote = *p;
+        }
+        else if (*p == '>') {
+            return p + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static const gchar *
+bulk_skip_past (const gchar *p, const gchar *end, const gchar *terminator)
+{
+    const gchar *found;
+
+    found = g_strstr_len (p, end - p, terminator);
+    if (!found) {
+        return NULL;
+    }
+
+    return found + strlen (terminator);
+}
+
+static gboolean
+bulk_has_prefix (const gchar *p, const gchar *end, const gchar *prefix)
+{
+    gsize len = strlen (prefix);
+
+    return (gsize) (end - p) >= len && strncmp (p, prefix, len) == 0;
+}
+
+static gboolean
+bulk_is_stream_header (const gchar *p, const gchar *end)
+{
+    return bulk_has_prefix (p, end, "<stream:stream") &&
+        (p + 14 < end) && (p[14] == ' ' || p[14] == '>' ||
+                           p[14] == '\t' || p[14] == '\r' || p[14] == '\n');
+}
+
+/* Finds the next complete top level stanza. Stream headers, stream
+ * closing tags, processing instructions and comments in between stanzas
+ * are skipped. A truncated stanza at the end of the data is ignored. */
+static gboolean
+bulk_scan_stanza (BulkScanner *scanner, BulkRange *range)
+{
+    const gchar *stanza_start = NULL;
+    const gchar *pos = scanner->pos;
+    const gchar *end = scanner->end;
+    guint        depth = 0;
+
+    while (pos < end) {
+        const gchar *lt;
+        const gchar *next;
+
+        lt = memchr (pos, '<', end - pos);
+        if (!lt || lt + 1 >= end) {
+            break;
+        }
+
+        switch (lt[1]) {
+        case '?':
+            next = bulk_skip_past (lt, end, "?>");
+            break;
+        case '!':
+            if (bulk_has_prefix (lt, end, "<!--")) {
+                next = bulk_skip_past (lt, end, "-->");
+            }
+            else if (bulk_has_prefix (lt, end, "<![CDATA[")) {
+                next = bulk_skip_past (lt, end, "]]>");
+            }
+            else {
+                next = bulk_skip_tag (lt, end);
+            }
+            break;
+        case '/':
+            next = bulk_skip_tag (lt, end);
+            if (next && depth > 0 && --depth == 0) {
+                range->start = stanza_start;
+                range->len = next - stanza_start;
+                scanner->pos = next;
+                return TRUE;
+            }
+            /* A closing tag at the top level ends a stream */
+            break;
+        default:
+            next = bulk_skip_tag (lt, end);
+            if (!next) {
+                break;
+            }
+
+            if (depth == 0) {
+                if (bulk_is_stream_header (lt, end)) {
+                    scanner->header.start = lt;
+                    scanner->header.len = next - lt;
+                    break;
+                }
+
+                stanza_start = lt;
+                if (next[-2] == '/') {
+                    range->start = stanza_start;
+                    range->len = next - stanza_start;
+                    scanner->pos = next;
+                    return TRUE;
+                }
+                depth = 1;
+            }
+            else if (next[-2] != '/') {
+                depth++;
+            }
+            break;
+        }
+
+        if (!next) {
+            break;
+        }
+
+        pos = next;
+    }
+
+    scanner->pos = end;
+
+    return FALSE;
+}
+
+static BulkChunk *
+bulk_scan_chunk (BulkScanner *scanner, guint index)
+{
+    BulkChunk *chunk = NULL;
+    BulkRange  range;
+    gsize      size = 0;
+
+    while (size < BULK_CHUNK_SIZE && bulk_scan_stanza (scanner, &range)) {
+        if (!chunk) {
+            chunk = g_slice_new0 (BulkChunk);
+            chunk->index = index;
+            chunk->header = scanner->header;
+            chunk->ranges = g_array_new (FALSE, FALSE, sizeof (BulkRange));
+        }
+        else if (chunk->header.start != scanner->header.start) {
+            /* From the next stream, starts the next chunk */
+            scanner->pos = range.start;
+            break;
+        }
+
+        g_array_append_val (chunk->ranges, range);
+        size += range.len;
+    }
+
+    return chunk;
+}
+
+static void
+bulk_chunk_free (BulkChunk *chunk)
+{
+    if (chunk->messages) {
+        guint i;
+
+        for (i = 0; i < chunk->messages->len; ++i) {
+            lm_message_unref (g_ptr_array_index (chunk->messages, i));
+        }
+        g_ptr_array_free (chunk->messages, TRUE);
+    }
+
+    g_array_free (chunk->ranges, TRUE);
+    g_slice_free (BulkChunk, chunk);
+}
+
+static void
+bulk_message_cb (LmParser *parser, LmMessage *message, BulkChunk *chunk)
+{
+    if (chunk->collecting) {
+        g_ptr_array_add (chunk->messages, lm_message_ref (message));
+    }
+}
+
+static LmParser *
+bulk_parser_new (BulkChunk *chunk)
+{
+    LmParser *parser;
+
+    parser = lm_parser_new ((LmParserMessageFunction) bulk_message_cb,
+                            chunk, NULL);
+
+    chunk->collecting = FALSE;
+    if (chunk->header.start &&
+        !lm_parser_parse_len (parser, chunk->header.start, chunk->header.len)) {
+        /* Without its namespaces rather than not at all */
+        lm_parser_free (parser);
+        parser = lm_parser_new ((LmParserMessageFunction) bulk_message_cb,
+                                chunk, NULL);
+        chunk->header.start = NULL;
+    }
+    if (!chunk->header.start) {
+        lm_parser_parse (parser, BULK_STREAM_OPENER);
+    }
+    chunk->collecting = TRUE;
+
+    return parser;
+}
+
+/* Runs in a worker thread */
+static void
+bulk_parse_chunk (BulkChunk *chunk, BulkContext *context)
+{
+    LmParser *parser;
+    guint     i;
+
+    chunk->messages = g_ptr_array_sized_new (chunk->ranges->len);
+    parser = bulk_parser_new (chunk);
+
+    for (i = 0; i < chunk->ranges->len; ++i) {
+        BulkRange *range = &g_array_index (chunk->ranges, BulkRange, i);
+
+        if (!lm_parser_parse_len (parser, range->start, range->len)) {
+            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+                   "Skipping malformed stanza of %" G_GSIZE_FORMAT " bytes\n",
+                   range->len);
+
+            /* The parser may be left inside the broken stanza */
+            lm_parser_free (parser);
+            parser = bulk_parser_new (chunk);
+        }
+    }
+
+    lm_parser_free (parser);
+
+    g_async_queue_push (context->done, chunk);
+}
+
+/**
+ * lm_parser_parse_file:
+ * @filename: file containing a recorded XMPP stream
+ * @n_threads: number of worker threads, 0 to pick a default
+ * @function: called for each parsed message
+ * @user_data: user data passed to @function
+ * @error: location to store error, or %NULL
+ *
+ * Parses all top level stanzas in @filename using @n_threads worker threads.
+ * @function is called from the calling thread with the messages in the
+ * order they appear in the file. The file may contain several streams,
+ * stanzas get the default namespace of the stream they are in. Stanzas
+ * that fail to parse are dropped.
+ *
+ * Return value: %FALSE if @filename couldn't be read or the threads
+ * couldn't be started, %TRUE otherwise.
+ **/
+gboolean
+lm_parser_parse_file (const gchar          *filename,
+                      guint                 n_threads,
+                      LmParserBulkFunction  function,
+                      gpointer              user_data,
+                      GError              **error)
+{
+    GMappedFile  *file;
+    GThreadPool  *pool;
+    BulkContext   context;
+    BulkScanner   scanner;
+    BulkChunk   **slots;
+    guint         window;
+    guint         next_submit = 0;
+    guint         next_deliver = 0;
+    guint         in_flight = 0;
+
+    g_return_val_if_fail (filename != NULL, FALSE);
+    g_return_val_if_fail (function != NULL, FALSE);
+
+    lm_debug_init ();
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    if (!g_thread_supported ()) {
+        g_thread_init (NULL);
+    }
+#endif
+
+    if (n_threads == 0) {
+#if GLIB_CHECK_VERSION (2, 36, 0)
+        n_threads = g_get_num_processors ();
+#else
+        n_threads = BULK_DEFAULT_THREADS;
+#endif
+    }
+
+    file = g_mapped_file_new (filename, FALSE, error);
+    if (!file) {
+        return FALSE;
+    }
+
+    context.done = g_async_queue_new ();
+
+    pool = g_thread_pool_new ((GFunc) bulk_parse_chunk, &context,
+                              n_threads, FALSE, error);
+    if (!pool) {
+        g_async_queue_unref (context.done);
+#if GLIB_CHECK_VERSION (2, 22, 0)
+        g_mapped_file_unref (file);
+#else
+        g_mapped_file_free (file);
+#endif
+        return FALSE;
+    }
+
+    scanner.pos = g_mapped_file_get_contents (file);
+    scanner.end = scanner.pos + g_mapped_file_get_length (file);
+    scanner.header.start = NULL;
+    scanner.header.len = 0;
+
+    window = n_threads * BULK_CHUNKS_PER_THREAD;
+    slots = g_new0 (BulkChunk *, window);
+
+    while (TRUE) {
+        BulkChunk *chunk;
+
+        while (in_flight < window &&
+               (chunk = bulk_scan_chunk (&scanner, next_submit))) {
+            g_thread_pool_push (pool, chunk, NULL);
+            next_submit++;
+            in_flight++;
+        }
+
+        if (in_flight == 0) {
+            break;
+        }
+
+        chunk = g_async_queue_pop (context.done);
+        slots[chunk->index % window] = chunk;
+
+        /* Deliver everything that is now in order */
+        while ((chunk = slots[next_deliver % window])) {
+            guint i;
+
+            for (i = 0; i < chunk->messages->len; ++i) {
+                (function) (g_ptr_array_index (chunk->messages, i), user_data);
+            }
+
+            slots[next_deliver % window] = NULL;
+            bulk_chunk_free (chunk);
+            next_deliver++;
+            in_flight--;
+        }
+    }
+
+    g_free (slots);
+    g_thread_pool_free (pool, FALSE, TRUE);
+    g_async_queue_unref (context.done);
+#if GLIB_CHECK_VERSION (2, 22, 0)
+    g_mapped_file_unref (file);
+#else
+    g_mapped_file_free (file);
+#endif
+
+    return TRUE;
+}
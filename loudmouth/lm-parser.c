@@ -33,8 +33,20 @@
 
 #define LM_PARSER(o) ((LmParser *) o)
 
+#define XML_NS "http://www.w3.org/XML/1998/namespace"
+
+#define XMPP_NS_STREAMS "http://etherx.jabber.org/streams"
+
+typedef struct {
+    gchar  *prefix;  /* NULL for the default namespace */
+    GQuark  ns_id;   /* Only if someone interned the namespace */
+    gchar  *ns;      /* Otherwise the namespace itself */
+    guint   depth;
+} ParserNsDecl;
+
 struct LmParser {
     LmParserMessageFunction  function;
+    LmParserNodeFunction     node_function;
     gpointer                 user_data;
     GDestroyNotify           notify;
     
@@ -43,6 +55,14 @@ struct LmParser {
         
     GMarkupParser           *m_parser;
     GMarkupParseContext     *context;
+
+    /* Namespace declarations in scope, innermost last. Those on the
+     * stream header are at depth 0 and stay until the next header. */
+    GArray                  *ns_scope;
+    guint                    depth;
+
+    GQuark                   stream_id;
+    GQuark                   streams_ns_id;
 };
 
 
@@ -66,6 +86,94 @@ static void    parser_error_cb      (GMarkupParseContext  *context,
                                      GError               *error,
                                      gpointer              user_data);
 
+/* Forgets the declarations from @index on */
+static void
+parser_drop_ns (LmParser *parser, guint index)
+{
+    guint i;
+
+    for (i = index; i < parser->ns_scope->len; ++i) {
+        ParserNsDecl *decl = &g_array_index (parser->ns_scope, ParserNsDecl, i);
+
+        g_free (decl->prefix);
+        g_free (decl->ns);
+    }
+
+    g_array_set_size (parser->ns_scope, index);
+}
+
+static void
+parser_declare_ns (LmParser *parser, const gchar *name, const gchar *value)
+{
+    ParserNsDecl decl;
+
+    if (strcmp (name, "xmlns") == 0) {
+        decl.prefix = NULL;
+    }
+    else if (strncmp (name, "xmlns:", 6) == 0) {
+        decl.prefix = g_strdup (name + 6);
+    } else {
+        return;
+    }
+
+    /* Only looked up, the peer decides what namespaces it sends */
+    decl.ns_id = g_quark_try_string (value);
+    decl.ns = decl.ns_id ? NULL : g_strdup (value);
+    decl.depth = parser->depth;
+
+    g_array_append_val (parser->ns_scope, decl);
+}
+
+static void
+parser_resolve_ns (LmParser *parser, LmMessageNode *node)
+{
+    const gchar *colon;
+    gsize        len = 0;
+    gint         i;
+
+    colon = strchr (node->name, ':');
+    if (colon) {
+        len = colon - node->name;
+    }
+
+    for (i = parser->ns_scope->len - 1; i >= 0; --i) {
+        ParserNsDecl *decl = &g_array_index (parser->ns_scope, ParserNsDecl, i);
+
+        if (colon ? (decl->prefix &&
+                     strncmp (decl->prefix, node->name, len) == 0 &&
+                     decl->prefix[len] == '\0') : !decl->prefix) {
+            _lm_message_node_set_ns (node, decl->ns_id, decl->ns);
+            return;
+        }
+    }
+
+    if (len == 3 && strncmp (node->name, "xml", 3) == 0) {
+        _lm_message_node_set_ns (node, 0, XML_NS);
+    }
+}
+
+/* A new stream header, what the old stream declared goes and what
+ * this one declares stays until the next one */
+static void
+parser_start_stream (LmParser *parser, guint first_decl)
+{
+    guint i;
+
+    for (i = 0; i < first_decl; ++i) {
+        ParserNsDecl *decl = &g_array_index (parser->ns_scope, ParserNsDecl, i);
+
+        g_free (decl->prefix);
+        g_free (decl->ns);
+    }
+    g_array_remove_range (parser->ns_scope, 0, first_decl);
+
+    for (i = 0; i < parser->ns_scope->len; ++i) {
+        g_array_index (parser->ns_scope, ParserNsDecl, i).depth = 0;
+    }
+
+    parser->depth = 0;
+}
+
 static void
 parser_start_node_cb (GMarkupParseContext  *context,
                       const gchar          *node_name,
@@ -75,12 +183,13 @@ parser_start_node_cb (GMarkupParseContext  *context,
                       GError              **error)
 {   
     LmParser     *parser;
+    guint         first_decl;
     gint          i;
     
     parser = LM_PARSER (user_data);;
-    
 
-/*  parser->cur_depth++; */
+    first_decl = parser->ns_scope->len;
+    parser->depth++;
 
     if (!parser->cur_root) {
         /* New toplevel element */
@@ -106,13 +215,15 @@ parser_start_node_cb (GMarkupParseContext  *context,
                                         attribute_names[i],
                                         attribute_values[i], 
                                         NULL);
+        parser_declare_ns (parser, attribute_names[i], attribute_values[i]);
     }
+
+    parser_resolve_ns (parser, parser->cur_node);
     
-    if (strcmp ("stream:stream", node_name) == 0) {
-        parser_end_node_cb (context,
-                            "stream:stream",
-                            user_data, 
-                            error);
+    if (lm_message_node_get_name_id (parser->cur_node) == parser->stream_id &&
+        lm_message_node_get_ns_id (parser->cur_node) == parser->streams_ns_id) {
+        parser_start_stream (parser, first_decl);
+        parser_end_node_cb (context, node_name, user_data, error);
     }
 }
 
@@ -129,6 +240,21 @@ parser_end_node_cb (GMarkupParseContext  *context,
     g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
            "Trying to close node: %s\n", node_name);
 
+    /* The stream header is closed right away but its declarations stay,
+     * as they do at the end of the stream */
+    if (parser->depth > 0) {
+        guint len = parser->ns_scope->len;
+
+        while (len > 0 &&
+               g_array_index (parser->ns_scope, ParserNsDecl,
+                              len - 1).depth == parser->depth) {
+            len--;
+        }
+        parser_drop_ns (parser, len);
+
+        parser->depth--;
+    }
+
     if (!parser->cur_node) {
         /* FIXME: LM-1 should look at this */
         return;
@@ -154,16 +280,21 @@ parser_end_node_cb (GMarkupParseContext  *context,
             g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
                    "Couldn't create message: %s\n",
                    parser->cur_root->name);
-            return;
-        }
 
-        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
-               "Have a new message\n");
-        if (parser->function) {
-            (* parser->function) (parser, m, parser->user_data);
+            if (parser->node_function) {
+                (* parser->node_function) (parser, parser->cur_root,
+                                           parser->user_data);
+            }
+        } else {
+            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_PARSER,
+                   "Have a new message\n");
+            if (parser->function) {
+                (* parser->function) (parser, m, parser->user_data);
+            }
+
+            lm_message_unref (m);
         }
 
-        lm_message_unref (m);
         lm_message_node_unref (parser->cur_root);
         
             
@@ -240,29 +371,71 @@ lm_parser_new (LmParserMessageFunction function,
     parser->cur_root = NULL;
     parser->cur_node = NULL;
 
+    parser->ns_scope = g_array_new (FALSE, FALSE, sizeof (ParserNsDecl));
+    parser->stream_id = g_quark_from_static_string ("stream");
+    parser->streams_ns_id = g_quark_from_static_string (XMPP_NS_STREAMS);
+
     return parser;
 }
 
 gboolean
 lm_parser_parse (LmParser *parser, const gchar *string)
+{
+    g_return_val_if_fail (parser != NULL, FALSE);
+    g_return_val_if_fail (string != NULL, FALSE);
+
+    return lm_parser_parse_len (parser, string, strlen (string));
+}
+
+/* Same as lm_parser_parse() for callers that already know the length, 
+ * @string doesn't need to be NUL terminated. */
+gboolean
+lm_parser_parse_len (LmParser *parser, const gchar *string, gsize len)
 {
     g_return_val_if_fail (parser != NULL, FALSE);
     
     if (!parser->context) {
         parser->context = g_markup_parse_context_new (parser->m_parser, 0,
                                                       parser, NULL);
+        parser_drop_ns (parser, 0);
+        parser->depth = 0;
     }
         
     if (g_markup_parse_context_parse (parser->context, string, 
-                                      (gssize)strlen (string), NULL)) {
+                                      (gssize) len, NULL)) {
         return TRUE;
     } else {
         g_markup_parse_context_free (parser->context);
         parser->context = NULL;
+
+        /* Whatever was half way through is gone with the context, open
+         * elements below the root hold a reference of their own */
+        while (parser->cur_node && parser->cur_node != parser->cur_root) {
+            LmMessageNode *tmp_node = parser->cur_node;
+
+            parser->cur_node = tmp_node->parent;
+            lm_message_node_unref (tmp_node);
+        }
+
+        if (parser->cur_root) {
+            lm_message_node_unref (parser->cur_root);
+            parser->cur_node = parser->cur_root = NULL;
+        }
+
         return FALSE;
     }
 }
 
+/* Called with top level elements that aren't messages, which are
+ * otherwise dropped. Gets the user data passed to lm_parser_new (). */
+void
+lm_parser_set_node_function (LmParser *parser, LmParserNodeFunction function)
+{
+    g_return_if_fail (parser != NULL);
+
+    parser->node_function = function;
+}
+
 void
 lm_parser_free (LmParser *parser)
 {
@@ -273,6 +446,8 @@ lm_parser_free (LmParser *parser)
     if (parser->context) {
         g_markup_parse_context_free (parser->context);
     }
+    parser_drop_ns (parser, 0);
+    g_array_free (parser->ns_scope, TRUE);
     g_free (parser->m_parser);
     g_free (parser);
 }
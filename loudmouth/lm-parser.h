@@ -29,12 +29,29 @@ typedef struct LmParser LmParser;
 typedef void (* LmParserMessageFunction) (LmParser     *parser,
                                           LmMessage    *message,
                                           gpointer      user_data);
+typedef void (* LmParserNodeFunction)    (LmParser      *parser,
+                                          LmMessageNode *node,
+                                          gpointer       user_data);
 
 LmParser *   lm_parser_new       (LmParserMessageFunction  function,
                                   gpointer                 user_data,
                                   GDestroyNotify           notify);
 gboolean     lm_parser_parse     (LmParser                *parser,
                                   const gchar             *string);
+gboolean     lm_parser_parse_len (LmParser                *parser,
+                                  const gchar             *string,
+                                  gsize                    len);
+void         lm_parser_set_node_function (LmParser            *parser,
+                                          LmParserNodeFunction function);
 void         lm_parser_free      (LmParser                *parser);
 
+typedef void (* LmParserBulkFunction) (LmMessage    *message,
+                                       gpointer      user_data);
+
+gboolean     lm_parser_parse_file (const gchar            *filename,
+                                   guint                   n_threads,
+                                   LmParserBulkFunction    function,
+                                   gpointer                user_data,
+                                   GError                **error);
+
 #endif /* __LM_PARSER_H__ */
@@ -94,8 +94,9 @@ proxy_free (LmProxy *proxy)
     g_free (proxy);
 }
 
-static gboolean
-proxy_http_negotiate (LmProxy *proxy, gint fd, const gchar *server, guint port)
+/* The request asking an HTTP proxy for a tunnel to @server */
+gchar *
+_lm_proxy_connect_request (LmProxy *proxy, const gchar *server, guint port)
 {
     gchar *str;
 
@@ -121,6 +122,15 @@ proxy_http_negotiate (LmProxy *proxy, gint fd, const gchar *server, guint port)
                                server, port);
     }
 
+    return str;
+}
+
+static gboolean
+proxy_http_negotiate (LmProxy *proxy, gint fd, const gchar *server, guint port)
+{
+    gchar *str;
+
+    str = _lm_proxy_connect_request (proxy, server, port);
     send (fd, str, strlen (str), 0);
     g_free (str);
     return TRUE;
@@ -21,6 +21,9 @@
 #include <config.h>
 
 #include <string.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 /* Needed on Mac OS X */
 #if HAVE_ARPA_NAMESER_COMPAT_H
@@ -74,6 +77,13 @@ static void     resolver_set_property        (GObject           *object,
 
 G_DEFINE_TYPE (LmResolver, lm_resolver, G_TYPE_OBJECT)
 
+/* Set through _lm_resolver_set_nameserver () */
+static struct sockaddr_in resolver_nameserver;
+static gboolean           resolver_use_nameserver = FALSE;
+
+/* Set through _lm_resolver_set_default_type () */
+static GType              resolver_default_type = G_TYPE_INVALID;
+
 enum {
     PROP_0,
     PROP_CONTEXT,
@@ -272,16 +282,14 @@ resolver_set_property (GObject      *object,
     };
 }
 
+static GType resolver_get_gtype (void);
+
 LmResolver *
 lm_resolver_new (GMainContext *context)
 {
     LmResolver *resolver;
 
-#ifdef HAVE_ASYNCNS
-    resolver = g_object_new (LM_TYPE_ASYNCNS_RESOLVER, NULL);
-#else
-    resolver = g_object_new (LM_TYPE_BLOCKING_RESOLVER, NULL);
-#endif
+    resolver = g_object_new (resolver_get_gtype (), NULL);
 
     g_object_set (resolver, "context", context, NULL);
 
@@ -291,6 +299,10 @@ lm_resolver_new (GMainContext *context)
 static GType
 resolver_get_gtype (void)
 {
+    if (resolver_default_type != G_TYPE_INVALID) {
+        return resolver_default_type;
+    }
+
 #ifdef HAVE_ASYNCNS
     return LM_TYPE_ASYNCNS_RESOLVER;
 #else
@@ -463,6 +475,10 @@ _lm_resolver_parse_srv_response (unsigned char  *srv,
 
     pref_name[0] = 0;
 
+    if (srv_len < (int) sizeof (HEADER)) {
+        return FALSE;
+    }
+
     pos = srv + sizeof (HEADER);
     end = srv + srv_len;
     head = (HEADER *) srv;
@@ -479,23 +495,44 @@ _lm_resolver_parse_srv_response (unsigned char  *srv,
     /* Parse the answers */
     while (ancount-- > 0 && (len = dn_expand (srv, end, pos, name, 255)) >= 0) {
         /* Ignore the initial string */
+        const unsigned char *rdata;
+        uint16_t type, rdlength;
         uint16_t pref, weight, port;
 
-        g_assert (len >= 0);
         pos += len;
-        /* Ignore type, ttl, class and dlen */
-        pos += 10;
-        GETSHORT (pref, pos);
-        GETSHORT (weight, pos);
-        GETSHORT (port, pos);
+        if (pos + RRFIXEDSZ > end) {
+            break;
+        }
+
+        GETSHORT (type, pos);
+        /* Ignore class and ttl */
+        pos += 6;
+        GETSHORT (rdlength, pos);
+
+        rdata = pos;
+        pos += rdlength;
+        if (pos > end) {
+            break;
+        }
+
+        /* Skip anything else the server put in, like CNAMEs */
+        if (type != T_SRV || rdlength < 7) {
+            continue;
+        }
+
+        GETSHORT (pref, rdata);
+        GETSHORT (weight, rdata);
+        GETSHORT (port, rdata);
+
+        if (dn_expand (srv, end, rdata, name, 255) < 0) {
+            continue;
+        }
 
-        len = dn_expand (srv, end, pos, name, 255);
         if (pref < pref_prio) {
             pref_prio = pref;
             strcpy (pref_name, name);
             pref_port = port;
         }
-        pos += len;
     }
 
     if (pref_name[0]) {
@@ -506,3 +543,73 @@ _lm_resolver_parse_srv_response (unsigned char  *srv,
     return FALSE;
 }
 
+/* Resets the resolver state before a query, picking up changes to
+ * resolv.conf. Sub classes call this instead of res_init () so that the
+ * nameserver set for the tests is used. The state belongs to the calling
+ * thread, so it has to be called by the thread doing the query, or
+ * before forking a process that does. */
+void
+_lm_resolver_res_init (void)
+{
+    res_init ();
+
+    if (resolver_use_nameserver) {
+        _res.nsaddr_list[0] = resolver_nameserver;
+        _res.nscount = 1;
+    }
+}
+
+/**
+ * _lm_resolver_set_nameserver:
+ * @address: IPv4 address of a nameserver, or %NULL
+ * @port: UDP and TCP port of the nameserver
+ *
+ * Makes all following lookups go to @address instead of the nameservers
+ * in resolv.conf. Used to point Loudmouth at the DNS stand-in of the
+ * tests, %NULL goes back to the system configuration. Not exported, the
+ * tests link the internal library.
+ *
+ * Only the resolver state of the C library is changed. Host lookups
+ * with getaddrinfo () follow it only when the name service switch asks
+ * DNS through that state, and asyncns only when its workers are forked
+ * processes, as with the copy shipped here, not threads.
+ **/
+void
+_lm_resolver_set_nameserver (const gchar *address, guint port)
+{
+    if (!address) {
+        resolver_use_nameserver = FALSE;
+        res_init ();
+        return;
+    }
+
+    memset (&resolver_nameserver, 0, sizeof (resolver_nameserver));
+    resolver_nameserver.sin_family = AF_INET;
+    resolver_nameserver.sin_port = htons (port);
+
+    if (inet_pton (AF_INET, address, &resolver_nameserver.sin_addr) != 1) {
+        g_warning ("Invalid nameserver address: %s", address);
+        return;
+    }
+
+    resolver_use_nameserver = TRUE;
+    _lm_resolver_res_init ();
+}
+
+/**
+ * _lm_resolver_set_default_type:
+ * @type: a sub class of #LmResolver, or %G_TYPE_INVALID
+ *
+ * Overrides the resolver implementation picked at configure time for
+ * all resolvers created after this call, so both can be exercised by
+ * the same test. %G_TYPE_INVALID goes back to the default. Not
+ * exported, the tests link the internal library.
+ **/
+void
+_lm_resolver_set_default_type (GType type)
+{
+    g_return_if_fail (type == G_TYPE_INVALID ||
+                      g_type_is_a (type, LM_TYPE_RESOLVER));
+
+    resolver_default_type = type;
+}
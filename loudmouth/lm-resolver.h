@@ -91,6 +91,12 @@ gboolean        _lm_resolver_parse_srv_response (unsigned char      *srv,
                                                  int                 srv_len, 
                                                  gchar            **out_server, 
                                                  guint              *out_port);
+void              _lm_resolver_res_init         (void);
+
+/* For tests and benchmarks */
+void              _lm_resolver_set_nameserver   (const gchar        *address,
+                                                 guint               port);
+void              _lm_resolver_set_default_type (GType               type);
 
 G_END_DECLS
 
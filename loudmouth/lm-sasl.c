@@ -44,10 +44,16 @@
 
 #include "md5.h"
 
+/* FAST needs GChecksum for HMAC-SHA-256 */
+#if GLIB_CHECK_VERSION (2, 16, 0)
+#define SASL_HAVE_FAST 1
+#endif
+
 typedef enum {
     AUTH_TYPE_PLAIN  = 1,
     AUTH_TYPE_DIGEST = 2,
     AUTH_TYPE_GSSAPI = 4,
+    AUTH_TYPE_FAST   = 8,
 } AuthType;
 
 typedef enum {
@@ -59,11 +65,13 @@ typedef enum {
     SASL_AUTH_STATE_GSSAPI_STARTED,
     SASL_AUTH_STATE_GSSAPI_SENT_AUTH_RESPONSE,
     SASL_AUTH_STATE_GSSAPI_SENT_FINAL_RESPONSE,
+    SASL_AUTH_STATE_FAST_STARTED,
 } SaslAuthState;
 
 struct _LmSASL {
     LmConnection        *connection;
     AuthType             auth_type;
+    AuthType             mechanisms;
     SaslAuthState        state;
     LmAuthParameters    *auth_params;
     gchar               *server;
@@ -78,6 +86,15 @@ struct _LmSASL {
 
     LmSASLResultHandler  handler;
 
+    /* SASL2 (XEP-0388) with inline Bind 2 (XEP-0386) and FAST (XEP-0484) */
+    gboolean             sasl2;
+    gboolean             sasl2_bind;
+    gboolean             sasl2_fast;
+    gchar               *fast_token;
+    gchar               *authorization_identifier;
+    gboolean             bound;
+    gboolean             aborted;
+
 #ifdef HAVE_GSSAPI
     gss_ctx_id_t         gss_ctx;
     gss_name_t           gss_service;
@@ -85,6 +102,16 @@ struct _LmSASL {
 };
 
 #define XMPP_NS_SASL_AUTH "urn:ietf:params:xml:ns:xmpp-sasl"
+#define XMPP_NS_SASL2     "urn:xmpp:sasl:2"
+#define XMPP_NS_BIND2     "urn:xmpp:bind:0"
+#define XMPP_NS_FAST      "urn:xmpp:fast:0"
+
+#define FAST_MECHANISM    "HT-SHA-256-NONE"
+
+#define SHA256_BLOCK_SIZE  64
+#define SHA256_DIGEST_SIZE 32
+
+#define sasl_ns(sasl) ((sasl)->sasl2 ? XMPP_NS_SASL2 : XMPP_NS_SASL_AUTH)
 
 static LmHandlerResult     sasl_features_cb  (LmMessageHandler *handler,
                                               LmConnection     *connection,
@@ -106,6 +133,11 @@ static LmHandlerResult     sasl_failure_cb   (LmMessageHandler *handler,
                                               LmMessage        *message,
                                               gpointer          user_data);
 
+static gboolean            sasl_authenticate    (LmSASL        *sasl);
+
+static gboolean            sasl2_handle_success (LmSASL        *sasl,
+                                                 LmMessageNode *success);
+
 
 #ifdef HAVE_GSSAPI
 static gboolean
@@ -344,7 +376,7 @@ sasl_gssapi_handle_challenge (LmSASL *sasl, LmMessageNode *node)
 
     msg = lm_message_new (NULL, LM_MESSAGE_TYPE_RESPONSE);
     lm_message_node_set_attributes (msg->node,
-                                    "xmlns", XMPP_NS_SASL_AUTH,
+                                    "xmlns", sasl_ns (sasl),
                                     NULL);
 
     if (output_buffer_desc.value != NULL) {
@@ -629,7 +661,7 @@ sasl_digest_md5_send_initial_response (LmSASL *sasl, GHashTable *challenge)
 
     msg = lm_message_new (NULL, LM_MESSAGE_TYPE_RESPONSE);
     lm_message_node_set_attributes (msg->node,
-                                    "xmlns", XMPP_NS_SASL_AUTH,
+                                    "xmlns", sasl_ns (sasl),
                                     NULL);
     lm_message_node_set_value (msg->node, response64);
 
@@ -682,7 +714,7 @@ sasl_digest_md5_check_server_response(LmSASL *sasl, GHashTable *challenge)
 
     msg = lm_message_new (NULL, LM_MESSAGE_TYPE_RESPONSE);
     lm_message_node_set_attributes (msg->node,
-                                    "xmlns", XMPP_NS_SASL_AUTH,
+                                    "xmlns", sasl_ns (sasl),
                                     NULL);
 
     result = lm_connection_send (sasl->connection, msg, NULL);
@@ -760,15 +792,16 @@ sasl_challenge_cb (LmMessageHandler *handler,
     LmSASL      *sasl;
     const gchar *ns;
 
+    sasl = (LmSASL *) user_data;
+
     ns = lm_message_node_get_attribute (message->node, "xmlns");
-    if (!ns || strcmp (ns, XMPP_NS_SASL_AUTH) != 0) {
+    if (!ns || strcmp (ns, sasl_ns (sasl)) != 0) {
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    sasl = (LmSASL *) user_data;
-
     switch (sasl->auth_type) {
     case AUTH_TYPE_PLAIN:
+    case AUTH_TYPE_FAST:
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL,
                "%s: server sent challenge for PLAIN mechanism",
                G_STRFUNC);
@@ -803,13 +836,13 @@ sasl_success_cb (LmMessageHandler *handler,
     LmSASL      *sasl;
     const gchar *ns;
     
+    sasl = (LmSASL *) user_data;
+
     ns = lm_message_node_get_attribute (message->node, "xmlns");
-    if (!ns || strcmp (ns, XMPP_NS_SASL_AUTH) != 0) {
+    if (!ns || strcmp (ns, sasl_ns (sasl)) != 0) {
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    sasl = (LmSASL *) user_data;
-
     switch (sasl->auth_type) {
     case AUTH_TYPE_PLAIN:
         if (sasl->state != SASL_AUTH_STATE_PLAIN_STARTED) {
@@ -849,11 +882,21 @@ sasl_success_cb (LmMessageHandler *handler,
         }
         break;
 #endif
+    case AUTH_TYPE_FAST:
+        break;
     default:
         g_warning ("Wrong auth type");
         break;
     }
 
+    if (sasl->sasl2 && !sasl2_handle_success (sasl, message->node)) {
+        if (sasl->handler) {
+            sasl->handler (sasl, sasl->connection, FALSE, "server error");
+        }
+
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
+
     g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
            "%s: SASL authentication successful", G_STRFUNC);
 
@@ -875,12 +918,17 @@ sasl_failure_cb (LmMessageHandler *handler,
     const gchar *ns;
     const gchar *reason = "unknown reason";
     
+    sasl = (LmSASL *) user_data;
+
     ns = lm_message_node_get_attribute (message->node, "xmlns");
-    if (!ns || strcmp (ns, XMPP_NS_SASL_AUTH) != 0) {
+    if (!ns || strcmp (ns, sasl_ns (sasl)) != 0) {
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    sasl = (LmSASL *) user_data;
+    if (sasl->aborted) {
+        /* The answer to our <abort/>, the handler knows already */
+        return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+    }
 
     if (message->node->children) {
         const gchar *r;
@@ -894,6 +942,21 @@ sasl_failure_cb (LmMessageHandler *handler,
     g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
            "%s: SASL authentication failed: %s", G_STRFUNC, reason);
 
+    if (sasl->auth_type == AUTH_TYPE_FAST) {
+        /* The token expired or was revoked, SASL2 lets us try again
+         * on the same stream with the password. */
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
+               "%s: FAST token rejected, falling back to password", G_STRFUNC);
+
+        g_free (sasl->fast_token);
+        sasl->fast_token = NULL;
+        sasl->auth_type = sasl->mechanisms;
+
+        if (sasl_authenticate (sasl)) {
+            return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+        }
+    }
+
     if (sasl->handler) {
         sasl->handler (sasl, sasl->connection, FALSE, reason);
     }
@@ -902,14 +965,242 @@ sasl_failure_cb (LmMessageHandler *handler,
 }
 
 
+#ifdef SASL_HAVE_FAST
+static void
+sasl_hmac_sha256 (const guchar *key,
+                  gsize         key_len,
+                  const guchar *data,
+                  gsize         data_len,
+                  guint8       *digest)
+{
+    GChecksum *checksum;
+    guint8     k[SHA256_BLOCK_SIZE];
+    guint8     pad[SHA256_BLOCK_SIZE];
+    gsize      len;
+    gint       i;
+
+    memset (k, 0, sizeof (k));
+
+    if (key_len > SHA256_BLOCK_SIZE) {
+        checksum = g_checksum_new (G_CHECKSUM_SHA256);
+        g_checksum_update (checksum, key, key_len);
+        len = SHA256_DIGEST_SIZE;
+        g_checksum_get_digest (checksum, k, &len);
+        g_checksum_free (checksum);
+    } else {
+        memcpy (k, key, key_len);
+    }
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = k[i] ^ 0x36;
+    }
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (checksum, pad, SHA256_BLOCK_SIZE);
+    g_checksum_update (checksum, data, data_len);
+    len = SHA256_DIGEST_SIZE;
+    g_checksum_get_digest (checksum, digest, &len);
+    g_checksum_free (checksum);
+
+    for (i = 0; i < SHA256_BLOCK_SIZE; i++) {
+        pad[i] = k[i] ^ 0x5c;
+    }
+
+    checksum = g_checksum_new (G_CHECKSUM_SHA256);
+    g_checksum_update (checksum, pad, SHA256_BLOCK_SIZE);
+    g_checksum_update (checksum, digest, SHA256_DIGEST_SIZE);
+    len = SHA256_DIGEST_SIZE;
+    g_checksum_get_digest (checksum, digest, &len);
+    g_checksum_free (checksum);
+}
+
+/* HT-* hashed token, no channel binding data with the -NONE variant */
+static void
+sasl_fast_hash_token (LmSASL *sasl, const gchar *label, guint8 *digest)
+{
+    sasl_hmac_sha256 ((const guchar *) sasl->fast_token,
+                      strlen (sasl->fast_token),
+                      (const guchar *) label, strlen (label),
+                      digest);
+}
+
+static void
+sasl_fast_start (LmSASL *sasl, LmMessageNode *node)
+{
+    GString *str;
+    guint8   digest[SHA256_DIGEST_SIZE];
+    gchar   *cstr;
+
+    sasl->state = SASL_AUTH_STATE_FAST_STARTED;
+
+    sasl_fast_hash_token (sasl, "Initiator", digest);
+
+    str = g_string_new (lm_auth_parameters_get_username (sasl->auth_params));
+    g_string_append_c (str, '\0');
+    g_string_append_len (str, (const gchar *) digest, SHA256_DIGEST_SIZE);
+
+    cstr = g_base64_encode ((const guchar *) str->str, (gsize) str->len);
+    lm_message_node_set_value (node, cstr);
+
+    g_string_free (str, TRUE);
+    g_free (cstr);
+}
+
+static gboolean
+sasl_fast_check_server_response (LmSASL *sasl, LmMessageNode *success)
+{
+    LmMessageNode *data_node;
+    const gchar   *encoded = NULL;
+    guint8         expected[SHA256_DIGEST_SIZE];
+    guchar        *data;
+    gsize          len = 0;
+    gboolean       retval;
+
+    data_node = lm_message_node_get_child (success, "additional-data");
+    if (data_node) {
+        encoded = lm_message_node_get_value (data_node);
+    }
+
+    if (!encoded) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
+               "%s: server didn't prove knowledge of the FAST token",
+               G_STRFUNC);
+        return FALSE;
+    }
+
+    sasl_fast_hash_token (sasl, "Responder", expected);
+
+    data = g_base64_decode (encoded, &len);
+    retval = (len == SHA256_DIGEST_SIZE &&
+              memcmp (data, expected, SHA256_DIGEST_SIZE) == 0);
+    g_free (data);
+
+    if (!retval) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
+               "%s: FAST server response not matching", G_STRFUNC);
+    }
+
+    return retval;
+}
+#endif /* SASL_HAVE_FAST */
+
+/* Same id for every login of an account/resource pair so the server can
+ * tie FAST tokens to it. Formatted like a UUID. */
+static gchar *
+sasl2_create_user_agent_id (LmSASL *sasl)
+{
+    gchar *seed;
+    gchar *hash;
+    gchar *id;
+
+    seed = g_strdup_printf ("%s@%s/%s",
+                            lm_auth_parameters_get_username (sasl->auth_params),
+                            sasl->server ? sasl->server : "",
+                            lm_auth_parameters_get_resource (sasl->auth_params));
+    hash = lm_sha_hash (seed);
+
+    id = g_strdup_printf ("%.8s-%.4s-%.4s-%.4s-%.12s",
+                          hash, hash + 8, hash + 12, hash + 16, hash + 20);
+
+    g_free (hash);
+    g_free (seed);
+
+    return id;
+}
+
+static void
+sasl2_add_inline_requests (LmSASL *sasl, LmMessageNode *authenticate)
+{
+    LmMessageNode *node;
+    gchar         *id;
+
+    id = sasl2_create_user_agent_id (sasl);
+    node = lm_message_node_add_child (authenticate, "user-agent", NULL);
+    lm_message_node_set_attribute (node, "id", id);
+    lm_message_node_add_child (node, "software", "Loudmouth");
+    g_free (id);
+
+    if (sasl->sasl2_bind) {
+        node = lm_message_node_add_child (authenticate, "bind", NULL);
+        lm_message_node_set_attribute (node, "xmlns", XMPP_NS_BIND2);
+        lm_message_node_add_child (node, "tag",
+                                   lm_auth_parameters_get_resource (sasl->auth_params));
+    }
+
+    if (sasl->sasl2_fast) {
+        if (sasl->auth_type == AUTH_TYPE_FAST) {
+            node = lm_message_node_add_child (authenticate, "fast", NULL);
+            lm_message_node_set_attribute (node, "xmlns", XMPP_NS_FAST);
+        }
+
+        /* Ask for a fresh token, rotating the one we used if any */
+        node = lm_message_node_add_child (authenticate, "request-token", NULL);
+        lm_message_node_set_attributes (node,
+                                        "xmlns", XMPP_NS_FAST,
+                                        "mechanism", FAST_MECHANISM,
+                                        NULL);
+    }
+}
+
+static gboolean
+sasl2_handle_success (LmSASL *sasl, LmMessageNode *success)
+{
+    LmMessageNode *node;
+    const gchar   *token;
+
+#ifdef SASL_HAVE_FAST
+    if (sasl->auth_type == AUTH_TYPE_FAST &&
+        !sasl_fast_check_server_response (sasl, success)) {
+        return FALSE;
+    }
+#endif
+
+    node = lm_message_node_get_child (success, "authorization-identifier");
+    if (node && lm_message_node_get_value (node)) {
+        g_free (sasl->authorization_identifier);
+        sasl->authorization_identifier =
+            g_strdup (lm_message_node_get_value (node));
+    }
+
+    sasl->bound = (lm_message_node_get_child (success, "bound") != NULL);
+
+    node = lm_message_node_get_child (success, "token");
+    if (node) {
+        token = lm_message_node_get_attribute (node, "token");
+        if (token) {
+            lm_verbose ("Received new FAST token, expires %s\n",
+                        lm_message_node_get_attribute (node, "expiry"));
+            g_free (sasl->fast_token);
+            sasl->fast_token = g_strdup (token);
+        }
+    }
+
+    return TRUE;
+}
+
 static gboolean
 sasl_start (LmSASL *sasl)
 {
-    LmMessage  *auth_msg;
-    gboolean    result;
-    const char *mech = NULL;
+    LmMessage     *auth_msg;
+    LmMessageNode *response;
+    gboolean       result;
+    const char    *mech = NULL;
 
-    auth_msg = lm_message_new (NULL, LM_MESSAGE_TYPE_AUTH);
+    /* Filled in by the mechanism, sent as the body of <auth/> or as
+     * <initial-response/> with SASL2 */
+    response = _lm_message_node_new ("initial-response");
+
+    if (sasl->auth_params == NULL) {
+        g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
+               "%s: no authentication parameters provided", 
+               G_STRFUNC);
+        if (sasl->handler) {
+            sasl->handler (sasl, sasl->connection, FALSE, "no username/password provided");
+        }
+
+        lm_message_node_unref (response);
+        return FALSE;
+    }
 
     if (sasl->auth_type == AUTH_TYPE_PLAIN) {
         GString *str;
@@ -920,17 +1211,6 @@ sasl_start (LmSASL *sasl)
         mech = "PLAIN";
         sasl->state = SASL_AUTH_STATE_PLAIN_STARTED;
 
-        if (sasl->auth_params == NULL) {
-            g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
-                   "%s: no authentication parameters provided", 
-                   G_STRFUNC);
-            if (sasl->handler) {
-                sasl->handler (sasl, sasl->connection, FALSE, "no username/password provided");
-            }
-
-            return FALSE;
-        }
-
         g_string_append_c (str, '\0');
         g_string_append (str, lm_auth_parameters_get_username (sasl->auth_params));
         g_string_append_c (str, '\0');
@@ -938,17 +1218,10 @@ sasl_start (LmSASL *sasl)
         cstr = g_base64_encode ((const guchar *) str->str, 
                                 (gsize) str->len);
 
-        lm_message_node_set_value (auth_msg->node, cstr);
+        lm_message_node_set_value (response, cstr);
 
         g_string_free (str, TRUE);
         g_free (cstr);
-
-        /* Here we say the Google magic word. Bad Google. */
-        lm_message_node_set_attributes (auth_msg->node,
-                                        "xmlns:ga", "http://www.google.com/talk/protocol/auth",
-                                        "ga:client-uses-full-bind-result", "true",
-                                        NULL);
-
     } 
     else if (sasl->auth_type == AUTH_TYPE_DIGEST) {
         mech = "DIGEST-MD5";
@@ -957,10 +1230,56 @@ sasl_start (LmSASL *sasl)
 #ifdef HAVE_GSSAPI
     else if (sasl->auth_type == AUTH_TYPE_GSSAPI) {
         mech = "GSSAPI";
-        sasl_gssapi_start (sasl, auth_msg->node);
+        sasl_gssapi_start (sasl, response);
+    }
+#endif
+#ifdef SASL_HAVE_FAST
+    else if (sasl->auth_type == AUTH_TYPE_FAST) {
+        mech = FAST_MECHANISM;
+        sasl_fast_start (sasl, response);
     }
 #endif
 
+    if (sasl->sasl2) {
+        LmMessageNode *authenticate;
+        gchar         *str;
+
+        authenticate = _lm_message_node_new ("authenticate");
+        lm_message_node_set_attributes (authenticate,
+                                        "xmlns", XMPP_NS_SASL2,
+                                        "mechanism", mech,
+                                        NULL);
+
+        if (lm_message_node_get_value (response)) {
+            _lm_message_node_add_child_node (authenticate, response);
+        }
+
+        sasl2_add_inline_requests (sasl, authenticate);
+
+        /* <authenticate/> isn't a message type of its own */
+        str = lm_message_node_to_string (authenticate);
+        result = lm_connection_send_raw (sasl->connection, str, NULL);
+        g_free (str);
+
+        lm_message_node_unref (authenticate);
+        lm_message_node_unref (response);
+
+        return result;
+    }
+
+    auth_msg = lm_message_new (NULL, LM_MESSAGE_TYPE_AUTH);
+    lm_message_node_set_value (auth_msg->node,
+                               lm_message_node_get_value (response));
+    lm_message_node_unref (response);
+
+    if (sasl->auth_type == AUTH_TYPE_PLAIN) {
+        /* Here we say the Google magic word. Bad Google. */
+        lm_message_node_set_attributes (auth_msg->node,
+                                        "xmlns:ga", "http://www.google.com/talk/protocol/auth",
+                                        "ga:client-uses-full-bind-result", "true",
+                                        NULL);
+    }
+
     lm_message_node_set_attributes (auth_msg->node,
                                     "xmlns", XMPP_NS_SASL_AUTH,
                                     "mechanism", mech,
@@ -985,13 +1304,17 @@ sasl_set_auth_type (LmSASL *sasl, LmMessageNode *mechanisms)
     sasl->auth_type = 0;
 
     ns = lm_message_node_get_attribute (mechanisms, "xmlns");
-    if (!ns || strcmp (ns, XMPP_NS_SASL_AUTH) != 0) {
+    if (!ns || strcmp (ns, sasl_ns (sasl)) != 0) {
         return FALSE;
     }
 
     for (m = mechanisms->children; m; m = m->next) {
         const gchar *name;
 
+        if (strcmp (m->name, "mechanism") != 0) {
+            continue;
+        }
+
         name = lm_message_node_get_value (m);
 
         if (!name) {
@@ -1014,12 +1337,64 @@ sasl_set_auth_type (LmSASL *sasl, LmMessageNode *mechanisms)
                "%s: unknown SASL auth mechanism: %s", G_STRFUNC, name);
     }
 
+    sasl->mechanisms = sasl->auth_type;
+
     return TRUE;
 }
 
+static void
+sasl2_set_inline_features (LmSASL *sasl, LmMessageNode *authentication)
+{
+    LmMessageNode *inline_node;
+    LmMessageNode *node;
+    const gchar   *ns;
+
+    sasl->sasl2_bind = FALSE;
+    sasl->sasl2_fast = FALSE;
+
+    inline_node = lm_message_node_get_child (authentication, "inline");
+    if (!inline_node) {
+        return;
+    }
+
+    node = lm_message_node_get_child (inline_node, "bind");
+    if (node) {
+        ns = lm_message_node_get_attribute (node, "xmlns");
+        sasl->sasl2_bind = (ns && strcmp (ns, XMPP_NS_BIND2) == 0);
+    }
+
+#ifdef SASL_HAVE_FAST
+    node = lm_message_node_get_child (inline_node, "fast");
+    if (node) {
+        LmMessageNode *m;
+
+        ns = lm_message_node_get_attribute (node, "xmlns");
+        if (!ns || strcmp (ns, XMPP_NS_FAST) != 0) {
+            return;
+        }
+
+        for (m = node->children; m; m = m->next) {
+            const gchar *name = lm_message_node_get_value (m);
+
+            if (name && strcmp (name, FAST_MECHANISM) == 0) {
+                sasl->sasl2_fast = TRUE;
+            }
+        }
+    }
+#endif
+}
+
 static gboolean
 sasl_authenticate (LmSASL *sasl)
 {
+#ifdef SASL_HAVE_FAST
+    /* A cached token skips the password exchange */
+    if (sasl->sasl2_fast && sasl->fast_token) {
+        sasl->auth_type = AUTH_TYPE_FAST;
+        return sasl_start (sasl);
+    }
+#endif
+
     if (sasl->auth_type == 0) {
         g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
                "%s: no supported SASL auth mechanisms found",
@@ -1055,15 +1430,43 @@ sasl_features_cb (LmMessageHandler *handler,
                   gpointer          user_data)
 {
     LmMessageNode *mechanisms;
+    LmMessageNode *authentication;
     LmSASL        *sasl;
+    const gchar   *ns;
 
     g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL, "Stream features received\n");
+
+    sasl = (LmSASL *) user_data;
+
+    /* Prefer SASL2 (XEP-0388), it can bind and hand out FAST tokens
+     * without a stream restart */
+    authentication = lm_message_node_get_child (message->node, "authentication");
+    if (authentication) {
+        ns = lm_message_node_get_attribute (authentication, "xmlns");
+        if (!ns || strcmp (ns, XMPP_NS_SASL2) != 0) {
+            authentication = NULL;
+        }
+    }
+
+    if (authentication) {
+        sasl->sasl2 = TRUE;
+        sasl->features_received = TRUE;
+
+        sasl_set_auth_type (sasl, authentication);
+        sasl2_set_inline_features (sasl, authentication);
+
+        if (sasl->start_auth) {
+            sasl_authenticate (sasl);
+        }
+
+        return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+    }
+
     mechanisms = lm_message_node_find_child (message->node, "mechanisms");
     if (!mechanisms) {
         return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
     }
 
-    sasl = (LmSASL *) user_data;
     sasl->features_received = TRUE;
 
     sasl_set_auth_type (sasl, mechanisms);
@@ -1148,6 +1551,8 @@ lm_sasl_free (LmSASL *sasl)
     }
 
     g_free (sasl->server);
+    g_free (sasl->fast_token);
+    g_free (sasl->authorization_identifier);
 
     if (sasl->features_cb) {
         lm_connection_unregister_message_handler (sasl->connection,
@@ -1177,9 +1582,89 @@ lm_sasl_free (LmSASL *sasl)
 }
 
 
+/* SASL2 servers can ask for more before the login is done, like a
+ * second factor or a password change. None of those tasks are supported
+ * so the attempt is aborted and fails instead of waiting forever.
+ * Returns FALSE if @node isn't a SASL2 <continue/>. */
+gboolean
+lm_sasl_handle_continue (LmSASL *sasl, LmMessageNode *node)
+{
+    LmMessageNode *tasks;
+    LmMessageNode *task;
+    const gchar   *ns;
+    GString       *reason;
+
+    if (!sasl->sasl2 || strcmp (node->name, "continue") != 0) {
+        return FALSE;
+    }
+
+    ns = lm_message_node_get_attribute (node, "xmlns");
+    if (!ns || strcmp (ns, XMPP_NS_SASL2) != 0) {
+        return FALSE;
+    }
+
+    reason = g_string_new ("unsupported SASL2 tasks required:");
+
+    tasks = lm_message_node_get_child (node, "tasks");
+    for (task = tasks ? tasks->children : NULL; task; task = task->next) {
+        const gchar *name = lm_message_node_get_value (task);
+
+        g_string_append_printf (reason, " %s", name ? name : "(unnamed)");
+    }
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SASL,
+           "%s: %s", G_STRFUNC, reason->str);
+
+    sasl->aborted = TRUE;
+    lm_connection_send_raw (sasl->connection,
+                            "<abort xmlns='" XMPP_NS_SASL2 "'/>", NULL);
+
+    if (sasl->handler) {
+        sasl->handler (sasl, sasl->connection, FALSE, reason->str);
+    }
+
+    g_string_free (reason, TRUE);
+
+    return TRUE;
+}
+
 LmAuthParameters *
 lm_sasl_get_auth_params (LmSASL *sasl)
 {
     return sasl->auth_params;
 }
 
+/* Token used for FAST authentication before lm_sasl_authenticate(), the
+ * one handed out by the server after it */
+void
+lm_sasl_set_fast_token (LmSASL *sasl, const gchar *token)
+{
+    g_return_if_fail (sasl != NULL);
+
+    g_free (sasl->fast_token);
+    sasl->fast_token = g_strdup (token);
+}
+
+const gchar *
+lm_sasl_get_fast_token (LmSASL *sasl)
+{
+    return sasl->fast_token;
+}
+
+gboolean
+lm_sasl_is_sasl2 (LmSASL *sasl)
+{
+    return sasl->sasl2;
+}
+
+const gchar *
+lm_sasl_get_authorization_identifier (LmSASL *sasl)
+{
+    return sasl->authorization_identifier;
+}
+
+gboolean
+lm_sasl_get_bound (LmSASL *sasl)
+{
+    return sasl->bound;
+}
@@ -49,6 +49,16 @@ void               lm_sasl_free             (LmSASL               *sasl);
 
 LmAuthParameters * lm_sasl_get_auth_params  (LmSASL               *sasl);
 
+void               lm_sasl_set_fast_token   (LmSASL               *sasl,
+                                             const gchar          *token);
+const gchar *      lm_sasl_get_fast_token   (LmSASL               *sasl);
+
+gboolean           lm_sasl_is_sasl2         (LmSASL               *sasl);
+const gchar *      lm_sasl_get_authorization_identifier (LmSASL   *sasl);
+gboolean           lm_sasl_get_bound        (LmSASL               *sasl);
+gboolean           lm_sasl_handle_continue  (LmSASL               *sasl,
+                                             LmMessageNode        *node);
+
 
 G_END_DECLS
 
@@ -18,6 +18,12 @@
  * Boston, MA 02111-1307, USA.
  */
 
+/* Declares splice (), which is Linux only. Has to come before anything
+ * includes a system header, so it can't wait for HAVE_SPLICE. */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <config.h>
 
 #include <glib.h>
@@ -43,6 +49,10 @@
 #include <arpa/inet.h>
 #define LM_SHUTDOWN SHUT_RDWR
 
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+
 #else  /* G_OS_WIN32 */
 
 #include <winsock2.h>
@@ -57,6 +67,9 @@
 
 #define IPV6_MAX_ADDRESS_LEN 46 /* 45 + '\0' */
 
+/* Used where the data has to be copied through user space */
+#define COPY_BUFFER_SIZE     65536
+
 static gboolean initialised = FALSE;
 
 gboolean
@@ -372,3 +385,158 @@ _lm_sock_get_local_host (LmOldSocketT sock)
 
     return g_strdup (host);
 }
+
+/* Writes all of @buf to @fd, FALSE on errors */
+static gboolean
+sock_write_all (gint fd, const gchar *buf, gsize len)
+{
+    gsize n_written = 0;
+
+    while (n_written < len) {
+        gssize n;
+
+        n = write (fd, buf + n_written, len - n_written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FALSE;
+        }
+
+        n_written += n;
+    }
+
+    return TRUE;
+}
+
+static gssize
+sock_send_file_copy (LmOldSocketT  sock,
+                     gint          fd,
+                     off_t        *offset,
+                     gsize         count)
+{
+    gchar   buf[COPY_BUFFER_SIZE];
+    gssize  n_read;
+    gssize  n_sent;
+
+    n_read = pread (fd, buf, MIN (count, sizeof (buf)), *offset);
+    if (n_read <= 0) {
+        return n_read;
+    }
+
+    n_sent = send (sock, buf, n_read, 0);
+    if (n_sent > 0) {
+        *offset += n_sent;
+    }
+
+    return n_sent;
+}
+
+/* Sends up to @count bytes of @fd, starting at *@offset, over @sock and
+ * moves *@offset past them. With sendfile () the data goes from the page
+ * cache to the socket without being copied through user space, where the
+ * kernel or the file system can't do that it is copied instead. Returns
+ * the number of bytes sent or -1 with the error in errno, EAGAIN when
+ * @sock is non-blocking and full. */
+gssize
+_lm_sock_send_file (LmOldSocketT  sock,
+                    gint          fd,
+                    off_t        *offset,
+                    gsize         count)
+{
+#if defined (HAVE_SENDFILE) && defined (HAVE_SYS_SENDFILE_H)
+    gssize n;
+
+    n = sendfile (sock, fd, offset, count);
+    if (n >= 0 || (errno != EINVAL && errno != ENOSYS)) {
+        return n;
+    }
+#endif
+
+    return sock_send_file_copy (sock, fd, offset, count);
+}
+
+static gssize
+sock_recv_file_copy (LmOldSocketT  sock,
+                     gint          fd,
+                     gsize         count)
+{
+    gchar   buf[COPY_BUFFER_SIZE];
+    gssize  n_received;
+
+    n_received = recv (sock, buf, MIN (count, sizeof (buf)), 0);
+    if (n_received <= 0) {
+        return n_received;
+    }
+
+    return sock_write_all (fd, buf, n_received) ? n_received : -1;
+}
+
+#ifdef HAVE_SPLICE
+/* Moves @count bytes waiting in the pipe to @fd */
+static gboolean
+sock_drain_pipe (gint *pipe_fds, gint fd, gsize count)
+{
+    gsize n_written = 0;
+
+    while (n_written < count) {
+        gchar  buf[COPY_BUFFER_SIZE];
+        gssize n;
+
+        n = splice (pipe_fds[0], NULL, fd, NULL, count - n_written,
+                    SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+            /* @fd can't be spliced to, copy what is in the pipe */
+            n = read (pipe_fds[0], buf, MIN (count - n_written, sizeof (buf)));
+            if (n <= 0 || !sock_write_all (fd, buf, n)) {
+                return FALSE;
+            }
+        }
+        else if (n <= 0) {
+            return FALSE;
+        }
+
+        n_written += n;
+    }
+
+    return TRUE;
+}
+#endif
+
+/* Receives up to @count bytes from @sock and writes them to @fd. With
+ * splice () the data moves through @pipe_fds, a pipe created on first use
+ * that the caller closes, without being copied through user space. Where
+ * splice () can't be used the data is copied instead. Returns the number
+ * of bytes received, 0 at the end of the stream or -1 with the error in
+ * errno. */
+gssize
+_lm_sock_recv_file (LmOldSocketT  sock,
+                    gint          fd,
+                    gint         *pipe_fds,
+                    gsize         count)
+{
+#ifdef HAVE_SPLICE
+    gssize n_received;
+
+    if (pipe_fds[0] < 0 && pipe (pipe_fds) < 0) {
+        return sock_recv_file_copy (sock, fd, count);
+    }
+
+    n_received = splice (sock, NULL, pipe_fds[1], NULL, count,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n_received < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        return sock_recv_file_copy (sock, fd, count);
+    }
+    if (n_received <= 0) {
+        return n_received;
+    }
+
+    /* The pipe has to be drained before the next call */
+    return sock_drain_pipe (pipe_fds, fd, n_received) ? n_received : -1;
+#else
+    return sock_recv_file_copy (sock, fd, count);
+#endif
+}
@@ -52,5 +52,27 @@ void
 _lm_ssl_base_free_fields (LmSSLBase *base)
 {
     g_free (base->expected_fingerprint);
+    g_free (base->ciphers);
+    g_free (base->groups);
+    g_free (base->negotiated_protocol);
+    g_free (base->negotiated_cipher);
+    g_free (base->negotiated_group);
+}
+
+void
+_lm_ssl_base_set_negotiated (LmSSLBase   *base,
+                             const gchar *protocol,
+                             const gchar *cipher,
+                             const gchar *group,
+                             gdouble      handshake_time)
+{
+    g_free (base->negotiated_protocol);
+    g_free (base->negotiated_cipher);
+    g_free (base->negotiated_group);
+
+    base->negotiated_protocol = g_strdup (protocol);
+    base->negotiated_cipher   = g_strdup (cipher);
+    base->negotiated_group    = g_strdup (group);
+    base->handshake_time      = handshake_time;
 }
 
@@ -35,6 +35,19 @@ struct _LmSSLBase {
     gboolean        use_starttls;
     gboolean        require_starttls;
 
+    /* Handshake configuration, applied by the backends */
+    LmSSLProtocol   min_protocol;
+    LmSSLProtocol   max_protocol;
+    gchar          *ciphers;
+    gchar          *groups;
+
+    /* What the last handshake ended up with */
+    gchar          *negotiated_protocol;
+    gchar          *negotiated_cipher;
+    gchar          *negotiated_group;
+    gdouble         handshake_time;
+    gboolean        session_resumed;
+
     gint            ref_count;
 };
 
@@ -46,4 +59,10 @@ void _lm_ssl_base_init         (LmSSLBase      *base,
 
 void _lm_ssl_base_free_fields  (LmSSLBase      *base);
 
+void _lm_ssl_base_set_negotiated (LmSSLBase   *base,
+                                  const gchar *protocol,
+                                  const gchar *cipher,
+                                  const gchar *group,
+                                  gdouble      handshake_time);
+
 #endif /* __LM_SSL_BASE_H__ */
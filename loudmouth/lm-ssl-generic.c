@@ -32,6 +32,37 @@ _lm_ssl_func_always_continue (LmSSL       *ssl,
     return LM_SSL_RESPONSE_CONTINUE;;
 }
 
+LmSSLResponse
+_lm_ssl_func_always_stop (LmSSL       *ssl,
+                          LmSSLStatus  status,
+                          gpointer     user_data)
+{
+    return LM_SSL_RESPONSE_STOP;
+}
+
+/* Takes the handshake configuration of @from, not its callback or the
+ * fingerprint, which belong to the server @from was made for */
+void
+_lm_ssl_copy_settings (LmSSL *ssl, LmSSL *from)
+{
+    LmSSLBase *base;
+    LmSSLBase *from_base;
+
+    g_return_if_fail (ssl != NULL);
+    g_return_if_fail (from != NULL);
+
+    base = LM_SSL_BASE (ssl);
+    from_base = LM_SSL_BASE (from);
+
+    base->min_protocol = from_base->min_protocol;
+    base->max_protocol = from_base->max_protocol;
+
+    g_free (base->ciphers);
+    base->ciphers = g_strdup (from_base->ciphers);
+    g_free (base->groups);
+    base->groups = g_strdup (from_base->groups);
+}
+
 /* Define the SSL functions as noops if we compile without support */
 #ifndef HAVE_SSL
 
@@ -77,6 +108,15 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
     /* NOOP */
     return TRUE;
 }
+
+GIOStatus
+_lm_ssl_write (LmSSL *ssl, const gchar *str, gint len, gsize *bytes_written)
+{
+    /* NOOP */
+    *bytes_written = 0;
+
+    return G_IO_STATUS_ERROR;
+}
 void 
 _lm_ssl_close (LmSSL *ssl)
 {
@@ -174,6 +214,10 @@ lm_ssl_ref (LmSSL *ssl)
  * @ssl: an #LmSSL
  *
  * Set whether STARTTLS should be used.
+ *
+ * When no server is set on the connection a _xmpps-client._tcp SRV
+ * lookup (XEP-0368) is done as well and a direct TLS target found that
+ * way is preferred, in which case STARTTLS is not negotiated at all.
  **/
 void
 lm_ssl_use_starttls (LmSSL *ssl,
@@ -215,6 +259,158 @@ lm_ssl_get_require_starttls (LmSSL *ssl)
     return base->require_starttls;
 }
 
+/**
+ * lm_ssl_set_protocol_range:
+ * @ssl: an #LmSSL
+ * @min: lowest protocol version to offer
+ * @max: highest protocol version to offer
+ *
+ * Restricts the TLS versions negotiated by @ssl. Use
+ * #LM_SSL_PROTOCOL_DEFAULT for a bound to keep the SSL library default.
+ * Has to be called before the connection is opened. The handshake fails
+ * when the SSL library doesn't support the range.
+ **/
+void
+lm_ssl_set_protocol_range (LmSSL         *ssl,
+                           LmSSLProtocol  min,
+                           LmSSLProtocol  max)
+{
+    LmSSLBase *base;
+
+    g_return_if_fail (ssl != NULL);
+    g_return_if_fail (max == LM_SSL_PROTOCOL_DEFAULT || min <= max);
+
+    base = LM_SSL_BASE (ssl);
+    base->min_protocol = min;
+    base->max_protocol = max;
+}
+
+/**
+ * lm_ssl_set_ciphers:
+ * @ssl: an #LmSSL
+ * @ciphers: colon separated cipher names in order of preference, or %NULL
+ *
+ * Sets the bulk ciphers offered by @ssl. Known names are
+ * "CHACHA20-POLY1305", "AES-128-GCM", "AES-256-GCM", "AES-128-CBC"
+ * and "AES-256-CBC", they are mapped to the matching suites of the SSL
+ * backend in use. When a name is unknown to the backend the handshake
+ * fails with #LM_ERROR_CONNECTION_OPEN rather than falling back to the
+ * library defaults. Passing %NULL restores the library default. For
+ * example "CHACHA20-POLY1305:AES-128-GCM" is a good choice on CPUs
+ * without AES instructions.
+ **/
+void
+lm_ssl_set_ciphers (LmSSL *ssl, const gchar *ciphers)
+{
+    LmSSLBase *base;
+
+    g_return_if_fail (ssl != NULL);
+
+    base = LM_SSL_BASE (ssl);
+    g_free (base->ciphers);
+    base->ciphers = g_strdup (ciphers);
+}
+
+/**
+ * lm_ssl_set_groups:
+ * @ssl: an #LmSSL
+ * @groups: colon separated key exchange groups in order of preference, or %NULL
+ *
+ * Sets the key exchange groups offered by @ssl. Known names are
+ * "X25519", "X448", "P-256", "P-384" and "P-521". Like with
+ * lm_ssl_set_ciphers() the handshake fails when the groups can't be set.
+ * Passing %NULL restores the library default.
+ **/
+void
+lm_ssl_set_groups (LmSSL *ssl, const gchar *groups)
+{
+    LmSSLBase *base;
+
+    g_return_if_fail (ssl != NULL);
+
+    base = LM_SSL_BASE (ssl);
+    g_free (base->groups);
+    base->groups = g_strdup (groups);
+}
+
+/**
+ * lm_ssl_get_negotiated_protocol:
+ * @ssl: an #LmSSL
+ *
+ * Return value: name of the protocol version agreed on in the last
+ * handshake, as reported by the SSL backend, or %NULL.
+ **/
+const gchar *
+lm_ssl_get_negotiated_protocol (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, NULL);
+
+    return LM_SSL_BASE (ssl)->negotiated_protocol;
+}
+
+/**
+ * lm_ssl_get_negotiated_cipher:
+ * @ssl: an #LmSSL
+ *
+ * Return value: name of the cipher agreed on in the last handshake, as
+ * reported by the SSL backend, or %NULL.
+ **/
+const gchar *
+lm_ssl_get_negotiated_cipher (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, NULL);
+
+    return LM_SSL_BASE (ssl)->negotiated_cipher;
+}
+
+/**
+ * lm_ssl_get_negotiated_group:
+ * @ssl: an #LmSSL
+ *
+ * Return value: name of the key exchange group used in the last
+ * handshake or %NULL if the SSL backend can't tell.
+ **/
+const gchar *
+lm_ssl_get_negotiated_group (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, NULL);
+
+    return LM_SSL_BASE (ssl)->negotiated_group;
+}
+
+/**
+ * lm_ssl_get_handshake_time:
+ * @ssl: an #LmSSL
+ *
+ * Return value: the time in seconds the last handshake took, including
+ * certificate verification.
+ **/
+gdouble
+lm_ssl_get_handshake_time (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, 0.0);
+
+    return LM_SSL_BASE (ssl)->handshake_time;
+}
+
+/**
+ * lm_ssl_get_session_resumed:
+ * @ssl: an #LmSSL
+ *
+ * An #LmSSL remembers the session of its last connection and offers it
+ * again when reconnecting to the same server, which saves the full key
+ * exchange and certificate transfer.
+ *
+ * Return value: %TRUE if the last handshake resumed a previous session.
+ **/
+gboolean
+lm_ssl_get_session_resumed (LmSSL *ssl)
+{
+    g_return_val_if_fail (ssl != NULL, FALSE);
+
+    return LM_SSL_BASE (ssl)->session_resumed;
+}
+
 /**
  * lm_ssl_unref
  * @ssl: an #LmSSL
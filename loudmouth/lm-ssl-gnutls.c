@@ -40,11 +40,167 @@ struct _LmSSL {
     gnutls_session                 gnutls_session;
     gnutls_certificate_credentials gnutls_xcred;
     gboolean                       started;
+
+    /* Session of the last connection, offered again to the same server */
+    gnutls_datum_t                 session_data;
+    gchar                         *session_server;
 };
 
 static gboolean       ssl_verify_certificate    (LmSSL       *ssl,
                                                  const gchar *server);
 
+/* Priority string keywords for the names accepted by lm_ssl_set_groups(),
+ * the cipher names are the GnuTLS ones already. */
+static const struct {
+    const gchar *name;
+    const gchar *keyword;
+} group_map[] = {
+    { "X25519", "GROUP-X25519" },
+    { "X448",   "GROUP-X448" },
+    { "P-256",  "GROUP-SECP256R1" },
+    { "P-384",  "GROUP-SECP384R1" },
+    { "P-521",  "GROUP-SECP521R1" },
+    { NULL, NULL }
+};
+
+static const gchar *
+ssl_protocol_keyword (LmSSLProtocol protocol)
+{
+    switch (protocol) {
+    case LM_SSL_PROTOCOL_TLS_1_0:
+        return "VERS-TLS1.0";
+    case LM_SSL_PROTOCOL_TLS_1_1:
+        return "VERS-TLS1.1";
+    case LM_SSL_PROTOCOL_TLS_1_2:
+        return "VERS-TLS1.2";
+    case LM_SSL_PROTOCOL_TLS_1_3:
+        return "VERS-TLS1.3";
+    default:
+        break;
+    }
+
+    return NULL;
+}
+
+/* Builds a priority string out of the LmSSL configuration, sets
+ * @priority to NULL when the defaults should be used. Fails when part of
+ * the configuration can't be expressed. */
+static gboolean
+ssl_create_priority_string (LmSSL *ssl, gchar **priority_ret, GError **error)
+{
+    LmSSLBase      *base = LM_SSL_BASE (ssl);
+    GString        *priority;
+    gchar         **names;
+    LmSSLProtocol   protocol;
+    LmSSLProtocol   min, max;
+    gint            i, j;
+
+    if (base->min_protocol == LM_SSL_PROTOCOL_DEFAULT &&
+        base->max_protocol == LM_SSL_PROTOCOL_DEFAULT &&
+        !base->ciphers && !base->groups) {
+        *priority_ret = NULL;
+        return TRUE;
+    }
+
+    priority = g_string_new ("NORMAL");
+
+    if (base->min_protocol != LM_SSL_PROTOCOL_DEFAULT ||
+        base->max_protocol != LM_SSL_PROTOCOL_DEFAULT) {
+        min = base->min_protocol;
+        if (min == LM_SSL_PROTOCOL_DEFAULT) {
+            min = LM_SSL_PROTOCOL_TLS_1_0;
+        }
+        max = base->max_protocol;
+        if (max == LM_SSL_PROTOCOL_DEFAULT) {
+            max = LM_SSL_PROTOCOL_TLS_1_3;
+        }
+
+        g_string_append (priority, ":-VERS-ALL");
+        for (protocol = max; protocol >= min; protocol--) {
+            g_string_append_printf (priority, ":+%s",
+                                    ssl_protocol_keyword (protocol));
+        }
+    }
+
+    if (base->ciphers) {
+        g_string_append (priority, ":-CIPHER-ALL");
+
+        names = g_strsplit (base->ciphers, ":", -1);
+        for (i = 0; names[i]; i++) {
+            if (names[i][0] == '\0') {
+                continue;
+            }
+            g_string_append_printf (priority, ":+%s", names[i]);
+        }
+        g_strfreev (names);
+    }
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    if (base->groups) {
+        g_string_append (priority, ":-GROUP-ALL");
+
+        names = g_strsplit (base->groups, ":", -1);
+        for (i = 0; names[i]; i++) {
+            for (j = 0; group_map[j].name; j++) {
+                if (g_ascii_strcasecmp (names[i], group_map[j].name) == 0) {
+                    g_string_append_printf (priority, ":+%s",
+                                            group_map[j].keyword);
+                    break;
+                }
+            }
+
+            if (!group_map[j].name) {
+                g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                             "*** GNUTLS unknown group: %s", names[i]);
+                g_strfreev (names);
+                g_string_free (priority, TRUE);
+                return FALSE;
+            }
+        }
+        g_strfreev (names);
+    }
+#else
+    if (base->groups) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                     "*** GNUTLS setting key exchange groups needs "
+                     "GnuTLS 3.6");
+        g_string_free (priority, TRUE);
+        return FALSE;
+    }
+#endif
+
+    *priority_ret = g_string_free (priority, FALSE);
+
+    return TRUE;
+}
+
+static void
+ssl_store_negotiated (LmSSL *ssl, gdouble handshake_time)
+{
+    const gchar *group = NULL;
+
+#if GNUTLS_VERSION_NUMBER >= 0x030600
+    group = gnutls_group_get_name (gnutls_group_get (ssl->gnutls_session));
+#elif GNUTLS_VERSION_NUMBER >= 0x030000
+    group = gnutls_ecc_curve_get_name (gnutls_ecc_curve_get (ssl->gnutls_session));
+#endif
+
+    _lm_ssl_base_set_negotiated (LM_SSL_BASE (ssl),
+                                 gnutls_protocol_get_name (gnutls_protocol_get_version (ssl->gnutls_session)),
+                                 gnutls_cipher_get_name (gnutls_cipher_get (ssl->gnutls_session)),
+                                 group,
+                                 handshake_time);
+    LM_SSL_BASE (ssl)->session_resumed =
+        gnutls_session_is_resumed (ssl->gnutls_session) != 0;
+
+    lm_verbose ("GNUTLS handshake: %s, %s, %s in %f seconds%s\n",
+                LM_SSL_BASE (ssl)->negotiated_protocol,
+                LM_SSL_BASE (ssl)->negotiated_cipher,
+                group ? group : "unknown group",
+                handshake_time,
+                LM_SSL_BASE (ssl)->session_resumed ? " (resumed)" : "");
+}
+
 static gboolean
 ssl_verify_certificate (LmSSL *ssl, const gchar *server)
 {
@@ -162,6 +318,39 @@ ssl_verify_certificate (LmSSL *ssl, const gchar *server)
     return TRUE;
 }
 
+static void
+ssl_forget_session (LmSSL *ssl)
+{
+    if (ssl->session_data.data) {
+        gnutls_free (ssl->session_data.data);
+        ssl->session_data.data = NULL;
+        ssl->session_data.size = 0;
+    }
+
+    g_free (ssl->session_server);
+    ssl->session_server = NULL;
+}
+
+/* Keeps the session of a finished connection for the next handshake
+ * with the same server */
+static void
+ssl_remember_session (LmSSL *ssl)
+{
+#if GNUTLS_VERSION_NUMBER >= 0x030000
+    gnutls_datum_t data = { NULL, 0 };
+
+    if (gnutls_session_get_data2 (ssl->gnutls_session, &data) < 0) {
+        data.data = NULL;
+        data.size = 0;
+    }
+
+    if (ssl->session_data.data) {
+        gnutls_free (ssl->session_data.data);
+    }
+    ssl->session_data = data;
+#endif
+}
+
 /* From lm-ssl-protected.h */
 
 LmSSL *
@@ -196,6 +385,8 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
 {
     int ret;
     gboolean auth_ok = TRUE;
+    gchar *priority;
+    GTimer *timer;
     const int cert_type_priority[] =
         { GNUTLS_CRT_X509, GNUTLS_CRT_OPENPGP, 0 };
     const int compression_priority[] =
@@ -203,6 +394,32 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
 
     gnutls_init (&ssl->gnutls_session, GNUTLS_CLIENT);
     gnutls_set_default_priority (ssl->gnutls_session);
+
+    if (!ssl_create_priority_string (ssl, &priority, error)) {
+        gnutls_deinit (ssl->gnutls_session);
+        return FALSE;
+    }
+
+    if (priority) {
+        const gchar *err_pos = NULL;
+
+        lm_verbose ("GNUTLS priority: %s\n", priority);
+
+        /* Rather no connection than one with the library defaults in
+         * place of what was asked for */
+        ret = gnutls_priority_set_direct (ssl->gnutls_session,
+                                          priority, &err_pos);
+        if (ret < 0) {
+            g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                         "*** GNUTLS invalid priority at: %s",
+                         err_pos ? err_pos : priority);
+            g_free (priority);
+            gnutls_deinit (ssl->gnutls_session);
+            return FALSE;
+        }
+        g_free (priority);
+    }
+
     gnutls_certificate_type_set_priority (ssl->gnutls_session,
                                           cert_type_priority);
     gnutls_compression_set_priority (ssl->gnutls_session,
@@ -214,12 +431,39 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
     gnutls_transport_set_ptr (ssl->gnutls_session,
                               (gnutls_transport_ptr_t)(glong) fd);
 
+    if (ssl->session_data.data && server && ssl->session_server &&
+        strcmp (server, ssl->session_server) == 0) {
+        gnutls_session_set_data (ssl->gnutls_session,
+                                 ssl->session_data.data,
+                                 ssl->session_data.size);
+    } else {
+        ssl_forget_session (ssl);
+        ssl->session_server = g_strdup (server);
+    }
+
+#if GNUTLS_VERSION_NUMBER >= 0x030200
+    {
+        gnutls_datum_t alpn;
+
+        alpn.data = (unsigned char *) LM_SSL_ALPN_XMPP_CLIENT;
+        alpn.size = strlen (LM_SSL_ALPN_XMPP_CLIENT);
+        gnutls_alpn_set_protocols (ssl->gnutls_session, &alpn, 1, 0);
+    }
+#endif
+
+    timer = g_timer_new ();
+
     ret = gnutls_handshake (ssl->gnutls_session);
 
     if (ret >= 0) {
         auth_ok = ssl_verify_certificate (ssl, server);
     }
 
+    if (ret >= 0 && auth_ok) {
+        ssl_store_negotiated (ssl, g_timer_elapsed (timer, NULL));
+    }
+    g_timer_destroy (timer);
+
     if (ret < 0 || !auth_ok) {
         char *errmsg;
 
@@ -291,20 +535,49 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
     return bytes_written;
 }
 
+/* Like _lm_ssl_send () but returns instead of waiting for the socket. On
+ * G_IO_STATUS_AGAIN it has to be called with the same data again. */
+GIOStatus
+_lm_ssl_write (LmSSL *ssl, const gchar *str, gint len, gsize *bytes_written)
+{
+    gint b_written;
+
+    *bytes_written = 0;
+
+    do {
+        b_written = gnutls_record_send (ssl->gnutls_session, str, len);
+    } while (b_written == GNUTLS_E_INTERRUPTED);
+
+    if (b_written == GNUTLS_E_AGAIN) {
+        return G_IO_STATUS_AGAIN;
+    }
+    else if (b_written < 0) {
+        return G_IO_STATUS_ERROR;
+    }
+
+    *bytes_written = (gsize) b_written;
+
+    return G_IO_STATUS_NORMAL;
+}
+
 void 
 _lm_ssl_close (LmSSL *ssl)
 {
     if (!ssl->started)
         return;
 
+    ssl_remember_session (ssl);
+
     gnutls_deinit (ssl->gnutls_session);
     gnutls_certificate_free_credentials (ssl->gnutls_xcred);
     gnutls_global_deinit ();
+    ssl->started = FALSE;
 }
 
 void
 _lm_ssl_free (LmSSL *ssl)
 {
+    ssl_forget_session (ssl);
     _lm_ssl_base_free_fields (LM_SSL_BASE (ssl));
     g_free (ssl);
 }
@@ -23,9 +23,17 @@
 
 #include <glib.h>
 
+/* ALPN protocol id advertised in the handshake (XEP-0368) */
+#define LM_SSL_ALPN_XMPP_CLIENT "xmpp-client"
+
 LmSSLResponse   _lm_ssl_func_always_continue (LmSSL       *ssl,
                                               LmSSLStatus  status,
                                               gpointer     user_data);
+LmSSLResponse   _lm_ssl_func_always_stop     (LmSSL       *ssl,
+                                              LmSSLStatus  status,
+                                              gpointer     user_data);
+void             _lm_ssl_copy_settings    (LmSSL            *ssl,
+                                           LmSSL            *from);
 LmSSL *          _lm_ssl_new              (const gchar    *expected_fingerprint,
                                            LmSSLFunction   ssl_function,
                                            gpointer        user_data,
@@ -43,6 +51,10 @@ GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
 gint             _lm_ssl_send             (LmSSL            *ssl,
                                            const gchar      *str,
                                            gint              len);
+GIOStatus        _lm_ssl_write            (LmSSL            *ssl,
+                                           const gchar      *str,
+                                           gint              len,
+                                           gsize            *bytes_written);
 void             _lm_ssl_close            (LmSSL            *ssl);
 void             _lm_ssl_free             (LmSSL            *ssl);
 
@@ -63,6 +75,10 @@ GIOStatus        _lm_ssl_read             (LmSSL            *ssl,
 gint             _lm_ssl_send             (LmSSL            *ssl,
                                            const gchar      *str,
                                            gint              len);
+GIOStatus        _lm_ssl_write            (LmSSL            *ssl,
+                                           const gchar      *str,
+                                           gint              len,
+                                           gsize            *bytes_written);
 void             _lm_ssl_close            (LmSSL            *ssl);
 void             _lm_ssl_free             (LmSSL            *ssl);
 
@@ -21,6 +21,7 @@
 
 #include <config.h>
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -38,6 +39,33 @@
 
 #define LM_SSL_CN_MAX       63
 
+/* Maps the cipher names accepted by lm_ssl_set_ciphers() to OpenSSL
+ * cipher lists for TLS <= 1.2 and ciphersuites for TLS 1.3 */
+typedef struct {
+    const gchar *name;
+    const gchar *cipher_list;
+    const gchar *ciphersuite;
+} SSLCipherMap;
+
+static const SSLCipherMap cipher_map[] = {
+    { "CHACHA20-POLY1305",
+      "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305",
+      "TLS_CHACHA20_POLY1305_SHA256" },
+    { "AES-128-GCM",
+      "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256",
+      "TLS_AES_128_GCM_SHA256" },
+    { "AES-256-GCM",
+      "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384",
+      "TLS_AES_256_GCM_SHA384" },
+    { "AES-128-CBC",
+      "ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES128-SHA:AES128-SHA",
+      NULL },
+    { "AES-256-CBC",
+      "ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:AES256-SHA",
+      NULL },
+    { NULL, NULL, NULL }
+};
+
 struct _LmSSL {
     LmSSLBase base;
 
@@ -45,6 +73,14 @@ struct _LmSSL {
     SSL_CTX *ssl_ctx;
     SSL *ssl;
     /*BIO *bio;*/
+
+    /* Session of the last connection, offered again to the same server */
+    SSL_SESSION *session;
+    gchar       *session_server;
+
+    /* Why the configured protocols, ciphers or groups couldn't be set on
+     * the context, the handshake fails instead of using the defaults */
+    gchar       *config_error;
 };
 
 int ssl_verify_cb (int preverify_ok, X509_STORE_CTX *x509_ctx);
@@ -115,6 +151,201 @@ ssl_verify_cb (int preverify_ok, X509_STORE_CTX *x509_ctx)
     return 1;
 }
 
+static int
+ssl_protocol_to_version (LmSSLProtocol protocol)
+{
+    switch (protocol) {
+    case LM_SSL_PROTOCOL_TLS_1_0:
+        return TLS1_VERSION;
+    case LM_SSL_PROTOCOL_TLS_1_1:
+        return TLS1_1_VERSION;
+    case LM_SSL_PROTOCOL_TLS_1_2:
+        return TLS1_2_VERSION;
+    case LM_SSL_PROTOCOL_TLS_1_3:
+#ifdef TLS1_3_VERSION
+        return TLS1_3_VERSION;
+#else
+        return TLS1_2_VERSION;
+#endif
+    default:
+        break;
+    }
+
+    return 0;
+}
+
+static void
+ssl_config_failed (LmSSL *ssl, const gchar *format, ...)
+{
+    va_list args;
+
+    if (ssl->config_error) {
+        return;
+    }
+
+    va_start (args, format);
+    ssl->config_error = g_strdup_vprintf (format, args);
+    va_end (args);
+
+    g_log (LM_LOG_DOMAIN, LM_LOG_LEVEL_SSL, "%s\n", ssl->config_error);
+}
+
+static void
+ssl_apply_protocol_range (LmSSL *ssl)
+{
+    LmSSLBase *base = LM_SSL_BASE (ssl);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    /* 0 keeps the library default for that bound */
+    if (!SSL_CTX_set_min_proto_version (ssl->ssl_ctx,
+                                        ssl_protocol_to_version (base->min_protocol)) ||
+        !SSL_CTX_set_max_proto_version (ssl->ssl_ctx,
+                                        ssl_protocol_to_version (base->max_protocol))) {
+        ssl_config_failed (ssl, "Unsupported TLS protocol range");
+    }
+#else
+    static const struct {
+        int  version;
+        long option;
+    } versions[] = {
+        { TLS1_VERSION,   SSL_OP_NO_TLSv1 },
+        { TLS1_1_VERSION, SSL_OP_NO_TLSv1_1 },
+        { TLS1_2_VERSION, SSL_OP_NO_TLSv1_2 }
+    };
+    int  min, max;
+    long options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
+    gint i;
+
+    min = ssl_protocol_to_version (base->min_protocol);
+    max = ssl_protocol_to_version (base->max_protocol);
+
+    for (i = 0; i < G_N_ELEMENTS (versions); i++) {
+        if ((min && versions[i].version < min) ||
+            (max && versions[i].version > max)) {
+            options |= versions[i].option;
+        }
+    }
+
+    SSL_CTX_set_options (ssl->ssl_ctx, options);
+#endif
+}
+
+static void
+ssl_apply_ciphers (LmSSL *ssl)
+{
+    LmSSLBase  *base = LM_SSL_BASE (ssl);
+    GString    *cipher_list;
+    GString    *ciphersuites;
+    gchar     **names;
+    gint        i, j;
+
+    if (!base->ciphers) {
+        return;
+    }
+
+    cipher_list = g_string_new (NULL);
+    ciphersuites = g_string_new (NULL);
+
+    names = g_strsplit (base->ciphers, ":", -1);
+    for (i = 0; names[i]; i++) {
+        for (j = 0; cipher_map[j].name; j++) {
+            if (g_ascii_strcasecmp (names[i], cipher_map[j].name) == 0) {
+                break;
+            }
+        }
+
+        if (!cipher_map[j].name) {
+            ssl_config_failed (ssl, "Unknown cipher: %s", names[i]);
+            continue;
+        }
+
+        if (cipher_list->len > 0) {
+            g_string_append_c (cipher_list, ':');
+        }
+        g_string_append (cipher_list, cipher_map[j].cipher_list);
+
+        if (cipher_map[j].ciphersuite) {
+            if (ciphersuites->len > 0) {
+                g_string_append_c (ciphersuites, ':');
+            }
+            g_string_append (ciphersuites, cipher_map[j].ciphersuite);
+        }
+    }
+    g_strfreev (names);
+
+    if (cipher_list->len > 0 &&
+        !SSL_CTX_set_cipher_list (ssl->ssl_ctx, cipher_list->str)) {
+        ssl_config_failed (ssl, "SSL_CTX_set_cipher_list(%s) failed",
+                           cipher_list->str);
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (ciphersuites->len > 0 &&
+        !SSL_CTX_set_ciphersuites (ssl->ssl_ctx, ciphersuites->str)) {
+        ssl_config_failed (ssl, "SSL_CTX_set_ciphersuites(%s) failed",
+                           ciphersuites->str);
+    }
+#endif
+
+    g_string_free (cipher_list, TRUE);
+    g_string_free (ciphersuites, TRUE);
+}
+
+static void
+ssl_apply_groups (LmSSL *ssl)
+{
+    LmSSLBase *base = LM_SSL_BASE (ssl);
+
+    if (!base->groups) {
+        return;
+    }
+
+    /* OpenSSL knows the X25519 and P-256 style names already */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    if (!SSL_CTX_set1_groups_list (ssl->ssl_ctx, base->groups)) {
+        ssl_config_failed (ssl, "SSL_CTX_set1_groups_list(%s) failed",
+                           base->groups);
+    }
+#elif defined (SSL_CTX_set1_curves_list)
+    if (!SSL_CTX_set1_curves_list (ssl->ssl_ctx, base->groups)) {
+        ssl_config_failed (ssl, "SSL_CTX_set1_curves_list(%s) failed",
+                           base->groups);
+    }
+#else
+    ssl_config_failed (ssl, "Setting key exchange groups is not "
+                       "supported by this OpenSSL");
+#endif
+}
+
+static void
+ssl_store_negotiated (LmSSL *ssl, gdouble handshake_time)
+{
+    const gchar *group = NULL;
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    int nid;
+
+    nid = SSL_get_negotiated_group (ssl->ssl);
+    if (nid != NID_undef) {
+        group = OBJ_nid2sn (nid);
+    }
+#endif
+
+    _lm_ssl_base_set_negotiated (LM_SSL_BASE (ssl),
+                                 SSL_get_version (ssl->ssl),
+                                 SSL_get_cipher_name (ssl->ssl),
+                                 group,
+                                 handshake_time);
+    LM_SSL_BASE (ssl)->session_resumed = SSL_session_reused (ssl->ssl);
+
+    lm_verbose ("SSL handshake: %s, %s, %s in %f seconds%s\n",
+                SSL_get_version (ssl->ssl),
+                SSL_get_cipher_name (ssl->ssl),
+                group ? group : "unknown group",
+                handshake_time,
+                LM_SSL_BASE (ssl)->session_resumed ? " (resumed)" : "");
+}
+
 static gboolean
 ssl_verify_certificate (LmSSL *ssl, const gchar *server)
 {
@@ -263,6 +494,41 @@ ssl_io_status_from_return (LmSSL *ssl, gint ret)
     return status;
 }
 
+static void
+ssl_forget_session (LmSSL *ssl)
+{
+    if (ssl->session) {
+        SSL_SESSION_free (ssl->session);
+        ssl->session = NULL;
+    }
+
+    g_free (ssl->session_server);
+    ssl->session_server = NULL;
+}
+
+/* Keeps the session of a finished connection for the next handshake
+ * with the same server. With TLS 1.3 this only works if the server's
+ * tickets were read before closing, which happens as soon as the first
+ * stanza comes in. */
+static void
+ssl_remember_session (LmSSL *ssl)
+{
+    SSL_SESSION *session;
+
+    session = SSL_get1_session (ssl->ssl);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    if (session && !SSL_SESSION_is_resumable (session)) {
+        SSL_SESSION_free (session);
+        session = NULL;
+    }
+#endif
+
+    if (ssl->session) {
+        SSL_SESSION_free (ssl->session);
+    }
+    ssl->session = session;
+}
+
 /* From lm-ssl-protected.h */
 
 LmSSL *
@@ -295,11 +561,23 @@ _lm_ssl_initialize (LmSSL *ssl)
         initialized = TRUE;
     }
 
-    ssl->ssl_method = TLSv1_client_method();
+    /* Version flexible method, the range is set by
+     * ssl_apply_protocol_range() */
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    ssl->ssl_method = TLS_client_method();
+#else
+    ssl->ssl_method = SSLv23_client_method();
+#endif
     if (ssl->ssl_method == NULL) {
-        g_warning ("TLSv1_client_method() == NULL");
+        g_warning ("TLS_client_method() == NULL");
         abort();
     }
+    /* Called again for every connection attempt, the session kept for
+     * resumption doesn't depend on the context */
+    if (ssl->ssl_ctx) {
+        SSL_CTX_free (ssl->ssl_ctx);
+    }
+
     ssl->ssl_ctx = SSL_CTX_new(ssl->ssl_method);
     if (ssl->ssl_ctx == NULL) {
         g_warning ("SSL_CTX_new() == NULL");
@@ -323,6 +601,13 @@ _lm_ssl_initialize (LmSSL *ssl)
       }*/
     SSL_CTX_set_default_verify_paths (ssl->ssl_ctx);
     SSL_CTX_set_verify (ssl->ssl_ctx, SSL_VERIFY_PEER, ssl_verify_cb);
+
+    g_free (ssl->config_error);
+    ssl->config_error = NULL;
+
+    ssl_apply_protocol_range (ssl);
+    ssl_apply_ciphers (ssl);
+    ssl_apply_groups (ssl);
 }
 
 gboolean
@@ -330,6 +615,7 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
 {
     gint ssl_ret;
     GIOStatus status;
+    GTimer *timer;
 
     if (!ssl->ssl_ctx) {
         g_set_error (error,
@@ -338,6 +624,12 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
         return FALSE;
     }
 
+    if (ssl->config_error) {
+        g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
+                     "*** SSL configuration: %s", ssl->config_error);
+        return FALSE;
+    }
+
     ssl->ssl = SSL_new(ssl->ssl_ctx);
     if (ssl->ssl == NULL) {
         g_warning ("SSL_new() == NULL");
@@ -352,6 +644,26 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
                     "SSL_set_fd()");
         return FALSE;
     }
+
+#ifdef TLSEXT_TYPE_application_layer_protocol_negotiation
+    {
+        unsigned char alpn[sizeof (LM_SSL_ALPN_XMPP_CLIENT)];
+
+        /* Length prefixed protocol list */
+        alpn[0] = strlen (LM_SSL_ALPN_XMPP_CLIENT);
+        memcpy (alpn + 1, LM_SSL_ALPN_XMPP_CLIENT, alpn[0]);
+        SSL_set_alpn_protos (ssl->ssl, alpn, sizeof (alpn));
+    }
+#endif
+
+    if (ssl->session && server && ssl->session_server &&
+        strcmp (server, ssl->session_server) == 0) {
+        SSL_set_session (ssl->ssl, ssl->session);
+    } else {
+        ssl_forget_session (ssl);
+        ssl->session_server = g_strdup (server);
+    }
+
     /*ssl->bio = BIO_new_socket (fd, BIO_NOCLOSE);
       if (ssl->bio == NULL) {
       g_warning("BIO_new_socket() failed");
@@ -361,6 +673,8 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
       }
       SSL_set_bio(ssl->ssl, ssl->bio, ssl->bio);*/
 
+    timer = g_timer_new ();
+
     do {
         ssl_ret = SSL_connect(ssl->ssl);
         if (ssl_ret <= 0) {
@@ -371,6 +685,7 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
                 g_set_error(error, LM_ERROR,
                             LM_ERROR_CONNECTION_OPEN,
                             "SSL_connect()");
+                g_timer_destroy (timer);
                 return FALSE;
             }
 
@@ -380,8 +695,12 @@ _lm_ssl_begin (LmSSL *ssl, gint fd, const gchar *server, GError **error)
     if (!ssl_verify_certificate (ssl, server)) {
         g_set_error (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN,
                      "*** SSL certificate verification failed");
+        g_timer_destroy (timer);
         return FALSE;
     }
+
+    ssl_store_negotiated (ssl, g_timer_elapsed (timer, NULL));
+    g_timer_destroy (timer);
     
     return TRUE; 
 }
@@ -420,10 +739,31 @@ _lm_ssl_send (LmSSL *ssl, const gchar *str, gint len)
     return ssl_ret;
 }
 
+/* Like _lm_ssl_send () but returns instead of waiting for the socket. On
+ * G_IO_STATUS_AGAIN it has to be called with the same data again. */
+GIOStatus
+_lm_ssl_write (LmSSL *ssl, const gchar *str, gint len, gsize *bytes_written)
+{
+    GIOStatus status;
+    gint ssl_ret;
+
+    *bytes_written = 0;
+    ssl_ret = SSL_write(ssl->ssl, str, len);
+    if (ssl_ret <= 0) {
+        status = ssl_io_status_from_return(ssl, ssl_ret);
+        return status == G_IO_STATUS_AGAIN ? status : G_IO_STATUS_ERROR;
+    }
+
+    *bytes_written = ssl_ret;
+
+    return G_IO_STATUS_NORMAL;
+}
+
 void 
 _lm_ssl_close (LmSSL *ssl)
 {
     if (ssl->ssl != NULL) {
+        ssl_remember_session (ssl);
         SSL_shutdown(ssl->ssl);
         SSL_free(ssl->ssl);
         ssl->ssl = NULL;
@@ -436,6 +776,9 @@ _lm_ssl_free (LmSSL *ssl)
     SSL_CTX_free(ssl->ssl_ctx);
     ssl->ssl_ctx = NULL;
 
+    ssl_forget_session (ssl);
+    g_free (ssl->config_error);
+
     _lm_ssl_base_free_fields (LM_SSL_BASE(ssl));
     g_free (ssl);
 }
@@ -102,6 +102,24 @@ typedef enum {
     LM_SSL_RESPONSE_STOP
 } LmSSLResponse;
 
+/**
+ * LmSSLProtocol:
+ * @LM_SSL_PROTOCOL_DEFAULT: Leave the bound to the SSL library.
+ * @LM_SSL_PROTOCOL_TLS_1_0: TLS 1.0.
+ * @LM_SSL_PROTOCOL_TLS_1_1: TLS 1.1.
+ * @LM_SSL_PROTOCOL_TLS_1_2: TLS 1.2.
+ * @LM_SSL_PROTOCOL_TLS_1_3: TLS 1.3.
+ * 
+ * Protocol versions used with lm_ssl_set_protocol_range().
+ */
+typedef enum {
+    LM_SSL_PROTOCOL_DEFAULT,
+    LM_SSL_PROTOCOL_TLS_1_0,
+    LM_SSL_PROTOCOL_TLS_1_1,
+    LM_SSL_PROTOCOL_TLS_1_2,
+    LM_SSL_PROTOCOL_TLS_1_3
+} LmSSLProtocol;
+
 /**
  * LmSSLFunction:
  * @ssl: An #LmSSL.
@@ -133,6 +151,20 @@ gboolean              lm_ssl_get_use_starttls (LmSSL *ssl);
 
 gboolean              lm_ssl_get_require_starttls (LmSSL *ssl);
 
+void                  lm_ssl_set_protocol_range (LmSSL         *ssl,
+                                                 LmSSLProtocol  min,
+                                                 LmSSLProtocol  max);
+void                  lm_ssl_set_ciphers     (LmSSL          *ssl,
+                                              const gchar    *ciphers);
+void                  lm_ssl_set_groups      (LmSSL          *ssl,
+                                              const gchar    *groups);
+
+const gchar *         lm_ssl_get_negotiated_protocol (LmSSL *ssl);
+const gchar *         lm_ssl_get_negotiated_cipher   (LmSSL *ssl);
+const gchar *         lm_ssl_get_negotiated_group    (LmSSL *ssl);
+gdouble               lm_ssl_get_handshake_time      (LmSSL *ssl);
+gboolean              lm_ssl_get_session_resumed     (LmSSL *ssl);
+
 LmSSL *               lm_ssl_ref             (LmSSL          *ssl);
 void                  lm_ssl_unref           (LmSSL          *ssl);
 
@@ -23,8 +23,11 @@
 
 #define LM_INSIDE_LOUDMOUTH_H 1
 
+#include <loudmouth/lm-archive.h>
+#include <loudmouth/lm-bytestream.h>
 #include <loudmouth/lm-connection.h>
 #include <loudmouth/lm-error.h>
+#include <loudmouth/lm-http-upload.h>
 #include <loudmouth/lm-message.h>
 #include <loudmouth/lm-message-handler.h>
 #include <loudmouth/lm-message-node.h>
@@ -0,0 +1,104 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * The allocator is interposed by defining malloc(), calloc() and
+ * realloc() in the test program itself and forwarding to the C library.
+ * GLib's memory vtable can't be used since it is ignored by newer
+ * versions. Only GNU libc exposes the functions needed to forward, on
+ * other systems nothing is counted and the budgets aren't checked.
+ *
+ * Memory handed out by GSlice magazines isn't counted once the magazines
+ * have been filled, which is what warming up before measuring is for.
+ */
+
+#include <stdlib.h>
+
+#include "alloc-counter.h"
+
+static gint counting = 0;
+static gint count = 0;
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc  (size_t size);
+extern void *__libc_calloc  (size_t n_members, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+
+void *
+malloc (size_t size)
+{
+    if (g_atomic_int_get (&counting)) {
+        g_atomic_int_inc (&count);
+    }
+
+    return __libc_malloc (size);
+}
+
+void *
+calloc (size_t n_members, size_t size)
+{
+    if (g_atomic_int_get (&counting)) {
+        g_atomic_int_inc (&count);
+    }
+
+    return __libc_calloc (n_members, size);
+}
+
+void *
+realloc (void *ptr, size_t size)
+{
+    if (g_atomic_int_get (&counting)) {
+        g_atomic_int_inc (&count);
+    }
+
+    return __libc_realloc (ptr, size);
+}
+
+gboolean
+alloc_counter_is_supported (void)
+{
+    return TRUE;
+}
+
+#else
+
+gboolean
+alloc_counter_is_supported (void)
+{
+    return FALSE;
+}
+
+#endif /* __GLIBC__ */
+
+void
+alloc_counter_start (void)
+{
+    g_atomic_int_set (&count, 0);
+    g_atomic_int_set (&counting, 1);
+}
+
+guint
+alloc_counter_stop (void)
+{
+    g_atomic_int_set (&counting, 0);
+
+    return g_atomic_int_get (&count);
+}
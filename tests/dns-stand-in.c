@@ -0,0 +1,805 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "dns-stand-in.h"
+
+#define DNS_HEADER_SIZE   12
+#define DNS_MAX_MESSAGE   65535
+#define DNS_TTL           300
+
+#define DNS_TYPE_A        1
+#define DNS_TYPE_AAAA     28
+#define DNS_TYPE_SRV      33
+#define DNS_CLASS_IN      1
+
+#define DNS_FLAG_QR       0x8000
+#define DNS_FLAG_AA       0x0400
+#define DNS_FLAG_TC       0x0200
+#define DNS_FLAG_RD       0x0100
+#define DNS_FLAG_RA       0x0080
+
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+typedef struct {
+    gchar      *name;
+    guint16     type;
+    GByteArray *rdata;
+} DnsRecord;
+
+typedef struct {
+    DnsStandIn *dns;
+    gint        fd;
+    gboolean    closed;
+    GByteArray *buffer;
+    gint        ref_count;
+} DnsTcpConn;
+
+typedef struct {
+    DnsStandIn         *dns;
+    GByteArray         *message;
+    gchar              *name;
+    struct sockaddr_in  to;     /* For answers over UDP */
+    DnsTcpConn         *conn;   /* For answers over TCP */
+} DnsReply;
+
+struct _DnsStandIn {
+    /* Protected by the lock below, changed from the test thread */
+    GSList              *records;
+    GHashTable          *behaviours;
+    DnsStandInBehaviour  default_behaviour;
+    guint                delay;
+
+    /* When queries came in and were answered, by name. Only the order
+     * is kept, as the number of events before. */
+    guint                events;
+    GHashTable          *started;
+    GHashTable          *answered;
+
+    volatile gint        queries;
+
+    gint                 udp_fd;
+    gint                 tcp_fd;
+    guint                port;
+
+    GMainContext        *context;
+    GMainLoop           *loop;
+    GThread             *thread;
+};
+
+G_LOCK_DEFINE_STATIC (dns_stand_in);
+
+static gchar *
+dns_normalize_name (const gchar *name)
+{
+    gchar *ret;
+    gsize  len;
+
+    ret = g_ascii_strdown (name, -1);
+
+    len = strlen (ret);
+    if (len > 0 && ret[len - 1] == '.') {
+        ret[len - 1] = '\0';
+    }
+
+    return ret;
+}
+
+static void
+dns_append_16 (GByteArray *array, guint16 value)
+{
+    guint8 bytes[2];
+
+    bytes[0] = value >> 8;
+    bytes[1] = value & 0xff;
+
+    g_byte_array_append (array, bytes, 2);
+}
+
+static void
+dns_append_32 (GByteArray *array, guint32 value)
+{
+    dns_append_16 (array, value >> 16);
+    dns_append_16 (array, value & 0xffff);
+}
+
+static void
+dns_append_name (GByteArray *array, const gchar *name)
+{
+    gchar **labels;
+    gint    i;
+
+    labels = g_strsplit (name, ".", -1);
+
+    for (i = 0; labels[i]; i++) {
+        guint8 len = MIN (strlen (labels[i]), 63);
+
+        if (len == 0) {
+            continue;
+        }
+
+        g_byte_array_append (array, &len, 1);
+        g_byte_array_append (array, (guint8 *) labels[i], len);
+    }
+
+    g_byte_array_append (array, (guint8 *) "", 1);
+    g_strfreev (labels);
+}
+
+static guint16
+dns_get_16 (const guint8 *data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+static void
+dns_add_record (DnsStandIn  *dns,
+                const gchar *name,
+                guint16      type,
+                GByteArray  *rdata)
+{
+    DnsRecord *record;
+
+    record = g_new0 (DnsRecord, 1);
+    record->name = dns_normalize_name (name);
+    record->type = type;
+    record->rdata = rdata;
+
+    G_LOCK (dns_stand_in);
+    dns->records = g_slist_append (dns->records, record);
+    G_UNLOCK (dns_stand_in);
+}
+
+/* Reads the question, only uncompressed names are expected there */
+static gboolean
+dns_parse_question (const guint8  *query,
+                    gsize          len,
+                    gchar        **name,
+                    guint16       *type,
+                    gsize         *end)
+{
+    GString *str;
+    gsize    pos = DNS_HEADER_SIZE;
+
+    if (len < DNS_HEADER_SIZE || dns_get_16 (query + 4) < 1) {
+        return FALSE;
+    }
+
+    str = g_string_new (NULL);
+
+    while (pos < len && query[pos] != 0) {
+        guint label_len = query[pos];
+
+        if ((label_len & 0xc0) || pos + 1 + label_len > len) {
+            g_string_free (str, TRUE);
+            return FALSE;
+        }
+
+        if (str->len > 0) {
+            g_string_append_c (str, '.');
+        }
+        g_string_append_len (str, (const gchar *) query + pos + 1, label_len);
+
+        pos += 1 + label_len;
+    }
+
+    /* The terminating label, type and class */
+    if (pos + 5 > len) {
+        g_string_free (str, TRUE);
+        return FALSE;
+    }
+
+    *type = dns_get_16 (query + pos + 1);
+    *end = pos + 5;
+    *name = dns_normalize_name (str->str);
+
+    g_string_free (str, TRUE);
+
+    return TRUE;
+}
+
+/* Returns NULL when the query should go unanswered */
+static GByteArray *
+dns_create_reply (DnsStandIn   *dns,
+                  const guint8 *query,
+                  gsize         len,
+                  gboolean      over_tcp)
+{
+    GByteArray          *reply;
+    DnsStandInBehaviour  behaviour;
+    gchar               *name;
+    guint16              type;
+    guint16              flags;
+    gsize                question_end;
+    guint                rcode = 0;
+    guint                answers = 0;
+    gboolean             name_exists = FALSE;
+    gpointer             value;
+    GSList              *l;
+
+    if (!dns_parse_question (query, len, &name, &type, &question_end)) {
+        return NULL;
+    }
+
+    reply = g_byte_array_new ();
+
+    G_LOCK (dns_stand_in);
+
+    if (g_hash_table_lookup_extended (dns->behaviours, name, NULL, &value)) {
+        behaviour = GPOINTER_TO_INT (value);
+    } else {
+        behaviour = dns->default_behaviour;
+    }
+
+    /* The header is filled in below, the answers refer to the question
+     * with a pointer to offset 12 */
+    g_byte_array_append (reply, query, question_end);
+
+    if (behaviour == DNS_STAND_IN_ANSWER ||
+        (behaviour == DNS_STAND_IN_TRUNCATE && over_tcp)) {
+        for (l = dns->records; l; l = l->next) {
+            DnsRecord *record = l->data;
+
+            if (strcmp (record->name, name) != 0) {
+                continue;
+            }
+
+            name_exists = TRUE;
+
+            if (record->type != type) {
+                continue;
+            }
+
+            dns_append_16 (reply, 0xc000 | DNS_HEADER_SIZE);
+            dns_append_16 (reply, record->type);
+            dns_append_16 (reply, DNS_CLASS_IN);
+            dns_append_32 (reply, DNS_TTL);
+            dns_append_16 (reply, record->rdata->len);
+            g_byte_array_append (reply, record->rdata->data,
+                                 record->rdata->len);
+            answers++;
+        }
+
+        if (!name_exists) {
+            rcode = DNS_RCODE_NXDOMAIN;
+        }
+    }
+
+    G_UNLOCK (dns_stand_in);
+
+    g_free (name);
+
+    switch (behaviour) {
+    case DNS_STAND_IN_DROP:
+        g_byte_array_free (reply, TRUE);
+        return NULL;
+    case DNS_STAND_IN_SERVFAIL:
+        rcode = DNS_RCODE_SERVFAIL;
+        break;
+    case DNS_STAND_IN_NXDOMAIN:
+        rcode = DNS_RCODE_NXDOMAIN;
+        break;
+    default:
+        break;
+    }
+
+    flags = DNS_FLAG_QR | DNS_FLAG_AA | DNS_FLAG_RA | rcode;
+    flags |= dns_get_16 (query + 2) & DNS_FLAG_RD;
+    if (behaviour == DNS_STAND_IN_TRUNCATE && !over_tcp) {
+        flags |= DNS_FLAG_TC;
+    }
+
+    /* Id stays, flags, one question, the answers, nothing else */
+    reply->data[2] = flags >> 8;
+    reply->data[3] = flags & 0xff;
+    reply->data[4] = 0;
+    reply->data[5] = 1;
+    reply->data[6] = answers >> 8;
+    reply->data[7] = answers & 0xff;
+    memset (reply->data + 8, 0, 4);
+
+    return reply;
+}
+
+static DnsTcpConn *
+dns_tcp_conn_ref (DnsTcpConn *conn)
+{
+    conn->ref_count++;
+
+    return conn;
+}
+
+static void
+dns_tcp_conn_unref (DnsTcpConn *conn)
+{
+    if (--conn->ref_count > 0) {
+        return;
+    }
+
+    if (!conn->closed) {
+        close (conn->fd);
+    }
+
+    g_byte_array_free (conn->buffer, TRUE);
+    g_free (conn);
+}
+
+/* Remembers the last time @name was queried or the first time it was
+ * answered */
+static void
+dns_note_event (DnsStandIn *dns, GHashTable *events, const gchar *name)
+{
+    G_LOCK (dns_stand_in);
+
+    dns->events++;
+    if (events == dns->started || !g_hash_table_lookup (events, name)) {
+        g_hash_table_insert (events, g_strdup (name),
+                             GUINT_TO_POINTER (dns->events));
+    }
+
+    G_UNLOCK (dns_stand_in);
+}
+
+static void
+dns_reply_send (DnsReply *reply)
+{
+    GByteArray *message = reply->message;
+
+    if (reply->name) {
+        dns_note_event (reply->dns, reply->dns->answered, reply->name);
+    }
+
+    if (reply->conn) {
+        guint8 len[2];
+
+        if (reply->conn->closed) {
+            return;
+        }
+
+        len[0] = message->len >> 8;
+        len[1] = message->len & 0xff;
+
+        if (write (reply->conn->fd, len, 2) != 2 ||
+            write (reply->conn->fd, message->data, message->len) !=
+            (gssize) message->len) {
+            g_warning ("DNS stand-in: short write over TCP");
+        }
+    } else {
+        sendto (reply->dns->udp_fd, message->data, message->len, 0,
+                (struct sockaddr *) &reply->to, sizeof (reply->to));
+    }
+}
+
+static void
+dns_reply_free (DnsReply *reply)
+{
+    if (reply->conn) {
+        dns_tcp_conn_unref (reply->conn);
+    }
+
+    g_byte_array_free (reply->message, TRUE);
+    g_free (reply->name);
+    g_free (reply);
+}
+
+static gboolean
+dns_reply_timeout_cb (DnsReply *reply)
+{
+    dns_reply_send (reply);
+
+    return FALSE;
+}
+
+static void
+dns_handle_query (DnsStandIn         *dns,
+                  const guint8       *query,
+                  gsize               len,
+                  struct sockaddr_in *from,
+                  DnsTcpConn         *conn)
+{
+    DnsReply   *reply;
+    GByteArray *message;
+    GSource    *source;
+    gchar      *name = NULL;
+    guint16     type;
+    gsize       end;
+    guint       delay;
+
+    g_atomic_int_inc (&dns->queries);
+
+    if (dns_parse_question (query, len, &name, &type, &end)) {
+        dns_note_event (dns, dns->started, name);
+    }
+
+    message = dns_create_reply (dns, query, len, conn != NULL);
+    if (!message) {
+        g_free (name);
+        return;
+    }
+
+    reply = g_new0 (DnsReply, 1);
+    reply->dns = dns;
+    reply->message = message;
+    reply->name = name;
+    if (conn) {
+        reply->conn = dns_tcp_conn_ref (conn);
+    } else {
+        reply->to = *from;
+    }
+
+    G_LOCK (dns_stand_in);
+    delay = dns->delay;
+    G_UNLOCK (dns_stand_in);
+
+    if (delay == 0) {
+        dns_reply_send (reply);
+        dns_reply_free (reply);
+        return;
+    }
+
+    /* Each answer gets a timeout of its own so delayed queries are
+     * still answered concurrently */
+    source = g_timeout_source_new (delay);
+    g_source_set_callback (source, (GSourceFunc) dns_reply_timeout_cb,
+                           reply, (GDestroyNotify) dns_reply_free);
+    g_source_attach (source, dns->context);
+    g_source_unref (source);
+}
+
+static void
+dns_add_watch (DnsStandIn     *dns,
+               gint            fd,
+               GIOFunc         func,
+               gpointer        user_data,
+               GDestroyNotify  notify)
+{
+    GIOChannel *channel;
+    GSource    *source;
+
+    channel = g_io_channel_unix_new (fd);
+    source = g_io_create_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback (source, (GSourceFunc) func, user_data, notify);
+    g_source_attach (source, dns->context);
+    g_source_unref (source);
+    g_io_channel_unref (channel);
+}
+
+static gboolean
+dns_udp_cb (GIOChannel *channel, GIOCondition condition, DnsStandIn *dns)
+{
+    guint8             buf[512];
+    struct sockaddr_in from;
+    socklen_t          from_len = sizeof (from);
+    gssize             len;
+
+    len = recvfrom (dns->udp_fd, buf, sizeof (buf), 0,
+                    (struct sockaddr *) &from, &from_len);
+    if (len > 0) {
+        dns_handle_query (dns, buf, len, &from, NULL);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+dns_tcp_conn_cb (GIOChannel *channel, GIOCondition condition, DnsTcpConn *conn)
+{
+    guint8 buf[1024];
+    gssize len;
+
+    len = read (conn->fd, buf, sizeof (buf));
+    if (len <= 0) {
+        close (conn->fd);
+        conn->closed = TRUE;
+        return FALSE;
+    }
+
+    g_byte_array_append (conn->buffer, buf, len);
+
+    /* Messages over TCP are prefixed with their length */
+    while (conn->buffer->len >= 2) {
+        guint msg_len = dns_get_16 (conn->buffer->data);
+
+        if (conn->buffer->len < msg_len + 2) {
+            break;
+        }
+
+        dns_handle_query (conn->dns, conn->buffer->data + 2, msg_len,
+                          NULL, conn);
+        g_byte_array_remove_range (conn->buffer, 0, msg_len + 2);
+    }
+
+    return TRUE;
+}
+
+static gboolean
+dns_tcp_listen_cb (GIOChannel *channel, GIOCondition condition, DnsStandIn *dns)
+{
+    DnsTcpConn *conn;
+    gint        fd;
+
+    fd = accept (dns->tcp_fd, NULL, NULL);
+    if (fd < 0) {
+        return TRUE;
+    }
+
+    conn = g_new0 (DnsTcpConn, 1);
+    conn->dns = dns;
+    conn->fd = fd;
+    conn->buffer = g_byte_array_new ();
+    conn->ref_count = 1;
+
+    dns_add_watch (dns, fd, (GIOFunc) dns_tcp_conn_cb, conn,
+                   (GDestroyNotify) dns_tcp_conn_unref);
+
+    return TRUE;
+}
+
+static gpointer
+dns_thread (DnsStandIn *dns)
+{
+    g_main_loop_run (dns->loop);
+
+    return NULL;
+}
+
+/* Binds UDP and TCP to the same port, as resolvers fall back to TCP on
+ * the nameserver address they were given */
+static gboolean
+dns_bind (DnsStandIn *dns)
+{
+    struct sockaddr_in addr;
+    socklen_t          len = sizeof (addr);
+    int                reuse = 1;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    dns->udp_fd = socket (AF_INET, SOCK_DGRAM, 0);
+    if (bind (dns->udp_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0) {
+        close (dns->udp_fd);
+        return FALSE;
+    }
+
+    getsockname (dns->udp_fd, (struct sockaddr *) &addr, &len);
+    dns->port = ntohs (addr.sin_port);
+
+    dns->tcp_fd = socket (AF_INET, SOCK_STREAM, 0);
+    setsockopt (dns->tcp_fd, SOL_SOCKET, SO_REUSEADDR,
+                &reuse, sizeof (reuse));
+
+    if (bind (dns->tcp_fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+        listen (dns->tcp_fd, 64) != 0) {
+        close (dns->udp_fd);
+        close (dns->tcp_fd);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+DnsStandIn *
+dns_stand_in_new (void)
+{
+    DnsStandIn *dns;
+    gint        attempts = 0;
+
+    dns = g_new0 (DnsStandIn, 1);
+    dns->behaviours = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                             g_free, NULL);
+    dns->default_behaviour = DNS_STAND_IN_ANSWER;
+    dns->started = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                          g_free, NULL);
+    dns->answered = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, NULL);
+
+    /* The TCP port can be taken even if the UDP one is free */
+    while (!dns_bind (dns)) {
+        if (++attempts == 10) {
+            g_error ("Couldn't set up the DNS stand-in sockets");
+        }
+    }
+
+    dns->context = g_main_context_new ();
+    dns->loop = g_main_loop_new (dns->context, FALSE);
+
+    dns_add_watch (dns, dns->udp_fd, (GIOFunc) dns_udp_cb, dns, NULL);
+    dns_add_watch (dns, dns->tcp_fd, (GIOFunc) dns_tcp_listen_cb, dns, NULL);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    dns->thread = g_thread_new ("dns-stand-in", (GThreadFunc) dns_thread, dns);
+#else
+    dns->thread = g_thread_create ((GThreadFunc) dns_thread, dns, TRUE, NULL);
+#endif
+
+    return dns;
+}
+
+void
+dns_stand_in_free (DnsStandIn *dns)
+{
+    GSList *l;
+
+    g_main_loop_quit (dns->loop);
+    g_main_context_wakeup (dns->context);
+    g_thread_join (dns->thread);
+
+    /* Drops the watches and the answers that are still delayed */
+    g_main_loop_unref (dns->loop);
+    g_main_context_unref (dns->context);
+
+    close (dns->udp_fd);
+    close (dns->tcp_fd);
+
+    for (l = dns->records; l; l = l->next) {
+        DnsRecord *record = l->data;
+
+        g_free (record->name);
+        g_byte_array_free (record->rdata, TRUE);
+        g_free (record);
+    }
+    g_slist_free (dns->records);
+
+    g_hash_table_destroy (dns->behaviours);
+    g_hash_table_destroy (dns->started);
+    g_hash_table_destroy (dns->answered);
+    g_free (dns);
+}
+
+guint
+dns_stand_in_get_port (DnsStandIn *dns)
+{
+    return dns->port;
+}
+
+void
+dns_stand_in_add_srv (DnsStandIn  *dns,
+                      const gchar *name,
+                      guint        priority,
+                      guint        weight,
+                      guint        port,
+                      const gchar *target)
+{
+    GByteArray *rdata;
+
+    rdata = g_byte_array_new ();
+    dns_append_16 (rdata, priority);
+    dns_append_16 (rdata, weight);
+    dns_append_16 (rdata, port);
+    dns_append_name (rdata, target);
+
+    dns_add_record (dns, name, DNS_TYPE_SRV, rdata);
+}
+
+void
+dns_stand_in_add_a (DnsStandIn *dns, const gchar *name, const gchar *address)
+{
+    GByteArray     *rdata;
+    struct in_addr  addr;
+
+    if (inet_pton (AF_INET, address, &addr) != 1) {
+        g_error ("Invalid IPv4 address: %s", address);
+    }
+
+    rdata = g_byte_array_new ();
+    g_byte_array_append (rdata, (guint8 *) &addr, sizeof (addr));
+
+    dns_add_record (dns, name, DNS_TYPE_A, rdata);
+}
+
+void
+dns_stand_in_add_aaaa (DnsStandIn *dns, const gchar *name, const gchar *address)
+{
+    GByteArray      *rdata;
+    struct in6_addr  addr;
+
+    if (inet_pton (AF_INET6, address, &addr) != 1) {
+        g_error ("Invalid IPv6 address: %s", address);
+    }
+
+    rdata = g_byte_array_new ();
+    g_byte_array_append (rdata, (guint8 *) &addr, sizeof (addr));
+
+    dns_add_record (dns, name, DNS_TYPE_AAAA, rdata);
+}
+
+/* Delay in ms before each answer, applies to queries arriving later */
+void
+dns_stand_in_set_delay (DnsStandIn *dns, guint delay)
+{
+    G_LOCK (dns_stand_in);
+    dns->delay = delay;
+    G_UNLOCK (dns_stand_in);
+}
+
+/* A NULL name sets the behaviour for all names without one of their own */
+void
+dns_stand_in_set_behaviour (DnsStandIn          *dns,
+                            const gchar         *name,
+                            DnsStandInBehaviour  behaviour)
+{
+    G_LOCK (dns_stand_in);
+
+    if (name) {
+        g_hash_table_insert (dns->behaviours, dns_normalize_name (name),
+                             GINT_TO_POINTER (behaviour));
+    } else {
+        dns->default_behaviour = behaviour;
+    }
+
+    G_UNLOCK (dns_stand_in);
+}
+
+/* Number of queries received over UDP and TCP together */
+guint
+dns_stand_in_get_queries (DnsStandIn *dns)
+{
+    return g_atomic_int_get (&dns->queries);
+}
+
+static guint
+dns_get_event (DnsStandIn *dns, GHashTable *events, const gchar *name)
+{
+    gchar *normalized;
+    guint  event;
+
+    normalized = dns_normalize_name (name);
+
+    G_LOCK (dns_stand_in);
+    event = GPOINTER_TO_UINT (g_hash_table_lookup (events, normalized));
+    G_UNLOCK (dns_stand_in);
+
+    g_free (normalized);
+
+    return event;
+}
+
+/* When the last query for @name came in, compared with other names and
+ * with dns_stand_in_get_answered (). 0 if it wasn't queried. */
+guint
+dns_stand_in_get_started (DnsStandIn *dns, const gchar *name)
+{
+    return dns_get_event (dns, dns->started, name);
+}
+
+/* When @name was first answered, 0 if it wasn't */
+guint
+dns_stand_in_get_answered (DnsStandIn *dns, const gchar *name)
+{
+    return dns_get_event (dns, dns->answered, name);
+}
+
+/* Forgets when names were queried and answered */
+void
+dns_stand_in_clear_events (DnsStandIn *dns)
+{
+    G_LOCK (dns_stand_in);
+    g_hash_table_remove_all (dns->started);
+    g_hash_table_remove_all (dns->answered);
+    G_UNLOCK (dns_stand_in);
+}
@@ -0,0 +1,77 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * DNS stand-in for tests and benchmarks.
+ *
+ * DnsStandIn answers SRV, A and AAAA queries for the records it was
+ * given, over UDP and TCP on the same loopback port. It runs in a thread
+ * of its own so the blocking resolver can query it from the main loop.
+ * Answers can be delayed and names can be made to fail in different
+ * ways. Use _lm_resolver_set_nameserver () to point Loudmouth at it.
+ */
+
+#ifndef __DNS_STAND_IN_H__
+#define __DNS_STAND_IN_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _DnsStandIn DnsStandIn;
+
+typedef enum {
+    DNS_STAND_IN_ANSWER,    /* Answer from the records */
+    DNS_STAND_IN_SERVFAIL,  /* Answer with a server failure */
+    DNS_STAND_IN_NXDOMAIN,  /* Claim the name doesn't exist */
+    DNS_STAND_IN_DROP,      /* Never answer */
+    DNS_STAND_IN_TRUNCATE   /* Truncated over UDP, answer over TCP */
+} DnsStandInBehaviour;
+
+DnsStandIn * dns_stand_in_new           (void);
+void         dns_stand_in_free          (DnsStandIn          *dns);
+guint        dns_stand_in_get_port      (DnsStandIn          *dns);
+void         dns_stand_in_add_srv       (DnsStandIn          *dns,
+                                         const gchar         *name,
+                                         guint                priority,
+                                         guint                weight,
+                                         guint                port,
+                                         const gchar         *target);
+void         dns_stand_in_add_a         (DnsStandIn          *dns,
+                                         const gchar         *name,
+                                         const gchar         *address);
+void         dns_stand_in_add_aaaa      (DnsStandIn          *dns,
+                                         const gchar         *name,
+                                         const gchar         *address);
+void         dns_stand_in_set_delay     (DnsStandIn          *dns,
+                                         guint                delay);
+void         dns_stand_in_set_behaviour (DnsStandIn          *dns,
+                                         const gchar         *name,
+                                         DnsStandInBehaviour  behaviour);
+guint        dns_stand_in_get_queries   (DnsStandIn          *dns);
+guint        dns_stand_in_get_started   (DnsStandIn          *dns,
+                                         const gchar         *name);
+guint        dns_stand_in_get_answered  (DnsStandIn          *dns,
+                                         const gchar         *name);
+void         dns_stand_in_clear_events  (DnsStandIn          *dns);
+
+G_END_DECLS
+
+#endif /* __DNS_STAND_IN_H__ */
@@ -0,0 +1,417 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "http-stand-in.h"
+
+#define HTTP_BUFFER_SIZE 65536
+
+typedef struct {
+    HttpStandIn *http;
+    gint         fd;
+    GString     *head;
+    gboolean     in_body;
+    guint64      length;
+    guint64      received;
+    gboolean     intact;
+} HttpConn;
+
+struct _HttpStandIn {
+    /* Protected by the lock below, read from the test thread */
+    guint         status;
+    gboolean      hold;
+    GSList       *held;
+    guint         connections;
+    guint         open;
+    guint         max_open;
+    guint         complete;
+    guint         corrupt;
+    guint64       bytes;
+    gchar        *last_request;
+
+    gint          fd;
+    guint         port;
+
+    GMainContext *context;
+    GMainLoop    *loop;
+    GThread      *thread;
+};
+
+G_LOCK_DEFINE_STATIC (http_stand_in);
+
+static const gchar *
+http_status_text (guint status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    case 403:
+        return "Forbidden";
+    case 413:
+        return "Payload Too Large";
+    default:
+        return "Error";
+    }
+}
+
+/* Called with the lock held */
+static void
+http_conn_close (HttpConn *conn, guint status)
+{
+    HttpStandIn *http = conn->http;
+
+    if (status) {
+        gchar *str;
+
+        str = g_strdup_printf ("HTTP/1.1 %u %s\r\n"
+                               "Content-Length: 0\r\n"
+                               "Connection: close\r\n"
+                               "\r\n",
+                               status, http_status_text (status));
+        send (conn->fd, str, strlen (str), 0);
+        g_free (str);
+    }
+
+    close (conn->fd);
+    http->open--;
+
+    g_string_free (conn->head, TRUE);
+    g_free (conn);
+}
+
+static void
+http_conn_body (HttpConn *conn, const guint8 *buf, gsize len)
+{
+    gsize i;
+
+    len = MIN (len, conn->length - conn->received);
+
+    for (i = 0; i < len; i++) {
+        if (buf[i] != (guint8) ((conn->received + i) % 251)) {
+            conn->intact = FALSE;
+        }
+    }
+
+    conn->received += len;
+}
+
+/* Returns the number of bytes of @buf that belonged to the head */
+static gsize
+http_conn_head (HttpConn *conn, const gchar *buf, gsize len)
+{
+    gsize  old_len = conn->head->len;
+    gchar *end;
+    gchar *lower;
+    gchar *length;
+
+    g_string_append_len (conn->head, buf, len);
+
+    end = strstr (conn->head->str, "\r\n\r\n");
+    if (!end) {
+        return len;
+    }
+
+    g_string_truncate (conn->head, end + 4 - conn->head->str);
+    conn->in_body = TRUE;
+
+    lower = g_ascii_strdown (conn->head->str, -1);
+    length = strstr (lower, "\r\ncontent-length:");
+    conn->length = length ?
+        g_ascii_strtoull (length + strlen ("\r\ncontent-length:"), NULL, 10) : 0;
+    g_free (lower);
+
+    return conn->head->len - old_len;
+}
+
+static gboolean
+http_conn_cb (GIOChannel *channel, GIOCondition condition, HttpConn *conn)
+{
+    HttpStandIn *http = conn->http;
+    guint8       buf[HTTP_BUFFER_SIZE];
+    gssize       len;
+    gsize        used = 0;
+
+    len = recv (conn->fd, buf, sizeof (buf), 0);
+
+    G_LOCK (http_stand_in);
+
+    if (len <= 0) {
+        /* Gone before the whole body was there */
+        http->corrupt++;
+        http_conn_close (conn, 0);
+        G_UNLOCK (http_stand_in);
+        return FALSE;
+    }
+
+    if (!conn->in_body) {
+        used = http_conn_head (conn, (gchar *) buf, len);
+    }
+
+    if (conn->in_body) {
+        http_conn_body (conn, buf + used, len - used);
+    }
+
+    if (!conn->in_body || conn->received < conn->length) {
+        G_UNLOCK (http_stand_in);
+        return TRUE;
+    }
+
+    http->complete++;
+    http->bytes += conn->received;
+    if (!conn->intact) {
+        http->corrupt++;
+    }
+
+    g_free (http->last_request);
+    http->last_request = g_strdup (conn->head->str);
+
+    if (http->hold) {
+        http->held = g_slist_append (http->held, conn);
+    } else {
+        http_conn_close (conn, http->status);
+    }
+
+    G_UNLOCK (http_stand_in);
+
+    return FALSE;
+}
+
+static gboolean
+http_listen_cb (GIOChannel *channel, GIOCondition condition, HttpStandIn *http)
+{
+    HttpConn   *conn;
+    GSource    *source;
+    GIOChannel *conn_channel;
+    gint        fd;
+
+    fd = accept (http->fd, NULL, NULL);
+    if (fd < 0) {
+        return TRUE;
+    }
+
+    conn = g_new0 (HttpConn, 1);
+    conn->http = http;
+    conn->fd = fd;
+    conn->head = g_string_new (NULL);
+    conn->intact = TRUE;
+
+    G_LOCK (http_stand_in);
+    http->connections++;
+    http->open++;
+    http->max_open = MAX (http->max_open, http->open);
+    G_UNLOCK (http_stand_in);
+
+    conn_channel = g_io_channel_unix_new (fd);
+    source = g_io_create_watch (conn_channel, G_IO_IN | G_IO_HUP | G_IO_ERR);
+    g_source_set_callback (source, (GSourceFunc) http_conn_cb, conn, NULL);
+    g_source_attach (source, http->context);
+    g_source_unref (source);
+    g_io_channel_unref (conn_channel);
+
+    return TRUE;
+}
+
+static gpointer
+http_thread (HttpStandIn *http)
+{
+    g_main_loop_run (http->loop);
+
+    return NULL;
+}
+
+HttpStandIn *
+http_stand_in_new (void)
+{
+    HttpStandIn        *http;
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof (addr);
+    GIOChannel         *channel;
+    GSource            *source;
+
+    http = g_new0 (HttpStandIn, 1);
+    http->status = 201;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    http->fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (bind (http->fd, (struct sockaddr *) &addr, sizeof (addr)) != 0 ||
+        listen (http->fd, 64) != 0) {
+        g_error ("Couldn't set up the HTTP stand-in socket");
+    }
+
+    getsockname (http->fd, (struct sockaddr *) &addr, &len);
+    http->port = ntohs (addr.sin_port);
+
+    http->context = g_main_context_new ();
+    http->loop = g_main_loop_new (http->context, FALSE);
+
+    channel = g_io_channel_unix_new (http->fd);
+    source = g_io_create_watch (channel, G_IO_IN);
+    g_source_set_callback (source, (GSourceFunc) http_listen_cb, http, NULL);
+    g_source_attach (source, http->context);
+    g_source_unref (source);
+    g_io_channel_unref (channel);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    http->thread = g_thread_new ("http-stand-in", (GThreadFunc) http_thread, http);
+#else
+    http->thread = g_thread_create ((GThreadFunc) http_thread, http, TRUE, NULL);
+#endif
+
+    return http;
+}
+
+void
+http_stand_in_free (HttpStandIn *http)
+{
+    g_main_loop_quit (http->loop);
+    g_main_context_wakeup (http->context);
+    g_thread_join (http->thread);
+
+    http_stand_in_set_hold (http, FALSE);
+
+    /* Drops the watches of connections still open */
+    g_main_loop_unref (http->loop);
+    g_main_context_unref (http->context);
+
+    close (http->fd);
+    g_free (http->last_request);
+    g_free (http);
+}
+
+guint
+http_stand_in_get_port (HttpStandIn *http)
+{
+    return http->port;
+}
+
+void
+http_stand_in_set_status (HttpStandIn *http, guint status)
+{
+    G_LOCK (http_stand_in);
+    http->status = status;
+    G_UNLOCK (http_stand_in);
+}
+
+/* Held answers go out when holding is turned off */
+void
+http_stand_in_set_hold (HttpStandIn *http, gboolean hold)
+{
+    GSList *l;
+
+    G_LOCK (http_stand_in);
+
+    http->hold = hold;
+
+    if (!hold) {
+        for (l = http->held; l; l = l->next) {
+            http_conn_close (l->data, http->status);
+        }
+
+        g_slist_free (http->held);
+        http->held = NULL;
+    }
+
+    G_UNLOCK (http_stand_in);
+}
+
+guint
+http_stand_in_get_connections (HttpStandIn *http)
+{
+    guint ret;
+
+    G_LOCK (http_stand_in);
+    ret = http->connections;
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
+
+guint
+http_stand_in_get_max_open (HttpStandIn *http)
+{
+    guint ret;
+
+    G_LOCK (http_stand_in);
+    ret = http->max_open;
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
+
+guint
+http_stand_in_get_complete (HttpStandIn *http)
+{
+    guint ret;
+
+    G_LOCK (http_stand_in);
+    ret = http->complete;
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
+
+guint
+http_stand_in_get_corrupt (HttpStandIn *http)
+{
+    guint ret;
+
+    G_LOCK (http_stand_in);
+    ret = http->corrupt;
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
+
+guint64
+http_stand_in_get_bytes (HttpStandIn *http)
+{
+    guint64 ret;
+
+    G_LOCK (http_stand_in);
+    ret = http->bytes;
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
+
+/* The head of the last complete request, free with g_free () */
+gchar *
+http_stand_in_get_last_request (HttpStandIn *http)
+{
+    gchar *ret;
+
+    G_LOCK (http_stand_in);
+    ret = g_strdup (http->last_request);
+    G_UNLOCK (http_stand_in);
+
+    return ret;
+}
@@ -0,0 +1,55 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * HTTP stand-in for tests and benchmarks.
+ *
+ * HttpStandIn takes PUT requests on a loopback port, in a thread of its
+ * own. It checks that each body is the test pattern, byte n being
+ * n % 251, and answers with the status it was given. Answers can be held
+ * back to see how many uploads run at the same time.
+ */
+
+#ifndef __HTTP_STAND_IN_H__
+#define __HTTP_STAND_IN_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _HttpStandIn HttpStandIn;
+
+HttpStandIn * http_stand_in_new              (void);
+void          http_stand_in_free             (HttpStandIn *http);
+guint         http_stand_in_get_port         (HttpStandIn *http);
+void          http_stand_in_set_status       (HttpStandIn *http,
+                                              guint        status);
+void          http_stand_in_set_hold         (HttpStandIn *http,
+                                              gboolean     hold);
+guint         http_stand_in_get_connections  (HttpStandIn *http);
+guint         http_stand_in_get_max_open     (HttpStandIn *http);
+guint         http_stand_in_get_complete     (HttpStandIn *http);
+guint         http_stand_in_get_corrupt      (HttpStandIn *http);
+guint64       http_stand_in_get_bytes        (HttpStandIn *http);
+gchar *       http_stand_in_get_last_request (HttpStandIn *http);
+
+G_END_DECLS
+
+#endif /* __HTTP_STAND_IN_H__ */
@@ -0,0 +1,117 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Uses perf_event_open(2) to count cache misses in user space of the
+ * calling thread. Where that isn't available nothing is counted and
+ * perf_counter_stop() returns 0.
+ */
+
+#include <config.h>
+
+#include "perf-counter.h"
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+static int fd = -2;
+
+static int
+perf_counter_get_fd (void)
+{
+    struct perf_event_attr attr;
+
+    if (fd != -2) {
+        return fd;
+    }
+
+    memset (&attr, 0, sizeof (attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof (attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    fd = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+
+    return fd;
+}
+
+gboolean
+perf_counter_is_supported (void)
+{
+    return perf_counter_get_fd () >= 0;
+}
+
+void
+perf_counter_start (void)
+{
+    if (perf_counter_get_fd () < 0) {
+        return;
+    }
+
+    ioctl (fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl (fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+guint64
+perf_counter_stop (void)
+{
+    guint64 count;
+
+    if (perf_counter_get_fd () < 0) {
+        return 0;
+    }
+
+    ioctl (fd, PERF_EVENT_IOC_DISABLE, 0);
+
+    if (read (fd, &count, sizeof (count)) != sizeof (count)) {
+        return 0;
+    }
+
+    return count;
+}
+
+#else
+
+gboolean
+perf_counter_is_supported (void)
+{
+    return FALSE;
+}
+
+void
+perf_counter_start (void)
+{
+}
+
+guint64
+perf_counter_stop (void)
+{
+    return 0;
+}
+
+#endif /* HAVE_LINUX_PERF_EVENT_H */
@@ -0,0 +1,41 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Counts cache misses of the test process with the CPU's performance
+ * counters. Only Linux is supported, and not every machine lets
+ * unprivileged processes use the counters, virtual machines often don't
+ * have them at all.
+ */
+
+#ifndef __PERF_COUNTER_H__
+#define __PERF_COUNTER_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gboolean perf_counter_is_supported (void);
+void     perf_counter_start        (void);
+guint64  perf_counter_stop         (void);
+
+G_END_DECLS
+
+#endif /* __PERF_COUNTER_H__ */
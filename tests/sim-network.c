@@ -0,0 +1,1499 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-exi.h"
+#include "loudmouth/lm-misc.h"
+#include "loudmouth/lm-parser.h"
+
+#include "sim-network.h"
+
+#define SIM_MSS             1460
+/* Real time the loop waits for socket activity before advancing the
+ * virtual clock, loopback traffic arrives well within this. */
+#define SIM_QUIET_SLEEP     1000
+#define SIM_QUIET_ITERATIONS 3
+
+#define SIM_STREAM_HEADER                                         \
+    "<?xml version='1.0' encoding='UTF-8'?>"                      \
+    "<stream:stream xmlns='jabber:client' "                       \
+    "xmlns:stream='http://etherx.jabber.org/streams' "            \
+    "id='sim' from='example.com'>"
+
+/* Offering SASL first and EXI compression after it */
+#define SIM_STREAM_HEADER_XMPP                                    \
+    "<?xml version='1.0' encoding='UTF-8'?>"                      \
+    "<stream:stream xmlns='jabber:client' "                       \
+    "xmlns:stream='http://etherx.jabber.org/streams' "            \
+    "id='sim' from='example.com' version='1.0'>"
+
+#define SIM_FEATURES_SASL                                         \
+    "<stream:features>"                                           \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"       \
+    "<mechanism>PLAIN</mechanism></mechanisms>"                   \
+    "</stream:features>"
+
+/* SASL2 (XEP-0388) with Bind 2 and FAST, next to the old SASL */
+#define SIM_FEATURES_SASL2                                        \
+    "<stream:features>"                                           \
+    "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"       \
+    "<mechanism>PLAIN</mechanism></mechanisms>"                   \
+    "<authentication xmlns='urn:xmpp:sasl:2'>"                    \
+    "<mechanism>PLAIN</mechanism>"                                \
+    "<inline><bind xmlns='urn:xmpp:bind:0'/>"                     \
+    "<fast xmlns='urn:xmpp:fast:0'>"                              \
+    "<mechanism>" SIM_FAST_MECHANISM "</mechanism></fast>"        \
+    "</inline></authentication>"                                  \
+    "</stream:features>"
+
+#define SIM_FAST_MECHANISM "HT-SHA-256-NONE"
+#define SIM_SASL2_FAILURE                                         \
+    "<failure xmlns='urn:xmpp:sasl:2'>"                           \
+    "<not-authorized xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>"  \
+    "</failure>"
+
+#define SIM_FEATURE_EXI                                           \
+    "<compression xmlns='http://jabber.org/features/compress'>"   \
+    "<method>exi</method></compression>"
+
+#define SIM_FEATURE_CSI "<csi xmlns='urn:xmpp:csi:0'/>"
+
+/* Items of the server, only the first does extended stanza addressing */
+#define SIM_MULTICAST_SERVICE "multicast.example.com"
+#define SIM_CONFERENCE_SERVICE "conference.example.com"
+
+typedef struct {
+    guint64  deliver_at;
+    gchar   *data;
+    gsize    len;
+} SimPacket;
+
+typedef struct {
+    GQueue  *packets;
+    guint64  free_at;       /* When the link is done transmitting */
+    guint64  last_delivery;
+    guint64  offset;        /* Bytes sent, used to find segment boundaries */
+} SimDirection;
+
+typedef struct {
+    guint64  start;
+    guint    duration;
+} SimStall;
+
+struct _SimNetwork {
+    SimLinkParams  params;
+    GRand         *rand;
+    guint64        now;
+    GList         *timeouts;
+    GArray        *stalls;
+
+    int            listen_fd;
+    int            client_fd;
+    guint          port;
+    guint          listen_watch;
+    guint          client_watch;
+
+    SimDirection   up;      /* Client to server */
+    SimDirection   down;    /* Server to client */
+
+    /* NAT in front of the client, forgets idle connections */
+    guint          idle_timeout;
+    guint64        last_activity;
+    gboolean       mapping_lost;
+
+    LmParser      *parser;
+    gboolean       answer_pings;
+    guint          messages_received;
+    GPtrArray     *bodies;
+    GPtrArray     *ids;
+    gchar         *last_result;
+
+    /* Extended stanza addressing (XEP-0033) */
+    gboolean       multicast;
+    gboolean       answer_disco;
+    guint          addresses_received;
+
+    SimIqFunc      iq_func;
+    gpointer       iq_data;
+
+    /* EXI compression (XEP-0322), @exi is set once it is active */
+    gboolean       offer_exi;
+    guint          streams;
+    LmExi         *exi;
+    /* Value partition limits, the client's unless @exi_capacity_answer
+     * is set */
+    gint           exi_max_length;
+    gint           exi_capacity;
+    gint           exi_capacity_answer;
+
+    /* Client State Indication (XEP-0352), presences pushed while the
+     * client is inactive are held back until it is active again */
+    gboolean       offer_csi;
+    gboolean       client_inactive;
+    guint          client_states;
+    guint          messages_inactive;
+    GQueue        *held;
+
+    /* SASL2 with Bind 2 and FAST, and a task to ask the client for
+     * with <continue/> instead of succeeding */
+    gboolean       offer_sasl2;
+    gchar         *sasl2_task;
+    gboolean       sasl2_aborted;
+    gchar         *fast_token;
+    guint          fast_tokens;
+    guint          fast_logins;
+
+    /* Progress of sim_network_login() */
+    gchar         *login_resource;
+    gboolean       login_done;
+    gboolean       login_success;
+};
+
+typedef struct {
+    GSource     source;
+    SimNetwork *net;
+    guint       interval;
+    guint64     deadline;
+} SimTimeoutSource;
+
+/* Only one network can drive Loudmouth's timeouts at a time */
+static SimNetwork *current_net = NULL;
+
+static gboolean
+sim_timeout_prepare (GSource *source, gint *timeout)
+{
+    SimTimeoutSource *ts = (SimTimeoutSource *) source;
+
+    /* Never wake up by real time, the clock is advanced explicitly */
+    *timeout = -1;
+
+    return ts->net && ts->deadline <= ts->net->now;
+}
+
+static gboolean
+sim_timeout_check (GSource *source)
+{
+    SimTimeoutSource *ts = (SimTimeoutSource *) source;
+
+    return ts->net && ts->deadline <= ts->net->now;
+}
+
+static gboolean
+sim_timeout_dispatch (GSource     *source,
+                      GSourceFunc  callback,
+                      gpointer     user_data)
+{
+    SimTimeoutSource *ts = (SimTimeoutSource *) source;
+
+    if (!callback) {
+        return FALSE;
+    }
+
+    ts->deadline = ts->net->now + ts->interval;
+
+    return callback (user_data);
+}
+
+static void
+sim_timeout_finalize (GSource *source)
+{
+    SimTimeoutSource *ts = (SimTimeoutSource *) source;
+
+    if (ts->net) {
+        ts->net->timeouts = g_list_remove (ts->net->timeouts, ts);
+    }
+}
+
+static GSourceFuncs sim_timeout_funcs = {
+    sim_timeout_prepare,
+    sim_timeout_check,
+    sim_timeout_dispatch,
+    sim_timeout_finalize
+};
+
+static GSource *
+sim_timeout_source_new (guint interval, SimNetwork *net)
+{
+    SimTimeoutSource *ts;
+
+    ts = (SimTimeoutSource *) g_source_new (&sim_timeout_funcs,
+                                            sizeof (SimTimeoutSource));
+    ts->net = net;
+    ts->interval = interval;
+    ts->deadline = net->now + interval;
+
+    net->timeouts = g_list_prepend (net->timeouts, ts);
+
+    return (GSource *) ts;
+}
+
+static guint64
+sim_network_after_stalls (SimNetwork *net, guint64 t)
+{
+    guint i;
+
+    for (i = 0; i < net->stalls->len; ++i) {
+        SimStall *stall = &g_array_index (net->stalls, SimStall, i);
+
+        if (t >= stall->start && t < stall->start + stall->duration) {
+            t = stall->start + stall->duration;
+        }
+    }
+
+    return t;
+}
+
+/* Works out when @data arrives at the other end. Lost segments hold up
+ * everything behind them like they would on a TCP connection, which also
+ * makes the result independent of how the data was split into writes. */
+static void
+sim_network_transmit (SimNetwork   *net,
+                      SimDirection *dir,
+                      const gchar  *data,
+                      gsize         len)
+{
+    SimPacket *packet;
+    guint64    start;
+    guint64    segments;
+
+    if (net->idle_timeout > 0 &&
+        net->now - net->last_activity > net->idle_timeout) {
+        /* Dropped from here on without a word to either end */
+        net->mapping_lost = TRUE;
+    }
+
+    if (net->mapping_lost) {
+        return;
+    }
+
+    net->last_activity = net->now;
+
+    start = sim_network_after_stalls (net, MAX (net->now, dir->free_at));
+
+    dir->free_at = start;
+    if (net->params.bandwidth > 0) {
+        dir->free_at += (guint64) len * 1000 / net->params.bandwidth;
+    }
+
+    /* Segments started by this write */
+    segments = (dir->offset + len + SIM_MSS - 1) / SIM_MSS -
+        (dir->offset + SIM_MSS - 1) / SIM_MSS;
+    dir->offset += len;
+
+    while (segments-- > 0) {
+        if (net->params.loss > 0 &&
+            g_rand_double (net->rand) < net->params.loss) {
+            dir->free_at += net->params.rto;
+        }
+    }
+
+    packet = g_slice_new (SimPacket);
+    packet->deliver_at = MAX (dir->free_at + net->params.latency,
+                              dir->last_delivery);
+    packet->data = g_memdup (data, len);
+    packet->len = len;
+
+    dir->last_delivery = packet->deliver_at;
+
+    g_queue_push_tail (dir->packets, packet);
+}
+
+static void
+sim_packet_free (SimPacket *packet)
+{
+    g_free (packet->data);
+    g_slice_free (SimPacket, packet);
+}
+
+static void
+sim_network_server_send (SimNetwork *net, LmMessage *m)
+{
+    gchar *str;
+
+    if (net->exi) {
+        GString *out = g_string_new (NULL);
+
+        _lm_exi_encode (net->exi, m->node, out);
+        sim_network_transmit (net, &net->down, out->str, out->len);
+        g_string_free (out, TRUE);
+        return;
+    }
+
+    str = lm_message_node_to_string (m->node);
+    sim_network_transmit (net, &net->down, str, strlen (str));
+    g_free (str);
+}
+
+static void
+sim_network_server_reply (SimNetwork    *net,
+                          LmMessage     *m,
+                          LmMessageNode *query)
+{
+    LmMessage *reply;
+
+    reply = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                          LM_MESSAGE_SUB_TYPE_RESULT);
+    lm_message_node_set_attribute (reply->node, "id",
+                                   lm_message_node_get_attribute (m->node,
+                                                                  "id"));
+    if (query) {
+        LmMessageNode *node;
+
+        node = lm_message_node_add_child (reply->node, "query", NULL);
+        lm_message_node_set_attribute (node, "xmlns", "jabber:iq:auth");
+        lm_message_node_add_child (node, "username", NULL);
+        lm_message_node_add_child (node, "password", NULL);
+        lm_message_node_add_child (node, "digest", NULL);
+        lm_message_node_add_child (node, "resource", NULL);
+    }
+
+    sim_network_server_send (net, reply);
+    lm_message_unref (reply);
+}
+
+static LmMessage *
+sim_network_server_disco_reply (LmMessage *m, const gchar *xmlns)
+{
+    LmMessage     *reply;
+    LmMessageNode *query;
+
+    reply = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                          LM_MESSAGE_SUB_TYPE_RESULT);
+    lm_message_node_set_attribute (reply->node, "id",
+                                   lm_message_node_get_attribute (m->node,
+                                                                  "id"));
+    if (lm_message_node_get_attribute (m->node, "to")) {
+        lm_message_node_set_attribute (reply->node, "from",
+                                       lm_message_node_get_attribute (m->node,
+                                                                      "to"));
+    }
+
+    query = lm_message_node_add_child (reply->node, "query", NULL);
+    lm_message_node_set_attribute (query, "xmlns", xmlns);
+
+    return reply;
+}
+
+/* The server and its items, the multicast service only advertises the
+ * feature if it is turned on */
+static void
+sim_network_server_disco_info (SimNetwork *net, LmMessage *m)
+{
+    LmMessage     *reply;
+    LmMessageNode *query;
+    const gchar   *to;
+
+    if (!net->answer_disco) {
+        return;
+    }
+
+    reply = sim_network_server_disco_reply (m,
+                                            "http://jabber.org/protocol/disco#info");
+    query = lm_message_node_get_child (reply->node, "query");
+    to = lm_message_node_get_attribute (m->node, "to");
+
+    if (g_strcmp0 (to, SIM_MULTICAST_SERVICE) == 0) {
+        lm_message_node_set_attributes (lm_message_node_add_child (query, "identity", NULL),
+                                        "category", "service",
+                                        "type", "multicast",
+                                        NULL);
+        if (net->multicast) {
+            lm_message_node_set_attribute (lm_message_node_add_child (query, "feature", NULL),
+                                           "var", "http://jabber.org/protocol/address");
+        }
+    }
+    else if (g_strcmp0 (to, SIM_CONFERENCE_SERVICE) == 0) {
+        lm_message_node_set_attributes (lm_message_node_add_child (query, "identity", NULL),
+                                        "category", "conference",
+                                        "type", "text",
+                                        NULL);
+    } else {
+        lm_message_node_set_attributes (lm_message_node_add_child (query, "identity", NULL),
+                                        "category", "server",
+                                        "type", "im",
+                                        NULL);
+    }
+
+    sim_network_server_send (net, reply);
+    lm_message_unref (reply);
+}
+
+static void
+sim_network_server_disco_items (SimNetwork *net, LmMessage *m)
+{
+    LmMessage     *reply;
+    LmMessageNode *query;
+
+    if (!net->answer_disco) {
+        return;
+    }
+
+    reply = sim_network_server_disco_reply (m,
+                                            "http://jabber.org/protocol/disco#items");
+    query = lm_message_node_get_child (reply->node, "query");
+
+    lm_message_node_set_attribute (lm_message_node_add_child (query, "item", NULL),
+                                   "jid", SIM_CONFERENCE_SERVICE);
+    lm_message_node_set_attribute (lm_message_node_add_child (query, "item", NULL),
+                                   "jid", SIM_MULTICAST_SERVICE);
+
+    sim_network_server_send (net, reply);
+    lm_message_unref (reply);
+}
+
+static void
+sim_network_server_bind (SimNetwork *net, LmMessage *m)
+{
+    LmMessage     *reply;
+    LmMessageNode *bind;
+    LmMessageNode *resource;
+    gchar         *jid;
+
+    reply = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_IQ,
+                                          LM_MESSAGE_SUB_TYPE_RESULT);
+    lm_message_node_set_attribute (reply->node, "id",
+                                   lm_message_node_get_attribute (m->node,
+                                                                  "id"));
+
+    resource = lm_message_node_find_child (m->node, "resource");
+    jid = g_strdup_printf ("user@example.com/%s",
+                           resource && resource->value ? resource->value : "sim");
+
+    bind = lm_message_node_add_child (reply->node, "bind", NULL);
+    lm_message_node_set_attribute (bind, "xmlns",
+                                   "urn:ietf:params:xml:ns:xmpp-bind");
+    lm_message_node_add_child (bind, "jid", jid);
+    g_free (jid);
+
+    sim_network_server_send (net, reply);
+    lm_message_unref (reply);
+}
+
+/* The features after authentication */
+static gchar *
+sim_network_server_features (SimNetwork *net, gboolean compression)
+{
+    return g_strconcat ("<stream:features>",
+                        compression && net->offer_exi ? SIM_FEATURE_EXI : "",
+                        net->offer_csi ? SIM_FEATURE_CSI : "",
+                        "<bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+                        "</stream:features>",
+                        NULL);
+}
+
+static void
+sim_network_server_stream (SimNetwork *net)
+{
+    gchar *features;
+
+    if (!net->offer_exi && !net->offer_csi && !net->offer_sasl2) {
+        sim_network_transmit (net, &net->down, SIM_STREAM_HEADER,
+                              strlen (SIM_STREAM_HEADER));
+        return;
+    }
+
+    /* The first stream is for SASL, the one after it for the rest */
+    if (net->streams++ == 0) {
+        features = g_strdup (net->offer_sasl2 ?
+                             SIM_FEATURES_SASL2 : SIM_FEATURES_SASL);
+    } else {
+        features = sim_network_server_features (net, TRUE);
+    }
+
+    sim_network_transmit (net, &net->down, SIM_STREAM_HEADER_XMPP,
+                          strlen (SIM_STREAM_HEADER_XMPP));
+    sim_network_transmit (net, &net->down, features, strlen (features));
+    g_free (features);
+}
+
+/* PLAIN is authzid, authcid and password separated by NULs */
+static gboolean
+sim_network_check_plain (const guchar *data, gsize len)
+{
+    const guchar *authcid;
+    const guchar *password;
+
+    authcid = memchr (data, '\0', len);
+    if (!authcid) {
+        return FALSE;
+    }
+    authcid++;
+
+    password = memchr (authcid, '\0', len - (authcid - data));
+    if (!password) {
+        return FALSE;
+    }
+    password++;
+
+    return (gsize) (data + len - password) == strlen ("password") &&
+        memcmp (password, "password", strlen ("password")) == 0;
+}
+
+#if GLIB_CHECK_VERSION (2, 30, 0)
+static void
+sim_network_fast_hash (SimNetwork *net, const gchar *label, guint8 *digest)
+{
+    GHmac *hmac;
+    gsize  len = 32;
+
+    hmac = g_hmac_new (G_CHECKSUM_SHA256,
+                       (const guchar *) net->fast_token,
+                       strlen (net->fast_token));
+    g_hmac_update (hmac, (const guchar *) label, -1);
+    g_hmac_get_digest (hmac, digest, &len);
+    g_hmac_unref (hmac);
+}
+
+/* The user name followed by the HMAC of the token over "Initiator" */
+static gboolean
+sim_network_check_fast (SimNetwork *net, const guchar *data, gsize len)
+{
+    const guchar *hash;
+    guint8        expected[32];
+
+    hash = memchr (data, '\0', len);
+    if (!net->fast_token || !hash) {
+        return FALSE;
+    }
+    hash++;
+
+    sim_network_fast_hash (net, "Initiator", expected);
+
+    return (gsize) (data + len - hash) == sizeof (expected) &&
+        memcmp (hash, expected, sizeof (expected)) == 0;
+}
+#endif
+
+static void
+sim_network_server_sasl2 (SimNetwork *net, LmMessageNode *authenticate)
+{
+    LmMessageNode *node;
+    LmMessageNode *bind;
+    const gchar   *mechanism;
+    const gchar   *value = NULL;
+    guchar        *data = NULL;
+    gsize          len = 0;
+    gboolean       fast;
+    gboolean       ok = FALSE;
+    GString       *success;
+
+    mechanism = lm_message_node_get_attribute (authenticate, "mechanism");
+    fast = g_strcmp0 (mechanism, SIM_FAST_MECHANISM) == 0;
+
+    node = lm_message_node_get_child (authenticate, "initial-response");
+    if (node) {
+        value = lm_message_node_get_value (node);
+    }
+    if (value) {
+        data = g_base64_decode (value, &len);
+    }
+
+    if (data && g_strcmp0 (mechanism, "PLAIN") == 0) {
+        ok = sim_network_check_plain (data, len);
+    }
+#if GLIB_CHECK_VERSION (2, 30, 0)
+    else if (data && fast) {
+        ok = sim_network_check_fast (net, data, len);
+    }
+#endif
+    g_free (data);
+
+    if (!ok) {
+        sim_network_server_push (net, SIM_SASL2_FAILURE);
+        return;
+    }
+
+    if (net->sasl2_task) {
+        gchar *str;
+
+        str = g_strdup_printf ("<continue xmlns='urn:xmpp:sasl:2'>"
+                               "<tasks><task>%s</task></tasks></continue>",
+                               net->sasl2_task);
+        sim_network_server_push (net, str);
+        g_free (str);
+        return;
+    }
+
+    success = g_string_new ("<success xmlns='urn:xmpp:sasl:2'>");
+
+#if GLIB_CHECK_VERSION (2, 30, 0)
+    if (fast) {
+        guint8  digest[32];
+        gchar  *encoded;
+
+        /* Proves the server knows the token the client used */
+        net->fast_logins++;
+        sim_network_fast_hash (net, "Responder", digest);
+        encoded = g_base64_encode (digest, sizeof (digest));
+        g_string_append_printf (success,
+                                "<additional-data>%s</additional-data>",
+                                encoded);
+        g_free (encoded);
+    }
+#endif
+
+    bind = lm_message_node_get_child (authenticate, "bind");
+    node = bind ? lm_message_node_get_child (bind, "tag") : NULL;
+    if (node && lm_message_node_get_value (node)) {
+        g_string_append_printf (success,
+                                "<authorization-identifier>user@example.com/%s"
+                                "</authorization-identifier>"
+                                "<bound xmlns='urn:xmpp:bind:0'/>",
+                                lm_message_node_get_value (node));
+    } else {
+        g_string_append (success,
+                         "<authorization-identifier>user@example.com"
+                         "</authorization-identifier>");
+    }
+
+    if (lm_message_node_get_child (authenticate, "request-token")) {
+        /* A new one every time, the one used is no good after this */
+        g_free (net->fast_token);
+        net->fast_token = g_strdup_printf ("sim-token-%u", ++net->fast_tokens);
+        g_string_append_printf (success,
+                                "<token xmlns='urn:xmpp:fast:0' token='%s' "
+                                "expiry='2100-01-01T00:00:00Z'/>",
+                                net->fast_token);
+    }
+
+    g_string_append (success, "</success>");
+    sim_network_server_push (net, success->str);
+    g_string_free (success, TRUE);
+}
+
+static void
+sim_network_exi_node_cb (LmExi *exi, LmMessageNode *node, SimNetwork *net)
+{
+    gchar *str;
+
+    if (strcmp (node->name, "streamStart") == 0) {
+        sim_network_server_push (net,
+                                 "<streamStart xmlns='" LM_EXI_NS "' "
+                                 "id='sim' from='example.com' version='1.0'/>");
+        str = sim_network_server_features (net, FALSE);
+        sim_network_server_push (net, str);
+        g_free (str);
+        return;
+    }
+
+    if (strcmp (node->name, "streamEnd") == 0) {
+        return;
+    }
+
+    /* Handled like the XML it stands for */
+    str = lm_message_node_to_string (node);
+    lm_parser_parse (net->parser, str);
+    g_free (str);
+}
+
+static void
+sim_network_server_client_state (SimNetwork *net, gboolean inactive)
+{
+    net->client_states++;
+    net->client_inactive = inactive;
+
+    while (!net->client_inactive && !g_queue_is_empty (net->held)) {
+        gchar *str = g_queue_pop_head (net->held);
+
+        sim_network_server_push (net, str);
+        g_free (str);
+    }
+}
+
+/* Client state indications, SASL2, EXI setup and compression requests,
+ * which aren't messages */
+static void
+sim_network_server_handle_node (LmParser      *parser,
+                                LmMessageNode *node,
+                                SimNetwork    *net)
+{
+    /* Counted even when not advertised, for tests to see they weren't sent */
+    if (strcmp (node->name, "inactive") == 0) {
+        sim_network_server_client_state (net, TRUE);
+        return;
+    }
+
+    if (strcmp (node->name, "active") == 0) {
+        sim_network_server_client_state (net, FALSE);
+        return;
+    }
+
+    if (net->offer_sasl2 && strcmp (node->name, "authenticate") == 0) {
+        sim_network_server_sasl2 (net, node);
+        return;
+    }
+
+    if (net->offer_sasl2 && strcmp (node->name, "abort") == 0) {
+        net->sasl2_aborted = TRUE;
+        sim_network_server_push (net,
+                                 "<failure xmlns='urn:xmpp:sasl:2'>"
+                                 "<aborted xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>"
+                                 "</failure>");
+        return;
+    }
+
+    if (!net->offer_exi) {
+        return;
+    }
+
+    if (strcmp (node->name, "setup") == 0) {
+        const gchar *str;
+        gchar       *response;
+
+        str = lm_message_node_get_attribute (node, "valueMaxLength");
+        net->exi_max_length = str ? atoi (str) : -1;
+        str = lm_message_node_get_attribute (node, "valuePartitionCapacity");
+        net->exi_capacity = str ? atoi (str) : -1;
+
+        if (net->exi_capacity_answer >= 0) {
+            net->exi_capacity = net->exi_capacity_answer;
+        }
+
+        response = g_strdup_printf ("<setupResponse xmlns='" LM_EXI_NS "' "
+                                    "version='1' agreement='true' "
+                                    "valueMaxLength='%d' "
+                                    "valuePartitionCapacity='%d'/>",
+                                    net->exi_max_length, net->exi_capacity);
+        sim_network_server_push (net, response);
+        g_free (response);
+    }
+    else if (strcmp (node->name, "compress") == 0) {
+        sim_network_server_push (net,
+                                 "<compressed xmlns='http://jabber.org/protocol/compress'/>");
+        net->exi = _lm_exi_new ("jabber:client", TRUE,
+                                (LmExiNodeFunction) sim_network_exi_node_cb,
+                                net);
+        _lm_exi_set_value_limits (net->exi, net->exi_max_length,
+                                  net->exi_capacity);
+    }
+}
+
+static void
+sim_network_server_handle (LmParser *parser, LmMessage *m, SimNetwork *net)
+{
+    LmMessageNode *child;
+
+    switch (lm_message_get_type (m)) {
+    case LM_MESSAGE_TYPE_STREAM:
+        sim_network_server_stream (net);
+        break;
+    case LM_MESSAGE_TYPE_AUTH:
+        /* SASL PLAIN, every password is accepted */
+        sim_network_server_push (net,
+                                 "<success xmlns='urn:ietf:params:xml:ns:xmpp-sasl'/>");
+        break;
+    case LM_MESSAGE_TYPE_IQ:
+        if (net->iq_func && net->iq_func (net, m, net->iq_data)) {
+            break;
+        }
+
+        if (lm_message_node_get_child (m->node, "bind")) {
+            sim_network_server_bind (net, m);
+            break;
+        }
+
+        if (lm_message_node_get_child (m->node, "session")) {
+            sim_network_server_reply (net, m, NULL);
+            break;
+        }
+
+        if (lm_message_get_sub_type (m) == LM_MESSAGE_SUB_TYPE_RESULT &&
+            lm_message_node_get_attribute (m->node, "to")) {
+            /* Addressed to another entity, keep it for the test to see */
+            g_free (net->last_result);
+            net->last_result = lm_message_node_to_string (m->node);
+        }
+        else if ((child = lm_message_node_get_child (m->node, "query")) &&
+                 g_strcmp0 (lm_message_node_get_attribute (child, "xmlns"),
+                            "http://jabber.org/protocol/disco#info") == 0) {
+            sim_network_server_disco_info (net, m);
+        }
+        else if ((child = lm_message_node_get_child (m->node, "query")) &&
+                 g_strcmp0 (lm_message_node_get_attribute (child, "xmlns"),
+                            "http://jabber.org/protocol/disco#items") == 0) {
+            sim_network_server_disco_items (net, m);
+        }
+        else if ((child = lm_message_node_get_child (m->node, "query"))) {
+            /* Non-SASL authentication, every password is accepted */
+            sim_network_server_reply (net, m,
+                                      lm_message_get_sub_type (m) == LM_MESSAGE_SUB_TYPE_GET ?
+                                      child : NULL);
+        }
+        else if (lm_message_node_get_child (m->node, "ping")) {
+            if (net->answer_pings) {
+                sim_network_server_reply (net, m, NULL);
+            }
+        }
+        break;
+    case LM_MESSAGE_TYPE_MESSAGE:
+        net->messages_received++;
+        child = lm_message_node_get_child (m->node, "body");
+        g_ptr_array_add (net->bodies,
+                         g_strdup (child && lm_message_node_get_value (child) ?
+                                   lm_message_node_get_value (child) : ""));
+        g_ptr_array_add (net->ids,
+                         g_strdup (lm_message_node_get_attribute (m->node, "id")));
+        if (net->client_inactive) {
+            net->messages_inactive++;
+        }
+
+        /* Only the service found through discovery expands them */
+        if (g_strcmp0 (lm_message_node_get_attribute (m->node, "to"),
+                       SIM_MULTICAST_SERVICE) == 0 &&
+            (child = lm_message_node_get_child (m->node, "addresses"))) {
+            for (child = child->children; child; child = child->next) {
+                net->addresses_received++;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+static void
+sim_network_deliver (SimNetwork *net)
+{
+    SimPacket *packet;
+
+    while ((packet = g_queue_peek_head (net->up.packets)) &&
+           packet->deliver_at <= net->now) {
+        g_queue_pop_head (net->up.packets);
+        if (net->exi) {
+            _lm_exi_decode (net->exi, packet->data, packet->len);
+        } else {
+            lm_parser_parse_len (net->parser, packet->data, packet->len);
+        }
+        sim_packet_free (packet);
+    }
+
+    while ((packet = g_queue_peek_head (net->down.packets)) &&
+           packet->deliver_at <= net->now) {
+        g_queue_pop_head (net->down.packets);
+        if (net->client_fd >= 0 &&
+            write (net->client_fd, packet->data, packet->len) != (gssize) packet->len) {
+            g_warning ("Short write to simulated client");
+        }
+        sim_packet_free (packet);
+    }
+}
+
+static guint64
+sim_network_next_event (SimNetwork *net)
+{
+    guint64    next = G_MAXUINT64;
+    SimPacket *packet;
+    GList     *l;
+
+    if ((packet = g_queue_peek_head (net->up.packets))) {
+        next = MIN (next, packet->deliver_at);
+    }
+
+    if ((packet = g_queue_peek_head (net->down.packets))) {
+        next = MIN (next, packet->deliver_at);
+    }
+
+    for (l = net->timeouts; l; l = l->next) {
+        SimTimeoutSource *ts = l->data;
+
+        if (!g_source_is_destroyed ((GSource *) ts)) {
+            next = MIN (next, ts->deadline);
+        }
+    }
+
+    return next;
+}
+
+static gboolean
+sim_network_client_read_cb (GIOChannel   *channel,
+                            GIOCondition  condition,
+                            SimNetwork   *net)
+{
+    gchar   buf[4096];
+    gssize  len;
+
+    len = read (net->client_fd, buf, sizeof (buf));
+    if (len > 0) {
+        sim_network_transmit (net, &net->up, buf, len);
+        return TRUE;
+    }
+
+    close (net->client_fd);
+    net->client_fd = -1;
+    net->client_watch = 0;
+
+    return FALSE;
+}
+
+static gboolean
+sim_network_accept_cb (GIOChannel   *channel,
+                       GIOCondition  condition,
+                       SimNetwork   *net)
+{
+    GIOChannel *client;
+    int         fd;
+
+    if (net->client_fd >= 0) {
+        /* One client at a time. A client reconnecting can get here before
+         * the hang up of its old connection has been read, so leave the
+         * new one waiting until then. */
+        return TRUE;
+    }
+
+    fd = accept (net->listen_fd, NULL, NULL);
+    if (fd < 0) {
+        return TRUE;
+    }
+
+    net->client_fd = fd;
+    net->last_activity = net->now;
+    net->mapping_lost = FALSE;
+
+    if (net->parser) {
+        lm_parser_free (net->parser);
+    }
+
+    if (net->exi) {
+        _lm_exi_free (net->exi);
+        net->exi = NULL;
+    }
+    net->streams = 0;
+
+    net->client_inactive = FALSE;
+    net->client_states = 0;
+    net->messages_inactive = 0;
+    g_queue_foreach (net->held, (GFunc) g_free, NULL);
+    g_queue_clear (net->held);
+
+    g_free (net->last_result);
+    net->last_result = NULL;
+
+    net->parser = lm_parser_new ((LmParserMessageFunction) sim_network_server_handle,
+                                 net, NULL);
+    lm_parser_set_node_function (net->parser,
+                                 (LmParserNodeFunction) sim_network_server_handle_node);
+
+    client = g_io_channel_unix_new (fd);
+    net->client_watch = g_io_add_watch (client, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                                        (GIOFunc) sim_network_client_read_cb,
+                                        net);
+    g_io_channel_unref (client);
+
+    return TRUE;
+}
+
+SimNetwork *
+sim_network_new (const SimLinkParams *params, guint32 seed)
+{
+    SimNetwork         *net;
+    GIOChannel         *channel;
+    struct sockaddr_in  addr;
+    socklen_t           addr_len = sizeof (addr);
+
+    g_return_val_if_fail (params != NULL, NULL);
+    g_return_val_if_fail (current_net == NULL, NULL);
+
+    net = g_new0 (SimNetwork, 1);
+    net->params = *params;
+    net->rand = g_rand_new_with_seed (seed);
+    net->stalls = g_array_new (FALSE, FALSE, sizeof (SimStall));
+    net->up.packets = g_queue_new ();
+    net->down.packets = g_queue_new ();
+    net->held = g_queue_new ();
+    net->bodies = g_ptr_array_new ();
+    net->ids = g_ptr_array_new ();
+    net->answer_pings = TRUE;
+    net->answer_disco = TRUE;
+    net->exi_capacity_answer = -1;
+    net->client_fd = -1;
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+    addr.sin_port = 0;
+
+    net->listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (net->listen_fd < 0 ||
+        bind (net->listen_fd, (struct sockaddr *) &addr, sizeof (addr)) < 0 ||
+        listen (net->listen_fd, 1) < 0 ||
+        getsockname (net->listen_fd, (struct sockaddr *) &addr, &addr_len) < 0) {
+        g_error ("Couldn't set up simulated server socket");
+    }
+    net->port = ntohs (addr.sin_port);
+
+    channel = g_io_channel_unix_new (net->listen_fd);
+    net->listen_watch = g_io_add_watch (channel, G_IO_IN,
+                                        (GIOFunc) sim_network_accept_cb, net);
+    g_io_channel_unref (channel);
+
+    current_net = net;
+    _lm_misc_set_timeout_func ((LmMiscTimeoutFunc) sim_timeout_source_new, net);
+    _lm_misc_set_time_func ((LmMiscTimeFunc) sim_network_get_time, net);
+
+    return net;
+}
+
+void
+sim_network_free (SimNetwork *net)
+{
+    GList *l;
+
+    g_return_if_fail (net != NULL);
+
+    _lm_misc_set_timeout_func (NULL, NULL);
+    _lm_misc_set_time_func (NULL, NULL);
+    current_net = NULL;
+
+    /* Timeouts still attached belong to connections that outlive us,
+     * they will never fire */
+    for (l = net->timeouts; l; l = l->next) {
+        ((SimTimeoutSource *) l->data)->net = NULL;
+    }
+    g_list_free (net->timeouts);
+
+    if (net->client_watch) {
+        g_source_remove (net->client_watch);
+    }
+    if (net->client_fd >= 0) {
+        close (net->client_fd);
+    }
+    g_source_remove (net->listen_watch);
+    close (net->listen_fd);
+
+    if (net->parser) {
+        lm_parser_free (net->parser);
+    }
+
+    if (net->exi) {
+        _lm_exi_free (net->exi);
+    }
+
+    g_queue_foreach (net->up.packets, (GFunc) sim_packet_free, NULL);
+    g_queue_free (net->up.packets);
+    g_queue_foreach (net->down.packets, (GFunc) sim_packet_free, NULL);
+    g_queue_free (net->down.packets);
+    g_queue_foreach (net->held, (GFunc) g_free, NULL);
+    g_queue_free (net->held);
+    g_ptr_array_foreach (net->bodies, (GFunc) g_free, NULL);
+    g_ptr_array_free (net->bodies, TRUE);
+    g_ptr_array_foreach (net->ids, (GFunc) g_free, NULL);
+    g_ptr_array_free (net->ids, TRUE);
+    g_free (net->last_result);
+    g_free (net->login_resource);
+    g_free (net->sasl2_task);
+    g_free (net->fast_token);
+
+    g_array_free (net->stalls, TRUE);
+    g_rand_free (net->rand);
+    g_free (net);
+}
+
+guint
+sim_network_get_port (SimNetwork *net)
+{
+    return net->port;
+}
+
+guint64
+sim_network_get_time (SimNetwork *net)
+{
+    return net->now;
+}
+
+/* Nothing is transmitted in either direction from @start for @duration ms */
+void
+sim_network_add_stall (SimNetwork *net, guint64 start, guint duration)
+{
+    SimStall stall;
+
+    stall.start = start;
+    stall.duration = duration;
+
+    g_array_append_val (net->stalls, stall);
+}
+
+void
+sim_network_set_answer_pings (SimNetwork *net, gboolean answer)
+{
+    net->answer_pings = answer;
+}
+
+/* Traffic is dropped once the connection has been idle for longer than
+ * @timeout ms, until the client connects again. 0 turns that off. */
+void
+sim_network_set_idle_timeout (SimNetwork *net, guint timeout)
+{
+    net->idle_timeout = timeout;
+    net->last_activity = net->now;
+}
+
+/* Sends @str to the client as if the server had written it */
+void
+sim_network_server_push (SimNetwork *net, const gchar *str)
+{
+    if (net->client_inactive && g_str_has_prefix (str, "<presence")) {
+        g_queue_push_tail (net->held, g_strdup (str));
+        return;
+    }
+
+    if (net->exi) {
+        GString *out = g_string_new (NULL);
+
+        _lm_exi_encode_xml (net->exi, str, -1, out);
+        sim_network_transmit (net, &net->down, out->str, out->len);
+        g_string_free (out, TRUE);
+        return;
+    }
+
+    sim_network_transmit (net, &net->down, str, strlen (str));
+}
+
+/* Sends @len bytes of @data to the client as they are, also on an EXI
+ * compressed stream */
+void
+sim_network_server_push_raw (SimNetwork *net, const gchar *data, gsize len)
+{
+    sim_network_transmit (net, &net->down, data, len);
+}
+
+guint
+sim_network_get_messages_received (SimNetwork *net)
+{
+    return net->messages_received;
+}
+
+/* The body of the @n:th message received from the client, "" for one
+ * without a body or %NULL if fewer have arrived */
+const gchar *
+sim_network_get_message_body (SimNetwork *net, guint n)
+{
+    if (n >= net->bodies->len) {
+        return NULL;
+    }
+
+    return g_ptr_array_index (net->bodies, n);
+}
+
+/* The id of the @n:th message received from the client, %NULL for one
+ * without an id or if fewer have arrived */
+const gchar *
+sim_network_get_message_id (SimNetwork *net, guint n)
+{
+    if (n >= net->ids->len) {
+        return NULL;
+    }
+
+    return g_ptr_array_index (net->ids, n);
+}
+
+/* Lets the test play other entities, @func gets every IQ from the client
+ * first and returns TRUE for the ones it took care of */
+void
+sim_network_set_iq_func (SimNetwork *net, SimIqFunc func, gpointer user_data)
+{
+    net->iq_func = func;
+    net->iq_data = user_data;
+}
+
+/* Whether the multicast service among the server's items advertises
+ * extended stanza addressing */
+void
+sim_network_set_multicast (SimNetwork *net, gboolean multicast)
+{
+    net->multicast = multicast;
+}
+
+/* Service discovery queries go unanswered when FALSE */
+void
+sim_network_set_answer_disco (SimNetwork *net, gboolean answer)
+{
+    net->answer_disco = answer;
+}
+
+/* Whether the server logs in with SASL and offers EXI compression
+ * (XEP-0322) afterwards, instead of the old non-SASL login */
+void
+sim_network_set_exi (SimNetwork *net, gboolean offer)
+{
+    net->offer_exi = offer;
+}
+
+/* Whether the stream is EXI compressed now */
+gboolean
+sim_network_get_exi_active (SimNetwork *net)
+{
+    return net->exi != NULL;
+}
+
+/* Answers the EXI setup with @capacity as the valuePartitionCapacity
+ * instead of the one the client asked for, -1 to go back to that */
+void
+sim_network_set_exi_capacity (SimNetwork *net, gint capacity)
+{
+    net->exi_capacity_answer = capacity;
+}
+
+/* Whether the server logs in with SASL and advertises Client State
+ * Indication (XEP-0352) afterwards */
+void
+sim_network_set_csi (SimNetwork *net, gboolean offer)
+{
+    net->offer_csi = offer;
+}
+
+/* Whether the server logs in with SASL2 (XEP-0388), binding inline
+ * (XEP-0386) and handing out FAST tokens (XEP-0484) when asked. Only
+ * "password" is accepted as the password. */
+void
+sim_network_set_sasl2 (SimNetwork *net, gboolean offer)
+{
+    net->offer_sasl2 = offer;
+}
+
+/* Answers a correct SASL2 login with a <continue/> asking for @task
+ * instead of success, or succeeds again if @task is %NULL */
+void
+sim_network_set_sasl2_task (SimNetwork *net, const gchar *task)
+{
+    g_free (net->sasl2_task);
+    net->sasl2_task = g_strdup (task);
+}
+
+/* Whether the client gave up on a SASL2 login with <abort/> */
+gboolean
+sim_network_get_sasl2_aborted (SimNetwork *net)
+{
+    return net->sasl2_aborted;
+}
+
+/* The FAST token the server handed out last, or %NULL */
+const gchar *
+sim_network_get_fast_token (SimNetwork *net)
+{
+    return net->fast_token;
+}
+
+/* Forgets the FAST token, as if it had expired */
+void
+sim_network_revoke_fast_token (SimNetwork *net)
+{
+    g_free (net->fast_token);
+    net->fast_token = NULL;
+}
+
+/* Logins with a FAST token that the server accepted */
+guint
+sim_network_get_fast_logins (SimNetwork *net)
+{
+    return net->fast_logins;
+}
+
+/* Whether the client last said it is inactive */
+gboolean
+sim_network_get_client_inactive (SimNetwork *net)
+{
+    return net->client_inactive;
+}
+
+/* Number of client state indications received on this connection */
+guint
+sim_network_get_client_states (SimNetwork *net)
+{
+    return net->client_states;
+}
+
+/* Messages that arrived while the client said it was inactive */
+guint
+sim_network_get_messages_inactive (SimNetwork *net)
+{
+    return net->messages_inactive;
+}
+
+/* Bytes the client has sent, whether they got through or not */
+guint64
+sim_network_get_bytes_received (SimNetwork *net)
+{
+    return net->up.offset;
+}
+
+/* Bytes the server has sent */
+guint64
+sim_network_get_bytes_sent (SimNetwork *net)
+{
+    return net->down.offset;
+}
+
+/* Recipients listed in <addresses/> blocks of messages so far */
+guint
+sim_network_get_addresses_received (SimNetwork *net)
+{
+    return net->addresses_received;
+}
+
+/* The last IQ result the client sent to someone other than the server */
+const gchar *
+sim_network_get_last_result (SimNetwork *net)
+{
+    return net->last_result;
+}
+
+/* A connection to the simulated server for user@example.com */
+LmConnection *
+sim_network_connection_new (SimNetwork *net)
+{
+    LmConnection *connection;
+
+    connection = lm_connection_new ("127.0.0.1");
+    lm_connection_set_port (connection, net->port);
+    lm_connection_set_jid (connection, "user@example.com");
+
+    return connection;
+}
+
+static void
+sim_network_login_auth_cb (LmConnection *connection,
+                           gboolean      success,
+                           SimNetwork   *net)
+{
+    net->login_success = success;
+    net->login_done = TRUE;
+}
+
+static void
+sim_network_login_open_cb (LmConnection *connection,
+                           gboolean      success,
+                           SimNetwork   *net)
+{
+    if (success &&
+        lm_connection_authenticate (connection, "user", "password",
+                                    net->login_resource,
+                                    (LmResultFunction) sim_network_login_auth_cb,
+                                    net, NULL, NULL)) {
+        return;
+    }
+
+    net->login_done = TRUE;
+}
+
+static gboolean
+sim_network_login_is_done (SimNetwork *net)
+{
+    return net->login_done;
+}
+
+/* Opens @connection and authenticates it as "user" with "password" and
+ * @resource. Returns whether it was logged in before the
+ * clock passed @limit. */
+gboolean
+sim_network_login (SimNetwork   *net,
+                   LmConnection *connection,
+                   const gchar  *resource,
+                   guint64       limit)
+{
+    g_free (net->login_resource);
+    net->login_resource = g_strdup (resource);
+    net->login_done = FALSE;
+    net->login_success = FALSE;
+
+    if (!lm_connection_open (connection,
+                             (LmResultFunction) sim_network_login_open_cb,
+                             net, NULL, NULL)) {
+        return FALSE;
+    }
+
+    return sim_network_run_until (net,
+                                  (SimConditionFunc) sim_network_login_is_done,
+                                  net, limit) && net->login_success;
+}
+
+/* Closes @connection if it is still open, then frees both */
+void
+sim_network_finish (SimNetwork *net, LmConnection *connection)
+{
+    if (lm_connection_is_open (connection)) {
+        lm_connection_close (connection, NULL);
+    }
+    lm_connection_unref (connection);
+
+    sim_network_free (net);
+}
+
+/* Runs the default main context until it goes quiet, returns whether
+ * anything was dispatched. */
+static gboolean
+sim_network_settle (SimNetwork *net)
+{
+    gboolean activity = FALSE;
+    gint     quiet = 0;
+
+    while (quiet < SIM_QUIET_ITERATIONS) {
+        if (g_main_context_iteration (NULL, FALSE)) {
+            activity = TRUE;
+            quiet = 0;
+        } else {
+            g_usleep (SIM_QUIET_SLEEP);
+            quiet++;
+        }
+    }
+
+    return activity;
+}
+
+/* Runs until @func returns TRUE, advancing the virtual clock whenever
+ * everything is waiting on it. Returns FALSE if the clock would pass
+ * @limit or there is nothing left to wait for. */
+gboolean
+sim_network_run_until (SimNetwork       *net,
+                       SimConditionFunc  func,
+                       gpointer          user_data,
+                       guint64           limit)
+{
+    while (!func (user_data)) {
+        guint64 next;
+
+        if (sim_network_settle (net)) {
+            continue;
+        }
+
+        if (func (user_data)) {
+            break;
+        }
+
+        next = sim_network_next_event (net);
+        if (next > limit) {
+            net->now = MAX (net->now, limit);
+            return FALSE;
+        }
+
+        net->now = MAX (net->now, next);
+        sim_network_deliver (net);
+    }
+
+    return TRUE;
+}
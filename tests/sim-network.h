@@ -0,0 +1,120 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Simulated network for tests and benchmarks.
+ *
+ * SimNetwork runs a minimal XMPP server on a loopback port and passes all
+ * traffic between it and the client through a simulated link with
+ * latency, limited bandwidth, segment loss and stalls. Time on the link
+ * and in all Loudmouth timeouts is virtual: it only moves forward when
+ * nothing else can happen, so results don't depend on the speed of the
+ * machine running the test.
+ */
+
+#ifndef __SIM_NETWORK_H__
+#define __SIM_NETWORK_H__
+
+#include <glib.h>
+#include <loudmouth/loudmouth.h>
+
+G_BEGIN_DECLS
+
+typedef struct _SimNetwork SimNetwork;
+
+typedef struct {
+    guint    latency;   /* One way delay in ms */
+    guint    bandwidth; /* Bytes per second in each direction, 0 for unlimited */
+    gdouble  loss;      /* Probability that a segment is lost */
+    guint    rto;       /* Time in ms to recover from a lost segment */
+} SimLinkParams;
+
+typedef gboolean (* SimConditionFunc) (gpointer user_data);
+typedef gboolean (* SimIqFunc)        (SimNetwork *net,
+                                       LmMessage  *m,
+                                       gpointer    user_data);
+
+SimNetwork * sim_network_new                   (const SimLinkParams *params,
+                                                guint32              seed);
+void         sim_network_free                  (SimNetwork          *net);
+guint        sim_network_get_port              (SimNetwork          *net);
+guint64      sim_network_get_time              (SimNetwork          *net);
+void         sim_network_add_stall             (SimNetwork          *net,
+                                                guint64              start,
+                                                guint                duration);
+void         sim_network_set_answer_pings      (SimNetwork          *net,
+                                                gboolean             answer);
+void         sim_network_set_idle_timeout      (SimNetwork          *net,
+                                                guint                timeout);
+void         sim_network_set_iq_func           (SimNetwork          *net,
+                                                SimIqFunc            func,
+                                                gpointer             user_data);
+void         sim_network_set_multicast         (SimNetwork          *net,
+                                                gboolean             multicast);
+void         sim_network_set_answer_disco      (SimNetwork          *net,
+                                                gboolean             answer);
+void         sim_network_set_exi               (SimNetwork          *net,
+                                                gboolean             offer);
+void         sim_network_set_exi_capacity      (SimNetwork          *net,
+                                                gint                 capacity);
+gboolean     sim_network_get_exi_active        (SimNetwork          *net);
+void         sim_network_set_csi               (SimNetwork          *net,
+                                                gboolean             offer);
+void         sim_network_set_sasl2             (SimNetwork          *net,
+                                                gboolean             offer);
+void         sim_network_set_sasl2_task        (SimNetwork          *net,
+                                                const gchar         *task);
+gboolean     sim_network_get_sasl2_aborted     (SimNetwork          *net);
+const gchar *sim_network_get_fast_token        (SimNetwork          *net);
+void         sim_network_revoke_fast_token     (SimNetwork          *net);
+guint        sim_network_get_fast_logins       (SimNetwork          *net);
+gboolean     sim_network_get_client_inactive   (SimNetwork          *net);
+guint        sim_network_get_client_states     (SimNetwork          *net);
+guint        sim_network_get_messages_inactive (SimNetwork          *net);
+void         sim_network_server_push           (SimNetwork          *net,
+                                                const gchar         *str);
+void         sim_network_server_push_raw       (SimNetwork          *net,
+                                                const gchar         *data,
+                                                gsize                len);
+guint64      sim_network_get_bytes_received    (SimNetwork          *net);
+guint64      sim_network_get_bytes_sent        (SimNetwork          *net);
+guint        sim_network_get_messages_received (SimNetwork          *net);
+const gchar *sim_network_get_message_body      (SimNetwork          *net,
+                                                guint                n);
+const gchar *sim_network_get_message_id        (SimNetwork          *net,
+                                                guint                n);
+guint        sim_network_get_addresses_received (SimNetwork         *net);
+const gchar *sim_network_get_last_result       (SimNetwork          *net);
+gboolean     sim_network_run_until             (SimNetwork          *net,
+                                                SimConditionFunc     func,
+                                                gpointer             user_data,
+                                                guint64              limit);
+
+LmConnection *sim_network_connection_new       (SimNetwork          *net);
+gboolean     sim_network_login                 (SimNetwork          *net,
+                                                LmConnection        *connection,
+                                                const gchar         *resource,
+                                                guint64              limit);
+void         sim_network_finish                (SimNetwork          *net,
+                                                LmConnection        *connection);
+
+G_END_DECLS
+
+#endif /* __SIM_NETWORK_H__ */
@@ -0,0 +1,244 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Allocation budgets for hot paths. Each operation is warmed up first and
+ * then run a number of times while counting heap allocations, the average
+ * per operation has to stay within the budget. Lower a budget when an
+ * optimization makes it possible, raising one needs a good reason.
+ *
+ * Only malloc(), calloc() and realloc() are counted, and only with GNU
+ * libc, see alloc-counter.c. Elsewhere the counts are printed but the
+ * budgets aren't checked. The budgets are the counts of the paths below
+ * plus a little slack, the ranges come from how many times vasprintf()
+ * allocates for g_log() and whether GSlice still has magazines.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-internals.h"
+#include "loudmouth/lm-parser.h"
+
+#include "alloc-counter.h"
+#include "sim-network.h"
+
+#define WARM_UP_ROUNDS  100
+#define MEASURE_ROUNDS  1000
+/* Sends between letting the server read, keeps the socket from filling up
+ * and Loudmouth from buffering output */
+#define SEND_BATCH      50
+
+/* Message node and its name (2), two attributes with key, value and list
+ * link (6-8), the LmMessage and its private part (2) and four lines of
+ * parser logging (4-8): 14-20 */
+#define PARSE_PRESENCE_BUDGET 22
+/* Dispatching a received stanza to registered handlers must not
+ * allocate at all once warmed up */
+#define DISPATCH_BUDGET        0
+/* Serializing a message with three attributes and a body, escaping and
+ * growing the strings (18-31), and four lines of send logging (4-9):
+ * 22-40. Writing to the unbuffered socket doesn't allocate */
+#define SEND_MESSAGE_BUDGET   42
+
+#define PRESENCE_STANZA \
+    "<presence from='romeo@example.net/orchard' to='juliet@example.com'/>"
+
+static void
+check_budget (const gchar *operation, guint allocations, guint budget)
+{
+    gdouble per_op = (gdouble) allocations / MEASURE_ROUNDS;
+
+    g_test_message ("%s: %.2f allocations per operation, budget %u",
+                    operation, per_op, budget);
+
+    if (!alloc_counter_is_supported ()) {
+        return;
+    }
+
+    if (budget == 0) {
+        /* Not even an occasional one, that would be a cache growing */
+        g_assert_cmpuint (allocations, ==, 0);
+    } else {
+        g_assert_cmpfloat (per_op, <=, budget);
+    }
+}
+
+static void
+count_message_cb (LmParser *parser, LmMessage *message, guint *n_messages)
+{
+    (*n_messages)++;
+}
+
+static void
+test_parse_presence ()
+{
+    LmParser *parser;
+    guint     n_messages = 0;
+    guint     allocations;
+    guint     i;
+
+    parser = lm_parser_new ((LmParserMessageFunction) count_message_cb,
+                            &n_messages, NULL);
+    g_assert (lm_parser_parse (parser,
+                               "<stream:stream xmlns='jabber:client' "
+                               "xmlns:stream='http://etherx.jabber.org/streams'>"));
+
+    for (i = 0; i < WARM_UP_ROUNDS; ++i) {
+        lm_parser_parse (parser, PRESENCE_STANZA);
+    }
+
+    alloc_counter_start ();
+    for (i = 0; i < MEASURE_ROUNDS; ++i) {
+        lm_parser_parse (parser, PRESENCE_STANZA);
+    }
+    allocations = alloc_counter_stop ();
+
+    /* Stream header and every presence */
+    g_assert_cmpuint (n_messages, ==, 1 + WARM_UP_ROUNDS + MEASURE_ROUNDS);
+    check_budget ("Parse presence", allocations, PARSE_PRESENCE_BUDGET);
+
+    lm_parser_free (parser);
+}
+
+static LmHandlerResult
+count_handler_cb (LmMessageHandler *handler,
+                  LmConnection     *connection,
+                  LmMessage        *message,
+                  guint            *n_handled)
+{
+    (*n_handled)++;
+
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+/* Through the same function as stanzas coming off the message queue of
+ * a logged in connection, with the reply handler lookup and all */
+static void
+test_dispatch_presence ()
+{
+    SimLinkParams     params = { 10, 0, 0.0, 0 };
+    SimNetwork       *net;
+    LmConnection     *connection;
+    LmMessageHandler *handlers[3];
+    LmMessage        *presence;
+    guint             n_handled = 0;
+    guint             allocations;
+    guint             i;
+
+    net = sim_network_new (&params, 1);
+    connection = sim_network_connection_new (net);
+    g_assert (sim_network_login (net, connection, "alloc", 60 * 1000));
+
+    for (i = 0; i < G_N_ELEMENTS (handlers); ++i) {
+        handlers[i] = lm_message_handler_new ((LmHandleMessageFunction) count_handler_cb,
+                                              &n_handled, NULL);
+        lm_connection_register_message_handler (connection, handlers[i],
+                                                LM_MESSAGE_TYPE_PRESENCE,
+                                                LM_HANDLER_PRIORITY_NORMAL);
+    }
+
+    presence = lm_message_new ("user@example.com/alloc",
+                               LM_MESSAGE_TYPE_PRESENCE);
+    lm_message_node_set_attributes (presence->node,
+                                    "from", "juliet@example.com/balcony",
+                                    "id", "presence1",
+                                    NULL);
+
+    for (i = 0; i < WARM_UP_ROUNDS; ++i) {
+        _lm_connection_handle_message (connection, presence);
+    }
+
+    alloc_counter_start ();
+    for (i = 0; i < MEASURE_ROUNDS; ++i) {
+        _lm_connection_handle_message (connection, presence);
+    }
+    allocations = alloc_counter_stop ();
+
+    g_assert_cmpuint (n_handled, ==,
+                      G_N_ELEMENTS (handlers) * (WARM_UP_ROUNDS + MEASURE_ROUNDS));
+    check_budget ("Dispatch presence", allocations, DISPATCH_BUDGET);
+
+    lm_message_unref (presence);
+    for (i = 0; i < G_N_ELEMENTS (handlers); ++i) {
+        lm_connection_unregister_message_handler (connection, handlers[i],
+                                                  LM_MESSAGE_TYPE_PRESENCE);
+        lm_message_handler_unref (handlers[i]);
+    }
+    sim_network_finish (net, connection);
+}
+
+static void
+test_send_message ()
+{
+    SimLinkParams  params = { 10, 0, 0.0, 0 };
+    SimNetwork    *net;
+    LmConnection  *connection;
+    LmMessage     *m;
+    guint          allocations = 0;
+    guint          i;
+
+    net = sim_network_new (&params, 1);
+    connection = sim_network_connection_new (net);
+    g_assert (sim_network_login (net, connection, "alloc", 60 * 1000));
+
+    m = lm_message_new_with_sub_type ("juliet@example.com",
+                                      LM_MESSAGE_TYPE_MESSAGE,
+                                      LM_MESSAGE_SUB_TYPE_CHAT);
+    lm_message_node_add_child (m->node, "body", "Good night, good night!");
+
+    for (i = 0; i < WARM_UP_ROUNDS; ++i) {
+        g_assert (lm_connection_send (connection, m, NULL));
+    }
+
+    for (i = 0; i < MEASURE_ROUNDS; ++i) {
+        if (i % SEND_BATCH == 0) {
+            while (g_main_context_iteration (NULL, FALSE)) {
+                /* Let the server read */
+            }
+            alloc_counter_start ();
+        }
+
+        lm_connection_send (connection, m, NULL);
+
+        if ((i + 1) % SEND_BATCH == 0) {
+            allocations += alloc_counter_stop ();
+        }
+    }
+
+    check_budget ("Send message", allocations, SEND_MESSAGE_BUDGET);
+
+    lm_message_unref (m);
+    sim_network_finish (net, connection);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/allocations/parse_presence", test_parse_presence);
+    g_test_add_func ("/allocations/dispatch_presence", test_dispatch_presence);
+    g_test_add_func ("/allocations/send_message", test_send_message);
+
+    return g_test_run ();
+}
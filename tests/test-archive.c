@@ -0,0 +1,431 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Fetches with LmArchive. The simulated server plays an archive with a
+ * message every two seconds, so that the segment boundaries fall on
+ * messages. Segments ahead of their turn have to stop paging once they
+ * hold a few pages.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT   (10 * 60 * 1000)
+#define ARCHIVE_START     1200000000
+#define ARCHIVE_MESSAGES  401
+#define ARCHIVE_INTERVAL  2
+
+#define ARCHIVE_RESULT                                                  \
+    "<message to='user@example.com/archive' from='%s'>"                 \
+    "<result xmlns='urn:xmpp:mam:2' queryid='%s' id='msg-%d'>"          \
+    "<forwarded xmlns='urn:xmpp:forward:0'>"                            \
+    "<delay xmlns='urn:xmpp:delay' stamp='%s'/>"                        \
+    "<message from='friend@example.com/home' type='chat'>"              \
+    "<body>%d</body></message></forwarded></result></message>"
+
+#define ARCHIVE_FIN                                                     \
+    "<iq type='result' id='%s'>"                                        \
+    "<fin xmlns='urn:xmpp:mam:2' complete='%s'>"                        \
+    "<set xmlns='http://jabber.org/protocol/rsm'>%s</set></fin></iq>"
+
+#define ARCHIVE_ERROR                                                   \
+    "<iq type='error' id='%s'>"                                         \
+    "<error type='cancel'><item-not-found "                             \
+    "xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></iq>"
+
+typedef struct {
+    SimNetwork    *net;
+    LmConnection  *connection;
+
+    /* The archive */
+    const gchar   *from;
+    guint          queries;
+    gboolean       spoof;
+    gboolean       fail;
+    guint          results_sent;
+
+    /* What the client got */
+    gint           last;
+    guint          results;
+    guint          max_ahead;
+    gboolean       done;
+    gboolean       success;
+} ArchiveTest;
+
+static gboolean
+test_is_done (ArchiveTest *test)
+{
+    return test->done;
+}
+
+static gchar *
+format_stamp (glong t)
+{
+    GTimeVal tv = { t, 0 };
+
+    return g_time_val_to_iso8601 (&tv);
+}
+
+static glong
+get_field (LmMessageNode *x, const gchar *var)
+{
+    LmMessageNode *field;
+    LmMessageNode *value;
+    GTimeVal       tv;
+
+    for (field = x->children; field; field = field->next) {
+        if (g_strcmp0 (lm_message_node_get_attribute (field, "var"), var) == 0) {
+            value = lm_message_node_get_child (field, "value");
+            g_assert (g_time_val_from_iso8601 (lm_message_node_get_value (value),
+                                               &tv));
+            return tv.tv_sec;
+        }
+    }
+
+    g_assert_not_reached ();
+    return 0;
+}
+
+/* Answers a page the way an archive with second resolution would */
+static gboolean
+archive_iq_cb (SimNetwork *net, LmMessage *m, ArchiveTest *test)
+{
+    LmMessageNode *query;
+    LmMessageNode *set;
+    LmMessageNode *after;
+    const gchar   *query_id;
+    const gchar   *iq_id;
+    GString       *rsm;
+    gchar         *str;
+    glong          start;
+    glong          end;
+    gint           max;
+    gint           first = 0;
+    gint           sent = 0;
+    gint           i;
+
+    query = lm_message_node_get_child (m->node, "query");
+    if (!query) {
+        return FALSE;
+    }
+
+    g_assert_cmpstr (lm_message_node_get_attribute (query, "xmlns"), ==,
+                     "urn:xmpp:mam:2");
+
+    test->queries++;
+    iq_id = lm_message_node_get_attribute (m->node, "id");
+
+    if (test->fail) {
+        str = g_strdup_printf (ARCHIVE_ERROR, iq_id);
+        sim_network_server_push (net, str);
+        g_free (str);
+        return TRUE;
+    }
+
+    query_id = lm_message_node_get_attribute (query, "queryid");
+    start = get_field (lm_message_node_get_child (query, "x"), "start");
+    end = get_field (lm_message_node_get_child (query, "x"), "end");
+
+    set = lm_message_node_get_child (query, "set");
+    max = atoi (lm_message_node_get_value (lm_message_node_get_child (set, "max")));
+    after = lm_message_node_get_child (set, "after");
+    if (after) {
+        first = atoi (lm_message_node_get_value (after) + strlen ("msg-")) + 1;
+    }
+
+    if (test->spoof) {
+        /* Someone else trying to slip a message into the history */
+        str = g_strdup_printf (ARCHIVE_RESULT, "mallory@example.com",
+                               query_id, 9999, "2008-01-10T21:20:00Z", 9999);
+        sim_network_server_push (net, str);
+        g_free (str);
+    }
+
+    rsm = g_string_new (NULL);
+
+    for (i = first; i < ARCHIVE_MESSAGES && sent < max; i++) {
+        glong  t = ARCHIVE_START + i * ARCHIVE_INTERVAL;
+        gchar *stamp;
+
+        if (t < start || t > end) {
+            continue;
+        }
+
+        stamp = format_stamp (t);
+        str = g_strdup_printf (ARCHIVE_RESULT, test->from,
+                               query_id, i, stamp, i);
+        sim_network_server_push (net, str);
+        g_free (str);
+        g_free (stamp);
+
+        if (sent == 0) {
+            g_string_append_printf (rsm, "<first>msg-%d</first>", i);
+        }
+        sent++;
+        test->results_sent++;
+        first = i;
+    }
+
+    if (sent > 0) {
+        g_string_append_printf (rsm, "<last>msg-%d</last>", first);
+    }
+
+    str = g_strdup_printf (ARCHIVE_FIN, iq_id,
+                           (i >= ARCHIVE_MESSAGES ||
+                            ARCHIVE_START + i * ARCHIVE_INTERVAL > end) ?
+                           "true" : "false",
+                           rsm->str);
+    sim_network_server_push (net, str);
+    g_free (str);
+    g_string_free (rsm, TRUE);
+
+    return TRUE;
+}
+
+static void
+archive_result_cb (LmArchive     *archive,
+                   const gchar   *id,
+                   const gchar   *stamp,
+                   LmMessageNode *message,
+                   ArchiveTest   *test)
+{
+    LmMessageNode *body;
+    gint           n = atoi (id + strlen ("msg-"));
+    gchar         *expected;
+
+    /* Once each and in order */
+    g_assert_cmpint (n, ==, test->last + 1);
+    body = lm_message_node_get_child (message, "body");
+    g_assert_cmpint (atoi (lm_message_node_get_value (body)), ==, n);
+
+    expected = format_stamp (ARCHIVE_START + n * ARCHIVE_INTERVAL);
+    g_assert_cmpstr (stamp, ==, expected);
+    g_free (expected);
+
+    test->last = n;
+    test->results++;
+
+    /* Sent by the archive but not handed over yet */
+    test->max_ahead = MAX (test->max_ahead,
+                           test->results_sent - test->results);
+}
+
+static void
+archive_done_cb (LmArchive *archive, gboolean success, ArchiveTest *test)
+{
+    g_assert (!test->done);
+
+    test->done = TRUE;
+    test->success = success;
+}
+
+static void
+test_setup (ArchiveTest *test)
+{
+    SimLinkParams params = { 50, 0, 0.0, 0 };
+
+    memset (test, 0, sizeof (ArchiveTest));
+    test->last = -1;
+    test->from = "user@example.com";
+
+    test->net = sim_network_new (&params, 1);
+    sim_network_set_iq_func (test->net, (SimIqFunc) archive_iq_cb, test);
+
+    test->connection = sim_network_connection_new (test->net);
+    g_assert (sim_network_login (test->net, test->connection, "archive",
+                                 TEST_TIME_LIMIT));
+}
+
+static void
+test_teardown (ArchiveTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+}
+
+/* Returns the virtual time the fetch took */
+static guint64
+fetch_all (guint segments, gboolean spoof)
+{
+    ArchiveTest  test;
+    LmArchive   *archive;
+    guint64      started;
+    guint64      elapsed;
+
+    test_setup (&test);
+    test.spoof = spoof;
+
+    archive = lm_archive_new (test.connection, NULL);
+    lm_archive_set_segments (archive, segments);
+    lm_archive_set_page_size (archive, 20);
+
+    started = sim_network_get_time (test.net);
+
+    g_assert (lm_archive_fetch (archive, NULL, ARCHIVE_START,
+                                ARCHIVE_START + (ARCHIVE_MESSAGES - 1) * ARCHIVE_INTERVAL,
+                                (LmArchiveResultFunction) archive_result_cb,
+                                (LmArchiveFunction) archive_done_cb,
+                                &test, NULL, NULL));
+    /* The fetch keeps it alive */
+    lm_archive_unref (archive);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_done,
+                                     &test,
+                                     started + TEST_TIME_LIMIT));
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.results, ==, ARCHIVE_MESSAGES);
+    g_assert_cmpint (test.last, ==, ARCHIVE_MESSAGES - 1);
+
+    elapsed = sim_network_get_time (test.net) - started;
+    test_teardown (&test);
+
+    return elapsed;
+}
+
+static void
+test_fetch ()
+{
+    fetch_all (4, TRUE);
+}
+
+static void
+test_parallel ()
+{
+    guint64 sequential;
+    guint64 parallel;
+
+    sequential = fetch_all (1, FALSE);
+    parallel = fetch_all (8, FALSE);
+
+    if (g_test_perf ()) {
+        g_test_minimized_result (parallel, "8 segments: %" G_GUINT64_FORMAT " ms",
+                                 parallel);
+        g_test_maximized_result (sequential, "1 segment: %" G_GUINT64_FORMAT " ms",
+                                 sequential);
+    }
+
+    /* 21 pages one after the other against 3 in each segment */
+    g_assert_cmpuint (parallel * 4, <, sequential);
+}
+
+/* The second segment is as quick as the first, it can't keep paging
+ * through its part while the first one is still going */
+static void
+test_bounded ()
+{
+    ArchiveTest  test;
+    LmArchive   *archive;
+    guint        page_size = 5;
+
+    test_setup (&test);
+
+    archive = lm_archive_new (test.connection, NULL);
+    lm_archive_set_segments (archive, 2);
+    lm_archive_set_page_size (archive, page_size);
+
+    g_assert (lm_archive_fetch (archive, NULL, ARCHIVE_START,
+                                ARCHIVE_START + (ARCHIVE_MESSAGES - 1) * ARCHIVE_INTERVAL,
+                                (LmArchiveResultFunction) archive_result_cb,
+                                (LmArchiveFunction) archive_done_cb,
+                                &test, NULL, NULL));
+    lm_archive_unref (archive);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_done,
+                                     &test, TEST_TIME_LIMIT));
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.results, ==, ARCHIVE_MESSAGES);
+    g_assert_cmpint (test.last, ==, ARCHIVE_MESSAGES - 1);
+
+    /* Four pages held and one on the way for each segment */
+    g_assert_cmpuint (test.max_ahead, <=, 6 * page_size);
+
+    test_teardown (&test);
+}
+
+static void
+test_failed ()
+{
+    ArchiveTest  test;
+    LmArchive   *archive;
+
+    test_setup (&test);
+    test.fail = TRUE;
+    test.from = "room@muc.example.com";
+
+    archive = lm_archive_new (test.connection, "room@muc.example.com");
+
+    g_assert (lm_archive_fetch (archive, "friend@example.com",
+                                ARCHIVE_START, ARCHIVE_START + 100,
+                                (LmArchiveResultFunction) archive_result_cb,
+                                (LmArchiveFunction) archive_done_cb,
+                                &test, NULL, NULL));
+    g_assert (!lm_archive_fetch (archive, NULL, ARCHIVE_START,
+                                 ARCHIVE_START + 100, NULL, NULL,
+                                 NULL, NULL, NULL));
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_done,
+                                     &test, TEST_TIME_LIMIT));
+
+    g_assert (!test.success);
+    g_assert_cmpuint (test.results, ==, 0);
+    g_assert_cmpuint (test.queries, ==, 4);
+
+    /* Nothing is left running after the first error */
+    test.done = FALSE;
+    test.fail = FALSE;
+    test.last = (ARCHIVE_START + 100 - ARCHIVE_START) / ARCHIVE_INTERVAL;
+    g_assert (lm_archive_fetch (archive, NULL, ARCHIVE_START + 101,
+                                ARCHIVE_START + 110,
+                                (LmArchiveResultFunction) archive_result_cb,
+                                (LmArchiveFunction) archive_done_cb,
+                                &test, NULL, NULL));
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_done,
+                                     &test, TEST_TIME_LIMIT));
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.results, ==, 5);
+
+    lm_archive_unref (archive);
+    test_teardown (&test);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/archive/fetch", test_fetch);
+    g_test_add_func ("/archive/parallel", test_parallel);
+    g_test_add_func ("/archive/bounded", test_bounded);
+    g_test_add_func ("/archive/failed", test_failed);
+
+    return g_test_run ();
+}
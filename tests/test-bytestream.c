@@ -0,0 +1,861 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * File transfers with LmBytestream. The simulated server plays the
+ * receiver: it takes the streamhost offer and a thread connects to the
+ * sender's direct streamhost, does the SOCKS5 handshake and reads the
+ * file. Through a proxy the thread plays the proxy instead, which only
+ * passes data on once the sender activated it. In-band transfers are
+ * answered by the simulated server, block by block, or sent by it to a
+ * receiving LmBytestream. Run with -m perf to measure the throughput of
+ * a large file.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-sha.h"
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT  (10 * 60 * 1000)
+#define OWN_JID          "user@example.com/bytestream"
+#define TARGET_JID       "target@example.com/receiver"
+#define PROXY_JID        "proxy.example.com"
+#define IBB_SID          "ibb-sid"
+
+#define IBB_RESULT                                                      \
+    "<iq type='result' id='%s' from='" TARGET_JID "' to='" OWN_JID "'/>"
+
+#define IBB_REFUSED                                                     \
+    "<iq type='error' id='%s' from='" TARGET_JID "' to='" OWN_JID "'>"  \
+    "<error type='modify'><resource-constraint "                        \
+    "xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></iq>"
+
+#define STREAMHOST_USED                                                 \
+    "<iq type='result' id='%s' from='" TARGET_JID "' to='" OWN_JID "'>" \
+    "<query xmlns='http://jabber.org/protocol/bytestreams' sid='%s'>"   \
+    "<streamhost-used jid='%s'/></query></iq>"
+
+#define PROXY_ACTIVATED                                                 \
+    "<iq type='result' id='%s' from='" PROXY_JID "' to='" OWN_JID "'/>"
+
+#define IBB_DATA                                                        \
+    "<iq type='set' id='d%u' from='" TARGET_JID "' to='" OWN_JID "'>"   \
+    "<data xmlns='http://jabber.org/protocol/ibb' seq='%u' "            \
+    "sid='" IBB_SID "'>%s</data></iq>"
+
+#define IBB_CLOSE                                                       \
+    "<iq type='set' id='c1' from='" TARGET_JID "' to='" OWN_JID "'>"    \
+    "<close xmlns='http://jabber.org/protocol/ibb' sid='" IBB_SID "'/></iq>"
+
+typedef struct {
+    SimNetwork    *net;
+    LmConnection  *connection;
+
+    /* The offer as seen by the receiver */
+    gchar         *offer_id;
+    gchar         *sid;
+    gchar         *streamhost_jid;
+    gchar         *host;
+    guint          port;
+
+    /* Receiving thread, which first tries the sender with a connection
+     * that never says anything and one for another session if contended */
+    GThread       *thread;
+    gboolean       contended;
+    volatile gint  handshake_done;
+    guint64        received;
+    gboolean       intact;
+
+    /* Proxy played by the receiving thread */
+    gint           proxy_fd;
+    volatile gint  activated;
+    gboolean       early_data;
+
+    /* In-band receiver, answered by the simulated server */
+    guint          max_block_size;
+    guint          block_size;
+    guint          ibb_seq;
+    gboolean       closed;
+
+    /* Sender */
+    gboolean       done;
+    gboolean       success;
+    guint          progress_calls;
+} TransferTest;
+
+static gboolean
+test_handshake_is_done (TransferTest *test)
+{
+    return g_atomic_int_get (&test->handshake_done);
+}
+
+static gboolean
+test_is_done (TransferTest *test)
+{
+    return test->done;
+}
+
+static gboolean
+read_all (gint fd, guint8 *buf, gsize len)
+{
+    while (len > 0) {
+        gssize n = recv (fd, buf, len, 0);
+
+        if (n <= 0) {
+            return FALSE;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return TRUE;
+}
+
+/* Reads the file until the sender closes, checking every byte */
+static void
+receive_data (TransferTest *test, gint fd)
+{
+    guint8 buf[65536];
+    gssize n;
+
+    test->intact = TRUE;
+    while ((n = recv (fd, buf, sizeof (buf), 0)) > 0) {
+        gssize i;
+
+        if (!g_atomic_int_get (&test->activated) && test->proxy_fd > 0) {
+            test->early_data = TRUE;
+        }
+
+        for (i = 0; i < n; i++) {
+            if (buf[i] != (guint8) ((test->received + i) % 251)) {
+                test->intact = FALSE;
+            }
+        }
+
+        test->received += n;
+    }
+
+    close (fd);
+}
+
+static gint
+receiver_connect (TransferTest *test)
+{
+    struct sockaddr_in addr;
+    gint               fd;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (test->port);
+    inet_pton (AF_INET, test->host, &addr.sin_addr);
+    g_assert (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+
+    return fd;
+}
+
+/* FALSE when the sender hangs up on the connect request for @sid */
+static gboolean
+receiver_handshake (gint fd, const gchar *sid)
+{
+    guint8   greeting[3] = { 5, 1, 0 };
+    guint8   buf[256];
+    GString *request;
+    gchar   *str;
+    gchar   *hash;
+    gboolean result;
+
+    g_assert (send (fd, greeting, sizeof (greeting), 0) == sizeof (greeting));
+    g_assert (read_all (fd, buf, 2));
+    g_assert (buf[0] == 5 && buf[1] == 0);
+
+    str = g_strconcat (sid, OWN_JID, TARGET_JID, NULL);
+    hash = lm_sha_hash (str);
+    g_free (str);
+
+    request = g_string_new_len ("\x05\x01\x00\x03", 4);
+    g_string_append_c (request, strlen (hash));
+    g_string_append (request, hash);
+    g_string_append_len (request, "\x00\x00", 2);
+    g_assert (send (fd, request->str, request->len, 0) == (gssize) request->len);
+    g_string_free (request, TRUE);
+
+    result = read_all (fd, buf, 5 + strlen (hash) + 2);
+    if (result) {
+        g_assert (buf[1] == 0);
+    }
+    g_free (hash);
+
+    return result;
+}
+
+/* The receiver's side, blocking since it has a thread of its own */
+static gpointer
+receiver_thread (TransferTest *test)
+{
+    gint stalled = -1;
+    gint fd;
+
+    if (test->contended) {
+        stalled = receiver_connect (test);
+
+        fd = receiver_connect (test);
+        g_assert (!receiver_handshake (fd, "another-sid"));
+        close (fd);
+    }
+
+    fd = receiver_connect (test);
+    g_assert (receiver_handshake (fd, test->sid));
+
+    g_atomic_int_set (&test->handshake_done, TRUE);
+
+    receive_data (test, fd);
+
+    if (stalled >= 0) {
+        close (stalled);
+    }
+
+    return NULL;
+}
+
+/* The proxy's side: the sender connects, does the handshake and then
+ * activates the stream through the server */
+static gpointer
+proxy_thread (TransferTest *test)
+{
+    guint8  reply[2] = { 5, 0 };
+    guint8  buf[256];
+    gsize   len;
+    gint    fd;
+
+    fd = accept (test->proxy_fd, NULL, NULL);
+    g_assert (fd >= 0);
+
+    g_assert (read_all (fd, buf, 3));
+    g_assert (buf[0] == 5);
+    g_assert (send (fd, reply, sizeof (reply), 0) == sizeof (reply));
+
+    /* Connect to the hash, answered with the same address */
+    g_assert (read_all (fd, buf, 5));
+    g_assert (buf[1] == 1 && buf[3] == 3);
+    len = 5 + buf[4] + 2;
+    g_assert (read_all (fd, buf + 5, len - 5));
+    buf[1] = 0;
+    /* Before the reply, the sender activates as soon as it has it */
+    g_atomic_int_set (&test->handshake_done, TRUE);
+    g_assert (send (fd, buf, len, 0) == (gssize) len);
+
+    receive_data (test, fd);
+
+    return NULL;
+}
+
+static gboolean
+receiver_iq_cb (SimNetwork *net, LmMessage *m, TransferTest *test)
+{
+    LmMessageNode *query;
+    LmMessageNode *streamhost;
+
+    query = lm_message_node_get_child (m->node, "query");
+    if (!query ||
+        g_strcmp0 (lm_message_node_get_attribute (query, "xmlns"),
+                   "http://jabber.org/protocol/bytestreams") != 0) {
+        return FALSE;
+    }
+
+    g_assert_cmpstr (lm_message_node_get_attribute (m->node, "to"), ==,
+                     TARGET_JID);
+
+    streamhost = lm_message_node_get_child (query, "streamhost");
+    g_assert (streamhost != NULL);
+
+    test->offer_id = g_strdup (lm_message_node_get_attribute (m->node, "id"));
+    test->sid = g_strdup (lm_message_node_get_attribute (query, "sid"));
+    test->streamhost_jid =
+        g_strdup (lm_message_node_get_attribute (streamhost, "jid"));
+    test->host = g_strdup (lm_message_node_get_attribute (streamhost, "host"));
+    test->port = atoi (lm_message_node_get_attribute (streamhost, "port"));
+
+    /* Offered by the sender itself */
+    g_assert_cmpstr (test->streamhost_jid, ==, OWN_JID);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    test->thread = g_thread_new ("receiver", (GThreadFunc) receiver_thread, test);
+#else
+    test->thread = g_thread_create ((GThreadFunc) receiver_thread,
+                                    test, TRUE, NULL);
+#endif
+
+    return TRUE;
+}
+
+/* The target picks the proxy, the proxy is activated by the sender */
+static gboolean
+proxy_iq_cb (SimNetwork *net, LmMessage *m, TransferTest *test)
+{
+    LmMessageNode *query;
+    LmMessageNode *streamhost;
+    gchar         *str;
+
+    query = lm_message_node_get_child (m->node, "query");
+    if (!query ||
+        g_strcmp0 (lm_message_node_get_attribute (query, "xmlns"),
+                   "http://jabber.org/protocol/bytestreams") != 0) {
+        return FALSE;
+    }
+
+    if (lm_message_node_get_child (query, "activate")) {
+        g_assert_cmpstr (lm_message_node_get_attribute (m->node, "to"), ==,
+                         PROXY_JID);
+        g_assert_cmpstr (lm_message_node_get_attribute (query, "sid"), ==,
+                         test->sid);
+        g_assert_cmpstr (lm_message_node_get_child (query, "activate")->value,
+                         ==, TARGET_JID);
+        /* Only once the sender is through the handshake */
+        g_assert (g_atomic_int_get (&test->handshake_done));
+
+        g_atomic_int_set (&test->activated, TRUE);
+        str = g_strdup_printf (PROXY_ACTIVATED,
+                               lm_message_node_get_attribute (m->node, "id"));
+        sim_network_server_push (net, str);
+        g_free (str);
+        return TRUE;
+    }
+
+    /* No direct streamhost, only the proxy */
+    streamhost = lm_message_node_get_child (query, "streamhost");
+    g_assert (streamhost != NULL);
+    g_assert (streamhost->next == NULL);
+    g_assert_cmpstr (lm_message_node_get_attribute (streamhost, "jid"), ==,
+                     PROXY_JID);
+
+    test->sid = g_strdup (lm_message_node_get_attribute (query, "sid"));
+    str = g_strdup_printf (STREAMHOST_USED,
+                           lm_message_node_get_attribute (m->node, "id"),
+                           test->sid, PROXY_JID);
+    sim_network_server_push (net, str);
+    g_free (str);
+
+    return TRUE;
+}
+
+static void
+transfer_progress_cb (LmBytestream *bytestream,
+                      guint64       transferred,
+                      guint64       total,
+                      TransferTest *test)
+{
+    g_assert_cmpuint (transferred, <=, total);
+
+    test->progress_calls++;
+}
+
+static void
+transfer_done_cb (LmBytestream *bytestream,
+                  gboolean      success,
+                  TransferTest *test)
+{
+    test->done = TRUE;
+    test->success = success;
+}
+
+static gint
+make_file (guint64 size)
+{
+    guint8  buf[65536];
+    guint64 written = 0;
+    gchar  *path;
+    gint    fd;
+
+    fd = g_file_open_tmp ("lm-bytestream-XXXXXX", &path, NULL);
+    g_assert (fd >= 0);
+    unlink (path);
+    g_free (path);
+
+    while (written < size) {
+        gsize len = MIN (sizeof (buf), size - written);
+        gsize i;
+
+        for (i = 0; i < len; i++) {
+            buf[i] = (written + i) % 251;
+        }
+
+        g_assert (write (fd, buf, len) == (gssize) len);
+        written += len;
+    }
+
+    return fd;
+}
+
+static void
+login (TransferTest        *test,
+       const SimLinkParams *params,
+       SimIqFunc            iq_func)
+{
+    memset (test, 0, sizeof (TransferTest));
+
+    test->net = sim_network_new (params, 1);
+    sim_network_set_iq_func (test->net, iq_func, test);
+
+    test->connection = sim_network_connection_new (test->net);
+    g_assert (sim_network_login (test->net, test->connection, "bytestream",
+                                 TEST_TIME_LIMIT));
+}
+
+static void
+transfer (TransferTest *test, guint64 size, gboolean contended)
+{
+    SimLinkParams  params = { 0, 0, 0.0, 0 };
+    LmBytestream  *bytestream;
+    gchar         *str;
+    gint           fd;
+
+    login (test, &params, (SimIqFunc) receiver_iq_cb);
+    test->contended = contended;
+
+    fd = make_file (size);
+
+    bytestream = lm_bytestream_new (test->connection, TARGET_JID, NULL);
+    lm_bytestream_set_progress_function (bytestream,
+                                         (LmBytestreamProgressFunction) transfer_progress_cb,
+                                         test, NULL);
+    g_assert (lm_bytestream_send_file (bytestream, fd, size,
+                                       (LmBytestreamFunction) transfer_done_cb,
+                                       test, NULL, NULL));
+    /* The transfer keeps it alive */
+    lm_bytestream_unref (bytestream);
+
+    g_assert (sim_network_run_until (test->net,
+                                     (SimConditionFunc) test_handshake_is_done,
+                                     test, TEST_TIME_LIMIT));
+
+    str = g_strdup_printf (STREAMHOST_USED, test->offer_id, test->sid,
+                           test->streamhost_jid);
+    sim_network_server_push (test->net, str);
+    g_free (str);
+
+    g_assert (sim_network_run_until (test->net,
+                                     (SimConditionFunc) test_is_done,
+                                     test, TEST_TIME_LIMIT));
+    g_thread_join (test->thread);
+
+    close (fd);
+}
+
+static void
+transfer_finish (TransferTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+
+    g_free (test->offer_id);
+    g_free (test->sid);
+    g_free (test->streamhost_jid);
+    g_free (test->host);
+}
+
+static void
+test_send_direct ()
+{
+    TransferTest test;
+    guint64      size = 3 * 1024 * 1024 + 17;
+
+    transfer (&test, size, FALSE);
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.received, ==, size);
+    g_assert (test.intact);
+    g_assert_cmpuint (test.progress_calls, >, 0);
+
+    transfer_finish (&test);
+}
+
+/* The target's connection is found among others still in the handshake */
+static void
+test_send_contended ()
+{
+    TransferTest test;
+    guint64      size = 64 * 1024;
+
+    transfer (&test, size, TRUE);
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.received, ==, size);
+    g_assert (test.intact);
+
+    transfer_finish (&test);
+}
+
+static void
+test_send_proxy ()
+{
+    SimLinkParams       params = { 0, 0, 0.0, 0 };
+    TransferTest        test;
+    LmBytestream       *bytestream;
+    struct sockaddr_in  addr;
+    socklen_t           addr_len = sizeof (addr);
+    guint64             size = 1024 * 1024 + 3;
+    gint                fd;
+
+    login (&test, &params, (SimIqFunc) proxy_iq_cb);
+
+    test.proxy_fd = socket (AF_INET, SOCK_STREAM, 0);
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    inet_pton (AF_INET, "127.0.0.1", &addr.sin_addr);
+    g_assert (bind (test.proxy_fd, (struct sockaddr *) &addr,
+                    sizeof (addr)) == 0);
+    g_assert (listen (test.proxy_fd, 1) == 0);
+    g_assert (getsockname (test.proxy_fd, (struct sockaddr *) &addr,
+                           &addr_len) == 0);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    test.thread = g_thread_new ("proxy", (GThreadFunc) proxy_thread, &test);
+#else
+    test.thread = g_thread_create ((GThreadFunc) proxy_thread,
+                                   &test, TRUE, NULL);
+#endif
+
+    fd = make_file (size);
+
+    bytestream = lm_bytestream_new (test.connection, TARGET_JID, NULL);
+    lm_bytestream_set_direct (bytestream, FALSE);
+    lm_bytestream_add_streamhost (bytestream, PROXY_JID, "127.0.0.1",
+                                  ntohs (addr.sin_port));
+    g_assert (lm_bytestream_send_file (bytestream, fd, size,
+                                       (LmBytestreamFunction) transfer_done_cb,
+                                       &test, NULL, NULL));
+    lm_bytestream_unref (bytestream);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_done,
+                                     &test, TEST_TIME_LIMIT));
+    g_thread_join (test.thread);
+
+    g_assert (test.success);
+    g_assert (g_atomic_int_get (&test.activated));
+    g_assert (!test.early_data);
+    g_assert (test.intact);
+    g_assert_cmpuint (test.received, ==, size);
+
+    close (test.proxy_fd);
+    close (fd);
+    transfer_finish (&test);
+}
+
+static void
+test_perf_send ()
+{
+    TransferTest test;
+    guint64      size = 512 * 1024 * 1024;
+    GTimer      *timer;
+    gdouble      elapsed;
+
+    timer = g_timer_new ();
+    transfer (&test, size, FALSE);
+    elapsed = g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    g_assert (test.success);
+    g_assert_cmpuint (test.received, ==, size);
+
+    g_test_maximized_result (size / elapsed / (1024 * 1024),
+                             "%.0f MB/s over loopback",
+                             size / elapsed / (1024 * 1024));
+
+    transfer_finish (&test);
+}
+
+/* -- In-band -- */
+
+static void
+ibb_reply (TransferTest *test, const gchar *format, LmMessage *m)
+{
+    gchar *str;
+
+    str = g_strdup_printf (format, lm_message_node_get_attribute (m->node, "id"));
+    sim_network_server_push (test->net, str);
+    g_free (str);
+}
+
+static gboolean
+ibb_server_iq_cb (SimNetwork *net, LmMessage *m, TransferTest *test)
+{
+    LmMessageNode *node;
+
+    if ((node = lm_message_node_get_child (m->node, "open"))) {
+        guint block_size;
+
+        block_size = atoi (lm_message_node_get_attribute (node, "block-size"));
+        if (block_size > test->max_block_size) {
+            ibb_reply (test, IBB_REFUSED, m);
+            return TRUE;
+        }
+
+        test->block_size = block_size;
+        test->intact = TRUE;
+        ibb_reply (test, IBB_RESULT, m);
+        return TRUE;
+    }
+
+    if ((node = lm_message_node_get_child (m->node, "data"))) {
+        guchar *data;
+        gsize   len;
+        gsize   i;
+
+        g_assert_cmpuint (atoi (lm_message_node_get_attribute (node, "seq")),
+                          ==, test->ibb_seq);
+        test->ibb_seq = (test->ibb_seq + 1) & 0xffff;
+
+        data = g_base64_decode (lm_message_node_get_value (node), &len);
+        g_assert_cmpuint (len, <=, test->block_size);
+
+        for (i = 0; i < len; i++) {
+            if (data[i] != (guint8) ((test->received + i) % 251)) {
+                test->intact = FALSE;
+            }
+        }
+
+        test->received += len;
+        g_free (data);
+
+        ibb_reply (test, IBB_RESULT, m);
+        return TRUE;
+    }
+
+    if ((node = lm_message_node_get_child (m->node, "close"))) {
+        test->closed = TRUE;
+        ibb_reply (test, IBB_RESULT, m);
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+static gboolean
+ibb_is_closed (TransferTest *test)
+{
+    return test->done && test->closed;
+}
+
+/* Returns the virtual time the transfer took */
+static guint64
+ibb_transfer (TransferTest *test,
+              guint64       size,
+              guint         block_size,
+              guint         max_block_size,
+              guint         window)
+{
+    SimLinkParams  params = { 50, 0, 0.0, 0 };
+    LmBytestream  *bytestream;
+    guint64        start;
+    gint           fd;
+
+    login (test, &params, (SimIqFunc) ibb_server_iq_cb);
+    test->max_block_size = max_block_size;
+
+    fd = make_file (size);
+
+    bytestream = lm_bytestream_new (test->connection, TARGET_JID, NULL);
+    lm_bytestream_set_method (bytestream, LM_BYTESTREAM_METHOD_IBB);
+    lm_bytestream_set_block_size (bytestream, block_size);
+    lm_bytestream_set_window (bytestream, window);
+    lm_bytestream_set_progress_function (bytestream,
+                                         (LmBytestreamProgressFunction) transfer_progress_cb,
+                                         test, NULL);
+
+    start = sim_network_get_time (test->net);
+    g_assert (lm_bytestream_send_file (bytestream, fd, size,
+                                       (LmBytestreamFunction) transfer_done_cb,
+                                       test, NULL, NULL));
+    g_assert (sim_network_run_until (test->net,
+                                     (SimConditionFunc) ibb_is_closed,
+                                     test, TEST_TIME_LIMIT));
+
+    g_assert_cmpuint (lm_bytestream_get_block_size (bytestream), ==,
+                      test->block_size);
+    g_assert_cmpuint (lm_bytestream_get_transferred (bytestream), ==, size);
+    lm_bytestream_unref (bytestream);
+
+    close (fd);
+
+    return sim_network_get_time (test->net) - start;
+}
+
+static void
+test_ibb_window ()
+{
+    TransferTest test;
+    guint64      size = 64 * 4096 + 100;
+    guint64      stop_and_wait;
+    guint64      windowed;
+
+    stop_and_wait = ibb_transfer (&test, size, 4096, 4096, 1);
+    g_assert (test.success);
+    g_assert (test.intact);
+    g_assert_cmpuint (test.received, ==, size);
+    transfer_finish (&test);
+
+    windowed = ibb_transfer (&test, size, 4096, 4096, 16);
+    g_assert (test.success);
+    g_assert (test.intact);
+    g_assert_cmpuint (test.received, ==, size);
+    g_assert_cmpuint (test.progress_calls, ==, 65);
+    transfer_finish (&test);
+
+    g_test_message ("Stop and wait: %" G_GUINT64_FORMAT " ms, "
+                    "window of 16: %" G_GUINT64_FORMAT " ms",
+                    stop_and_wait, windowed);
+
+    /* 65 round trips against 5 */
+    g_assert_cmpuint (windowed * 8, <, stop_and_wait);
+}
+
+static void
+test_ibb_block_size ()
+{
+    TransferTest test;
+    guint64      size = 20000;
+
+    /* The receiver takes blocks of 1 KiB at most */
+    ibb_transfer (&test, size, 8192, 1024, 4);
+
+    g_assert (test.success);
+    g_assert (test.intact);
+    g_assert_cmpuint (test.block_size, ==, 1024);
+    g_assert_cmpuint (test.received, ==, size);
+
+    transfer_finish (&test);
+}
+
+/* Pushes @len bytes of the pattern in one block and closes the stream */
+static void
+ibb_push_and_close (TransferTest *test, gsize len)
+{
+    guint8 *data;
+    gchar  *encoded;
+    gchar  *str;
+    gsize   i;
+
+    data = g_malloc (len);
+    for (i = 0; i < len; i++) {
+        data[i] = i % 251;
+    }
+
+    encoded = g_base64_encode (data, len);
+    str = g_strdup_printf (IBB_DATA, 0, 0, encoded);
+    sim_network_server_push (test->net, str);
+    g_free (str);
+    g_free (encoded);
+    g_free (data);
+
+    sim_network_server_push (test->net, IBB_CLOSE);
+}
+
+/* The receiver knows the size from the file offer, short is a failure */
+static gboolean
+ibb_receive (TransferTest *test, guint64 offered, gsize sent)
+{
+    SimLinkParams  params = { 0, 0, 0.0, 0 };
+    LmBytestream  *bytestream;
+    LmMessage     *request;
+    LmMessageNode *open;
+    gint           fd;
+
+    login (test, &params, NULL);
+
+    fd = make_file (0);
+
+    request = lm_message_new_with_sub_type (OWN_JID, LM_MESSAGE_TYPE_IQ,
+                                            LM_MESSAGE_SUB_TYPE_SET);
+    lm_message_node_set_attributes (request->node,
+                                    "from", TARGET_JID,
+                                    "id", "o1",
+                                    NULL);
+    open = lm_message_node_add_child (request->node, "open", NULL);
+    lm_message_node_set_attributes (open,
+                                    "xmlns", "http://jabber.org/protocol/ibb",
+                                    "sid", IBB_SID,
+                                    "block-size", "4096",
+                                    NULL);
+
+    bytestream = lm_bytestream_new (test->connection, TARGET_JID, IBB_SID);
+    lm_bytestream_set_size (bytestream, offered);
+    g_assert (lm_bytestream_receive_file (bytestream, request, fd,
+                                          (LmBytestreamFunction) transfer_done_cb,
+                                          test, NULL, NULL));
+    lm_message_unref (request);
+
+    ibb_push_and_close (test, sent);
+    g_assert (sim_network_run_until (test->net,
+                                     (SimConditionFunc) test_is_done,
+                                     test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (lm_bytestream_get_transferred (bytestream), ==, sent);
+    lm_bytestream_unref (bytestream);
+
+    close (fd);
+    transfer_finish (test);
+
+    return test->success;
+}
+
+static void
+test_receive_size ()
+{
+    TransferTest test;
+
+    g_assert (ibb_receive (&test, 1000, 1000));
+    g_assert (!ibb_receive (&test, 1000, 600));
+    /* Nothing offered, whatever arrives will do */
+    g_assert (ibb_receive (&test, 0, 600));
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/bytestream/send_direct", test_send_direct);
+    g_test_add_func ("/bytestream/send_contended", test_send_contended);
+    g_test_add_func ("/bytestream/send_proxy", test_send_proxy);
+    g_test_add_func ("/bytestream/receive_size", test_receive_size);
+    g_test_add_func ("/bytestream/ibb_window", test_ibb_window);
+    g_test_add_func ("/bytestream/ibb_block_size", test_ibb_block_size);
+
+    if (g_test_perf ()) {
+        g_test_add_func ("/bytestream/perf/send", test_perf_send);
+    }
+
+    return g_test_run ();
+}
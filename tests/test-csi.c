@@ -0,0 +1,399 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Client State Indication against the simulated server, which holds back
+ * presences while the client is inactive. Stanzas from other threads
+ * have to go out after the client said it is active again.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT      (10 * 60 * 1000)
+#define TEST_PRESENCES       20
+#define TEST_TIMEOUT         30
+
+typedef struct {
+    SimNetwork   *net;
+    LmConnection *connection;
+    guint         messages;
+    guint         presences;
+    guint         sent;
+} CsiTest;
+
+static LmHandlerResult
+test_message_cb (LmMessageHandler *handler,
+                 LmConnection     *connection,
+                 LmMessage        *m,
+                 CsiTest          *test)
+{
+    if (lm_message_get_type (m) == LM_MESSAGE_TYPE_PRESENCE) {
+        test->presences++;
+    } else {
+        test->messages++;
+    }
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+test_setup (CsiTest *test, gboolean offer_csi)
+{
+    SimLinkParams     params = { 20, 0, 0.0, 0 };
+    LmMessageHandler *handler;
+
+    memset (test, 0, sizeof (CsiTest));
+
+    test->net = sim_network_new (&params, 1);
+    if (offer_csi) {
+        sim_network_set_csi (test->net, TRUE);
+    } else {
+        /* Logs in the same way, with EXI offered instead */
+        sim_network_set_exi (test->net, TRUE);
+    }
+
+    test->connection = sim_network_connection_new (test->net);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) test_message_cb,
+                                      test, NULL);
+    lm_connection_register_message_handler (test->connection, handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_connection_register_message_handler (test->connection, handler,
+                                            LM_MESSAGE_TYPE_PRESENCE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+}
+
+static void
+test_open (CsiTest *test)
+{
+    g_assert (sim_network_login (test->net, test->connection, "csi",
+                                 TEST_TIME_LIMIT));
+}
+
+static void
+test_teardown (CsiTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+}
+
+static void
+test_push_presences (CsiTest *test)
+{
+    guint i;
+
+    for (i = 0; i < TEST_PRESENCES; i++) {
+        gchar *str;
+
+        str = g_strdup_printf ("<presence from='contact%u@example.net/home'>"
+                               "<show>away</show></presence>", i);
+        sim_network_server_push (test->net, str);
+        g_free (str);
+    }
+}
+
+static void
+test_send_message (CsiTest *test)
+{
+    LmMessage *m;
+
+    m = lm_message_new_with_sub_type ("romeo@example.net",
+                                      LM_MESSAGE_TYPE_MESSAGE,
+                                      LM_MESSAGE_SUB_TYPE_CHAT);
+    lm_message_node_add_child (m->node, "body", "Still here");
+    g_assert (lm_connection_send (test->connection, m, NULL));
+    lm_message_unref (m);
+}
+
+static GThread *
+test_thread_new (GThreadFunc func, CsiTest *test)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    return g_thread_new ("sender", func, test);
+#else
+    return g_thread_create (func, test, TRUE, NULL);
+#endif
+}
+
+static gpointer
+test_late_thread (CsiTest *test)
+{
+    test_send_message (test);
+
+    return NULL;
+}
+
+/* Written while the queue is being drained: goes inactive again and has
+ * another thread queue a message before the rest of the batch is sent */
+static void
+test_sent_cb (LmConnection      *connection,
+              gboolean           success,
+              const LmSendTimes *times,
+              CsiTest           *test)
+{
+    g_assert (success);
+
+    if (test->sent++ > 0) {
+        return;
+    }
+
+    lm_connection_set_client_state (connection, LM_CLIENT_STATE_INACTIVE);
+    g_thread_join (test_thread_new ((GThreadFunc) test_late_thread, test));
+}
+
+static gpointer
+test_sender_thread (CsiTest *test)
+{
+    LmMessage *m;
+
+    m = lm_message_new_with_sub_type ("romeo@example.net",
+                                      LM_MESSAGE_TYPE_MESSAGE,
+                                      LM_MESSAGE_SUB_TYPE_CHAT);
+    lm_message_node_add_child (m->node, "body", "First");
+    g_assert (lm_connection_send_with_callback (test->connection, m,
+                                                (LmSendFunction) test_sent_cb,
+                                                test, NULL, NULL));
+    lm_message_unref (m);
+
+    test_send_message (test);
+
+    return NULL;
+}
+
+static gboolean
+test_is_inactive (CsiTest *test)
+{
+    return sim_network_get_client_inactive (test->net);
+}
+
+static gboolean
+test_is_active (CsiTest *test)
+{
+    return !sim_network_get_client_inactive (test->net);
+}
+
+static gboolean
+test_got_message (CsiTest *test)
+{
+    return test->messages > 0;
+}
+
+static gboolean
+test_got_presences (CsiTest *test)
+{
+    return test->presences == TEST_PRESENCES;
+}
+
+static gboolean
+test_never (gpointer user_data)
+{
+    return FALSE;
+}
+
+/* Lets @ms of virtual time pass */
+static void
+test_wait (CsiTest *test, guint ms)
+{
+    g_assert (!sim_network_run_until (test->net, test_never, NULL,
+                                      sim_network_get_time (test->net) + ms));
+}
+
+/* Set by the application before logging in and changed afterwards */
+static void
+test_hint ()
+{
+    CsiTest test;
+
+    test_setup (&test, TRUE);
+
+    lm_connection_set_client_state (test.connection, LM_CLIENT_STATE_INACTIVE);
+    g_assert (lm_connection_get_client_state (test.connection) ==
+              LM_CLIENT_STATE_INACTIVE);
+
+    test_open (&test);
+
+    /* Told right away, before anything else is sent */
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_inactive,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 1);
+
+    /* Messages get through, presences wait */
+    test_push_presences (&test);
+    sim_network_server_push (test.net,
+                             "<message from='romeo@example.net' type='chat'>"
+                             "<body>Hello</body></message>");
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_got_message,
+                                     &test, TEST_TIME_LIMIT));
+    test_wait (&test, 1000);
+    g_assert_cmpuint (test.presences, ==, 0);
+
+    lm_connection_set_client_state (test.connection, LM_CLIENT_STATE_ACTIVE);
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_got_presences,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 2);
+
+    /* Nothing to tell when nothing changes */
+    lm_connection_set_client_state (test.connection, LM_CLIENT_STATE_ACTIVE);
+    test_wait (&test, 1000);
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 2);
+
+    test_teardown (&test);
+}
+
+static void
+test_automatic ()
+{
+    CsiTest test;
+    guint64 start;
+    guint   i;
+
+    test_setup (&test, TRUE);
+
+    lm_connection_set_inactivity_timeout (test.connection, TEST_TIMEOUT);
+    g_assert_cmpuint (lm_connection_get_inactivity_timeout (test.connection),
+                      ==, TEST_TIMEOUT);
+
+    test_open (&test);
+    start = sim_network_get_time (test.net);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_inactive,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_time (test.net) - start, >=,
+                      TEST_TIMEOUT * 1000);
+    g_assert (lm_connection_get_client_state (test.connection) ==
+              LM_CLIENT_STATE_INACTIVE);
+
+    /* Sending a message makes it active again */
+    test_send_message (&test);
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_active,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert (lm_connection_get_client_state (test.connection) ==
+              LM_CLIENT_STATE_ACTIVE);
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 2);
+
+    /* And keeps it active while it goes on */
+    for (i = 0; i < 5; i++) {
+        test_wait (&test, TEST_TIMEOUT * 1000 * 2 / 3);
+        test_send_message (&test);
+    }
+    start = sim_network_get_time (test.net);
+    test_wait (&test, 1000);
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 2);
+    g_assert_cmpuint (sim_network_get_messages_received (test.net), ==, 6);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_inactive,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_time (test.net) - start, >=,
+                      TEST_TIMEOUT * 1000);
+
+    /* Turned off, it stays as it was */
+    lm_connection_set_inactivity_timeout (test.connection, 0);
+    test_send_message (&test);
+    test_wait (&test, 1000);
+    g_assert (sim_network_get_client_inactive (test.net));
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 3);
+
+    test_teardown (&test);
+}
+
+static gboolean
+test_got_three (CsiTest *test)
+{
+    return sim_network_get_messages_received (test->net) == 3;
+}
+
+/* Sent by other threads while inactive, handed to the thread running the
+ * context through the outgoing queue */
+static void
+test_thread ()
+{
+    CsiTest test;
+
+    test_setup (&test, TRUE);
+    lm_connection_set_inactivity_timeout (test.connection, TEST_TIMEOUT);
+
+    test_open (&test);
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_is_inactive,
+                                     &test, TEST_TIME_LIMIT));
+
+    /* Both are queued, the context is ours */
+    g_assert (g_main_context_acquire (NULL));
+    g_thread_join (test_thread_new ((GThreadFunc) test_sender_thread, &test));
+    g_main_context_release (NULL);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_got_three,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (test.sent, ==, 1);
+
+    /* Active before each batch, the late one waits for its turn */
+    g_assert_cmpuint (sim_network_get_messages_inactive (test.net), ==, 0);
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 4);
+    g_assert (!sim_network_get_client_inactive (test.net));
+
+    test_teardown (&test);
+}
+
+static void
+test_unsupported ()
+{
+    CsiTest test;
+
+    test_setup (&test, FALSE);
+    lm_connection_set_inactivity_timeout (test.connection, TEST_TIMEOUT);
+
+    test_open (&test);
+
+    lm_connection_set_client_state (test.connection, LM_CLIENT_STATE_INACTIVE);
+    test_wait (&test, TEST_TIMEOUT * 1000 * 2);
+    g_assert_cmpuint (sim_network_get_client_states (test.net), ==, 0);
+
+    test_teardown (&test);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/csi/hint", test_hint);
+    g_test_add_func ("/csi/automatic", test_automatic);
+    g_test_add_func ("/csi/thread", test_thread);
+    g_test_add_func ("/csi/unsupported", test_unsupported);
+
+    return g_test_run ();
+}
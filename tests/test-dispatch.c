@@ -0,0 +1,524 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Stanzas pushed by the simulated server through parsing and dispatch to
+ * registered handlers, and the ones answered by the built-in responders
+ * without reaching them, and messages fanned out to many recipients the
+ * other way. The benchmark reports cache misses per stanza
+ * where the CPU's counters can be used.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "perf-counter.h"
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT  (10 * 60 * 1000)
+/* Stanzas written before letting the client read, keeps the socket from
+ * filling up */
+#define PUSH_BATCH       200
+
+#define MESSAGE_STANZA                                              \
+    "<message from='romeo@example.net/orchard' "                    \
+    "to='user@example.com/dispatch' type='chat' id='m%u'>"          \
+    "<body>%u</body>"                                               \
+    "<active xmlns='http://jabber.org/protocol/chatstates'/>"       \
+    "</message>"
+
+#define PING_STANZA                                                 \
+    "<iq from='romeo@example.net/orchard' to='user@example.com/dispatch' " \
+    "type='get' id='%s'><ping xmlns='urn:xmpp:ping'/></iq>"
+
+#define DISCO_INFO_STANZA                                           \
+    "<iq from='romeo@example.net/orchard' to='user@example.com/dispatch' " \
+    "type='get' id='%s'>"                                           \
+    "<query xmlns='http://jabber.org/protocol/disco#info'%s/></iq>"
+
+typedef struct {
+    SimNetwork   *net;
+    LmConnection *connection;
+    guint         received;
+    guint         expected;
+    gboolean      in_order;
+    guint         iqs;
+    const gchar  *awaited_id;
+    guint         sent;
+} DispatchClient;
+
+static gboolean
+client_has_received_all (DispatchClient *client)
+{
+    return client->received >= client->expected;
+}
+
+static gboolean
+client_has_answered (DispatchClient *client)
+{
+    const gchar *result;
+    gchar       *id;
+    gboolean     found;
+
+    result = sim_network_get_last_result (client->net);
+    if (!result) {
+        return FALSE;
+    }
+
+    id = g_strdup_printf ("id=\"%s\"", client->awaited_id);
+    found = strstr (result, id) != NULL;
+    g_free (id);
+
+    return found;
+}
+
+static gboolean
+client_has_delivered_all (DispatchClient *client)
+{
+    return sim_network_get_messages_received (client->net) >= client->sent;
+}
+
+static gboolean
+client_has_iqs (DispatchClient *client)
+{
+    return client->iqs > 0;
+}
+
+static LmHandlerResult
+client_iq_cb (LmMessageHandler *handler,
+              LmConnection     *connection,
+              LmMessage        *m,
+              DispatchClient   *client)
+{
+    client->iqs++;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static LmHandlerResult
+client_message_cb (LmMessageHandler *handler,
+                   LmConnection     *connection,
+                   LmMessage        *m,
+                   DispatchClient   *client)
+{
+    LmMessageNode *body;
+
+    body = lm_message_node_get_child (m->node, "body");
+    if (!body || atoi (lm_message_node_get_value (body)) != (gint) client->received) {
+        client->in_order = FALSE;
+    }
+
+    client->received++;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static void
+client_login (DispatchClient *client)
+{
+    SimLinkParams     params = { 0, 0, 0.0, 0 };
+    LmMessageHandler *handler;
+
+    memset (client, 0, sizeof (DispatchClient));
+    client->in_order = TRUE;
+
+    client->net = sim_network_new (&params, 1);
+    client->connection = sim_network_connection_new (client->net);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) client_message_cb,
+                                      client, NULL);
+    lm_connection_register_message_handler (client->connection, handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+
+    g_assert (sim_network_login (client->net, client->connection,
+                                 "dispatch", TEST_TIME_LIMIT));
+}
+
+static void
+client_finish (DispatchClient *client)
+{
+    sim_network_finish (client->net, client->connection);
+}
+
+static void
+client_push_messages (DispatchClient *client, guint n_messages)
+{
+    guint i;
+
+    for (i = 0; i < n_messages; ++i) {
+        gchar *str;
+
+        str = g_strdup_printf (MESSAGE_STANZA, client->expected, client->expected);
+        sim_network_server_push (client->net, str);
+        g_free (str);
+
+        client->expected++;
+
+        if (client->expected % PUSH_BATCH == 0) {
+            g_assert (sim_network_run_until (client->net,
+                                             (SimConditionFunc) client_has_received_all,
+                                             client, TEST_TIME_LIMIT));
+        }
+    }
+
+    g_assert (sim_network_run_until (client->net,
+                                     (SimConditionFunc) client_has_received_all,
+                                     client, TEST_TIME_LIMIT));
+}
+
+static void
+test_messages ()
+{
+    DispatchClient client;
+
+    client_login (&client);
+    client_push_messages (&client, 1000);
+
+    g_assert_cmpuint (client.received, ==, 1000);
+    g_assert (client.in_order);
+
+    client_finish (&client);
+}
+
+static void
+client_push_iq (DispatchClient *client,
+                const gchar    *format,
+                const gchar    *id,
+                const gchar    *extra)
+{
+    gchar *str;
+
+    str = g_strdup_printf (format, id, extra);
+    sim_network_server_push (client->net, str);
+    g_free (str);
+}
+
+static void
+test_responders ()
+{
+    DispatchClient    client;
+    LmMessageHandler *handler;
+    LmMessageNode    *query;
+    LmMessage        *info;
+    const gchar      *result;
+
+    client_login (&client);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) client_iq_cb,
+                                      &client, NULL);
+    lm_connection_register_message_handler (client.connection, handler,
+                                            LM_MESSAGE_TYPE_IQ,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+
+    /* Left to the application unless enabled */
+    g_assert (!lm_connection_get_ping_responder (client.connection));
+    client_push_iq (&client, PING_STANZA, "p1", NULL);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_iqs,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert (sim_network_get_last_result (client.net) == NULL);
+
+    lm_connection_set_ping_responder (client.connection, TRUE);
+    client.awaited_id = "p2";
+    client_push_iq (&client, PING_STANZA, "p2", NULL);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_answered,
+                                     &client, TEST_TIME_LIMIT));
+    result = sim_network_get_last_result (client.net);
+    g_assert (strstr (result, "to=\"romeo@example.net/orchard\"") != NULL);
+    g_assert_cmpuint (client.iqs, ==, 1);
+
+    info = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+    query = lm_message_node_add_child (info->node, "query", NULL);
+    lm_message_node_set_attributes (query,
+                                    "xmlns", "http://jabber.org/protocol/disco#info",
+                                    "node", "http://loudmouth.example/#1",
+                                    NULL);
+    lm_message_node_set_attributes (lm_message_node_add_child (query, "identity", NULL),
+                                    "category", "client",
+                                    "type", "pc",
+                                    NULL);
+    lm_message_node_set_attribute (lm_message_node_add_child (query, "feature", NULL),
+                                   "var", "urn:xmpp:ping");
+    lm_connection_set_disco_info (client.connection, query);
+    lm_message_unref (info);
+
+    client.awaited_id = "d1";
+    client_push_iq (&client, DISCO_INFO_STANZA, "d1",
+                    " node='http://loudmouth.example/#1'");
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_answered,
+                                     &client, TEST_TIME_LIMIT));
+    result = sim_network_get_last_result (client.net);
+    g_assert (strstr (result, "var=\"urn:xmpp:ping\"") != NULL);
+    g_assert_cmpuint (client.iqs, ==, 1);
+
+    /* Other nodes go to the application */
+    client.iqs = 0;
+    client_push_iq (&client, DISCO_INFO_STANZA, "d2", "");
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_iqs,
+                                     &client, TEST_TIME_LIMIT));
+
+    client_finish (&client);
+}
+
+static void
+client_send_multicast (DispatchClient *client, guint n_recipients)
+{
+    LmMessage  *m;
+    gchar     **recipients;
+    guint       i;
+
+    recipients = g_new0 (gchar *, n_recipients + 1);
+    for (i = 0; i < n_recipients; i++) {
+        recipients[i] = g_strdup_printf ("user%u@example.net", i);
+    }
+
+    m = lm_message_new_with_sub_type (NULL, LM_MESSAGE_TYPE_MESSAGE,
+                                      LM_MESSAGE_SUB_TYPE_HEADLINE);
+    lm_message_node_add_child (m->node, "body", "Notification");
+
+    g_assert (lm_connection_send_multicast (client->connection, m,
+                                            (const gchar **) recipients,
+                                            NULL));
+    lm_message_unref (m);
+    g_strfreev (recipients);
+}
+
+static gboolean
+client_never (DispatchClient *client)
+{
+    return FALSE;
+}
+
+/* Gives discovery time to finish */
+static void
+client_wait (DispatchClient *client, guint ms)
+{
+    g_assert (!sim_network_run_until (client->net,
+                                      (SimConditionFunc) client_never,
+                                      client,
+                                      sim_network_get_time (client->net) + ms));
+}
+
+/* No two stanzas the server got share an id */
+static void
+client_assert_unique_ids (DispatchClient *client)
+{
+    GHashTable *ids;
+    guint       i;
+
+    ids = g_hash_table_new (g_str_hash, g_str_equal);
+
+    for (i = 0; i < sim_network_get_messages_received (client->net); i++) {
+        const gchar *id = sim_network_get_message_id (client->net, i);
+
+        g_assert (id != NULL);
+        g_assert (g_hash_table_lookup (ids, id) == NULL);
+        g_hash_table_insert (ids, (gpointer) id, (gpointer) id);
+    }
+
+    g_hash_table_destroy (ids);
+}
+
+static void
+test_multicast ()
+{
+    DispatchClient  client;
+    LmMessage      *m;
+
+    /* One stanza per recipient when the server can't do it */
+    client_login (&client);
+    client.sent = 120;
+    client_send_multicast (&client, 120);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_messages_received (client.net), ==, 120);
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 0);
+    client_assert_unique_ids (&client);
+    client_finish (&client);
+
+    /* Not held back while the service is looked for, so what is sent
+     * after it still comes after it */
+    client_login (&client);
+    sim_network_set_multicast (client.net, TRUE);
+    client.sent = 121;
+    client_send_multicast (&client, 120);
+
+    m = lm_message_new ("romeo@example.net", LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_node_add_child (m->node, "body", "After");
+    g_assert (lm_connection_send (client.connection, m, NULL));
+    lm_message_unref (m);
+
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_messages_received (client.net), ==, 121);
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 0);
+    g_assert_cmpstr (sim_network_get_message_body (client.net, 120), ==, "After");
+    client_wait (&client, 1000);
+
+    /* Found by now */
+    client.sent = 124;
+    client_send_multicast (&client, 120);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_messages_received (client.net), ==, 124);
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 120);
+
+    client.sent = 125;
+    client_send_multicast (&client, 2);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 122);
+    client_assert_unique_ids (&client);
+    client_finish (&client);
+
+    /* Nobody answers discovery, still sent one by one */
+    client_login (&client);
+    sim_network_set_multicast (client.net, TRUE);
+    sim_network_set_answer_disco (client.net, FALSE);
+    client.sent = 120;
+    client_send_multicast (&client, 120);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    client_wait (&client, 15000);
+
+    client.sent = 240;
+    client_send_multicast (&client, 120);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_messages_received (client.net), ==, 240);
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 0);
+    client_finish (&client);
+}
+
+static gpointer
+client_multicast_thread (DispatchClient *client)
+{
+    client_send_multicast (client, 120);
+
+    return NULL;
+}
+
+/* Discovery started from another thread is handed to the thread running
+ * the connection */
+static void
+test_multicast_thread ()
+{
+    DispatchClient  client;
+    GThread        *thread;
+
+    client_login (&client);
+    sim_network_set_multicast (client.net, TRUE);
+    client.sent = 120;
+
+    /* Keeps the other thread from running discovery itself */
+    g_assert (g_main_context_acquire (NULL));
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    thread = g_thread_new ("multicast",
+                           (GThreadFunc) client_multicast_thread, &client);
+#else
+    thread = g_thread_create ((GThreadFunc) client_multicast_thread,
+                              &client, TRUE, NULL);
+#endif
+    g_thread_join (thread);
+
+    g_main_context_release (NULL);
+
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 0);
+    client_wait (&client, 1000);
+
+    client.sent = 123;
+    client_send_multicast (&client, 120);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_has_delivered_all,
+                                     &client, TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_addresses_received (client.net), ==, 120);
+    client_finish (&client);
+}
+
+static void
+test_perf_messages ()
+{
+    DispatchClient client;
+    guint          n_messages = 20000;
+    guint64        misses;
+
+    client_login (&client);
+
+    /* Warm up the parser, the handlers and the slice allocator */
+    client_push_messages (&client, 1000);
+
+    /* Wall clock time would mostly be the simulated network waiting for
+     * the loopback socket to go quiet, so only cache misses are reported */
+    perf_counter_start ();
+    client_push_messages (&client, n_messages);
+    misses = perf_counter_stop ();
+
+    g_assert (client.in_order);
+
+    if (perf_counter_is_supported ()) {
+        g_test_minimized_result ((gdouble) misses / n_messages,
+                                 "%.2f cache misses per message",
+                                 (gdouble) misses / n_messages);
+    } else {
+        g_test_message ("Cache misses can't be counted here");
+    }
+
+    client_finish (&client);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/dispatch/messages", test_messages);
+    g_test_add_func ("/dispatch/responders", test_responders);
+    g_test_add_func ("/dispatch/multicast", test_multicast);
+    g_test_add_func ("/dispatch/multicast_thread", test_multicast_thread);
+
+    if (g_test_perf ()) {
+        g_test_add_func ("/dispatch/perf/messages", test_perf_messages);
+    }
+
+    return g_test_run ();
+}
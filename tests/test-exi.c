@@ -0,0 +1,729 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * EXI encoding of stanzas on its own and as negotiated by LmConnection
+ * with the simulated server. The vectors are worked out by hand from the
+ * EXI 1.0 specification, the bit layout is given next to each.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-exi.h"
+#include "loudmouth/lm-parser.h"
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT  (60 * 1000)
+#define TEST_MESSAGES    50
+
+#define STREAM_HEADER                                                   \
+    "<stream:stream xmlns='jabber:client' "                             \
+    "xmlns:stream='http://etherx.jabber.org/streams'>"
+
+static const gchar *stanzas[] = {
+    "<message to='romeo@example.net' from='juliet@example.com/balcony' "
+    "type='chat' id='m1' xml:lang='en'><body>Wherefore art thou, Romeo?"
+    "</body><thread>e0ffe42b28561960c6b12b944a092794b9683a38</thread>"
+    "</message>",
+
+    "<message to='romeo@example.net' from='juliet@example.com/balcony' "
+    "type='chat' id='m2' xml:lang='en'><body>Deny thy father and refuse "
+    "thy name</body><thread>e0ffe42b28561960c6b12b944a092794b9683a38"
+    "</thread></message>",
+
+    "<presence from='juliet@example.com/balcony'><show>away</show>"
+    "<status>Tom &amp; Jerry &lt;3 caf\xc3\xa9 \xe2\x98\x95</status>"
+    "<priority>5</priority><c xmlns='http://jabber.org/protocol/caps' "
+    "hash='sha-1' node='http://loudmouth.example' "
+    "ver='QgayPKawpkPSDYmwT/WM94uAlu0='/></presence>",
+
+    "<iq type='result' id='roster1'><query xmlns='jabber:iq:roster' "
+    "ver='ver7'><item jid='nurse@example.com' name='Nurse' "
+    "subscription='both'><group>Servants</group></item>"
+    "<item jid='romeo@example.net' subscription='to'/></query></iq>",
+
+    "<iq type='get' id='p1'><ping xmlns='urn:xmpp:ping'/></iq>",
+
+    "<r xmlns='urn:xmpp:sm:3'/>",
+
+    "<message to='romeo@example.net' type='chat' id='m3'><body></body>"
+    "</message>",
+
+    "<stream:features><bind xmlns='urn:ietf:params:xml:ns:xmpp-bind'/>"
+    "</stream:features>",
+
+    NULL
+};
+
+/* Documents without a namespace, so the URI is the empty one (2 bits,
+ * id 1), and the names and values are new the first time:
+ *
+ * <a/>
+ *   10000000          header
+ *   01                uri ""
+ *   00000010 01100001 local name "a", length + 1
+ *   00                EE, second level of StartTagContent
+ */
+static const guint8 vector_empty[] = { 0x80, 0x40, 0x98, 0x40 };
+
+/* <a b='c'>d</a>
+ *   10000000 01 00000010 01100001    header, SE (a)
+ *   01                               AT (*)
+ *   01 00000010 01100010             uri "", local name "b"
+ *   00000011 01100011                value "c", length + 2
+ *   1 11                             CH after the learned AT (b)
+ *   00000011 01100100                value "d"
+ *   0                                EE of ElementContent
+ */
+static const guint8 vector_value[] = {
+    0x80, 0x40, 0x98, 0x54, 0x09, 0x88, 0x0d, 0x8f, 0x81, 0xb2, 0x00
+};
+
+/* <a b='c'>c</a> has the text in the global partition, id 0 of 1:
+ *   ... 1 11 00000001 0
+ * With a valueMaxLength of 0 nothing is remembered and it is a miss:
+ *   ... 1 11 00000011 01100011 0
+ */
+static const guint8 vector_global[] = {
+    0x80, 0x40, 0x98, 0x54, 0x09, 0x88, 0x0d, 0x8f, 0x80, 0x80
+};
+static const guint8 vector_max_length[] = {
+    0x80, 0x40, 0x98, 0x54, 0x09, 0x88, 0x0d, 0x8f, 0x81, 0xb1, 0x80
+};
+
+/* <a b='c'/> after vector_value on the same tables:
+ *   10000000 01 00000000 0           header, uri "", name hit "a" of 2
+ *   01                               AT (b), second of the learned
+ *   00000000                         local hit "c", id 0 of 1
+ *   10 00                            EE
+ * With a valuePartitionCapacity of 1 "d" took the place of "c":
+ *   10000000 01 00000000 0 01 00000011 01100011 10 00
+ */
+static const guint8 vector_hit[] = { 0x80, 0x40, 0x08, 0x04, 0x00 };
+static const guint8 vector_capacity[] = {
+    0x80, 0x40, 0x08, 0x1b, 0x1c, 0x00
+};
+
+static void
+collect_message_cb (LmParser *parser, LmMessage *m, GPtrArray *nodes)
+{
+    if (lm_message_get_type (m) != LM_MESSAGE_TYPE_STREAM) {
+        g_ptr_array_add (nodes, lm_message_node_ref (m->node));
+    }
+}
+
+static void
+collect_node_cb (LmParser *parser, LmMessageNode *node, GPtrArray *nodes)
+{
+    g_ptr_array_add (nodes, lm_message_node_ref (node));
+}
+
+static GPtrArray *
+parse_stanzas (void)
+{
+    GPtrArray *nodes;
+    LmParser  *parser;
+    gint       i;
+
+    nodes = g_ptr_array_new ();
+
+    parser = lm_parser_new ((LmParserMessageFunction) collect_message_cb,
+                            nodes, NULL);
+    lm_parser_set_node_function (parser,
+                                 (LmParserNodeFunction) collect_node_cb);
+
+    g_assert (lm_parser_parse (parser, STREAM_HEADER));
+    for (i = 0; stanzas[i]; i++) {
+        g_assert (lm_parser_parse (parser, stanzas[i]));
+    }
+
+    lm_parser_free (parser);
+
+    g_assert_cmpuint (nodes->len, ==, G_N_ELEMENTS (stanzas) - 1);
+
+    return nodes;
+}
+
+static void
+free_nodes (GPtrArray *nodes)
+{
+    g_ptr_array_foreach (nodes, (GFunc) lm_message_node_unref, NULL);
+    g_ptr_array_free (nodes, TRUE);
+}
+
+static void
+decoded_cb (LmExi *exi, LmMessageNode *node, GPtrArray *strings)
+{
+    g_ptr_array_add (strings, lm_message_node_to_string (node));
+}
+
+static void
+free_strings (GPtrArray *strings)
+{
+    g_ptr_array_foreach (strings, (GFunc) g_free, NULL);
+    g_ptr_array_free (strings, TRUE);
+}
+
+static void
+assert_decoded (GPtrArray *nodes, GPtrArray *strings)
+{
+    guint i;
+
+    g_assert_cmpuint (strings->len, ==, nodes->len);
+
+    for (i = 0; i < nodes->len; i++) {
+        gchar *expected;
+
+        expected = lm_message_node_to_string (g_ptr_array_index (nodes, i));
+        g_assert_cmpstr (g_ptr_array_index (strings, i), ==, expected);
+        g_free (expected);
+    }
+}
+
+static void
+round_trip (gboolean session_wide)
+{
+    GPtrArray *nodes;
+    GPtrArray *strings;
+    GString   *out;
+    LmExi     *encoder;
+    LmExi     *decoder;
+    gsize      xml_len = 0;
+    gsize      i;
+
+    nodes = parse_stanzas ();
+    out = g_string_new (NULL);
+
+    /* Twice, the second round has everything in the tables */
+    encoder = _lm_exi_new ("jabber:client", session_wide, NULL, NULL);
+    for (i = 0; i < 2 * nodes->len; i++) {
+        LmMessageNode *node = g_ptr_array_index (nodes, i % nodes->len);
+        gchar         *str;
+
+        _lm_exi_encode (encoder, node, out);
+
+        str = lm_message_node_to_string (node);
+        xml_len += strlen (str);
+        g_free (str);
+    }
+    _lm_exi_free (encoder);
+
+    g_assert_cmpuint (out->len, <, xml_len);
+    g_test_message ("%s buffers: %u bytes of EXI for %u bytes of XML",
+                    session_wide ? "Session wide" : "Separate",
+                    (guint) out->len, (guint) xml_len);
+
+    /* All at once */
+    strings = g_ptr_array_new ();
+    decoder = _lm_exi_new ("jabber:client", session_wide,
+                           (LmExiNodeFunction) decoded_cb, strings);
+    g_assert (_lm_exi_decode (decoder, out->str, out->len));
+    _lm_exi_free (decoder);
+
+    g_assert_cmpuint (strings->len, ==, 2 * nodes->len);
+    g_ptr_array_remove_range (strings, nodes->len, nodes->len);
+    assert_decoded (nodes, strings);
+    free_strings (strings);
+
+    /* A byte at a time, documents are only complete at their last byte */
+    strings = g_ptr_array_new ();
+    decoder = _lm_exi_new ("jabber:client", session_wide,
+                           (LmExiNodeFunction) decoded_cb, strings);
+    for (i = 0; i < out->len; i++) {
+        g_assert (_lm_exi_decode (decoder, out->str + i, 1));
+    }
+    _lm_exi_free (decoder);
+
+    g_assert_cmpuint (strings->len, ==, 2 * nodes->len);
+    g_ptr_array_remove_range (strings, 0, nodes->len);
+    assert_decoded (nodes, strings);
+    free_strings (strings);
+
+    g_string_free (out, TRUE);
+    free_nodes (nodes);
+}
+
+static void
+test_round_trip ()
+{
+    round_trip (TRUE);
+    round_trip (FALSE);
+}
+
+/* Serialized stanzas come out the same as the nodes they are made of */
+static void
+test_encode_xml ()
+{
+    GPtrArray *nodes;
+    GString   *from_nodes;
+    GString   *from_xml;
+    LmExi     *encoder;
+    guint      i;
+
+    nodes = parse_stanzas ();
+
+    from_nodes = g_string_new (NULL);
+    encoder = _lm_exi_new ("jabber:client", TRUE, NULL, NULL);
+    for (i = 0; i < nodes->len; i++) {
+        _lm_exi_encode (encoder, g_ptr_array_index (nodes, i), from_nodes);
+    }
+    _lm_exi_free (encoder);
+
+    /* Split in the middle of elements as well */
+    from_xml = g_string_new (NULL);
+    encoder = _lm_exi_new ("jabber:client", TRUE, NULL, NULL);
+    for (i = 0; stanzas[i]; i++) {
+        gsize half = strlen (stanzas[i]) / 2;
+
+        g_assert (_lm_exi_encode_xml (encoder, stanzas[i], half, from_xml));
+        g_assert (_lm_exi_encode_xml (encoder, stanzas[i] + half, -1,
+                                      from_xml));
+    }
+
+    /* Not well formed, and fine again afterwards */
+    g_assert (!_lm_exi_encode_xml (encoder, "<message></iq>", -1, from_xml));
+    _lm_exi_free (encoder);
+
+    g_assert_cmpuint (from_xml->len, ==, from_nodes->len);
+    g_assert (memcmp (from_xml->str, from_nodes->str, from_nodes->len) == 0);
+
+    g_string_free (from_nodes, TRUE);
+    g_string_free (from_xml, TRUE);
+    free_nodes (nodes);
+}
+
+static void
+test_invalid ()
+{
+    GPtrArray *strings;
+    LmMessage *m;
+    LmMessageNode *node;
+    GString   *out;
+    LmExi     *encoder;
+    LmExi     *decoder;
+    GRand     *rand;
+    gint       i;
+
+    strings = g_ptr_array_new ();
+
+    /* Not EXI at all */
+    decoder = _lm_exi_new ("jabber:client", TRUE,
+                           (LmExiNodeFunction) decoded_cb, strings);
+    g_assert (!_lm_exi_decode (decoder, "<message/>", 10));
+    _lm_exi_free (decoder);
+
+    /* Nested deeper than accepted */
+    m = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+    node = m->node;
+    for (i = 0; i < 300; i++) {
+        node = lm_message_node_add_child (node, "x", NULL);
+    }
+
+    out = g_string_new (NULL);
+    encoder = _lm_exi_new ("jabber:client", TRUE, NULL, NULL);
+    _lm_exi_encode (encoder, m->node, out);
+    _lm_exi_free (encoder);
+    lm_message_unref (m);
+
+    decoder = _lm_exi_new ("jabber:client", TRUE,
+                           (LmExiNodeFunction) decoded_cb, strings);
+    g_assert (!_lm_exi_decode (decoder, out->str, out->len));
+    _lm_exi_free (decoder);
+    g_string_free (out, TRUE);
+
+    /* Garbage behind a valid header must not take anything down */
+    rand = g_rand_new_with_seed (1);
+    for (i = 0; i < 2000; i++) {
+        gchar buf[64];
+        gint  len;
+        gint  j;
+
+        len = g_rand_int_range (rand, 2, sizeof (buf));
+        buf[0] = (gchar) 0x80;
+        for (j = 1; j < len; j++) {
+            buf[j] = (gchar) g_rand_int_range (rand, 0, 256);
+        }
+
+        decoder = _lm_exi_new ("jabber:client", TRUE,
+                               (LmExiNodeFunction) decoded_cb, strings);
+        _lm_exi_decode (decoder, buf, len);
+        _lm_exi_free (decoder);
+    }
+    g_rand_free (rand);
+
+    free_strings (strings);
+}
+
+/* Encodes @docs, which have to come out as @expected, and decodes
+ * @expected back to them */
+static void
+assert_vector (const gchar  **docs,
+               gint           max_length,
+               gint           capacity,
+               const guint8  *expected,
+               gsize          len)
+{
+    GPtrArray *strings;
+    GString   *out;
+    LmExi     *exi;
+    guint      i;
+
+    out = g_string_new (NULL);
+    exi = _lm_exi_new ("", TRUE, NULL, NULL);
+    _lm_exi_set_value_limits (exi, max_length, capacity);
+    for (i = 0; docs[i]; i++) {
+        g_assert (_lm_exi_encode_xml (exi, docs[i], -1, out));
+    }
+    _lm_exi_free (exi);
+
+    g_assert_cmpuint (out->len, ==, len);
+    g_assert (memcmp (out->str, expected, len) == 0);
+    g_string_free (out, TRUE);
+
+    strings = g_ptr_array_new ();
+    exi = _lm_exi_new ("", TRUE, (LmExiNodeFunction) decoded_cb, strings);
+    _lm_exi_set_value_limits (exi, max_length, capacity);
+    g_assert (_lm_exi_decode (exi, (const gchar *) expected, len));
+    _lm_exi_free (exi);
+
+    for (i = 0; docs[i]; i++) {
+        g_assert (i < strings->len);
+        g_assert_cmpstr (g_ptr_array_index (strings, i), ==, docs[i]);
+    }
+    g_assert_cmpuint (strings->len, ==, i);
+    free_strings (strings);
+}
+
+static void
+test_vectors ()
+{
+    const gchar *empty[] = { "<a></a>", NULL };
+    const gchar *value[] = { "<a b=\"c\">d</a>", NULL };
+    const gchar *global[] = { "<a b=\"c\">c</a>", NULL };
+    const gchar *hit[] = { "<a b=\"c\">d</a>", "<a b=\"c\"></a>", NULL };
+    guint8       both[sizeof (vector_value) + sizeof (vector_hit)];
+
+    assert_vector (empty, -1, -1, vector_empty, sizeof (vector_empty));
+    assert_vector (value, -1, -1, vector_value, sizeof (vector_value));
+    assert_vector (global, -1, -1, vector_global, sizeof (vector_global));
+    assert_vector (global, 0, -1, vector_max_length,
+                   sizeof (vector_max_length));
+
+    memcpy (both, vector_value, sizeof (vector_value));
+    memcpy (both + sizeof (vector_value), vector_hit, sizeof (vector_hit));
+    assert_vector (hit, -1, -1, both, sizeof (both));
+
+    memcpy (both + sizeof (vector_value), vector_capacity,
+            sizeof (vector_capacity));
+    assert_vector (hit, -1, 1, both,
+                   sizeof (vector_value) + sizeof (vector_capacity));
+}
+
+/* A small partition wraps around many times, also when documents
+ * arrive a byte at a time and are taken back while incomplete */
+static void
+test_limits ()
+{
+    GPtrArray     *strings;
+    GString       *out;
+    LmMessage     *m;
+    LmExi         *exi;
+    gchar         *xml[100];
+    guint          i;
+
+    out = g_string_new (NULL);
+    exi = _lm_exi_new ("jabber:client", TRUE, NULL, NULL);
+    _lm_exi_set_value_limits (exi, 8, 5);
+    for (i = 0; i < G_N_ELEMENTS (xml); i++) {
+        xml[i] = g_strdup_printf ("<message to='user%u@example.com' "
+                                  "id='%u' type='chat'><body>%s %u</body>"
+                                  "</message>", i % 7, i % 3,
+                                  i % 2 ? "short" : "a longer body", i % 4);
+        g_assert (_lm_exi_encode_xml (exi, xml[i], -1, out));
+    }
+    _lm_exi_free (exi);
+
+    strings = g_ptr_array_new ();
+    exi = _lm_exi_new ("jabber:client", TRUE,
+                       (LmExiNodeFunction) decoded_cb, strings);
+    _lm_exi_set_value_limits (exi, 8, 5);
+    for (i = 0; i < out->len; i++) {
+        g_assert (_lm_exi_decode (exi, out->str + i, 1));
+    }
+    _lm_exi_free (exi);
+
+    g_assert_cmpuint (strings->len, ==, G_N_ELEMENTS (xml));
+    for (i = 0; i < G_N_ELEMENTS (xml); i++) {
+        LmParser  *parser;
+        GPtrArray *nodes;
+        gchar     *expected;
+
+        nodes = g_ptr_array_new ();
+        parser = lm_parser_new ((LmParserMessageFunction) collect_message_cb,
+                                nodes, NULL);
+        g_assert (lm_parser_parse (parser, STREAM_HEADER));
+        g_assert (lm_parser_parse (parser, xml[i]));
+        lm_parser_free (parser);
+
+        expected = lm_message_node_to_string (g_ptr_array_index (nodes, 0));
+        g_assert_cmpstr (g_ptr_array_index (strings, i), ==, expected);
+        g_free (expected);
+        free_nodes (nodes);
+        g_free (xml[i]);
+    }
+    free_strings (strings);
+    g_string_free (out, TRUE);
+
+    /* More names than a peer may teach us */
+    m = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+    for (i = 0; i < 9000; i++) {
+        gchar *name = g_strdup_printf ("x%u", i);
+
+        lm_message_node_add_child (m->node, name, NULL);
+        g_free (name);
+    }
+
+    out = g_string_new (NULL);
+    exi = _lm_exi_new ("jabber:client", TRUE, NULL, NULL);
+    _lm_exi_encode (exi, m->node, out);
+    _lm_exi_free (exi);
+    lm_message_unref (m);
+
+    strings = g_ptr_array_new ();
+    exi = _lm_exi_new ("jabber:client", TRUE,
+                       (LmExiNodeFunction) decoded_cb, strings);
+    g_assert (!_lm_exi_decode (exi, out->str, out->len));
+    _lm_exi_free (exi);
+    g_assert_cmpuint (strings->len, ==, 0);
+    free_strings (strings);
+    g_string_free (out, TRUE);
+}
+
+typedef struct {
+    SimNetwork   *net;
+    LmConnection *connection;
+    guint         received;
+} ExiTest;
+
+static LmHandlerResult
+test_message_cb (LmMessageHandler *handler,
+                 LmConnection     *connection,
+                 LmMessage        *m,
+                 ExiTest          *test)
+{
+    LmMessageNode *body;
+    gchar         *expected;
+
+    body = lm_message_node_get_child (m->node, "body");
+    g_assert (body != NULL);
+
+    expected = g_strdup_printf ("Message %u & more", test->received);
+    g_assert_cmpstr (lm_message_node_get_value (body), ==, expected);
+    g_free (expected);
+
+    test->received++;
+
+    return LM_HANDLER_RESULT_REMOVE_MESSAGE;
+}
+
+static gboolean
+test_all_arrived (ExiTest *test)
+{
+    return test->received == TEST_MESSAGES &&
+        sim_network_get_messages_received (test->net) == TEST_MESSAGES;
+}
+
+/* Logs in, then sends messages both ways. Returns the bytes on the link
+ * for the messages alone. */
+static guint64
+exchange_messages (gboolean use_exi)
+{
+    SimLinkParams     params = { 20, 0, 0.0, 0 };
+    ExiTest           test;
+    LmMessageHandler *handler;
+    guint64           before;
+    guint             i;
+
+    memset (&test, 0, sizeof (ExiTest));
+
+    test.net = sim_network_new (&params, 1);
+    sim_network_set_exi (test.net, TRUE);
+
+    test.connection = sim_network_connection_new (test.net);
+    lm_connection_set_exi (test.connection, use_exi);
+    g_assert (lm_connection_get_exi (test.connection) == use_exi);
+
+    handler = lm_message_handler_new ((LmHandleMessageFunction) test_message_cb,
+                                      &test, NULL);
+    lm_connection_register_message_handler (test.connection, handler,
+                                            LM_MESSAGE_TYPE_MESSAGE,
+                                            LM_HANDLER_PRIORITY_NORMAL);
+    lm_message_handler_unref (handler);
+
+    g_assert (sim_network_login (test.net, test.connection, "exi",
+                                 TEST_TIME_LIMIT));
+
+    /* The resource was bound on the compressed stream */
+    g_assert (sim_network_get_exi_active (test.net) == use_exi);
+    g_assert_cmpstr (lm_connection_get_full_jid (test.connection), ==,
+                     "user@example.com/exi");
+
+    before = sim_network_get_bytes_received (test.net) +
+        sim_network_get_bytes_sent (test.net);
+
+    for (i = 0; i < TEST_MESSAGES; i++) {
+        LmMessage *m;
+        gchar     *str;
+
+        m = lm_message_new_with_sub_type ("romeo@example.net",
+                                          LM_MESSAGE_TYPE_MESSAGE,
+                                          LM_MESSAGE_SUB_TYPE_CHAT);
+        str = g_strdup_printf ("Message %u & more", i);
+        lm_message_node_add_child (m->node, "body", str);
+        g_assert (lm_connection_send (test.connection, m, NULL));
+        lm_message_unref (m);
+
+        /* From the server the text way, through the same tables */
+        g_free (str);
+        str = g_strdup_printf ("<message from='romeo@example.net' "
+                               "to='user@example.com/exi' type='chat'>"
+                               "<body>Message %u &amp; more</body></message>",
+                               i);
+        sim_network_server_push (test.net, str);
+        g_free (str);
+    }
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_all_arrived,
+                                     &test, TEST_TIME_LIMIT));
+
+    before = sim_network_get_bytes_received (test.net) +
+        sim_network_get_bytes_sent (test.net) - before;
+
+    sim_network_finish (test.net, test.connection);
+
+    return before;
+}
+
+static void
+test_connection ()
+{
+    guint64 xml;
+    guint64 exi;
+
+    xml = exchange_messages (FALSE);
+    exi = exchange_messages (TRUE);
+
+    g_assert_cmpuint (exi, <, xml / 2);
+
+    if (g_test_perf ()) {
+        g_test_minimized_result (exi, "EXI: %" G_GUINT64_FORMAT " bytes", exi);
+        g_test_maximized_result (xml, "XML: %" G_GUINT64_FORMAT " bytes", xml);
+    }
+}
+
+static void
+test_disconnect_cb (LmConnection       *connection,
+                    LmDisconnectReason  reason,
+                    gint               *result)
+{
+    *result = reason;
+}
+
+static gboolean
+test_is_disconnected (gint *result)
+{
+    return *result >= 0;
+}
+
+/* Nothing can be decoded after data that doesn't, the connection has to
+ * go instead of waiting for stanzas that never come */
+static void
+test_connection_corrupt ()
+{
+    SimLinkParams  params = { 20, 0, 0.0, 0 };
+    SimNetwork    *net;
+    LmConnection  *connection;
+    gint           reason = -1;
+
+    net = sim_network_new (&params, 1);
+    sim_network_set_exi (net, TRUE);
+
+    connection = sim_network_connection_new (net);
+    lm_connection_set_exi (connection, TRUE);
+    lm_connection_set_disconnect_function (connection,
+                                           (LmDisconnectFunction) test_disconnect_cb,
+                                           &reason, NULL);
+
+    g_assert (sim_network_login (net, connection, "exi", TEST_TIME_LIMIT));
+    g_assert (sim_network_get_exi_active (net));
+
+    sim_network_server_push_raw (net, "<message/>", 10);
+    g_assert (sim_network_run_until (net,
+                                     (SimConditionFunc) test_is_disconnected,
+                                     &reason, 2 * TEST_TIME_LIMIT));
+    g_assert_cmpint (reason, ==, LM_DISCONNECT_REASON_ERROR);
+    g_assert (!lm_connection_is_open (connection));
+
+    sim_network_finish (net, connection);
+}
+
+/* Tables larger than we offered, the stream stays uncompressed */
+static void
+test_capacity ()
+{
+    SimLinkParams  params = { 20, 0, 0.0, 0 };
+    SimNetwork    *net;
+    LmConnection  *connection;
+
+    net = sim_network_new (&params, 1);
+    sim_network_set_exi (net, TRUE);
+    sim_network_set_exi_capacity (net, LM_EXI_VALUE_PARTITION_CAPACITY + 1);
+
+    connection = sim_network_connection_new (net);
+    lm_connection_set_exi (connection, TRUE);
+
+    g_assert (sim_network_login (net, connection, "exi", TEST_TIME_LIMIT));
+    g_assert (!sim_network_get_exi_active (net));
+    g_assert_cmpstr (lm_connection_get_full_jid (connection), ==,
+                     "user@example.com/exi");
+
+    sim_network_finish (net, connection);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/exi/round_trip", test_round_trip);
+    g_test_add_func ("/exi/encode_xml", test_encode_xml);
+    g_test_add_func ("/exi/invalid", test_invalid);
+    g_test_add_func ("/exi/vectors", test_vectors);
+    g_test_add_func ("/exi/limits", test_limits);
+    g_test_add_func ("/exi/connection", test_connection);
+    g_test_add_func ("/exi/connection/corrupt", test_connection_corrupt);
+    g_test_add_func ("/exi/capacity", test_capacity);
+
+    return g_test_run ();
+}
@@ -0,0 +1,245 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Handlers registered and unregistered from several threads while others
+ * dispatch messages through the same table.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include "loudmouth/lm-handler-table.h"
+
+#define N_WRITERS     4
+#define N_DISPATCHERS 2
+#define N_ROUNDS      500
+/* How long a registered handler may go without being called, in ms */
+#define CALL_TIMEOUT  10000
+
+typedef struct _TableTest TableTest;
+
+typedef struct {
+    TableTest     *test;
+    LmMessage     *message;
+    /* The dispatch currently running, counting from 1 */
+    volatile gint  seq;
+} Dispatcher;
+
+struct _TableTest {
+    LmHandlerTable *table;
+    Dispatcher      dispatchers[N_DISPATCHERS];
+    volatile gint   stop;
+    volatile gint   failed;
+    /* Called by every dispatch, never removed */
+    volatile gint   always_calls;
+};
+
+typedef struct {
+    TableTest     *test;
+    volatile gint  called;
+    volatile gint  removed;
+    /* Dispatch of each dispatcher running when the removal was done, later
+     * ones must not see the handler */
+    gint           removed_at[N_DISPATCHERS];
+} HandlerState;
+
+static Dispatcher *
+test_get_dispatcher (TableTest *test, LmMessage *m)
+{
+    guint i;
+
+    for (i = 0; i < N_DISPATCHERS; i++) {
+        if (test->dispatchers[i].message == m) {
+            return &test->dispatchers[i];
+        }
+    }
+
+    g_assert_not_reached ();
+    return NULL;
+}
+
+static LmHandlerResult
+always_cb (LmMessageHandler *handler,
+           LmConnection     *connection,
+           LmMessage        *m,
+           TableTest        *test)
+{
+    g_atomic_int_inc (&test->always_calls);
+
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+static LmHandlerResult
+state_cb (LmMessageHandler *handler,
+          LmConnection     *connection,
+          LmMessage        *m,
+          HandlerState     *state)
+{
+    Dispatcher *dispatcher;
+    guint       i;
+
+    dispatcher = test_get_dispatcher (state->test, m);
+    i = dispatcher - state->test->dispatchers;
+
+    if (g_atomic_int_get (&state->removed) &&
+        g_atomic_int_get (&dispatcher->seq) > state->removed_at[i]) {
+        g_atomic_int_set (&state->test->failed, TRUE);
+    }
+
+    g_atomic_int_set (&state->called, TRUE);
+
+    return LM_HANDLER_RESULT_ALLOW_MORE_HANDLERS;
+}
+
+static gpointer
+dispatcher_thread (Dispatcher *dispatcher)
+{
+    TableTest *test = dispatcher->test;
+
+    while (!g_atomic_int_get (&test->stop)) {
+        g_atomic_int_inc (&dispatcher->seq);
+        lm_handler_table_handle_message (test->table, NULL,
+                                         dispatcher->message);
+    }
+
+    return NULL;
+}
+
+static gpointer
+writer_thread (TableTest *test)
+{
+    guint round;
+
+    for (round = 0; round < N_ROUNDS && !g_atomic_int_get (&test->failed);
+         round++) {
+        LmMessageHandler *handler;
+        HandlerState     *state;
+        GTimer           *timer;
+        guint             i;
+
+        state = g_new0 (HandlerState, 1);
+        state->test = test;
+
+        handler = lm_message_handler_new ((LmHandleMessageFunction) state_cb,
+                                          state, g_free);
+        lm_handler_table_add (test->table, LM_MESSAGE_TYPE_MESSAGE, handler,
+                              g_random_int_range (LM_HANDLER_PRIORITY_LAST,
+                                                  LM_HANDLER_PRIORITY_FIRST + 1));
+
+        /* Lost if a concurrent change dropped it */
+        timer = g_timer_new ();
+        while (!g_atomic_int_get (&state->called)) {
+            if (g_timer_elapsed (timer, NULL) * 1000 > CALL_TIMEOUT) {
+                g_atomic_int_set (&test->failed, TRUE);
+                break;
+            }
+            g_thread_yield ();
+        }
+        g_timer_destroy (timer);
+
+        lm_handler_table_remove (test->table, LM_MESSAGE_TYPE_MESSAGE,
+                                 handler);
+
+        for (i = 0; i < N_DISPATCHERS; i++) {
+            state->removed_at[i] = g_atomic_int_get (&test->dispatchers[i].seq);
+        }
+        g_atomic_int_set (&state->removed, TRUE);
+
+        /* The table may still hold a reference until it is reclaimed */
+        lm_message_handler_unref (handler);
+    }
+
+    return NULL;
+}
+
+static GThread *
+test_start_thread (GThreadFunc func, gpointer data)
+{
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    return g_thread_new ("handler-table", func, data);
+#else
+    return g_thread_create (func, data, TRUE, NULL);
+#endif
+}
+
+static void
+test_threads ()
+{
+    TableTest         test;
+    LmMessageHandler *always;
+    GThread          *dispatchers[N_DISPATCHERS];
+    GThread          *writers[N_WRITERS];
+    gint              dispatched = 0;
+    guint             i;
+
+    memset (&test, 0, sizeof (test));
+    test.table = lm_handler_table_new ();
+
+    always = lm_message_handler_new ((LmHandleMessageFunction) always_cb,
+                                     &test, NULL);
+    lm_handler_table_add (test.table, LM_MESSAGE_TYPE_MESSAGE, always,
+                          LM_HANDLER_PRIORITY_NORMAL);
+
+    for (i = 0; i < N_DISPATCHERS; i++) {
+        test.dispatchers[i].test = &test;
+        test.dispatchers[i].message = lm_message_new (NULL,
+                                                      LM_MESSAGE_TYPE_MESSAGE);
+        dispatchers[i] = test_start_thread ((GThreadFunc) dispatcher_thread,
+                                            &test.dispatchers[i]);
+    }
+
+    for (i = 0; i < N_WRITERS; i++) {
+        writers[i] = test_start_thread ((GThreadFunc) writer_thread, &test);
+    }
+
+    for (i = 0; i < N_WRITERS; i++) {
+        g_thread_join (writers[i]);
+    }
+
+    g_atomic_int_set (&test.stop, TRUE);
+    for (i = 0; i < N_DISPATCHERS; i++) {
+        g_thread_join (dispatchers[i]);
+        dispatched += test.dispatchers[i].seq;
+        lm_message_unref (test.dispatchers[i].message);
+    }
+
+    g_assert (!test.failed);
+    /* Never dropped by the changes around it */
+    g_assert_cmpint (test.always_calls, ==, dispatched);
+
+    lm_handler_table_free (test.table);
+    lm_message_handler_unref (always);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/handler_table/threads", test_threads);
+
+    return g_test_run ();
+}
@@ -0,0 +1,362 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Uploads with LmHttpUpload. The simulated server hands out slots on the
+ * HTTP stand-in, which checks what is put there.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "http-stand-in.h"
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT   (10 * 60 * 1000)
+#define UPLOAD_SERVICE    "upload.example.com"
+#define UPLOAD_FILES      5
+
+#define SLOT_RESULT                                                     \
+    "<iq type='result' id='%s' from='" UPLOAD_SERVICE "'>"              \
+    "<slot xmlns='urn:xmpp:http:upload:0'>"                             \
+    "<put url='http://127.0.0.1:%u/upload/%s'>"                         \
+    "<header name='Authorization'>Bearer secret</header>"               \
+    "<header name='Host'>evil.example.com</header>"                     \
+    "</put><get url='https://download.example.com/%s'/></slot></iq>"
+
+#define SLOT_REFUSED                                                    \
+    "<iq type='error' id='%s' from='" UPLOAD_SERVICE "'>"               \
+    "<error type='modify'><not-acceptable "                             \
+    "xmlns='urn:ietf:params:xml:ns:xmpp-stanzas'/></error></iq>"
+
+typedef struct {
+    SimNetwork    *net;
+    HttpStandIn   *http;
+    LmConnection  *connection;
+    gboolean       refuse_slots;
+    guint          finished;
+} UploadTest;
+
+typedef struct {
+    UploadTest    *test;
+    gchar         *filename;
+    gint           fd;
+    guint64        size;
+    guint64        progress;
+    gboolean       done;
+    gchar         *url;
+} UploadResult;
+
+static gboolean
+slot_iq_cb (SimNetwork *net, LmMessage *m, UploadTest *test)
+{
+    LmMessageNode *request;
+    const gchar   *filename;
+    gchar         *str;
+
+    request = lm_message_node_get_child (m->node, "request");
+    if (!request) {
+        return FALSE;
+    }
+
+    g_assert_cmpstr (lm_message_node_get_attribute (m->node, "to"), ==,
+                     UPLOAD_SERVICE);
+    g_assert_cmpstr (lm_message_node_get_attribute (request, "xmlns"), ==,
+                     "urn:xmpp:http:upload:0");
+    g_assert (lm_message_node_get_attribute (request, "size") != NULL);
+
+    filename = lm_message_node_get_attribute (request, "filename");
+
+    if (test->refuse_slots) {
+        str = g_strdup_printf (SLOT_REFUSED,
+                               lm_message_node_get_attribute (m->node, "id"));
+    } else {
+        str = g_strdup_printf (SLOT_RESULT,
+                               lm_message_node_get_attribute (m->node, "id"),
+                               http_stand_in_get_port (test->http),
+                               filename, filename);
+    }
+
+    sim_network_server_push (net, str);
+    g_free (str);
+
+    return TRUE;
+}
+
+static void
+upload_progress_cb (LmHttpUpload *upload,
+                    guint64       sent,
+                    guint64       total,
+                    UploadResult *result)
+{
+    g_assert_cmpuint (sent, >, result->progress);
+    g_assert_cmpuint (total, ==, result->size);
+
+    result->progress = sent;
+}
+
+static void
+upload_done_cb (LmHttpUpload *upload, const gchar *url, UploadResult *result)
+{
+    g_assert (!result->done);
+
+    result->done = TRUE;
+    result->url = g_strdup (url);
+    result->test->finished++;
+}
+
+static gint
+make_file (guint64 size)
+{
+    guint8  buf[65536];
+    guint64 written = 0;
+    gchar  *path;
+    gint    fd;
+
+    fd = g_file_open_tmp ("lm-upload-XXXXXX", &path, NULL);
+    g_assert (fd >= 0);
+    unlink (path);
+    g_free (path);
+
+    while (written < size) {
+        gsize len = MIN (sizeof (buf), size - written);
+        gsize i;
+
+        for (i = 0; i < len; i++) {
+            buf[i] = (written + i) % 251;
+        }
+
+        g_assert (write (fd, buf, len) == (gssize) len);
+        written += len;
+    }
+
+    return fd;
+}
+
+static void
+test_setup (UploadTest *test)
+{
+    SimLinkParams params = { 20, 0, 0.0, 0 };
+
+    memset (test, 0, sizeof (UploadTest));
+
+    test->http = http_stand_in_new ();
+    test->net = sim_network_new (&params, 1);
+    sim_network_set_iq_func (test->net, (SimIqFunc) slot_iq_cb, test);
+
+    test->connection = sim_network_connection_new (test->net);
+    g_assert (sim_network_login (test->net, test->connection, "upload",
+                                 TEST_TIME_LIMIT));
+}
+
+static void
+test_teardown (UploadTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+    http_stand_in_free (test->http);
+}
+
+/* The stand-in answers from a thread of its own, so there may be
+ * nothing for the simulated network to do while waiting for it. The
+ * clock then jumps to the limit, which has to stay ahead of it. */
+static void
+test_run_until (UploadTest *test, SimConditionFunc func, gpointer user_data)
+{
+    GTimer *timer = g_timer_new ();
+
+    while (!sim_network_run_until (test->net, func, user_data,
+                                   sim_network_get_time (test->net) +
+                                   TEST_TIME_LIMIT)) {
+        g_assert (g_timer_elapsed (timer, NULL) < 60);
+
+        g_main_context_iteration (NULL, FALSE);
+        g_usleep (1000);
+    }
+
+    g_timer_destroy (timer);
+}
+
+static gboolean
+two_are_complete (UploadTest *test)
+{
+    return http_stand_in_get_complete (test->http) >= 2;
+}
+
+static gboolean
+all_are_finished (UploadTest *test)
+{
+    return test->finished == UPLOAD_FILES;
+}
+
+static void
+send_files (UploadTest *test, LmHttpUpload *upload, UploadResult *results)
+{
+    gint i;
+
+    for (i = 0; i < UPLOAD_FILES; i++) {
+        results[i].test = test;
+        results[i].filename = g_strdup_printf ("file-%d.bin", i);
+        results[i].size = 1024 * 1024 + i * 1000;
+        results[i].fd = make_file (results[i].size);
+
+        g_assert (lm_http_upload_send_file (upload, results[i].fd,
+                                            results[i].filename,
+                                            results[i].size, NULL,
+                                            (LmHttpUploadProgressFunction) upload_progress_cb,
+                                            (LmHttpUploadFunction) upload_done_cb,
+                                            &results[i], NULL, NULL));
+    }
+}
+
+static void
+free_results (UploadResult *results)
+{
+    gint i;
+
+    for (i = 0; i < UPLOAD_FILES; i++) {
+        close (results[i].fd);
+        g_free (results[i].filename);
+        g_free (results[i].url);
+    }
+}
+
+static void
+test_send ()
+{
+    UploadTest    test;
+    UploadResult  results[UPLOAD_FILES];
+    LmHttpUpload *upload;
+    guint64       total = 0;
+    gchar        *request;
+    gint          i;
+
+    test_setup (&test);
+    memset (results, 0, sizeof (results));
+
+    upload = lm_http_upload_new (test.connection, UPLOAD_SERVICE);
+    lm_http_upload_set_max_uploads (upload, 2);
+    http_stand_in_set_hold (test.http, TRUE);
+
+    send_files (&test, upload, results);
+    /* The uploads keep it alive */
+    lm_http_upload_unref (upload);
+
+    /* Only two may run until one of them has its answer */
+    test_run_until (&test, (SimConditionFunc) two_are_complete, &test);
+    g_assert_cmpuint (http_stand_in_get_connections (test.http), ==, 2);
+    g_assert_cmpuint (http_stand_in_get_max_open (test.http), ==, 2);
+
+    http_stand_in_set_hold (test.http, FALSE);
+    test_run_until (&test, (SimConditionFunc) all_are_finished, &test);
+
+    g_assert_cmpuint (http_stand_in_get_complete (test.http), ==, UPLOAD_FILES);
+    g_assert_cmpuint (http_stand_in_get_corrupt (test.http), ==, 0);
+    g_assert_cmpuint (http_stand_in_get_max_open (test.http), ==, 2);
+
+    for (i = 0; i < UPLOAD_FILES; i++) {
+        gchar *url;
+
+        url = g_strdup_printf ("https://download.example.com/%s",
+                               results[i].filename);
+        g_assert_cmpstr (results[i].url, ==, url);
+        g_assert_cmpuint (results[i].progress, ==, results[i].size);
+        g_free (url);
+
+        total += results[i].size;
+    }
+
+    g_assert_cmpuint (http_stand_in_get_bytes (test.http), ==, total);
+
+    /* Only the headers allowed in a slot are passed on */
+    request = http_stand_in_get_last_request (test.http);
+    g_assert (g_str_has_prefix (request, "PUT /upload/file-"));
+    g_assert (strstr (request, "\r\nAuthorization: Bearer secret\r\n"));
+    g_assert (strstr (request, "\r\nHost: 127.0.0.1:"));
+    g_assert (!strstr (request, "evil.example.com"));
+    g_free (request);
+
+    free_results (results);
+    test_teardown (&test);
+}
+
+static void
+test_refused ()
+{
+    UploadTest    test;
+    UploadResult  results[UPLOAD_FILES];
+    LmHttpUpload *upload;
+    gint          i;
+
+    test_setup (&test);
+    memset (results, 0, sizeof (results));
+
+    upload = lm_http_upload_new (test.connection, UPLOAD_SERVICE);
+
+    /* Refused by the HTTP server */
+    http_stand_in_set_status (test.http, 403);
+    send_files (&test, upload, results);
+    test_run_until (&test, (SimConditionFunc) all_are_finished, &test);
+
+    for (i = 0; i < UPLOAD_FILES; i++) {
+        g_assert (results[i].done);
+        g_assert (results[i].url == NULL);
+    }
+
+    free_results (results);
+    memset (results, 0, sizeof (results));
+    test.finished = 0;
+
+    /* Refused by the upload service */
+    test.refuse_slots = TRUE;
+    send_files (&test, upload, results);
+    test_run_until (&test, (SimConditionFunc) all_are_finished, &test);
+
+    for (i = 0; i < UPLOAD_FILES; i++) {
+        g_assert (results[i].done);
+        g_assert (results[i].url == NULL);
+        g_assert_cmpuint (results[i].progress, ==, 0);
+    }
+
+    g_assert_cmpuint (http_stand_in_get_connections (test.http), ==,
+                      UPLOAD_FILES);
+
+    lm_http_upload_unref (upload);
+    free_results (results);
+    test_teardown (&test);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/http_upload/send", test_send);
+    g_test_add_func ("/http_upload/refused", test_refused);
+
+    return g_test_run ();
+}
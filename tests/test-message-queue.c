@@ -0,0 +1,160 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+#include <stdlib.h>
+#include <glib.h>
+
+#include "loudmouth/lm-message-queue.h"
+
+#define N_MESSAGES 40
+
+static void
+fill_messages (LmMessage **messages, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; ++i) {
+        messages[i] = lm_message_new (NULL, LM_MESSAGE_TYPE_MESSAGE);
+    }
+}
+
+static void
+unref_messages (LmMessage **messages, guint n)
+{
+    guint i;
+
+    for (i = 0; i < n; ++i) {
+        lm_message_unref (messages[i]);
+    }
+}
+
+static void
+test_push_and_peek ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *messages[N_MESSAGES];
+    guint           i;
+
+    fill_messages (messages, N_MESSAGES);
+    queue = lm_message_queue_new (NULL, NULL);
+
+    g_assert (lm_message_queue_is_empty (queue));
+    g_assert (lm_message_queue_peek_nth (queue, 0) == NULL);
+
+    for (i = 0; i < N_MESSAGES; ++i) {
+        lm_message_queue_push_tail (queue, lm_message_ref (messages[i]));
+    }
+
+    g_assert (lm_message_queue_get_length (queue) == N_MESSAGES);
+    for (i = 0; i < N_MESSAGES; ++i) {
+        g_assert (lm_message_queue_peek_nth (queue, i) == messages[i]);
+    }
+    g_assert (lm_message_queue_peek_nth (queue, N_MESSAGES) == NULL);
+
+    /* Remaining messages are released with the queue */
+    lm_message_queue_unref (queue);
+    unref_messages (messages, N_MESSAGES);
+}
+
+static void
+test_wrap_around ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *messages[N_MESSAGES];
+    guint           i;
+
+    fill_messages (messages, N_MESSAGES);
+    queue = lm_message_queue_new (NULL, NULL);
+
+    /* Keep a few messages queued while the rest cycle through so the
+     * buffer wraps around, then grow it while it is wrapped. */
+    for (i = 0; i < N_MESSAGES; ++i) {
+        lm_message_queue_push_tail (queue, messages[i]);
+        if (i >= 3 && i < 25) {
+            g_assert (lm_message_queue_pop_nth (queue, 0) == messages[i - 3]);
+        }
+    }
+
+    g_assert (lm_message_queue_get_length (queue) == N_MESSAGES - 22);
+    for (i = 0; i < N_MESSAGES - 22; ++i) {
+        g_assert (lm_message_queue_peek_nth (queue, i) == messages[i + 22]);
+    }
+
+    while (!lm_message_queue_is_empty (queue)) {
+        lm_message_queue_pop_nth (queue, 0);
+    }
+
+    lm_message_queue_unref (queue);
+    unref_messages (messages, N_MESSAGES);
+}
+
+static void
+test_pop_nth ()
+{
+    LmMessageQueue *queue;
+    LmMessage      *messages[N_MESSAGES];
+    GSList         *expected = NULL;
+    GSList         *l;
+    guint           i;
+
+    fill_messages (messages, N_MESSAGES);
+    queue = lm_message_queue_new (NULL, NULL);
+
+    for (i = 0; i < N_MESSAGES; ++i) {
+        lm_message_queue_push_tail (queue, messages[i]);
+        expected = g_slist_append (expected, messages[i]);
+    }
+
+    /* Remove from the front half, the back half and both ends */
+    g_assert (lm_message_queue_pop_nth (queue, 5) == messages[5]);
+    expected = g_slist_remove (expected, messages[5]);
+    g_assert (lm_message_queue_pop_nth (queue, 30) == messages[31]);
+    expected = g_slist_remove (expected, messages[31]);
+    g_assert (lm_message_queue_pop_nth (queue, 0) == messages[0]);
+    expected = g_slist_remove (expected, messages[0]);
+    g_assert (lm_message_queue_pop_nth (queue, N_MESSAGES - 4) == messages[N_MESSAGES - 1]);
+    expected = g_slist_remove (expected, messages[N_MESSAGES - 1]);
+    g_assert (lm_message_queue_pop_nth (queue, N_MESSAGES) == NULL);
+
+    g_assert (lm_message_queue_get_length (queue) == g_slist_length (expected));
+    for (i = 0, l = expected; l; l = l->next, ++i) {
+        g_assert (lm_message_queue_peek_nth (queue, i) == l->data);
+    }
+
+    while (!lm_message_queue_is_empty (queue)) {
+        lm_message_queue_pop_nth (queue, 0);
+    }
+
+    g_slist_free (expected);
+    lm_message_queue_unref (queue);
+    unref_messages (messages, N_MESSAGES);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/message_queue/push_and_peek", test_push_and_peek);
+    g_test_add_func ("/message_queue/wrap_around", test_wrap_around);
+    g_test_add_func ("/message_queue/pop_nth", test_pop_nth);
+
+    return g_test_run ();
+}
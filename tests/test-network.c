@@ -0,0 +1,345 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Login, keep-alive and throughput behaviour on a simulated network, see
+ * sim-network.h. All times are in virtual milliseconds so the expected
+ * values are exact.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-misc.h"
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT (10 * 60 * 1000)
+
+typedef struct {
+    SimNetwork         *net;
+    LmConnection       *connection;
+
+    guint64             authenticated_at;
+
+    gboolean            disconnected;
+    guint64             disconnected_at;
+    LmDisconnectReason  reason;
+} TestClient;
+
+static void
+client_disconnect_cb (LmConnection       *connection,
+                      LmDisconnectReason  reason,
+                      TestClient         *client)
+{
+    client->disconnected = TRUE;
+    client->disconnected_at = sim_network_get_time (client->net);
+    client->reason = reason;
+}
+
+static gboolean
+client_is_disconnected (TestClient *client)
+{
+    return client->disconnected;
+}
+
+static void
+client_setup (TestClient          *client,
+              const SimLinkParams *params,
+              guint32              seed,
+              guint                keep_alive_rate)
+{
+    memset (client, 0, sizeof (TestClient));
+
+    client->net = sim_network_new (params, seed);
+    client->connection = sim_network_connection_new (client->net);
+    lm_connection_set_keep_alive_rate (client->connection, keep_alive_rate);
+    lm_connection_set_disconnect_function (client->connection,
+                                           (LmDisconnectFunction) client_disconnect_cb,
+                                           client, NULL);
+}
+
+static void
+client_open (TestClient *client, guint64 limit)
+{
+    client->disconnected = FALSE;
+
+    g_assert (sim_network_login (client->net, client->connection, "sim",
+                                 limit));
+    client->authenticated_at = sim_network_get_time (client->net);
+}
+
+static void
+client_login (TestClient          *client,
+              const SimLinkParams *params,
+              guint32              seed,
+              guint                keep_alive_rate)
+{
+    client_setup (client, params, seed, keep_alive_rate);
+    client_open (client, TEST_TIME_LIMIT);
+}
+
+static void
+client_finish (TestClient *client)
+{
+    sim_network_finish (client->net, client->connection);
+}
+
+static void
+test_login_latency ()
+{
+    SimLinkParams params = { 100, 0, 0.0, 0 };
+    TestClient    client;
+
+    client_login (&client, &params, 1, 0);
+
+    /* Stream headers, auth request and auth are three round trips */
+    g_assert_cmpuint (client.authenticated_at, ==, 6 * 100);
+    g_test_message ("Login with 100 ms latency took %" G_GUINT64_FORMAT " ms",
+                    client.authenticated_at);
+
+    client_finish (&client);
+}
+
+static void
+test_login_stall ()
+{
+    SimLinkParams params = { 100, 0, 0.0, 0 };
+    TestClient    client;
+
+    /* Stall right when the client sends its stream header. The stall
+     * has to be added before connecting. */
+    client_setup (&client, &params, 1, 0);
+    sim_network_add_stall (client.net, 0, 5000);
+    client_open (&client, TEST_TIME_LIMIT);
+
+    g_assert_cmpuint (client.authenticated_at, ==, 5000 + 6 * 100);
+
+    client_finish (&client);
+}
+
+static void
+test_ping_time_out ()
+{
+    SimLinkParams params = { 50, 0, 0.0, 0 };
+    TestClient    client;
+
+    client_login (&client, &params, 1, 10);
+
+    /* Pings that are answered keep the connection up */
+    g_assert (!sim_network_run_until (client.net,
+                                      (SimConditionFunc) client_is_disconnected,
+                                      &client, 120 * 1000));
+
+    /* Each ping crosses the link twice */
+    g_assert_cmpuint (lm_connection_get_rtt (client.connection), ==, 2 * 50);
+    g_assert_cmpuint (lm_connection_get_rtt_jitter (client.connection), ==, 0);
+    g_assert_cmpfloat (lm_connection_get_health (client.connection), >, 0.99);
+
+    sim_network_set_answer_pings (client.net, FALSE);
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_is_disconnected,
+                                     &client, TEST_TIME_LIMIT));
+
+    g_assert_cmpint (client.reason, ==, LM_DISCONNECT_REASON_PING_TIME_OUT);
+    g_test_message ("Ping time out detected after %" G_GUINT64_FORMAT " ms",
+                    client.disconnected_at - 120 * 1000);
+
+    /* Pings go out after 10 s without traffic, the first unanswered one
+     * within 10 s and a reply after pings stopped being answered. The
+     * round trip is steady, so it is retried after the smallest
+     * retransmission timeout of 1 s, then after 2 and 4 s, and the
+     * connection times out when the third one goes unanswered. That is
+     * well before the four keep alive intervals it used to take. */
+    g_assert_cmpuint (client.disconnected_at, >,
+                      120 * 1000 + 1000 + 2000 + 4000);
+    g_assert_cmpuint (client.disconnected_at, <=,
+                      120 * 1000 + 10000 + 2 * 50 + 1000 + 2000 + 4000);
+    g_assert_cmpuint (client.disconnected_at - 120 * 1000, <, 4 * 10000);
+
+    client_finish (&client);
+}
+
+static gboolean
+push_presence_cb (TestClient *client)
+{
+    sim_network_server_push (client->net,
+                             "<presence from='juliet@example.com/balcony'/>");
+
+    return TRUE;
+}
+
+/* A server too busy to answer pings is still there as long as it sends
+ * something */
+static void
+test_ping_other_traffic ()
+{
+    SimLinkParams  params = { 50, 0, 0.0, 0 };
+    TestClient     client;
+    GSource       *source;
+
+    client_login (&client, &params, 1, 10);
+    sim_network_set_answer_pings (client.net, FALSE);
+
+    source = lm_misc_add_timeout (NULL, 15 * 1000,
+                                  (GSourceFunc) push_presence_cb, &client);
+
+    g_assert (!sim_network_run_until (client.net,
+                                      (SimConditionFunc) client_is_disconnected,
+                                      &client, 10 * 60 * 1000));
+
+    /* Once it goes quiet the pings decide */
+    g_source_destroy (source);
+
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) client_is_disconnected,
+                                     &client, 20 * 60 * 1000));
+    g_assert_cmpint (client.reason, ==, LM_DISCONNECT_REASON_PING_TIME_OUT);
+
+    client_finish (&client);
+}
+
+static void
+test_keep_alive_adaptive ()
+{
+    SimLinkParams params = { 50, 0, 0.0, 0 };
+    TestClient    client;
+    guint         reconnects = 0;
+
+    client_login (&client, &params, 1, 10);
+    lm_connection_set_keep_alive_adaptive (client.connection, TRUE);
+
+    /* A NAT that forgets connections idle for more than 95 s */
+    sim_network_set_idle_timeout (client.net, 95 * 1000);
+
+    while (sim_network_run_until (client.net,
+                                  (SimConditionFunc) client_is_disconnected,
+                                  &client,
+                                  sim_network_get_time (client.net) + 60 * 60 * 1000)) {
+        g_assert_cmpint (client.reason, ==, LM_DISCONNECT_REASON_PING_TIME_OUT);
+        g_assert_cmpuint (++reconnects, <, 10);
+
+        client_open (&client,
+                     sim_network_get_time (client.net) + TEST_TIME_LIMIT);
+    }
+
+    /* Doubling from 10 s loses the path at 160 s, then 120 and 100 s are
+     * tried on the way to 90 s, which is close enough to stay at */
+    g_assert_cmpuint (reconnects, ==, 3);
+    g_assert_cmpuint (lm_connection_get_keep_alive_interval (client.connection),
+                      ==, 90);
+    g_test_message ("Settled on pinging every %u s after %u reconnects",
+                    lm_connection_get_keep_alive_interval (client.connection),
+                    reconnects);
+
+    client_finish (&client);
+}
+
+typedef struct {
+    SimNetwork *net;
+    guint       expected;
+} ThroughputData;
+
+static gboolean
+all_messages_received (ThroughputData *data)
+{
+    return sim_network_get_messages_received (data->net) >= data->expected;
+}
+
+static guint64
+run_throughput (guint32 seed, gsize *bytes)
+{
+    SimLinkParams   params = { 20, 10000, 0.05, 200 };
+    TestClient      client;
+    ThroughputData  data;
+    guint64         start;
+    gchar          *body;
+    guint           i;
+
+    client_login (&client, &params, seed, 0);
+
+    body = g_strnfill (100, 'x');
+    start = sim_network_get_time (client.net);
+    *bytes = 0;
+
+    for (i = 0; i < 200; ++i) {
+        LmMessage *m;
+        gchar     *str;
+
+        m = lm_message_new ("peer@example.com", LM_MESSAGE_TYPE_MESSAGE);
+        lm_message_node_add_child (m->node, "body", body);
+
+        str = lm_message_node_to_string (m->node);
+        *bytes += strlen (str);
+        g_free (str);
+
+        g_assert (lm_connection_send (client.connection, m, NULL));
+        lm_message_unref (m);
+    }
+    g_free (body);
+
+    data.net = client.net;
+    data.expected = 200;
+    g_assert (sim_network_run_until (client.net,
+                                     (SimConditionFunc) all_messages_received,
+                                     &data, TEST_TIME_LIMIT));
+
+    start = sim_network_get_time (client.net) - start;
+
+    client_finish (&client);
+
+    return start;
+}
+
+static void
+test_throughput ()
+{
+    guint64 elapsed;
+    guint64 again;
+    gsize   bytes;
+
+    elapsed = run_throughput (42, &bytes);
+
+    /* Can't beat the link and the result only depends on the seed */
+    g_assert_cmpuint (elapsed, >=, bytes * 1000 / 10000 + 20);
+    again = run_throughput (42, &bytes);
+    g_assert_cmpuint (elapsed, ==, again);
+
+    g_test_message ("Sent %" G_GSIZE_FORMAT " bytes in %" G_GUINT64_FORMAT
+                    " ms, %.1f kB/s with 5%% segment loss",
+                    bytes, elapsed, (gdouble) bytes / elapsed);
+}
+
+int 
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/network/login_latency", test_login_latency);
+    g_test_add_func ("/network/login_stall", test_login_stall);
+    g_test_add_func ("/network/ping_time_out", test_ping_time_out);
+    g_test_add_func ("/network/ping_other_traffic", test_ping_other_traffic);
+    g_test_add_func ("/network/keep_alive_adaptive", test_keep_alive_adaptive);
+    g_test_add_func ("/network/throughput", test_throughput);
+
+    return g_test_run ();
+}
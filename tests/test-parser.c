@@ -111,6 +111,179 @@ test_invalid_suite ()
     g_slist_free (list);
 }
 
+/* Collects "id namespace" of each stanza */
+static void
+bulk_message_cb (LmMessage *message, GSList **ids)
+{
+    *ids = g_slist_append (*ids,
+                           g_strdup_printf ("%s %s",
+                                            lm_message_node_get_attribute (message->node,
+                                                                           "id"),
+                                            g_quark_to_string (lm_message_node_get_ns_id (message->node))));
+}
+
+static void
+test_parse_file ()
+{
+    /* Each with the default namespace of its own stream */
+    const gchar *expected[] = {
+        "m1 jabber:client", "p1 jabber:client", "i1 jabber:client",
+        "m2 jabber:server"
+    };
+    GSList      *ids = NULL;
+    GSList      *l;
+    GError      *error = NULL;
+    guint        i;
+
+    g_assert (lm_parser_parse_file (PARSER_TEST_DIR "/bulk-1.xml", 2,
+                                    (LmParserBulkFunction) bulk_message_cb,
+                                    &ids, &error));
+    g_assert (error == NULL);
+
+    g_assert (g_slist_length (ids) == G_N_ELEMENTS (expected));
+    for (i = 0, l = ids; l; l = l->next, ++i) {
+        g_assert (g_strcmp0 (expected[i], l->data) == 0);
+        g_free (l->data);
+    }
+    g_slist_free (ids);
+
+    g_assert (!lm_parser_parse_file (PARSER_TEST_DIR "/no-such-file.xml", 2,
+                                     (LmParserBulkFunction) bulk_message_cb,
+                                     &ids, &error));
+    g_assert (error != NULL);
+    g_clear_error (&error);
+}
+
+static void
+collect_message_cb (LmParser *parser, LmMessage *message, GSList **messages)
+{
+    *messages = g_slist_append (*messages, lm_message_ref (message));
+}
+
+static void
+test_namespaces ()
+{
+    LmParser      *parser;
+    GSList        *messages = NULL;
+    LmMessage     *m;
+    LmMessageNode *node;
+    GQuark         client_ns = g_quark_from_static_string ("jabber:client");
+    GQuark         x_ns;
+    gchar         *x_uri = NULL;
+    gchar         *str;
+
+    /* A namespace nothing in this process has interned */
+    while (!x_uri) {
+        x_uri = g_strdup_printf ("urn:example:x:%08x", g_random_int ());
+        if (g_quark_try_string (x_uri) != 0) {
+            g_free (x_uri);
+            x_uri = NULL;
+        }
+    }
+
+    parser = lm_parser_new ((LmParserMessageFunction) collect_message_cb,
+                            &messages, NULL);
+
+    g_assert (lm_parser_parse (parser,
+                               "<stream:stream xmlns='jabber:client' "
+                               "xmlns:stream='http://etherx.jabber.org/streams'>"
+                               "<stream:features>"
+                               "<mechanisms xmlns='urn:ietf:params:xml:ns:xmpp-sasl'>"
+                               "<mechanism>PLAIN</mechanism>"
+                               "</mechanisms>"
+                               "</stream:features>"
+                               "<s:features xmlns:s='http://etherx.jabber.org/streams'/>"));
+
+    str = g_strdup_printf ("<message id='m1'>"
+                           "<x xmlns='%s'><y/></x>"
+                           "<body>Hi</body>"
+                           "<xml:foo/>"
+                           "</message>", x_uri);
+    g_assert (lm_parser_parse (parser, str));
+    g_free (str);
+
+    g_assert_cmpuint (g_slist_length (messages), ==, 4);
+
+    /* Declarations on the stream header hold for every stanza */
+    m = g_slist_nth_data (messages, 1);
+    g_assert_cmpint (lm_message_get_type (m), ==, LM_MESSAGE_TYPE_STREAM_FEATURES);
+    g_assert (lm_message_node_get_ns_id (m->node) ==
+              g_quark_from_static_string ("http://etherx.jabber.org/streams"));
+    g_assert (lm_message_node_get_name_id (m->node) ==
+              g_quark_from_static_string ("features"));
+
+    node = lm_message_node_get_child_by_id (m->node,
+                                            g_quark_from_static_string ("urn:ietf:params:xml:ns:xmpp-sasl"),
+                                            g_quark_from_static_string ("mechanisms"));
+    g_assert (node != NULL);
+    node = lm_message_node_get_child (node, "mechanism");
+    g_assert (lm_message_node_get_ns_id (node) ==
+              g_quark_from_static_string ("urn:ietf:params:xml:ns:xmpp-sasl"));
+
+    /* Any prefix will do */
+    m = g_slist_nth_data (messages, 2);
+    g_assert_cmpint (lm_message_get_type (m), ==, LM_MESSAGE_TYPE_STREAM_FEATURES);
+
+    /* Default namespaces end with the element declaring them */
+    m = g_slist_nth_data (messages, 3);
+    g_assert_cmpint (lm_message_get_type (m), ==, LM_MESSAGE_TYPE_MESSAGE);
+    g_assert (lm_message_node_get_ns_id (m->node) == client_ns);
+    node = lm_message_node_get_child (m->node, "x");
+
+    /* What the peer sends isn't interned, it only has an id once the
+     * application made one */
+    g_assert (g_quark_try_string (x_uri) == 0);
+    g_assert (lm_message_node_get_ns_id (node->children) == 0);
+    x_ns = g_quark_from_string (x_uri);
+    g_assert (lm_message_node_get_ns_id (node->children) == x_ns);
+    g_assert (lm_message_node_get_child_by_id (m->node, client_ns,
+                                               g_quark_from_static_string ("body")));
+    g_assert (!lm_message_node_get_child_by_id (m->node, client_ns,
+                                                g_quark_from_static_string ("x")));
+    node = lm_message_node_get_child (m->node, "xml:foo");
+    g_assert (lm_message_node_get_ns_id (node) ==
+              g_quark_from_static_string ("http://www.w3.org/XML/1998/namespace"));
+
+    g_slist_foreach (messages, (GFunc) lm_message_unref, NULL);
+    g_slist_free (messages);
+    messages = NULL;
+
+    /* A new stream starts from scratch */
+    g_assert (lm_parser_parse (parser,
+                               "<stream:stream "
+                               "xmlns:stream='http://etherx.jabber.org/streams'>"
+                               "<message id='m2'/>"));
+    g_assert_cmpuint (g_slist_length (messages), ==, 2);
+    m = g_slist_nth_data (messages, 1);
+    g_assert (lm_message_node_get_ns_id (m->node) == 0);
+
+    g_slist_foreach (messages, (GFunc) lm_message_unref, NULL);
+    g_slist_free (messages);
+    lm_parser_free (parser);
+    g_free (x_uri);
+}
+
+static void
+test_namespaces_built ()
+{
+    LmMessage     *m;
+    LmMessageNode *query;
+    LmMessageNode *item;
+    GQuark         roster_ns = g_quark_from_static_string ("jabber:iq:roster");
+    GQuark         item_id = g_quark_from_static_string ("item");
+
+    m = lm_message_new (NULL, LM_MESSAGE_TYPE_IQ);
+    query = lm_message_node_add_child (m->node, "query", NULL);
+    lm_message_node_set_attribute (query, "xmlns", "jabber:iq:roster");
+    item = lm_message_node_add_child (query, "item", NULL);
+
+    g_assert (lm_message_node_get_ns_id (item) == roster_ns);
+    g_assert (lm_message_node_get_name_id (item) == item_id);
+    g_assert (lm_message_node_get_ns_id (m->node) == 0);
+
+    lm_message_unref (m);
+}
+
 int 
 main (int argc, char **argv)
 {
@@ -118,6 +291,9 @@ main (int argc, char **argv)
     
     g_test_add_func ("/parser/valid_suite", test_valid_suite);
     g_test_add_func ("/parser/invalid/suite", test_invalid_suite);
+    g_test_add_func ("/parser/parse_file", test_parse_file);
+    g_test_add_func ("/parser/namespaces", test_namespaces);
+    g_test_add_func ("/parser/namespaces_built", test_namespaces_built);
 
     return g_test_run ();
 }
@@ -0,0 +1,676 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * SRV and host lookups and the connection set up on top of them against
+ * the DNS stand-in, see dns-stand-in.h. Every test runs with both the
+ * blocking and the asyncns resolver.
+ *
+ * Run with -m perf (or "make perf-report") to measure the time from
+ * lm_connection_open () to the TCP connection for many connections at
+ * once, with and without a delay on every DNS answer.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-asyncns-resolver.h"
+#include "loudmouth/lm-blocking-resolver.h"
+#include "loudmouth/lm-resolver.h"
+
+#include "dns-stand-in.h"
+
+#define TEST_TIMEOUT      10000
+#define PERF_CONNECTIONS  32
+#define PERF_TIMEOUT      120000
+#define CONCURRENT_DELAY  300
+
+typedef struct {
+    const gchar *name;
+    GType      (*get_type) (void);
+} TestBackend;
+
+static const TestBackend backends[] = {
+    { "blocking", lm_blocking_resolver_get_type },
+    { "asyncns",  lm_asyncns_resolver_get_type }
+};
+
+static DnsStandIn *dns;
+
+/* Where the connections end up */
+static gint        listen_fd;
+static guint       listen_port;
+static GArray     *accepted_fds;
+static GArray     *accepted_times;
+static GTimer     *timer;
+
+/* Host lookups go through the name service switch, which might not ask
+ * DNS at all on the machine running the tests, or not through the
+ * resolver state the nameserver is set in. Checked for every backend. */
+static gboolean    host_lookups_work[G_N_ELEMENTS (backends)];
+
+typedef struct {
+    gboolean          done;
+    LmResolverResult  result;
+    gchar            *host;
+    guint             port;
+    gchar            *address;
+} TestLookup;
+
+static gboolean
+test_timeout_cb (gboolean *timed_out)
+{
+    *timed_out = TRUE;
+
+    return FALSE;
+}
+
+static gboolean
+test_run_until (gboolean (*func) (gpointer), gpointer user_data, guint timeout)
+{
+    GSource  *source;
+    gboolean  timed_out = FALSE;
+
+    source = g_timeout_source_new (timeout);
+    g_source_set_callback (source, (GSourceFunc) test_timeout_cb,
+                           &timed_out, NULL);
+    g_source_attach (source, NULL);
+
+    while (!func (user_data) && !timed_out) {
+        g_main_context_iteration (NULL, TRUE);
+    }
+
+    g_source_destroy (source);
+    g_source_unref (source);
+
+    return func (user_data);
+}
+
+static gboolean
+test_lookup_is_done (TestLookup *lookup)
+{
+    return lookup->done;
+}
+
+static void
+test_lookup_cb (LmResolver       *resolver,
+                LmResolverResult  result,
+                TestLookup       *lookup)
+{
+    struct addrinfo *addr;
+
+    lookup->done = TRUE;
+    lookup->result = result;
+
+    if (result != LM_RESOLVER_RESULT_OK) {
+        return;
+    }
+
+    g_object_get (resolver,
+                  "host", &lookup->host,
+                  "port", &lookup->port,
+                  NULL);
+
+    addr = lm_resolver_results_get_next (resolver);
+    if (addr) {
+        gchar buf[INET_ADDRSTRLEN];
+
+        inet_ntop (AF_INET,
+                   &((struct sockaddr_in *) addr->ai_addr)->sin_addr,
+                   buf, sizeof (buf));
+        lookup->address = g_strdup (buf);
+    }
+}
+
+static void
+test_lookup_clear (TestLookup *lookup)
+{
+    g_free (lookup->host);
+    g_free (lookup->address);
+    memset (lookup, 0, sizeof (TestLookup));
+}
+
+static void
+test_lookup (const TestBackend *backend,
+             const gchar       *domain,
+             gboolean           srv,
+             TestLookup        *lookup)
+{
+    LmResolver *resolver;
+
+    memset (lookup, 0, sizeof (TestLookup));
+
+    _lm_resolver_set_default_type (backend->get_type ());
+
+    if (srv) {
+        resolver = lm_resolver_new_for_service (domain, "xmpp-client", "tcp",
+                                                (LmResolverCallback) test_lookup_cb,
+                                                lookup);
+    } else {
+        resolver = lm_resolver_new_for_host (domain,
+                                             (LmResolverCallback) test_lookup_cb,
+                                             lookup);
+    }
+
+    lm_resolver_lookup (resolver);
+    g_assert (test_run_until ((gpointer) test_lookup_is_done, lookup,
+                              TEST_TIMEOUT));
+
+    g_object_unref (resolver);
+    _lm_resolver_set_default_type (G_TYPE_INVALID);
+}
+
+static gboolean
+test_listen_cb (GIOChannel *channel, GIOCondition condition, gpointer data)
+{
+    gdouble elapsed;
+    gint    fd;
+
+    fd = accept (listen_fd, NULL, NULL);
+    if (fd >= 0) {
+        elapsed = g_timer_elapsed (timer, NULL);
+
+        g_array_append_val (accepted_fds, fd);
+        g_array_append_val (accepted_times, elapsed);
+    }
+
+    return TRUE;
+}
+
+static void
+test_listen (void)
+{
+    struct sockaddr_in  addr;
+    socklen_t           len = sizeof (addr);
+    GIOChannel         *channel;
+
+    listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    g_assert (bind (listen_fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    g_assert (listen (listen_fd, PERF_CONNECTIONS * 2) == 0);
+
+    getsockname (listen_fd, (struct sockaddr *) &addr, &len);
+    listen_port = ntohs (addr.sin_port);
+
+    channel = g_io_channel_unix_new (listen_fd);
+    g_io_add_watch (channel, G_IO_IN, test_listen_cb, NULL);
+    g_io_channel_unref (channel);
+
+    accepted_fds = g_array_new (FALSE, FALSE, sizeof (gint));
+    accepted_times = g_array_new (FALSE, FALSE, sizeof (gdouble));
+    timer = g_timer_new ();
+}
+
+static void
+test_close_accepted (void)
+{
+    guint i;
+
+    for (i = 0; i < accepted_fds->len; i++) {
+        close (g_array_index (accepted_fds, gint, i));
+    }
+
+    g_array_set_size (accepted_fds, 0);
+    g_array_set_size (accepted_times, 0);
+}
+
+static gboolean
+test_accepted (gpointer n)
+{
+    return accepted_fds->len >= GPOINTER_TO_UINT (n);
+}
+
+static void
+test_open_cb (LmConnection *connection, gboolean success, gpointer user_data)
+{
+    /* The listener never answers the stream header */
+}
+
+static LmConnection *
+test_connection_open (const gchar *jid)
+{
+    LmConnection *connection;
+    GError       *error = NULL;
+
+    connection = lm_connection_new (NULL);
+    lm_connection_set_jid (connection, jid);
+    /* Only used when there is no SRV record */
+    lm_connection_set_port (connection, listen_port);
+
+    if (!lm_connection_open (connection, test_open_cb, NULL, NULL, &error)) {
+        g_error ("Couldn't open %s: %s", jid, error->message);
+    }
+
+    return connection;
+}
+
+static void
+test_connection_free (LmConnection *connection)
+{
+    lm_connection_close (connection, NULL);
+    lm_connection_unref (connection);
+}
+
+/* -- Tests -- */
+
+static void
+test_srv_priority (const TestBackend *backend)
+{
+    TestLookup lookup;
+
+    test_lookup (backend, "srv.test", TRUE, &lookup);
+
+    g_assert_cmpint (lookup.result, ==, LM_RESOLVER_RESULT_OK);
+    g_assert_cmpstr (lookup.host, ==, "primary.srv.test");
+    g_assert_cmpuint (lookup.port, ==, 5269);
+
+    test_lookup_clear (&lookup);
+}
+
+static void
+test_srv_over_tcp (const TestBackend *backend)
+{
+    TestLookup lookup;
+    guint      queries;
+
+    queries = dns_stand_in_get_queries (dns);
+    test_lookup (backend, "truncated.test", TRUE, &lookup);
+
+    g_assert_cmpint (lookup.result, ==, LM_RESOLVER_RESULT_OK);
+    g_assert_cmpstr (lookup.host, ==, "xmpp.truncated.test");
+    g_assert_cmpuint (lookup.port, ==, 5222);
+    /* The truncated answer over UDP and the full one over TCP */
+    g_assert_cmpuint (dns_stand_in_get_queries (dns) - queries, >=, 2);
+
+    test_lookup_clear (&lookup);
+}
+
+static void
+test_srv_missing (const TestBackend *backend)
+{
+    TestLookup lookup;
+
+    test_lookup (backend, "missing.test", TRUE, &lookup);
+    g_assert_cmpint (lookup.result, ==, LM_RESOLVER_RESULT_FAILED);
+    test_lookup_clear (&lookup);
+
+    test_lookup (backend, "servfail.test", TRUE, &lookup);
+    g_assert_cmpint (lookup.result, ==, LM_RESOLVER_RESULT_FAILED);
+    test_lookup_clear (&lookup);
+}
+
+static void
+test_host (const TestBackend *backend)
+{
+    TestLookup lookup;
+
+    if (!host_lookups_work[backend - backends]) {
+        g_test_message ("Host lookups don't reach the DNS stand-in, skipped");
+        return;
+    }
+
+    test_lookup (backend, "host.test", FALSE, &lookup);
+
+    g_assert_cmpint (lookup.result, ==, LM_RESOLVER_RESULT_OK);
+    /* Only IPv4 is used even though there is an AAAA record */
+    g_assert_cmpstr (lookup.address, ==, "127.0.0.2");
+
+    test_lookup_clear (&lookup);
+}
+
+static void
+test_connect (const TestBackend *backend, const gchar *jid)
+{
+    LmConnection *connection;
+
+    if (!host_lookups_work[backend - backends]) {
+        g_test_message ("Host lookups don't reach the DNS stand-in, skipped");
+        return;
+    }
+
+    _lm_resolver_set_default_type (backend->get_type ());
+
+    connection = test_connection_open (jid);
+    g_assert (test_run_until (test_accepted, GUINT_TO_POINTER (1),
+                              TEST_TIMEOUT));
+
+    test_connection_free (connection);
+    test_close_accepted ();
+
+    _lm_resolver_set_default_type (G_TYPE_INVALID);
+}
+
+static void
+test_connect_srv (const TestBackend *backend)
+{
+    /* SRV points at the listener */
+    test_connect (backend, "user@connect.test");
+}
+
+static void
+test_connect_fallback (const TestBackend *backend)
+{
+    /* No SRV record, the domain itself with the connection's port */
+    test_connect (backend, "user@fallback.test");
+}
+
+static gdouble
+test_connect_time (const gchar *jid)
+{
+    LmConnection *connection;
+    gdouble       elapsed;
+
+    g_timer_start (timer);
+
+    connection = test_connection_open (jid);
+    g_assert (test_run_until (test_accepted, GUINT_TO_POINTER (1),
+                              TEST_TIMEOUT));
+    elapsed = g_array_index (accepted_times, gdouble, 0);
+
+    test_connection_free (connection);
+    test_close_accepted ();
+
+    return elapsed * 1000;
+}
+
+static void
+test_assert_overlap (const gchar *domain)
+{
+    gchar *srv;
+    guint  started;
+    guint  answered;
+
+    srv = g_strconcat ("_xmpp-client._tcp.", domain, NULL);
+    started = dns_stand_in_get_started (dns, domain);
+    answered = dns_stand_in_get_answered (dns, srv);
+    g_free (srv);
+
+    g_assert_cmpuint (started, >, 0);
+    g_assert_cmpuint (answered, >, 0);
+    g_assert_cmpuint (started, <, answered);
+}
+
+static void
+test_connect_concurrent (const TestBackend *backend)
+{
+    gdouble fallback;
+    gdouble self;
+
+    if (!host_lookups_work[backend - backends]) {
+        g_test_message ("Host lookups don't reach the DNS stand-in, skipped");
+        return;
+    }
+
+    dns_stand_in_set_delay (dns, CONCURRENT_DELAY);
+    dns_stand_in_clear_events (dns);
+    _lm_resolver_set_default_type (backend->get_type ());
+
+    /* The domain is looked up next to the SRV record that isn't there */
+    fallback = test_connect_time ("user@fallback.test");
+    /* The SRV target is the domain, which is being looked up already */
+    self = test_connect_time ("user@self.test");
+
+    g_test_message ("%s resolver: %.0f ms without SRV, %.0f ms with SRV "
+                    "to the domain, %u ms per answer",
+                    backend->name, fallback, self, CONCURRENT_DELAY);
+
+    /* The blocking resolver does one lookup after the other. Whatever
+     * the machine's load, the domain has to be asked for before the
+     * SRV answer is in, and not again after it. */
+    if (backend->get_type == lm_asyncns_resolver_get_type) {
+        test_assert_overlap ("fallback.test");
+        test_assert_overlap ("self.test");
+    }
+
+    _lm_resolver_set_default_type (G_TYPE_INVALID);
+    dns_stand_in_set_delay (dns, 0);
+}
+
+static gboolean
+test_never (gpointer data)
+{
+    return FALSE;
+}
+
+/* Cancelled while both SRV lookups are outstanding, the domain the
+ * connection would fall back to must not be connected to */
+static void
+test_connect_cancel (const TestBackend *backend)
+{
+    LmConnection *connection;
+    LmSSL        *ssl;
+
+    if (!lm_ssl_is_supported ()) {
+        g_test_message ("No SSL support, no _xmpps-client lookup");
+        return;
+    }
+
+    /* The blocking resolver would block on the lookups that are never
+     * answered, and its cancel doesn't call back */
+    if (backend->get_type != lm_asyncns_resolver_get_type) {
+        g_test_message ("Only the asyncns resolver runs lookups in parallel");
+        return;
+    }
+
+    _lm_resolver_set_default_type (backend->get_type ());
+
+    connection = lm_connection_new (NULL);
+    lm_connection_set_jid (connection, "user@cancel.test");
+    lm_connection_set_port (connection, listen_port);
+
+    ssl = lm_ssl_new (NULL, NULL, NULL, NULL);
+    lm_connection_set_ssl (connection, ssl);
+    lm_ssl_unref (ssl);
+
+    g_assert (lm_connection_open (connection, test_open_cb, NULL, NULL,
+                                  NULL));
+    /* Let the lookups get going */
+    test_run_until (test_never, NULL, 100);
+
+    lm_connection_cancel_open (connection);
+    g_assert (!test_run_until (test_accepted, GUINT_TO_POINTER (1), 500));
+
+    lm_connection_unref (connection);
+    test_close_accepted ();
+
+    _lm_resolver_set_default_type (G_TYPE_INVALID);
+}
+
+/* -- Benchmarks -- */
+
+static void
+perf_connect (const TestBackend *backend, guint delay)
+{
+    LmConnection *connections[PERF_CONNECTIONS];
+    gdouble       total = 0.0;
+    gdouble       max = 0.0;
+    gdouble       elapsed;
+    guint         i;
+
+    if (!host_lookups_work[backend - backends]) {
+        g_test_message ("Host lookups don't reach the DNS stand-in, skipped");
+        return;
+    }
+
+    dns_stand_in_set_delay (dns, delay);
+    _lm_resolver_set_default_type (backend->get_type ());
+
+    g_timer_start (timer);
+
+    for (i = 0; i < PERF_CONNECTIONS; i++) {
+        connections[i] = test_connection_open ("user@connect.test");
+    }
+
+    g_assert (test_run_until (test_accepted,
+                              GUINT_TO_POINTER (PERF_CONNECTIONS),
+                              PERF_TIMEOUT));
+    elapsed = g_timer_elapsed (timer, NULL);
+
+    for (i = 0; i < accepted_times->len; i++) {
+        gdouble t = g_array_index (accepted_times, gdouble, i);
+
+        total += t;
+        max = MAX (max, t);
+    }
+
+    g_test_minimized_result (total / PERF_CONNECTIONS * 1000,
+                             "%s resolver, %u ms DNS delay: "
+                             "resolve to connect %.1f ms mean, %.1f ms max, "
+                             "%.0f connections/s",
+                             backend->name, delay,
+                             total / PERF_CONNECTIONS * 1000, max * 1000,
+                             PERF_CONNECTIONS / elapsed);
+
+    for (i = 0; i < PERF_CONNECTIONS; i++) {
+        test_connection_free (connections[i]);
+    }
+    test_close_accepted ();
+
+    _lm_resolver_set_default_type (G_TYPE_INVALID);
+    dns_stand_in_set_delay (dns, 0);
+}
+
+static void
+perf_connect_no_delay (const TestBackend *backend)
+{
+    perf_connect (backend, 0);
+}
+
+static void
+perf_connect_delay (const TestBackend *backend)
+{
+    perf_connect (backend, 20);
+}
+
+static void
+setup_records (void)
+{
+    dns_stand_in_add_srv (dns, "_xmpp-client._tcp.srv.test",
+                          20, 0, 5270, "backup.srv.test");
+    dns_stand_in_add_srv (dns, "_xmpp-client._tcp.srv.test",
+                          10, 0, 5269, "primary.srv.test");
+
+    dns_stand_in_add_srv (dns, "_xmpp-client._tcp.truncated.test",
+                          0, 0, 5222, "xmpp.truncated.test");
+    dns_stand_in_set_behaviour (dns, "_xmpp-client._tcp.truncated.test",
+                                DNS_STAND_IN_TRUNCATE);
+
+    dns_stand_in_set_behaviour (dns, "_xmpp-client._tcp.servfail.test",
+                                DNS_STAND_IN_SERVFAIL);
+
+    dns_stand_in_add_a (dns, "host.test", "127.0.0.2");
+    dns_stand_in_add_aaaa (dns, "host.test", "::1");
+
+    dns_stand_in_add_srv (dns, "_xmpp-client._tcp.connect.test",
+                          0, 0, listen_port, "xmpp.connect.test");
+    dns_stand_in_add_a (dns, "xmpp.connect.test", "127.0.0.1");
+
+    dns_stand_in_add_a (dns, "fallback.test", "127.0.0.1");
+
+    dns_stand_in_add_srv (dns, "_xmpp-client._tcp.self.test",
+                          0, 0, listen_port, "self.test");
+    dns_stand_in_add_a (dns, "self.test", "127.0.0.1");
+
+    dns_stand_in_set_behaviour (dns, "_xmpp-client._tcp.cancel.test",
+                                DNS_STAND_IN_DROP);
+    dns_stand_in_set_behaviour (dns, "_xmpps-client._tcp.cancel.test",
+                                DNS_STAND_IN_DROP);
+    dns_stand_in_add_a (dns, "cancel.test", "127.0.0.1");
+}
+
+static void
+add_backend_test (const gchar *path, const TestBackend *backend,
+                  void (*func) (const TestBackend *))
+{
+    gchar *full_path;
+
+    full_path = g_strdup_printf ("/resolver/%s/%s", backend->name, path);
+    g_test_add_data_func (full_path, backend, (GTestDataFunc) func);
+    g_free (full_path);
+}
+
+int
+main (int argc, char **argv)
+{
+    TestLookup lookup;
+    guint      i;
+    gint       result;
+
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+#if !GLIB_CHECK_VERSION (2, 36, 0)
+    g_type_init ();
+#endif
+
+    dns = dns_stand_in_new ();
+    test_listen ();
+    setup_records ();
+
+    _lm_resolver_set_nameserver ("127.0.0.1", dns_stand_in_get_port (dns));
+
+    for (i = 0; i < G_N_ELEMENTS (backends); i++) {
+        test_lookup (&backends[i], "host.test", FALSE, &lookup);
+        host_lookups_work[i] = lookup.result == LM_RESOLVER_RESULT_OK;
+        test_lookup_clear (&lookup);
+
+        add_backend_test ("srv_priority", &backends[i], test_srv_priority);
+        add_backend_test ("srv_over_tcp", &backends[i], test_srv_over_tcp);
+        add_backend_test ("srv_missing", &backends[i], test_srv_missing);
+        add_backend_test ("host", &backends[i], test_host);
+        add_backend_test ("connect_srv", &backends[i], test_connect_srv);
+        add_backend_test ("connect_fallback", &backends[i],
+                          test_connect_fallback);
+        add_backend_test ("connect_concurrent", &backends[i],
+                          test_connect_concurrent);
+        add_backend_test ("connect_cancel", &backends[i],
+                          test_connect_cancel);
+
+        if (g_test_perf ()) {
+            add_backend_test ("perf/connect", &backends[i],
+                              perf_connect_no_delay);
+            add_backend_test ("perf/connect_delayed", &backends[i],
+                              perf_connect_delay);
+        }
+    }
+
+    result = g_test_run ();
+
+    _lm_resolver_set_nameserver (NULL, 0);
+    dns_stand_in_free (dns);
+
+    return result;
+}
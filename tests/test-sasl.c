@@ -0,0 +1,205 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * SASL2 logins against the simulated server: binding inline, wrong
+ * passwords, FAST tokens being used and rotated, and tasks we don't
+ * support.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT  (10 * 60 * 1000)
+/* A failed login shouldn't have to wait for anything */
+#define TEST_FAIL_LIMIT  (10 * 1000)
+
+typedef struct {
+    SimNetwork   *net;
+    LmConnection *connection;
+    const gchar  *password;
+    gboolean      done;
+    gboolean      success;
+} SaslTest;
+
+static void
+test_setup (SaslTest *test)
+{
+    SimLinkParams params = { 20, 0, 0.0, 0 };
+
+    memset (test, 0, sizeof (SaslTest));
+
+    test->net = sim_network_new (&params, 1);
+    sim_network_set_sasl2 (test->net, TRUE);
+    test->connection = sim_network_connection_new (test->net);
+}
+
+static void
+test_finish (SaslTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+}
+
+static void
+test_auth_cb (LmConnection *connection, gboolean success, SaslTest *test)
+{
+    test->success = success;
+    test->done = TRUE;
+}
+
+static void
+test_open_cb (LmConnection *connection, gboolean success, SaslTest *test)
+{
+    if (success &&
+        lm_connection_authenticate (connection, "user", test->password,
+                                    "sasl",
+                                    (LmResultFunction) test_auth_cb,
+                                    test, NULL, NULL)) {
+        return;
+    }
+
+    test->done = TRUE;
+}
+
+static gboolean
+test_is_done (SaslTest *test)
+{
+    return test->done;
+}
+
+/* Like sim_network_login(), with the password up to the test */
+static gboolean
+test_login (SaslTest *test, const gchar *password, guint64 limit)
+{
+    test->password = password;
+    test->done = FALSE;
+    test->success = FALSE;
+
+    g_assert (lm_connection_open (test->connection,
+                                  (LmResultFunction) test_open_cb,
+                                  test, NULL, NULL));
+
+    g_assert (sim_network_run_until (test->net,
+                                     (SimConditionFunc) test_is_done,
+                                     test, limit));
+
+    return test->success;
+}
+
+/* Bound with Bind 2, no stream restart and no bind IQ */
+static void
+test_success ()
+{
+    SaslTest test;
+
+    test_setup (&test);
+
+    g_assert (test_login (&test, "password", TEST_TIME_LIMIT));
+    g_assert_cmpstr (lm_connection_get_full_jid (test.connection), ==,
+                     "user@example.com/sasl");
+    g_assert (lm_connection_is_authenticated (test.connection));
+
+    test_finish (&test);
+}
+
+static void
+test_failure ()
+{
+    SaslTest test;
+
+    test_setup (&test);
+
+    g_assert (!test_login (&test, "wrong", TEST_FAIL_LIMIT));
+    g_assert (!lm_connection_is_authenticated (test.connection));
+
+    test_finish (&test);
+}
+
+/* The second login uses the token from the first, and gets a new one */
+static void
+test_fast ()
+{
+    SaslTest  test;
+    gchar    *first;
+
+    test_setup (&test);
+
+    g_assert (test_login (&test, "password", TEST_TIME_LIMIT));
+    g_assert (sim_network_get_fast_token (test.net) != NULL);
+    g_assert_cmpstr (lm_connection_get_fast_token (test.connection), ==,
+                     sim_network_get_fast_token (test.net));
+    g_assert_cmpuint (sim_network_get_fast_logins (test.net), ==, 0);
+    first = g_strdup (lm_connection_get_fast_token (test.connection));
+    lm_connection_close (test.connection, NULL);
+
+    /* The password is wrong, only the token can get us in */
+    g_assert (test_login (&test, "wrong", TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_fast_logins (test.net), ==, 1);
+    g_assert_cmpstr (lm_connection_get_fast_token (test.connection), !=,
+                     first);
+    g_assert_cmpstr (lm_connection_get_fast_token (test.connection), ==,
+                     sim_network_get_fast_token (test.net));
+    lm_connection_close (test.connection, NULL);
+    g_free (first);
+
+    /* Rejected, tried again with the password on the same stream */
+    sim_network_revoke_fast_token (test.net);
+    g_assert (test_login (&test, "password", TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_fast_logins (test.net), ==, 1);
+    g_assert_cmpstr (lm_connection_get_fast_token (test.connection), ==,
+                     sim_network_get_fast_token (test.net));
+
+    test_finish (&test);
+}
+
+/* A task we can't do is aborted, the login fails instead of hanging */
+static void
+test_continue ()
+{
+    SaslTest test;
+
+    test_setup (&test);
+    sim_network_set_sasl2_task (test.net, "HOTP-EXAMPLE");
+
+    g_assert (!test_login (&test, "password", TEST_FAIL_LIMIT));
+    g_assert (sim_network_get_sasl2_aborted (test.net));
+
+    test_finish (&test);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+    g_test_add_func ("/sasl/sasl2/success", test_success);
+    g_test_add_func ("/sasl/sasl2/failure", test_failure);
+#if GLIB_CHECK_VERSION (2, 30, 0)
+    /* The simulated server needs GHmac for the tokens */
+    g_test_add_func ("/sasl/sasl2/fast", test_fast);
+#endif
+    g_test_add_func ("/sasl/sasl2/continue", test_continue);
+
+    return g_test_run ();
+}
@@ -0,0 +1,515 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Send completion callbacks, for stanzas written right away, ones left
+ * in the output buffer because the simulated server doesn't read, ones
+ * sent from other threads and ones sending more themselves.
+ */
+
+#include <string.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+
+#include "sim-network.h"
+
+#define TEST_TIME_LIMIT  (10 * 60 * 1000)
+/* More than the kernel buffers on loopback, so most of it waits in the
+ * output buffer until the server reads */
+#define LARGE_BODY       (16 * 1024 * 1024)
+#define THREAD_MESSAGES  10
+/* Sent before the connection is closed under the sending thread */
+#define CLOSE_MESSAGES   20
+#define CLOSE_MAX        100000
+#define PERF_MESSAGES    1000
+
+typedef struct {
+    SimNetwork   *net;
+    LmConnection *connection;
+    guint         done;
+    guint         failed;
+    gboolean      in_order;
+    GThread      *thread;
+    gint64        serialize_time;
+    gint64        write_time;
+
+    /* For test_nested(), the callback of the first stanza has the sender
+     * push another one and then sends one of its own */
+    GAsyncQueue  *queued;
+    GAsyncQueue  *go;
+    GAsyncQueue  *pushed;
+
+    /* Sends taken by lm_connection_send_with_callback(), and the
+     * messages the server is waiting for */
+    guint         accepted;
+    guint         expected;
+} SendTest;
+
+typedef struct {
+    SendTest *test;
+    guint     index;
+} SendInfo;
+
+static void
+test_login (SendTest *test)
+{
+    SimLinkParams params = { 0, 0, 0.0, 0 };
+
+    memset (test, 0, sizeof (SendTest));
+    test->in_order = TRUE;
+    test->thread = g_thread_self ();
+
+    test->net = sim_network_new (&params, 1);
+    test->connection = sim_network_connection_new (test->net);
+    g_assert (sim_network_login (test->net, test->connection, "send",
+                                 TEST_TIME_LIMIT));
+}
+
+static void
+test_finish (SendTest *test)
+{
+    sim_network_finish (test->net, test->connection);
+}
+
+static void
+test_sent_cb (LmConnection      *connection,
+              gboolean           success,
+              const LmSendTimes *times,
+              SendInfo          *info)
+{
+    SendTest *test = info->test;
+
+    /* Called back from whoever wrote the last byte, the context is ours */
+    g_assert (test->thread == g_thread_self ());
+
+    if (info->index != test->done + test->failed) {
+        test->in_order = FALSE;
+    }
+
+    g_assert (times->enqueued > 0);
+    g_assert_cmpint (times->serialized, >=, times->enqueued);
+
+    if (success) {
+        g_assert_cmpint (times->written, >=, times->serialized);
+        test->serialize_time += times->serialized - times->enqueued;
+        test->write_time += times->written - times->serialized;
+        test->done++;
+    } else {
+        g_assert_cmpint (times->written, ==, 0);
+        test->failed++;
+    }
+
+    if (info->index == 0 && test->go) {
+        LmMessage *m;
+
+        g_async_queue_push (test->go, GUINT_TO_POINTER (1));
+        g_async_queue_pop (test->pushed);
+
+        m = lm_message_new ("romeo@example.net", LM_MESSAGE_TYPE_MESSAGE);
+        lm_message_node_add_child (m->node, "body", "From the callback");
+        g_assert (lm_connection_send (connection, m, NULL));
+        lm_message_unref (m);
+    }
+}
+
+static gboolean
+test_send (SendTest *test, guint index, const gchar *body)
+{
+    LmMessage *m;
+    SendInfo  *info;
+    gboolean   result;
+
+    m = lm_message_new_with_sub_type ("romeo@example.net",
+                                      LM_MESSAGE_TYPE_MESSAGE,
+                                      LM_MESSAGE_SUB_TYPE_CHAT);
+    lm_message_node_add_child (m->node, "body", body);
+
+    info = g_new0 (SendInfo, 1);
+    info->test = test;
+    info->index = index;
+
+    result = lm_connection_send_with_callback (test->connection, m,
+                                               (LmSendFunction) test_sent_cb,
+                                               info, g_free, NULL);
+    lm_message_unref (m);
+
+    return result;
+}
+
+static gchar *
+test_large_body (void)
+{
+    gchar *body;
+
+    body = g_malloc (LARGE_BODY + 1);
+    memset (body, 'x', LARGE_BODY);
+    body[LARGE_BODY] = '\0';
+
+    return body;
+}
+
+static gboolean
+test_all_done (SendTest *test)
+{
+    return test->done + test->failed >= THREAD_MESSAGES;
+}
+
+static gboolean
+test_two_delivered (SendTest *test)
+{
+    return sim_network_get_messages_received (test->net) == 2;
+}
+
+/* Nothing in the way, written before the call returns */
+static void
+test_written ()
+{
+    SendTest test;
+
+    test_login (&test);
+
+    g_assert (test_send (&test, 0, "Hello"));
+    g_assert_cmpuint (test.done, ==, 1);
+
+    test_finish (&test);
+}
+
+/* Left in the output buffer until the server catches up */
+static void
+test_buffered ()
+{
+    SendTest  test;
+    gchar    *body;
+
+    test_login (&test);
+
+    body = test_large_body ();
+    g_assert (test_send (&test, 0, body));
+    g_free (body);
+    g_assert_cmpuint (test.done, ==, 0);
+
+    /* Behind it in the buffer, so it has to wait as well */
+    g_assert (test_send (&test, 1, "After"));
+    g_assert_cmpuint (test.done, ==, 0);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_two_delivered,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (test.done, ==, 2);
+    g_assert_cmpuint (test.failed, ==, 0);
+    g_assert (test.in_order);
+
+    test_finish (&test);
+}
+
+static void
+test_closed ()
+{
+    SendTest  test;
+    gchar    *body;
+
+    test_login (&test);
+
+    body = test_large_body ();
+    g_assert (test_send (&test, 0, body));
+    g_free (body);
+    g_assert_cmpuint (test.done, ==, 0);
+
+    lm_connection_close (test.connection, NULL);
+    g_assert_cmpuint (test.failed, ==, 1);
+
+    /* Not open, the callback isn't taken */
+    g_assert (!test_send (&test, 1, "Too late"));
+    g_assert_cmpuint (test.failed, ==, 1);
+
+    lm_connection_unref (test.connection);
+    sim_network_free (test.net);
+}
+
+static gpointer
+test_sender_thread (SendTest *test)
+{
+    guint i;
+
+    for (i = 0; i < THREAD_MESSAGES; i++) {
+        g_assert (test_send (test, i, "From a thread"));
+    }
+
+    return NULL;
+}
+
+static gpointer
+test_nested_sender_thread (SendTest *test)
+{
+    gchar *body;
+    guint  i;
+
+    for (i = 0; i < THREAD_MESSAGES; i++) {
+        body = g_strdup_printf ("Thread %u", i);
+        g_assert (test_send (test, i, body));
+        g_free (body);
+    }
+    g_async_queue_push (test->queued, GUINT_TO_POINTER (1));
+
+    /* While the batch above is being called back for */
+    g_async_queue_pop (test->go);
+    body = g_strdup_printf ("Thread %u", THREAD_MESSAGES);
+    g_assert (test_send (test, THREAD_MESSAGES, body));
+    g_free (body);
+    g_async_queue_push (test->pushed, GUINT_TO_POINTER (1));
+
+    return NULL;
+}
+
+static gboolean
+test_nested_done (SendTest *test)
+{
+    return test->done + test->failed > THREAD_MESSAGES &&
+        sim_network_get_messages_received (test->net) == THREAD_MESSAGES + 2;
+}
+
+/* A callback that sends comes after everything the sending thread
+ * queued before, in the batch being called back for and after it */
+static void
+test_nested ()
+{
+    SendTest  test;
+    GThread  *thread;
+    gchar    *body;
+    guint     i;
+
+    test_login (&test);
+    test.queued = g_async_queue_new ();
+    test.go = g_async_queue_new ();
+    test.pushed = g_async_queue_new ();
+
+    g_assert (g_main_context_acquire (NULL));
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    thread = g_thread_new ("sender",
+                           (GThreadFunc) test_nested_sender_thread, &test);
+#else
+    thread = g_thread_create ((GThreadFunc) test_nested_sender_thread,
+                              &test, TRUE, NULL);
+#endif
+    g_async_queue_pop (test.queued);
+    g_main_context_release (NULL);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_nested_done,
+                                     &test, TEST_TIME_LIMIT));
+    g_thread_join (thread);
+
+    g_assert_cmpuint (test.done, ==, THREAD_MESSAGES + 1);
+    g_assert (test.in_order);
+
+    for (i = 0; i <= THREAD_MESSAGES; i++) {
+        body = g_strdup_printf ("Thread %u", i);
+        g_assert_cmpstr (sim_network_get_message_body (test.net, i), ==,
+                         body);
+        g_free (body);
+    }
+    g_assert_cmpstr (sim_network_get_message_body (test.net, i), ==,
+                     "From the callback");
+
+    g_async_queue_unref (test.queued);
+    g_async_queue_unref (test.go);
+    g_async_queue_unref (test.pushed);
+
+    test_finish (&test);
+}
+
+static gpointer
+test_close_sender_thread (SendTest *test)
+{
+    guint i;
+
+    /* Until the connection is closed under us */
+    for (i = 0; i < CLOSE_MAX; i++) {
+        if (!test_send (test, i, "Before close")) {
+            break;
+        }
+        test->accepted++;
+    }
+
+    return NULL;
+}
+
+static gboolean
+test_close_sent (SendTest *test)
+{
+    return sim_network_get_messages_received (test->net) >= CLOSE_MESSAGES;
+}
+
+static gboolean
+test_all_received (SendTest *test)
+{
+    return sim_network_get_messages_received (test->net) >= test->expected;
+}
+
+static gboolean
+test_never (SendTest *test)
+{
+    return FALSE;
+}
+
+/* Closed while another thread sends. Whatever it had queued is called
+ * back as not sent, then it is turned away, and nothing of it goes out
+ * on the next stream. */
+static void
+test_thread_close ()
+{
+    SendTest   test;
+    GThread   *thread;
+    LmMessage *m;
+    guint      received;
+
+    test_login (&test);
+
+    /* Everything the thread sends is queued for us */
+    g_assert (g_main_context_acquire (NULL));
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    thread = g_thread_new ("sender",
+                           (GThreadFunc) test_close_sender_thread, &test);
+#else
+    thread = g_thread_create ((GThreadFunc) test_close_sender_thread,
+                              &test, TRUE, NULL);
+#endif
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_close_sent,
+                                     &test, TEST_TIME_LIMIT));
+    lm_connection_close (test.connection, NULL);
+    g_main_context_release (NULL);
+
+    g_thread_join (thread);
+
+    g_assert_cmpuint (test.accepted, <, CLOSE_MAX);
+    g_assert_cmpuint (test.done + test.failed, ==, test.accepted);
+    g_assert (test.in_order);
+
+    /* Let whatever is still on the link arrive */
+    sim_network_run_until (test.net, (SimConditionFunc) test_never, &test,
+                           sim_network_get_time (test.net) + 1000);
+    received = sim_network_get_messages_received (test.net);
+    g_assert_cmpuint (received, <=, test.accepted);
+
+    g_assert (sim_network_login (test.net, test.connection, "send",
+                                 sim_network_get_time (test.net) +
+                                 TEST_TIME_LIMIT));
+
+    m = lm_message_new ("romeo@example.net", LM_MESSAGE_TYPE_MESSAGE);
+    lm_message_node_add_child (m->node, "body", "After reopening");
+    g_assert (lm_connection_send (test.connection, m, NULL));
+    lm_message_unref (m);
+
+    test.expected = received + 1;
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_all_received,
+                                     &test,
+                                     sim_network_get_time (test.net) +
+                                     TEST_TIME_LIMIT));
+    g_assert_cmpuint (sim_network_get_messages_received (test.net), ==,
+                      received + 1);
+    g_assert_cmpstr (sim_network_get_message_body (test.net, received), ==,
+                     "After reopening");
+
+    test_finish (&test);
+}
+
+/* Queued for the thread running the context, called back there */
+static void
+test_thread ()
+{
+    SendTest  test;
+    GThread  *thread;
+
+    test_login (&test);
+
+    /* Keeps the other thread from writing itself */
+    g_assert (g_main_context_acquire (NULL));
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    thread = g_thread_new ("sender", (GThreadFunc) test_sender_thread, &test);
+#else
+    thread = g_thread_create ((GThreadFunc) test_sender_thread,
+                              &test, TRUE, NULL);
+#endif
+    g_thread_join (thread);
+
+    g_assert_cmpuint (test.done, ==, 0);
+    g_main_context_release (NULL);
+
+    g_assert (sim_network_run_until (test.net,
+                                     (SimConditionFunc) test_all_done,
+                                     &test, TEST_TIME_LIMIT));
+    g_assert_cmpuint (test.done, ==, THREAD_MESSAGES);
+    g_assert (test.in_order);
+
+    test_finish (&test);
+}
+
+static void
+test_perf_latency ()
+{
+    SendTest test;
+    guint    i;
+
+    test_login (&test);
+
+    for (i = 0; i < PERF_MESSAGES; i++) {
+        g_assert (test_send (&test, i, "Measured"));
+    }
+    g_assert_cmpuint (test.done, ==, PERF_MESSAGES);
+
+    g_test_minimized_result ((gdouble) test.serialize_time / PERF_MESSAGES,
+                             "Serialize: %.1f us",
+                             (gdouble) test.serialize_time / PERF_MESSAGES);
+    g_test_minimized_result ((gdouble) test.write_time / PERF_MESSAGES,
+                             "Write: %.1f us",
+                             (gdouble) test.write_time / PERF_MESSAGES);
+
+    test_finish (&test);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/send/written", test_written);
+    g_test_add_func ("/send/buffered", test_buffered);
+    g_test_add_func ("/send/closed", test_closed);
+    g_test_add_func ("/send/thread", test_thread);
+    g_test_add_func ("/send/nested", test_nested);
+    g_test_add_func ("/send/thread_close", test_thread_close);
+
+    if (g_test_perf ()) {
+        g_test_add_func ("/send/perf/latency", test_perf_latency);
+    }
+
+    return g_test_run ();
+}
@@ -0,0 +1,741 @@
+/* -*- Mode: C; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2026 The Loudmouth contributors
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License as
+ * published by the Free Software Foundation; either version 2 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 02111-1307, USA.
+ */
+
+/*
+ * Handshakes and bulk transfer through the compiled SSL backend against
+ * a TLS peer on the loopback interface. The peer runs in a thread and
+ * uses the same library as the client with the certificate in
+ * ssl-test-cert.pem, which was generated with:
+ *
+ *   openssl req -x509 -newkey ec -pkeyopt ec_paramgen_curve:prime256v1 \
+ *     -nodes -days 36500 -subj /CN=localhost \
+ *     -keyout ssl-test-key.pem -out ssl-test-cert.pem
+ *
+ * Run with -m perf (or "make perf-report") to get handshakes and
+ * throughput per second. The same workloads run for both backends so
+ * the numbers of an OpenSSL and a GnuTLS build can be compared directly.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <glib.h>
+
+#include <loudmouth/loudmouth.h>
+#include "loudmouth/lm-ssl-base.h"
+#include "loudmouth/lm-ssl-internals.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/ssl.h>
+#define BACKEND_NAME "OpenSSL"
+#elif defined(HAVE_GNUTLS)
+#include <gnutls/gnutls.h>
+#define BACKEND_NAME "GnuTLS"
+#endif
+
+#define TEST_CERT_FILE SSL_TEST_DIR "/ssl-test-cert.pem"
+#define TEST_KEY_FILE  SSL_TEST_DIR "/ssl-test-key.pem"
+#define TEST_SERVER    "localhost"
+
+/* Same as the read buffer in LmOldSocket */
+#define CLIENT_READ_SIZE  1024
+#define PEER_BUFFER_SIZE  (16 * 1024)
+
+#define PERF_HANDSHAKES   500
+#define SMALL_STANZA_SIZE 200
+#define SMALL_STANZAS     50000
+#define LARGE_STANZA_SIZE (64 * 1024)
+#define LARGE_STANZAS     400
+#define DOWNLOAD_SIZE     (32 * 1024 * 1024)
+
+typedef struct _TestPeer     TestPeer;
+typedef struct _TestPeerConn TestPeerConn;
+
+struct _TestPeer {
+    gint            listen_fd;
+    guint16         port;
+    GThread        *thread;
+    volatile gint   quit;
+
+#ifdef HAVE_OPENSSL
+    SSL_CTX        *ctx;
+#else
+    gnutls_certificate_credentials_t cred;
+    gnutls_datum_t                   ticket_key;
+#endif
+};
+
+struct _TestPeerConn {
+    gint              fd;
+#ifdef HAVE_OPENSSL
+    SSL              *ssl;
+#else
+    gnutls_session_t  session;
+#endif
+};
+
+/* -- Backend specific parts of the peer -- */
+
+#ifdef HAVE_OPENSSL
+
+static void
+peer_backend_init (TestPeer *peer)
+{
+    static const unsigned char sid_ctx[] = "loudmouth-test";
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    peer->ctx = SSL_CTX_new (TLS_server_method ());
+#else
+    peer->ctx = SSL_CTX_new (SSLv23_server_method ());
+#endif
+    g_assert (peer->ctx != NULL);
+
+    g_assert (SSL_CTX_use_certificate_file (peer->ctx, TEST_CERT_FILE,
+                                            SSL_FILETYPE_PEM) == 1);
+    g_assert (SSL_CTX_use_PrivateKey_file (peer->ctx, TEST_KEY_FILE,
+                                           SSL_FILETYPE_PEM) == 1);
+
+    /* Needed for the server side session cache */
+    SSL_CTX_set_session_id_context (peer->ctx, sid_ctx, sizeof (sid_ctx));
+}
+
+static void
+peer_backend_free (TestPeer *peer)
+{
+    SSL_CTX_free (peer->ctx);
+}
+
+static gboolean
+peer_conn_handshake (TestPeer *peer, TestPeerConn *conn)
+{
+    conn->ssl = SSL_new (peer->ctx);
+    SSL_set_fd (conn->ssl, conn->fd);
+
+    return SSL_accept (conn->ssl) == 1;
+}
+
+static gint
+peer_conn_read (TestPeerConn *conn, gchar *buf, gint len)
+{
+    return SSL_read (conn->ssl, buf, len);
+}
+
+static gint
+peer_conn_write (TestPeerConn *conn, const gchar *buf, gint len)
+{
+    return SSL_write (conn->ssl, buf, len);
+}
+
+static void
+peer_conn_shutdown (TestPeerConn *conn)
+{
+    SSL_free (conn->ssl);
+}
+
+#else /* HAVE_GNUTLS */
+
+static void
+peer_backend_init (TestPeer *peer)
+{
+    gnutls_global_init ();
+
+    gnutls_certificate_allocate_credentials (&peer->cred);
+    g_assert (gnutls_certificate_set_x509_key_file (peer->cred,
+                                                    TEST_CERT_FILE,
+                                                    TEST_KEY_FILE,
+                                                    GNUTLS_X509_FMT_PEM) == 0);
+
+    gnutls_session_ticket_key_generate (&peer->ticket_key);
+}
+
+static void
+peer_backend_free (TestPeer *peer)
+{
+    gnutls_free (peer->ticket_key.data);
+    gnutls_certificate_free_credentials (peer->cred);
+    gnutls_global_deinit ();
+}
+
+static gboolean
+peer_conn_handshake (TestPeer *peer, TestPeerConn *conn)
+{
+    gint ret;
+
+    gnutls_init (&conn->session, GNUTLS_SERVER);
+    gnutls_set_default_priority (conn->session);
+    gnutls_credentials_set (conn->session, GNUTLS_CRD_CERTIFICATE,
+                            peer->cred);
+    gnutls_session_ticket_enable_server (conn->session, &peer->ticket_key);
+    gnutls_transport_set_ptr (conn->session,
+                              (gnutls_transport_ptr_t)(glong) conn->fd);
+
+    do {
+        ret = gnutls_handshake (conn->session);
+    } while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+    return ret >= 0;
+}
+
+static gint
+peer_conn_read (TestPeerConn *conn, gchar *buf, gint len)
+{
+    gint ret;
+
+    do {
+        ret = gnutls_record_recv (conn->session, buf, len);
+    } while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+    return ret;
+}
+
+static gint
+peer_conn_write (TestPeerConn *conn, const gchar *buf, gint len)
+{
+    gint ret;
+
+    do {
+        ret = gnutls_record_send (conn->session, buf, len);
+    } while (ret == GNUTLS_E_AGAIN || ret == GNUTLS_E_INTERRUPTED);
+
+    return ret;
+}
+
+static void
+peer_conn_shutdown (TestPeerConn *conn)
+{
+    gnutls_deinit (conn->session);
+}
+
+#endif /* HAVE_OPENSSL */
+
+/* -- The peer -- */
+
+static gboolean
+peer_conn_write_all (TestPeerConn *conn, const gchar *buf, gsize len)
+{
+    while (len > 0) {
+        gint written;
+
+        written = peer_conn_write (conn, buf, MIN (len, PEER_BUFFER_SIZE));
+        if (written <= 0) {
+            return FALSE;
+        }
+
+        buf += written;
+        len -= written;
+    }
+
+    return TRUE;
+}
+
+/* Commands are a single letter, a decimal length and a newline:
+ *   p   - answer "k", lets the client pick up session tickets
+ *   u   - read <length> bytes, then answer "k"
+ *   d   - send <length> bytes
+ */
+static gboolean
+peer_conn_read_command (TestPeerConn *conn, gchar *cmd, gsize *length)
+{
+    gchar line[32];
+    guint i;
+
+    for (i = 0; i < sizeof (line) - 1; i++) {
+        if (peer_conn_read (conn, line + i, 1) != 1) {
+            return FALSE;
+        }
+
+        if (line[i] == '\n') {
+            break;
+        }
+    }
+    line[i] = '\0';
+
+    *cmd = line[0];
+    *length = line[0] ? strtoul (line + 1, NULL, 10) : 0;
+
+    return TRUE;
+}
+
+static void
+peer_conn_serve (TestPeerConn *conn)
+{
+    gchar  buf[PEER_BUFFER_SIZE];
+    gchar  cmd;
+    gsize  length;
+
+    memset (buf, 'x', sizeof (buf));
+
+    while (peer_conn_read_command (conn, &cmd, &length)) {
+        switch (cmd) {
+        case 'p':
+            break;
+        case 'u':
+            while (length > 0) {
+                gint n;
+
+                n = peer_conn_read (conn, buf, MIN (length, sizeof (buf)));
+                if (n <= 0) {
+                    return;
+                }
+                length -= n;
+            }
+            break;
+        case 'd':
+            while (length > 0) {
+                gsize n = MIN (length, sizeof (buf));
+
+                if (!peer_conn_write_all (conn, buf, n)) {
+                    return;
+                }
+                length -= n;
+            }
+            continue;
+        default:
+            return;
+        }
+
+        if (!peer_conn_write_all (conn, "k", 1)) {
+            return;
+        }
+    }
+}
+
+static gpointer
+peer_thread (TestPeer *peer)
+{
+    while (TRUE) {
+        TestPeerConn conn;
+
+        conn.fd = accept (peer->listen_fd, NULL, NULL);
+        if (g_atomic_int_get (&peer->quit)) {
+            if (conn.fd >= 0) {
+                close (conn.fd);
+            }
+            break;
+        }
+
+        if (conn.fd < 0) {
+            continue;
+        }
+
+        if (peer_conn_handshake (peer, &conn)) {
+            peer_conn_serve (&conn);
+        }
+
+        peer_conn_shutdown (&conn);
+        close (conn.fd);
+    }
+
+    return NULL;
+}
+
+static gint
+test_connect (guint16 port)
+{
+    struct sockaddr_in addr;
+    gint               fd;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    g_assert (fd >= 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons (port);
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    g_assert (connect (fd, (struct sockaddr *) &addr, sizeof (addr)) == 0);
+
+    return fd;
+}
+
+static TestPeer *
+test_peer_new (void)
+{
+    TestPeer           *peer;
+    struct sockaddr_in  addr;
+    socklen_t           len;
+
+    peer = g_new0 (TestPeer, 1);
+
+    peer_backend_init (peer);
+
+    peer->listen_fd = socket (AF_INET, SOCK_STREAM, 0);
+    g_assert (peer->listen_fd >= 0);
+
+    memset (&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+    g_assert (bind (peer->listen_fd,
+                    (struct sockaddr *) &addr, sizeof (addr)) == 0);
+    g_assert (listen (peer->listen_fd, 16) == 0);
+
+    len = sizeof (addr);
+    getsockname (peer->listen_fd, (struct sockaddr *) &addr, &len);
+    peer->port = ntohs (addr.sin_port);
+
+#if GLIB_CHECK_VERSION (2, 32, 0)
+    peer->thread = g_thread_new ("ssl-peer", (GThreadFunc) peer_thread, peer);
+#else
+    peer->thread = g_thread_create ((GThreadFunc) peer_thread, peer,
+                                    TRUE, NULL);
+#endif
+
+    return peer;
+}
+
+static void
+test_peer_free (TestPeer *peer)
+{
+    /* Wake up the accept() in the peer thread */
+    g_atomic_int_set (&peer->quit, 1);
+    close (test_connect (peer->port));
+
+    g_thread_join (peer->thread);
+    close (peer->listen_fd);
+
+    peer_backend_free (peer);
+    g_free (peer);
+}
+
+/* -- The client, driving LmSSL the way LmOldSocket does -- */
+
+typedef struct {
+    TestPeer *peer;
+    LmSSL    *ssl;
+    gint      fd;
+} TestClient;
+
+static void
+test_client_send (TestClient *client, const gchar *buf, gsize len)
+{
+    while (len > 0) {
+        gint written;
+
+        written = _lm_ssl_send (client->ssl, buf, len);
+        g_assert (written > 0);
+
+        buf += written;
+        len -= written;
+    }
+}
+
+static void
+test_client_command (TestClient *client, gchar cmd, gsize length)
+{
+    gchar *line;
+
+    line = g_strdup_printf ("%c%" G_GSIZE_FORMAT "\n", cmd, length);
+    test_client_send (client, line, strlen (line));
+    g_free (line);
+}
+
+static gsize
+test_client_read (TestClient *client, gsize length)
+{
+    gchar buf[CLIENT_READ_SIZE];
+    gsize total = 0;
+
+    while (total < length) {
+        GIOStatus status;
+        gsize     bytes_read;
+
+        status = _lm_ssl_read (client->ssl, buf, sizeof (buf), &bytes_read);
+        if (status == G_IO_STATUS_AGAIN) {
+            continue;
+        }
+
+        g_assert (status == G_IO_STATUS_NORMAL);
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+static void
+test_client_wait_ack (TestClient *client)
+{
+    g_assert_cmpuint (test_client_read (client, 1), ==, 1);
+}
+
+static void
+test_client_open (TestClient *client)
+{
+    GError *error = NULL;
+
+    client->fd = test_connect (client->peer->port);
+
+    _lm_ssl_initialize (client->ssl);
+    if (!_lm_ssl_begin (client->ssl, client->fd, TEST_SERVER, &error)) {
+        g_error ("Handshake failed: %s", error ? error->message : "unknown");
+    }
+
+    /* A round trip reads the TLS 1.3 session tickets as well */
+    test_client_command (client, 'p', 0);
+    test_client_wait_ack (client);
+}
+
+static void
+test_client_close (TestClient *client)
+{
+    _lm_ssl_close (client->ssl);
+    close (client->fd);
+    client->fd = -1;
+}
+
+static TestClient *
+test_client_new (void)
+{
+    TestClient *client;
+
+    client = g_new0 (TestClient, 1);
+    client->peer = test_peer_new ();
+    client->ssl = _lm_ssl_new (NULL, _lm_ssl_func_always_continue,
+                               NULL, NULL);
+    client->fd = -1;
+
+    return client;
+}
+
+static void
+test_client_free (TestClient *client)
+{
+    if (client->fd >= 0) {
+        test_client_close (client);
+    }
+
+    lm_ssl_unref (client->ssl);
+    test_peer_free (client->peer);
+    g_free (client);
+}
+
+/* -- Tests -- */
+
+static void
+test_handshake (void)
+{
+    TestClient *client;
+
+    client = test_client_new ();
+
+    test_client_open (client);
+    g_assert (lm_ssl_get_negotiated_protocol (client->ssl) != NULL);
+    g_assert (lm_ssl_get_negotiated_cipher (client->ssl) != NULL);
+    g_assert (!lm_ssl_get_session_resumed (client->ssl));
+
+    test_client_command (client, 'd', 100000);
+    g_assert_cmpuint (test_client_read (client, 100000), ==, 100000);
+    test_client_close (client);
+
+    test_client_open (client);
+    g_assert (lm_ssl_get_session_resumed (client->ssl));
+    test_client_close (client);
+
+    test_client_free (client);
+}
+
+/* A policy that can't be applied fails instead of using the defaults */
+static void
+test_client_open_fails (TestClient *client)
+{
+    GError *error = NULL;
+
+    client->fd = test_connect (client->peer->port);
+
+    _lm_ssl_initialize (client->ssl);
+    g_assert (!_lm_ssl_begin (client->ssl, client->fd, TEST_SERVER, &error));
+    g_assert (g_error_matches (error, LM_ERROR, LM_ERROR_CONNECTION_OPEN));
+    g_test_message ("%s", error->message);
+    g_error_free (error);
+
+    close (client->fd);
+    client->fd = -1;
+}
+
+static void
+test_bad_config (void)
+{
+    TestClient *client;
+
+    client = test_client_new ();
+
+    lm_ssl_set_ciphers (client->ssl, "AES-128-GCM:NO-SUCH-CIPHER");
+    test_client_open_fails (client);
+
+    lm_ssl_set_ciphers (client->ssl, NULL);
+    lm_ssl_set_groups (client->ssl, "X25519:NO-SUCH-GROUP");
+    test_client_open_fails (client);
+
+    /* Usable again once the configuration is */
+    lm_ssl_set_groups (client->ssl, NULL);
+    test_client_open (client);
+    test_client_close (client);
+
+    test_client_free (client);
+}
+
+static void
+perf_handshakes (gboolean resume)
+{
+    TestClient *client;
+    GTimer     *timer;
+    gdouble     rate;
+    guint       i;
+
+    client = test_client_new ();
+
+    /* The first one can't be resumed */
+    test_client_open (client);
+    test_client_close (client);
+
+    timer = g_timer_new ();
+    for (i = 0; i < PERF_HANDSHAKES; i++) {
+        if (!resume) {
+            lm_ssl_unref (client->ssl);
+            client->ssl = _lm_ssl_new (NULL, _lm_ssl_func_always_continue,
+                                       NULL, NULL);
+        }
+
+        test_client_open (client);
+        g_assert (lm_ssl_get_session_resumed (client->ssl) == resume);
+        test_client_close (client);
+    }
+    rate = PERF_HANDSHAKES / g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    g_test_maximized_result (rate, "%s %s: %.0f handshakes/s (%s)",
+                             BACKEND_NAME,
+                             resume ? "resumed handshakes" : "handshakes",
+                             rate,
+                             lm_ssl_get_negotiated_protocol (client->ssl));
+
+    test_client_free (client);
+}
+
+static void
+test_perf_handshakes (void)
+{
+    perf_handshakes (FALSE);
+}
+
+static void
+test_perf_resumed_handshakes (void)
+{
+    perf_handshakes (TRUE);
+}
+
+static void
+perf_upload (const gchar *name, gsize stanza_size, guint stanzas)
+{
+    TestClient *client;
+    GTimer     *timer;
+    gchar      *stanza;
+    gdouble     rate;
+    guint       i;
+
+    client = test_client_new ();
+    test_client_open (client);
+
+    stanza = g_malloc (stanza_size);
+    memset (stanza, 'x', stanza_size);
+
+    timer = g_timer_new ();
+    test_client_command (client, 'u', stanza_size * stanzas);
+    for (i = 0; i < stanzas; i++) {
+        /* One write per stanza, like lm_connection_send() */
+        test_client_send (client, stanza, stanza_size);
+    }
+    test_client_wait_ack (client);
+    rate = (gdouble) stanza_size * stanzas / g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    g_test_maximized_result (rate / (1024 * 1024),
+                             "%s %s: %.1f MB/s, %.0f stanzas/s",
+                             BACKEND_NAME, name, rate / (1024 * 1024),
+                             rate / stanza_size);
+
+    g_free (stanza);
+    test_client_free (client);
+}
+
+static void
+test_perf_small_stanzas (void)
+{
+    perf_upload ("small stanzas", SMALL_STANZA_SIZE, SMALL_STANZAS);
+}
+
+static void
+test_perf_large_stanzas (void)
+{
+    perf_upload ("large stanzas", LARGE_STANZA_SIZE, LARGE_STANZAS);
+}
+
+static void
+test_perf_read (void)
+{
+    TestClient *client;
+    GTimer     *timer;
+    gdouble     rate;
+
+    client = test_client_new ();
+    test_client_open (client);
+
+    timer = g_timer_new ();
+    test_client_command (client, 'd', DOWNLOAD_SIZE);
+    g_assert_cmpuint (test_client_read (client, DOWNLOAD_SIZE),
+                      ==, DOWNLOAD_SIZE);
+    rate = DOWNLOAD_SIZE / g_timer_elapsed (timer, NULL);
+    g_timer_destroy (timer);
+
+    g_test_maximized_result (rate / (1024 * 1024), "%s read: %.1f MB/s",
+                             BACKEND_NAME, rate / (1024 * 1024));
+
+    test_client_free (client);
+}
+
+int
+main (int argc, char **argv)
+{
+    g_test_init (&argc, &argv, NULL);
+
+#if !GLIB_CHECK_VERSION (2, 32, 0)
+    g_thread_init (NULL);
+#endif
+
+    g_test_add_func ("/ssl/handshake", test_handshake);
+    g_test_add_func ("/ssl/bad_config", test_bad_config);
+
+    if (g_test_perf ()) {
+        g_test_add_func ("/ssl/perf/handshakes", test_perf_handshakes);
+        g_test_add_func ("/ssl/perf/resumed_handshakes",
+                         test_perf_resumed_handshakes);
+        g_test_add_func ("/ssl/perf/small_stanzas", test_perf_small_stanzas);
+        g_test_add_func ("/ssl/perf/large_stanzas", test_perf_large_stanzas);
+        g_test_add_func ("/ssl/perf/read", test_perf_read);
+    }
+
+    return g_test_run ();
+}